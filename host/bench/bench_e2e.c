@@ -0,0 +1,1006 @@
+/**
+ * bench_e2e.c
+ * Host end-to-end benchmark: the library and its services against the modem simulator
+ *
+ * Scenarios, each one on a fresh simulator:
+ *   idle       library up and nothing to do for BENCH_IDLE_MS: how often the parser task
+ *              wakes up without data
+ *   bringup    cold start to MQTT connected (simcom_init, AT, ATE0, CFUN?, CREG?, CEREG?,
+ *              CGATT?, CGDCONT=, CGACT=, CGPADDR, CMQTTSTART, CMQTTACCQ, CMQTTCONNECT)
+ *   bringup_fsm  cold start through simcom_bringup() to the first publish, time of each phase;
+ *              then a warm bring-up on the same modem, where every phase is already done
+ *   poll       status poll loop: CSQ, CREG?, CEREG?
+ *   poll_cached  same loop through the _cached() queries after simcom_state_cache_start()
+ *   publish    CMQTTTOPIC + CMQTTPAYLOAD + CMQTTPUB loop, once per payload size
+ *   publish_msg  same messages through the one-shot simcom_mqtt_publish_msg()
+ *   publish_queue  same messages in bursts of BENCH_BURST through simcom_mqtt_enqueue(),
+ *              latency from queuing to the +CMQTTPUB result of each message and of each burst
+ *   urcflood   poll loop while the simulator sends unsolicited lines (-u per second, at most
+ *              half the wire capacity when -b is given)
+ *   poll_busy  poll loop while another task publishes, each AT+CMQTTPUB taking
+ *              BENCH_BUSY_PUB_MS to answer: the polls wait behind the publishes
+ *   poll_busy_cmux  same with the CMUX multiplexer started, MQTT on its own channel
+ *   socket     TCP echo through the simulator bridged to a local echo server: a task streams
+ *              -n blocks of each payload size with simcom_socket_send() while the main task
+ *              reads them back with simcom_socket_recv() and checks them
+ *   socket_transparent  same stream in transparent mode (AT+CIPMODE=1): raw data after
+ *              CONNECT, no AT+CIPSEND or AT+CIPRXGET; then "+++" (BENCH_ESCAPE_GUARD_MS guard
+ *              time), ATO and "+++" again before the close
+ *
+ * For each scenario: AT commands per second, bytes per second on the wire (both directions),
+ * p50/p95/p99/max latency of each operation, socket payload per second (sent and received back),
+ * CPU time of the parser and URC tasks, wake-ups of the parser task, and the
+ * peak RSS of the process so far (simulator included). Only the measured part of a scenario
+ * is counted, not its setup. Results go to stdout (or -o) as JSON or CSV, logs to stderr.
+ *
+ * Build and run from the repository root:
+ *   cmake -S . -B build && cmake --build build
+ *   ./build/host/bench_e2e [-n iterations] [-c cold_starts] [-b baud] [-r rates] [-p sizes]
+ *                          [-u urcs_per_s] [-f json|csv] [-o file] [-e directive]... [scenario]...
+ *
+ *   -b 115200 models the wire time of a 115200 baud UART; by default the pty is as fast as
+ *   the host. -r 3000000,921600 negotiates the fastest of those rates (AT+IPR) in the setup of
+ *   each scenario, the wire time then follows the new rate. -e applies a simulator directive
+ *   (see modem_sim.h), e.g. -e "latency * 20 5".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include "simcom.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "modem_sim.h"
+
+#define BENCH_MAX_OPS           16
+#define BENCH_MAX_SIZES         8
+#define BENCH_MAX_DIRECTIVES    16
+#define BENCH_MAX_RATES         8
+#define BENCH_MAX_URC_LINES     8       // the simulator has 16 timers
+#define BENCH_URC_TEXT          "+CGEV: NW PDN DEACT 1"
+#define BENCH_MAX_RESULTS       (8 + 5 * BENCH_MAX_SIZES)
+#define BENCH_BURST             50      // messages queued at once in publish_queue
+#define BENCH_BUSY_PUB_MS       100     // AT+CMQTTPUB latency in poll_busy
+#define BENCH_SOCKET_LINK       0
+#define BENCH_SOCKET_TIMEOUT_MS 5000    // longest wait for echoed data
+#define BENCH_ESCAPE_GUARD_MS   50      // "+++" guard time of socket_transparent
+#define BENCH_IDLE_MS           2000    // length of the idle scenario
+
+/* Latency samples of one operation */
+typedef struct {
+    const char *name;
+    uint32_t *samples_us;
+    size_t count;
+    size_t cap;
+    uint32_t errors;
+} bench_op_t;
+
+/* Counters of the measured part of a scenario */
+typedef struct {
+    const char *name;
+    int payload;                // publish payload or socket block size, 0 for the other scenarios
+    bench_op_t ops[BENCH_MAX_OPS];
+    size_t op_count;
+    uint64_t elapsed_us;
+    uint64_t commands;
+    uint64_t wire_bytes;
+    uint64_t payload_bytes;     // socket payload sent and received back
+    uint64_t urcs_sent;         // unsolicited lines sent, results after an OK included
+    uint64_t urcs_handled;      // lines received by the benchmark URC handler
+    uint64_t parser_cpu_us;
+    uint64_t urc_cpu_us;
+    uint64_t parser_wakeups;    // times the parser task blocked and woke up again
+    long peak_rss_kb;
+} bench_result_t;
+
+/* Snapshot at the start of a measured part */
+typedef struct {
+    uint64_t t_us;
+    modem_sim_stats_t stats;
+    uint32_t parser_cpu;
+    uint32_t urc_cpu;
+    uint32_t parser_wakeups;
+    uint64_t urcs_handled;
+} bench_mark_t;
+
+typedef struct {
+    int iterations;
+    int cold_starts;
+    int baud;
+    uint32_t rates[BENCH_MAX_RATES];    // negotiated in the setup, none by default
+    size_t rate_count;
+    int sizes[BENCH_MAX_SIZES];
+    size_t size_count;
+    int urc_rate;               // unsolicited lines per second in urcflood
+    bool csv;
+    const char *directives[BENCH_MAX_DIRECTIVES];
+    size_t directive_count;
+} bench_opts_t;
+
+static bench_opts_t s_opts = {
+    .iterations = 200,
+    .cold_starts = 10,
+    .baud = 0,
+    .sizes = { 16, 256, 2048, 8192 },
+    .size_count = 4,
+    .urc_rate = 2000,
+};
+
+static modem_sim_t *s_sim;
+static atomic_uint_fast64_t s_urcs_handled;
+
+static const char *TOPIC = "bench/e2e";
+static const char *BROKER = "tcp://broker.bench:1883";
+
+/* --- Measurement --- */
+
+static uint64_t _now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static uint32_t _task_cpu(const char *name)
+{
+    TaskHandle_t task = xTaskGetHandle(name);
+    return task ? ulTaskGetRunTimeCounter(task) : 0;
+}
+
+static bench_op_t *_op(bench_result_t *res, const char *name)
+{
+    for (size_t i = 0; i < res->op_count; i++)
+    {
+        if (strcmp(res->ops[i].name, name) == 0)
+            return &res->ops[i];
+    }
+    if (res->op_count == BENCH_MAX_OPS)
+    {
+        fprintf(stderr, "bench_e2e: too many operations\n");
+        exit(1);
+    }
+    bench_op_t *op = &res->ops[res->op_count++];
+    op->name = name;
+    return op;
+}
+
+static void _op_add(bench_result_t *res, const char *name, uint64_t us, simcom_err_t err)
+{
+    bench_op_t *op = _op(res, name);
+    if (op->count == op->cap)
+    {
+        op->cap = op->cap ? op->cap * 2 : 256;
+        op->samples_us = realloc(op->samples_us, op->cap * sizeof(uint32_t));
+        if (op->samples_us == NULL)
+        {
+            fprintf(stderr, "bench_e2e: out of memory\n");
+            exit(1);
+        }
+    }
+    op->samples_us[op->count++] = (us > UINT32_MAX) ? UINT32_MAX : (uint32_t)us;
+    if (err != SIM_AT_OK)
+        op->errors++;
+}
+
+// Times one library call as operation op of the scenario
+#define BENCH_TIMED(res, op, call)                          \
+    do {                                                    \
+        uint64_t _t0 = _now_us();                           \
+        simcom_err_t _err = (call);                         \
+        _op_add((res), (op), _now_us() - _t0, _err);        \
+    } while (0)
+
+static void _mark(bench_mark_t *mark)
+{
+    modem_sim_get_stats(s_sim, &mark->stats);
+    mark->parser_cpu = _task_cpu("sim_at_parser");
+    mark->urc_cpu = _task_cpu("sim_at_urc");
+    TaskHandle_t parser = xTaskGetHandle("sim_at_parser");
+    mark->parser_wakeups = parser ? ulTaskGetWakeCounter(parser) : 0;
+    mark->urcs_handled = atomic_load(&s_urcs_handled);
+    mark->t_us = _now_us();
+}
+
+/**
+ * @brief Adds what happened since the mark to the scenario counters. Call before simcom_deinit(),
+ * the task counters go away with the tasks.
+ */
+static void _accumulate(bench_result_t *res, const bench_mark_t *mark)
+{
+    bench_mark_t now;
+    _mark(&now);
+    res->elapsed_us += now.t_us - mark->t_us;
+    res->commands += now.stats.commands - mark->stats.commands;
+    res->wire_bytes += (now.stats.rx_bytes + now.stats.tx_bytes) - (mark->stats.rx_bytes + mark->stats.tx_bytes);
+    res->urcs_sent += now.stats.urcs - mark->stats.urcs;
+    res->urcs_handled += now.urcs_handled - mark->urcs_handled;
+    res->parser_cpu_us += (uint32_t)(now.parser_cpu - mark->parser_cpu);
+    res->urc_cpu_us += (uint32_t)(now.urc_cpu - mark->urc_cpu);
+    res->parser_wakeups += (uint32_t)(now.parser_wakeups - mark->parser_wakeups);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    res->peak_rss_kb = usage.ru_maxrss;
+}
+
+/* --- Modem link --- */
+
+static void _urc_count(const char *line, size_t len, void *ctx)
+{
+    atomic_fetch_add(&s_urcs_handled, 1);
+}
+
+/**
+ * @brief Starts a fresh simulator with the command line directives plus extra ones
+ */
+static void _sim_open(const char *const *extra, char *path, size_t size)
+{
+    s_sim = modem_sim_create();
+    if (s_sim == NULL)
+    {
+        fprintf(stderr, "bench_e2e: cannot create the simulator\n");
+        exit(1);
+    }
+
+    char baud[32];
+    snprintf(baud, sizeof(baud), "baud %d", s_opts.baud);
+    modem_sim_config(s_sim, baud);
+    for (size_t i = 0; i < s_opts.directive_count; i++)
+    {
+        if (modem_sim_config(s_sim, s_opts.directives[i]) != 0)
+            exit(1);
+    }
+    for (; extra && *extra; extra++)
+        modem_sim_config(s_sim, *extra);
+
+    if (modem_sim_open_pty(s_sim, path, size) != 0 || modem_sim_start(s_sim) != 0)
+    {
+        fprintf(stderr, "bench_e2e: cannot start the simulator\n");
+        exit(1);
+    }
+}
+
+static simcom_err_t _init(const char *path)
+{
+    simcom_config_t cfg = {
+        .uart_conf = { .baud_rate = s_opts.baud ? s_opts.baud : 115200 },
+        .control_pins = { .dtr_pin = -1, .pwrkey_pin = -1, .rst_pin = -1 },
+        .default_cmd_timeout_ms = 5000,
+        .rts_pin = -1,
+        .cts_pin = -1,
+        .transport = simcom_transport_posix(path),
+    };
+    return simcom_init(&cfg);
+}
+
+static void _close(void)
+{
+    simcom_deinit();
+    modem_sim_destroy(s_sim);
+    s_sim = NULL;
+}
+
+/**
+ * @brief Starts a simulator and brings the library up to ATE0, and to MQTT connected if asked
+ */
+static void _open(const char *const *extra, bool mqtt)
+{
+    char path[64];
+    _sim_open(extra, path, sizeof(path));
+
+    simcom_err_t err = _init(path);
+    if (err == SIM_AT_OK)
+        err = simcom_enable_echo(false);
+    if (err == SIM_AT_OK && s_opts.rate_count > 0)
+    {
+        simcom_baud_config_t baud = { .rates = s_opts.rates, .rate_count = s_opts.rate_count };
+        err = simcom_baud_negotiate(&baud, NULL);
+    }
+    if (err == SIM_AT_OK && mqtt)
+        err = simcom_mqtt_service_start();
+    if (err == SIM_AT_OK && mqtt)
+        err = simcom_mqtt_client_acquire(0, "bench");
+    if (err == SIM_AT_OK && mqtt)
+        err = simcom_mqtt_server_connect(0, BROKER, 60, 1);
+    if (err != SIM_AT_OK)
+    {
+        fprintf(stderr, "bench_e2e: setup failed: %d\n", err);
+        exit(1);
+    }
+}
+
+/* --- Scenarios --- */
+
+static void _bench_bringup(bench_result_t *res)
+{
+    for (int i = 0; i < s_opts.cold_starts; i++)
+    {
+        char path[64];
+        _sim_open(NULL, path, sizeof(path));
+
+        bench_mark_t mark;
+        _mark(&mark);
+
+        int rssi, ber, cid, attach;
+        sim_status_control_fun_t fun;
+        sim_network_registration_stat_t reg;
+        sim_eps_network_registration_stat_t eps_reg;
+        char addr[SIMCOM_PDP_ADDR_LEN];
+
+        uint64_t t0 = _now_us();
+        BENCH_TIMED(res, "init", _init(path));
+        BENCH_TIMED(res, "AT", simcom_comm_test());
+        BENCH_TIMED(res, "ATE0", simcom_enable_echo(false));
+        BENCH_TIMED(res, "CFUN?", simcom_get_phone_func(&fun));
+        BENCH_TIMED(res, "CSQ", simcom_query_signal_quality(&rssi, &ber));
+        BENCH_TIMED(res, "CREG?", simcom_net_reg(&reg));
+        BENCH_TIMED(res, "CEREG?", simcom_eps_net_reg(&eps_reg));
+        BENCH_TIMED(res, "CGATT?", simcom_get_packet_domain_attach(&attach));
+        BENCH_TIMED(res, "CGDCONT=", simcom_set_pdp_context(1, 0, "internet"));
+        BENCH_TIMED(res, "CGACT=", simcom_set_pdp_context_activate(1, 1));
+        BENCH_TIMED(res, "CGPADDR", simcom_show_pdp_addr(&cid, addr));
+        BENCH_TIMED(res, "CMQTTSTART", simcom_mqtt_service_start());
+        BENCH_TIMED(res, "CMQTTACCQ", simcom_mqtt_client_acquire(0, "bench"));
+        BENCH_TIMED(res, "CMQTTCONNECT", simcom_mqtt_server_connect(0, BROKER, 60, 1));
+        _op_add(res, "bringup", _now_us() - t0, SIM_AT_OK);
+
+        _accumulate(res, &mark);
+        _close();
+    }
+}
+
+static void _bench_bringup_fsm(bench_result_t *res)
+{
+    simcom_bringup_config_t cfg = {
+        .apn = "internet", .pdp_type = PDP_IP, .cid = 1,
+        .client_index = 0, .client_id = "bench", .server_addr = BROKER, .keepalive_time = 60, .clean_session = 1,
+    };
+
+    for (int i = 0; i < s_opts.cold_starts; i++)
+    {
+        char path[64];
+        _sim_open(NULL, path, sizeof(path));
+
+        bench_mark_t mark;
+        _mark(&mark);
+
+        simcom_bringup_stats_t stats;
+        uint64_t t0 = _now_us();
+        BENCH_TIMED(res, "init", _init(path));
+        BENCH_TIMED(res, "cold", simcom_bringup(&cfg, &stats));
+        for (int p = 0; p < SIMCOM_BRINGUP_PHASES; p++)
+            _op_add(res, simcom_bringup_phase_to_str(p), (uint64_t)stats.phase_ms[p] * 1000, SIM_AT_OK);
+        BENCH_TIMED(res, "publish_msg", simcom_mqtt_publish_msg(0, "bench/t", "1", 1, 1, 60));
+        _op_add(res, "first_publish", _now_us() - t0, SIM_AT_OK);
+        BENCH_TIMED(res, "warm", simcom_bringup(&cfg, &stats));
+
+        _accumulate(res, &mark);
+        _close();
+    }
+}
+
+static void _bench_idle(bench_result_t *res)
+{
+    _open(NULL, false);
+    bench_mark_t mark;
+    _mark(&mark);
+    uint64_t t0 = _now_us();
+    vTaskDelay(pdMS_TO_TICKS(BENCH_IDLE_MS));
+    _op_add(res, "idle", _now_us() - t0, SIM_AT_OK);
+    _accumulate(res, &mark);
+    _close();
+}
+
+static void _poll_loop(bench_result_t *res)
+{
+    int rssi, ber;
+    sim_network_registration_stat_t reg;
+    sim_eps_network_registration_stat_t eps_reg;
+
+    for (int i = 0; i < s_opts.iterations; i++)
+    {
+        BENCH_TIMED(res, "CSQ", simcom_query_signal_quality(&rssi, &ber));
+        BENCH_TIMED(res, "CREG?", simcom_net_reg(&reg));
+        BENCH_TIMED(res, "CEREG?", simcom_eps_net_reg(&eps_reg));
+    }
+}
+
+static void _bench_poll(bench_result_t *res)
+{
+    _open(NULL, false);
+    bench_mark_t mark;
+    _mark(&mark);
+    _poll_loop(res);
+    _accumulate(res, &mark);
+    _close();
+}
+
+static void _bench_poll_cached(bench_result_t *res)
+{
+    int rssi, ber;
+    sim_network_registration_stat_t reg;
+    sim_eps_network_registration_stat_t eps_reg;
+
+    _open(NULL, false);
+    BENCH_TIMED(res, "cache_start", simcom_state_cache_start());
+    bench_mark_t mark;
+    _mark(&mark);
+    for (int i = 0; i < s_opts.iterations; i++)
+    {
+        BENCH_TIMED(res, "CSQ", simcom_query_signal_quality_cached(&rssi, &ber, 0));
+        BENCH_TIMED(res, "CREG?", simcom_net_reg_cached(&reg, 0));
+        BENCH_TIMED(res, "CEREG?", simcom_eps_net_reg_cached(&eps_reg, 0));
+    }
+    _accumulate(res, &mark);
+    simcom_state_cache_stop();
+    _close();
+}
+
+static void _bench_urcflood(bench_result_t *res)
+{
+    // A faster flood than the line can carry only grows the simulator backlog
+    int rate = s_opts.urc_rate;
+    if (s_opts.baud > 0)
+    {
+        int max_rate = s_opts.baud / 10 / (int)(sizeof(BENCH_URC_TEXT) + 3) / 2;
+        if (rate > max_rate)
+            rate = max_rate;
+    }
+
+    // Timers have a 1 ms resolution: one timer per 1000 lines/s, the period sets the rest
+    int count = (rate + 999) / 1000;
+    if (count > BENCH_MAX_URC_LINES)
+        count = BENCH_MAX_URC_LINES;
+    int period_ms = (rate > 0) ? count * 1000 / rate : 0;
+    if (period_ms < 1)
+        period_ms = 1;
+
+    char lines[BENCH_MAX_URC_LINES][64];
+    const char *extra[BENCH_MAX_URC_LINES + 1] = { 0 };
+    for (int i = 0; i < count; i++)
+    {
+        snprintf(lines[i], sizeof(lines[i]), "urc every %d %s", period_ms, BENCH_URC_TEXT);
+        extra[i] = lines[i];
+    }
+
+    _open(extra, false);
+    bench_mark_t mark;
+    _mark(&mark);
+    _poll_loop(res);
+    _accumulate(res, &mark);
+    _close();
+}
+
+static atomic_bool s_busy_stop;
+static atomic_bool s_busy_done;
+
+/**
+ * @brief Publishes in a loop until s_busy_stop
+ */
+static void _busy_task(void *arg)
+{
+    bench_result_t *res = arg;
+    while (!atomic_load(&s_busy_stop))
+    {
+        // The three commands of a publish need three free slots
+        uint64_t t0 = _now_us();
+        simcom_err_t err = simcom_mqtt_publish_msg(0, TOPIC, "1", 1, 1, 60);
+        if (err == SIM_AT_ERR_BUSY)
+            vTaskDelay(1);
+        else
+            _op_add(res, "publish", _now_us() - t0, err);
+    }
+    atomic_store(&s_busy_done, true);
+    vTaskDelete(NULL);
+}
+
+static void _bench_poll_busy(bench_result_t *res, bool cmux)
+{
+    char latency[48];
+    snprintf(latency, sizeof(latency), "latency +CMQTTPUB %d", BENCH_BUSY_PUB_MS);
+    const char *extra[] = { latency, NULL };
+
+    _open(extra, true);
+    if (cmux)
+        BENCH_TIMED(res, "cmux_start", simcom_cmux_start(2));
+
+    // Both tasks add samples: their operations exist before the publisher starts
+    static const char *const ops[] = { "CSQ", "CREG?", "CEREG?", "publish" };
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+        _op(res, ops[i]);
+
+    atomic_store(&s_busy_stop, false);
+    atomic_store(&s_busy_done, false);
+    bench_mark_t mark;
+    _mark(&mark);
+    xTaskCreate(_busy_task, "bench_busy", 4096, res, 5, NULL);
+    _poll_loop(res);
+    atomic_store(&s_busy_stop, true);
+    while (!atomic_load(&s_busy_done))
+        vTaskDelay(1);
+    _accumulate(res, &mark);
+
+    if (cmux)
+        simcom_cmux_stop();
+    _close();
+}
+
+/**
+ * @brief Binary payload of a publish scenario, every byte value included
+ */
+static uint8_t *_payload(int len)
+{
+    uint8_t *payload = malloc(len > 0 ? len : 1);
+    if (payload == NULL)
+        exit(1);
+    for (int i = 0; i < len; i++)
+        payload[i] = (uint8_t)i;
+    return payload;
+}
+
+static void _bench_publish(bench_result_t *res)
+{
+    uint8_t *payload = _payload(res->payload);
+
+    _open(NULL, true);
+    bench_mark_t mark;
+    _mark(&mark);
+    for (int i = 0; i < s_opts.iterations; i++)
+    {
+        uint64_t t0 = _now_us();
+        BENCH_TIMED(res, "CMQTTTOPIC", simcom_mqtt_topic_set(0, TOPIC));
+        BENCH_TIMED(res, "CMQTTPAYLOAD", simcom_mqtt_payload_set_buf(0, payload, res->payload));
+        BENCH_TIMED(res, "CMQTTPUB", simcom_mqtt_publish(0, 1, 60));
+        _op_add(res, "publish", _now_us() - t0, SIM_AT_OK);
+    }
+    _accumulate(res, &mark);
+    _close();
+    free(payload);
+}
+
+static void _bench_publish_msg(bench_result_t *res)
+{
+    uint8_t *payload = _payload(res->payload);
+
+    _open(NULL, true);
+    bench_mark_t mark;
+    _mark(&mark);
+    for (int i = 0; i < s_opts.iterations; i++)
+        BENCH_TIMED(res, "publish", simcom_mqtt_publish_msg(0, TOPIC, payload, res->payload, 1, 60));
+    _accumulate(res, &mark);
+    _close();
+    free(payload);
+}
+
+/* Messages of the burst in progress */
+static uint64_t s_queued_us[BENCH_BURST];
+static atomic_int s_burst_done;
+
+static void _queue_cb(int client_index, simcom_err_t err, int mqtt_err, void *ctx)
+{
+    (void)client_index;
+    (void)mqtt_err;
+    bench_result_t *res = (bench_result_t *)ctx;
+    int done = atomic_load(&s_burst_done);
+    _op_add(res, "message", _now_us() - s_queued_us[done], err);
+    atomic_store(&s_burst_done, done + 1);
+}
+
+static void _bench_publish_queue(bench_result_t *res)
+{
+    uint8_t *payload = _payload(res->payload);
+
+    _open(NULL, true);
+    bench_mark_t mark;
+    _mark(&mark);
+    for (int sent = 0; sent < s_opts.iterations; )
+    {
+        int burst = s_opts.iterations - sent < BENCH_BURST ? s_opts.iterations - sent : BENCH_BURST;
+        atomic_store(&s_burst_done, 0);
+
+        // Results come in queuing order, the callback matches them by count
+        uint64_t t0 = _now_us();
+        for (int i = 0; i < burst; )
+        {
+            s_queued_us[i] = _now_us();
+            simcom_err_t err = simcom_mqtt_enqueue(0, TOPIC, payload, res->payload, 1, 60, _queue_cb, res);
+            if (err == SIM_AT_OK)
+                i++;
+            else if (err == SIM_AT_ERR_BUSY)
+                vTaskDelay(1);
+            else
+            {
+                fprintf(stderr, "bench_e2e: enqueue failed: %d\n", err);
+                exit(1);
+            }
+        }
+        while (atomic_load(&s_burst_done) < burst)
+            vTaskDelay(1);
+        _op_add(res, "burst", _now_us() - t0, SIM_AT_OK);
+        sent += burst;
+    }
+    _accumulate(res, &mark);
+    _close();
+    free(payload);
+}
+
+/* Local echo server of the socket scenario, the simulator connects to it */
+static int s_echo_fd = -1;
+static atomic_bool s_send_done;
+
+static void *_echo_thread(void *arg)
+{
+    (void)arg;
+    int fd = accept(s_echo_fd, NULL, NULL);
+    char buf[4096];
+    ssize_t n;
+    while (fd >= 0 && (n = read(fd, buf, sizeof(buf))) > 0)
+    {
+        for (ssize_t done = 0, w; done < n; done += w)
+        {
+            w = write(fd, buf + done, n - done);
+            if (w <= 0)
+                break;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+/**
+ * @brief Starts the echo server on a free loopback port, returns the port
+ */
+static uint16_t _echo_start(pthread_t *thread)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+    s_echo_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (s_echo_fd < 0 || bind(s_echo_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(s_echo_fd, 1) != 0
+        || getsockname(s_echo_fd, (struct sockaddr *)&addr, &len) != 0 || pthread_create(thread, NULL, _echo_thread, NULL) != 0)
+    {
+        fprintf(stderr, "bench_e2e: cannot start the echo server\n");
+        exit(1);
+    }
+    return ntohs(addr.sin_port);
+}
+
+/**
+ * @brief Sends -n blocks of the payload size, then sets s_send_done
+ */
+static void _socket_sender(void *arg)
+{
+    bench_result_t *res = arg;
+    uint8_t *payload = _payload(res->payload);
+    for (int i = 0; i < s_opts.iterations; i++)
+        BENCH_TIMED(res, "send", simcom_socket_send(BENCH_SOCKET_LINK, payload, res->payload));
+    free(payload);
+    atomic_store(&s_send_done, true);
+    vTaskDelete(NULL);
+}
+
+static void _bench_socket(bench_result_t *res, bool transparent)
+{
+    pthread_t echo;
+    uint16_t port = _echo_start(&echo);
+
+    char guard[32];
+    snprintf(guard, sizeof(guard), "guard %d", BENCH_ESCAPE_GUARD_MS);
+    const char *extra[] = { guard, NULL };
+    _open(transparent ? extra : NULL, false);
+    BENCH_TIMED(res, "net_open", transparent ? simcom_net_open_transparent() : simcom_net_open());
+    BENCH_TIMED(res, "socket_open", simcom_socket_open(BENCH_SOCKET_LINK, SIMCOM_SOCKET_TCP, "127.0.0.1", port, 0));
+
+    // Both tasks add samples: their operations exist before the sender starts
+    _op(res, "send");
+    _op(res, "recv");
+
+    atomic_store(&s_send_done, false);
+    bench_mark_t mark;
+    _mark(&mark);
+    xTaskCreate(_socket_sender, "bench_send", 4096, res, 5, NULL);
+
+    // The stream is the payload block repeated, byte k is k % payload
+    size_t total = (size_t)s_opts.iterations * res->payload;
+    size_t got = 0;
+    static uint8_t buf[2048];
+    while (got < total)
+    {
+        size_t len = 0;
+        uint64_t t0 = _now_us();
+        simcom_err_t err = simcom_socket_recv(BENCH_SOCKET_LINK, buf, sizeof(buf), &len, BENCH_SOCKET_TIMEOUT_MS);
+        for (size_t i = 0; err == SIM_AT_OK && i < len; i++)
+        {
+            if (buf[i] != (uint8_t)((got + i) % res->payload))
+                err = SIM_AT_ERR_RESPONSE;
+        }
+        _op_add(res, "recv", _now_us() - t0, err);
+        if (err != SIM_AT_OK || len == 0)
+        {
+            fprintf(stderr, "bench_e2e: echo stopped after %zu of %zu bytes: %d\n", got, total, err);
+            break;
+        }
+        got += len;
+    }
+    while (!atomic_load(&s_send_done))
+        vTaskDelay(1);
+    res->payload_bytes += total + got;
+    _accumulate(res, &mark);
+
+    // Command mode and back with the connection open
+    if (transparent)
+    {
+        BENCH_TIMED(res, "escape", simcom_socket_escape(BENCH_SOCKET_LINK, BENCH_ESCAPE_GUARD_MS));
+        BENCH_TIMED(res, "resume", simcom_socket_resume(BENCH_SOCKET_LINK));
+        BENCH_TIMED(res, "escape", simcom_socket_escape(BENCH_SOCKET_LINK, BENCH_ESCAPE_GUARD_MS));
+    }
+    BENCH_TIMED(res, "socket_close", simcom_socket_close(BENCH_SOCKET_LINK));
+    simcom_net_close();
+    _close();
+    pthread_join(echo, NULL);
+    close(s_echo_fd);
+    s_echo_fd = -1;
+}
+
+/* --- Report --- */
+
+static int _cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples
+static uint32_t _percentile(const bench_op_t *op, int p)
+{
+    if (op->count == 0)
+        return 0;
+    size_t rank = (op->count * p + 99) / 100;
+    return op->samples_us[rank > 0 ? rank - 1 : 0];
+}
+
+static double _per_s(uint64_t value, uint64_t us)
+{
+    return us ? value * 1e6 / us : 0.0;
+}
+
+static void _report_json(FILE *out, bench_result_t *results, size_t count)
+{
+    fprintf(out, "{\n  \"iterations\": %d,\n  \"cold_starts\": %d,\n  \"baud\": %d,\n  \"scenarios\": [\n",
+            s_opts.iterations, s_opts.cold_starts, s_opts.baud);
+    for (size_t i = 0; i < count; i++)
+    {
+        const bench_result_t *r = &results[i];
+        fprintf(out, "    {\n      \"scenario\": \"%s\",\n      \"payload\": %d,\n", r->name, r->payload);
+        fprintf(out, "      \"elapsed_s\": %.3f,\n      \"commands\": %llu,\n      \"commands_per_s\": %.1f,\n",
+                r->elapsed_us / 1e6, (unsigned long long)r->commands, _per_s(r->commands, r->elapsed_us));
+        fprintf(out, "      \"wire_bytes_per_s\": %.1f,\n      \"payload_bytes_per_s\": %.1f,\n",
+                _per_s(r->wire_bytes, r->elapsed_us), _per_s(r->payload_bytes, r->elapsed_us));
+        fprintf(out, "      \"parser_cpu_ms\": %.3f,\n      \"urc_cpu_ms\": %.3f,\n      \"parser_wakeups\": %llu,\n",
+                r->parser_cpu_us / 1e3, r->urc_cpu_us / 1e3, (unsigned long long)r->parser_wakeups);
+        fprintf(out, "      \"peak_rss_kb\": %ld,\n      \"urcs_sent\": %llu,\n      \"urcs_handled\": %llu,\n",
+                r->peak_rss_kb, (unsigned long long)r->urcs_sent, (unsigned long long)r->urcs_handled);
+        fprintf(out, "      \"ops\": [\n");
+        for (size_t j = 0; j < r->op_count; j++)
+        {
+            const bench_op_t *op = &r->ops[j];
+            fprintf(out, "        { \"op\": \"%s\", \"count\": %zu, \"errors\": %u, \"p50_us\": %u, \"p95_us\": %u, "
+                    "\"p99_us\": %u, \"max_us\": %u }%s\n", op->name, op->count, op->errors, _percentile(op, 50),
+                    _percentile(op, 95), _percentile(op, 99), _percentile(op, 100), (j + 1 < r->op_count) ? "," : "");
+        }
+        fprintf(out, "      ]\n    }%s\n", (i + 1 < count) ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+static void _report_csv(FILE *out, bench_result_t *results, size_t count)
+{
+    fprintf(out, "scenario,payload,baud,op,count,errors,p50_us,p95_us,p99_us,max_us,commands_per_s,"
+                 "wire_bytes_per_s,payload_bytes_per_s,parser_cpu_ms,urc_cpu_ms,peak_rss_kb,urcs_sent,urcs_handled,parser_wakeups\n");
+    for (size_t i = 0; i < count; i++)
+    {
+        const bench_result_t *r = &results[i];
+        for (size_t j = 0; j < r->op_count; j++)
+        {
+            const bench_op_t *op = &r->ops[j];
+            fprintf(out, "%s,%d,%d,%s,%zu,%u,%u,%u,%u,%u,%.1f,%.1f,%.1f,%.3f,%.3f,%ld,%llu,%llu,%llu\n", r->name, r->payload,
+                    s_opts.baud, op->name, op->count, op->errors, _percentile(op, 50), _percentile(op, 95),
+                    _percentile(op, 99), _percentile(op, 100), _per_s(r->commands, r->elapsed_us),
+                    _per_s(r->wire_bytes, r->elapsed_us), _per_s(r->payload_bytes, r->elapsed_us), r->parser_cpu_us / 1e3, r->urc_cpu_us / 1e3,
+                    r->peak_rss_kb, (unsigned long long)r->urcs_sent, (unsigned long long)r->urcs_handled,
+                    (unsigned long long)r->parser_wakeups);
+        }
+    }
+}
+
+/* --- Main --- */
+
+static void _usage(void)
+{
+    fprintf(stderr, "usage: bench_e2e [-n iterations] [-c cold_starts] [-b baud] [-r rate,...] [-p size,...] [-u urcs_per_s]\n"
+                    "                 [-f json|csv] [-o file] [-e directive]... [idle|bringup|bringup_fsm|poll|poll_cached|publish|publish_msg|publish_queue|urcflood|\n"
+                    "                 poll_busy|poll_busy_cmux|socket|socket_transparent]...\n");
+    exit(2);
+}
+
+static bool _selected(int argc, char **argv, const char *name)
+{
+    if (optind >= argc)
+        return true;
+    for (int i = optind; i < argc; i++)
+    {
+        if (strcmp(argv[i], name) == 0)
+            return true;
+    }
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    const char *out_path = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:c:b:r:p:u:f:o:e:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n': s_opts.iterations = atoi(optarg); break;
+        case 'c': s_opts.cold_starts = atoi(optarg); break;
+        case 'b': s_opts.baud = atoi(optarg); break;
+        case 'u': s_opts.urc_rate = atoi(optarg); break;
+        case 'o': out_path = optarg; break;
+        case 'f':
+            if (strcmp(optarg, "csv") != 0 && strcmp(optarg, "json") != 0)
+                _usage();
+            s_opts.csv = (strcmp(optarg, "csv") == 0);
+            break;
+        case 'r':
+            s_opts.rate_count = 0;
+            for (char *tok = strtok(optarg, ","); tok && s_opts.rate_count < BENCH_MAX_RATES; tok = strtok(NULL, ","))
+                s_opts.rates[s_opts.rate_count++] = (uint32_t)strtoul(tok, NULL, 10);
+            break;
+        case 'p':
+            s_opts.size_count = 0;
+            for (char *tok = strtok(optarg, ","); tok && s_opts.size_count < BENCH_MAX_SIZES; tok = strtok(NULL, ","))
+                s_opts.sizes[s_opts.size_count++] = atoi(tok);
+            break;
+        case 'e':
+            if (s_opts.directive_count == BENCH_MAX_DIRECTIVES)
+                _usage();
+            s_opts.directives[s_opts.directive_count++] = optarg;
+            break;
+        default:
+            _usage();
+        }
+    }
+    if (s_opts.iterations <= 0 || s_opts.cold_starts <= 0)
+        _usage();
+
+    simcom_urc_register("+CGEV", _urc_count, NULL);
+
+    static bench_result_t results[BENCH_MAX_RESULTS];
+    size_t count = 0;
+
+    if (_selected(argc, argv, "idle"))
+    {
+        results[count].name = "idle";
+        _bench_idle(&results[count++]);
+    }
+    if (_selected(argc, argv, "bringup"))
+    {
+        results[count].name = "bringup";
+        _bench_bringup(&results[count++]);
+    }
+    if (_selected(argc, argv, "bringup_fsm"))
+    {
+        results[count].name = "bringup_fsm";
+        _bench_bringup_fsm(&results[count++]);
+    }
+    if (_selected(argc, argv, "poll"))
+    {
+        results[count].name = "poll";
+        _bench_poll(&results[count++]);
+    }
+    if (_selected(argc, argv, "poll_cached"))
+    {
+        results[count].name = "poll_cached";
+        _bench_poll_cached(&results[count++]);
+    }
+    if (_selected(argc, argv, "publish"))
+    {
+        for (size_t i = 0; i < s_opts.size_count; i++)
+        {
+            results[count].name = "publish";
+            results[count].payload = s_opts.sizes[i];
+            _bench_publish(&results[count++]);
+        }
+    }
+    if (_selected(argc, argv, "publish_msg"))
+    {
+        for (size_t i = 0; i < s_opts.size_count; i++)
+        {
+            results[count].name = "publish_msg";
+            results[count].payload = s_opts.sizes[i];
+            _bench_publish_msg(&results[count++]);
+        }
+    }
+    if (_selected(argc, argv, "publish_queue"))
+    {
+        for (size_t i = 0; i < s_opts.size_count; i++)
+        {
+            results[count].name = "publish_queue";
+            results[count].payload = s_opts.sizes[i];
+            _bench_publish_queue(&results[count++]);
+        }
+    }
+    if (_selected(argc, argv, "urcflood"))
+    {
+        results[count].name = "urcflood";
+        _bench_urcflood(&results[count++]);
+    }
+    if (_selected(argc, argv, "poll_busy"))
+    {
+        results[count].name = "poll_busy";
+        _bench_poll_busy(&results[count++], false);
+    }
+    if (_selected(argc, argv, "poll_busy_cmux"))
+    {
+        results[count].name = "poll_busy_cmux";
+        _bench_poll_busy(&results[count++], true);
+    }
+    if (_selected(argc, argv, "socket"))
+    {
+        for (size_t i = 0; i < s_opts.size_count; i++)
+        {
+            results[count].name = "socket";
+            results[count].payload = s_opts.sizes[i];
+            _bench_socket(&results[count++], false);
+        }
+    }
+    if (_selected(argc, argv, "socket_transparent"))
+    {
+        for (size_t i = 0; i < s_opts.size_count; i++)
+        {
+            results[count].name = "socket_transparent";
+            results[count].payload = s_opts.sizes[i];
+            _bench_socket(&results[count++], true);
+        }
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        for (size_t j = 0; j < results[i].op_count; j++)
+        {
+            bench_op_t *op = &results[i].ops[j];
+            qsort(op->samples_us, op->count, sizeof(uint32_t), _cmp_u32);
+        }
+    }
+
+    FILE *out = out_path ? fopen(out_path, "w") : stdout;
+    if (out == NULL)
+    {
+        perror(out_path);
+        return 1;
+    }
+    if (s_opts.csv)
+        _report_csv(out, results, count);
+    else
+        _report_json(out, results, count);
+    if (out != stdout)
+        fclose(out);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        for (size_t j = 0; j < results[i].op_count; j++)
+            free(results[i].ops[j].samples_us);
+    }
+    return 0;
+}
@@ -0,0 +1,158 @@
+/**
+ * bench_fields.c
+ * Host micro-benchmark: sim_at_fields reader against sscanf() on the values of representative
+ * information responses.
+ *
+ * Build and run from the repository root:
+ *   gcc -O2 -Isrcs host/bench/bench_fields.c srcs/at/sim_at_fields.c -o bench_fields
+ *   ./bench_fields [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "at/sim_at_fields.h"
+
+static volatile int s_sink;
+
+/* Values as returned by simcom_read_resp_values(), after "<prefix>: " */
+static const char *CGPADDR = "1,10.160.42.17";
+static const char *CPSI = "LTE,Online,722-310,0x2D1F,26890763,338,EUTRAN-BAND28,9410,5,5,-97,-1046,-762,13";
+static const char *CCLK = "\"24/05/17,14:32:08-12\"";
+static const char *RXTOPIC = "0,28";
+
+/* --- sscanf --- */
+
+static int _scanf_cgpaddr(void)
+{
+    int cid;
+    char addr[64];
+    if (sscanf(CGPADDR, "%d,%63s", &cid, addr) != 2)
+        return -1;
+    return cid + addr[0];
+}
+
+static int _scanf_cpsi(void)
+{
+    char mode[16], state[16], oper[16], tac[16], band[32];
+    int cell, pci, earfcn, dl_bw, ul_bw, rsrq, rsrp, rssi, rssnr;
+    if (sscanf(CPSI, "%15[^,],%15[^,],%15[^,],%15[^,],%d,%d,%31[^,],%d,%d,%d,%d,%d,%d,%d",
+               mode, state, oper, tac, &cell, &pci, band, &earfcn, &dl_bw, &ul_bw,
+               &rsrq, &rsrp, &rssi, &rssnr) != 14)
+        return -1;
+    return cell + pci + earfcn + rsrp + mode[0] + band[0];
+}
+
+static int _scanf_cclk(void)
+{
+    char time[21];
+    if (sscanf(CCLK, "\"%20[^\"]\"", time) != 1)
+        return -1;
+    return time[0];
+}
+
+static int _scanf_rxtopic(void)
+{
+    int client, len;
+    if (sscanf(RXTOPIC, "%d,%d", &client, &len) != 2)
+        return -1;
+    return client + len;
+}
+
+/* --- sim_at_fields --- */
+
+static int _fields_cgpaddr(void)
+{
+    int cid;
+    char addr[64];
+    sim_at_fields_t f;
+    sim_at_fields_init(&f, CGPADDR);
+    if (!sim_at_fields_int(&f, &cid) || !sim_at_fields_str(&f, addr, sizeof(addr)))
+        return -1;
+    return cid + addr[0];
+}
+
+static int _fields_cpsi(void)
+{
+    char mode[16], state[16], oper[16], tac[16], band[32];
+    int cell, pci, earfcn, dl_bw, ul_bw, rsrq, rsrp, rssi, rssnr;
+    sim_at_fields_t f;
+    sim_at_fields_init(&f, CPSI);
+    if (!sim_at_fields_str(&f, mode, sizeof(mode)) || !sim_at_fields_str(&f, state, sizeof(state)) ||
+        !sim_at_fields_str(&f, oper, sizeof(oper)) || !sim_at_fields_str(&f, tac, sizeof(tac)) ||
+        !sim_at_fields_int(&f, &cell) || !sim_at_fields_int(&f, &pci) ||
+        !sim_at_fields_str(&f, band, sizeof(band)) || !sim_at_fields_int(&f, &earfcn) ||
+        !sim_at_fields_int(&f, &dl_bw) || !sim_at_fields_int(&f, &ul_bw) ||
+        !sim_at_fields_int(&f, &rsrq) || !sim_at_fields_int(&f, &rsrp) ||
+        !sim_at_fields_int(&f, &rssi) || !sim_at_fields_int(&f, &rssnr))
+        return -1;
+    return cell + pci + earfcn + rsrp + mode[0] + band[0];
+}
+
+static int _fields_cclk(void)
+{
+    char time[21];
+    sim_at_fields_t f;
+    sim_at_fields_init(&f, CCLK);
+    if (!sim_at_fields_str(&f, time, sizeof(time)))
+        return -1;
+    return time[0];
+}
+
+static int _fields_rxtopic(void)
+{
+    int client, len;
+    sim_at_fields_t f;
+    sim_at_fields_init(&f, RXTOPIC);
+    if (!sim_at_fields_int(&f, &client) || !sim_at_fields_int(&f, &len))
+        return -1;
+    return client + len;
+}
+
+static double _now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+typedef struct {
+    const char *name;
+    int (*scanf_fn)(void);
+    int (*fields_fn)(void);
+} bench_case_t;
+
+int main(int argc, char **argv)
+{
+    long iterations = (argc > 1) ? atol(argv[1]) : 500000;
+    const bench_case_t cases[] = {
+        { "+CGPADDR",     _scanf_cgpaddr, _fields_cgpaddr },
+        { "+CPSI",        _scanf_cpsi,    _fields_cpsi },
+        { "+CCLK",        _scanf_cclk,    _fields_cclk },
+        { "+CMQTTRXTOPIC", _scanf_rxtopic, _fields_rxtopic },
+    };
+
+    printf("%-14s %12s %12s %8s\n", "line", "sscanf ns", "fields ns", "speedup");
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        if (cases[c].scanf_fn() != cases[c].fields_fn())
+        {
+            printf("%s: results differ\n", cases[c].name);
+            return 1;
+        }
+
+        double t0 = _now_ns();
+        for (long i = 0; i < iterations; i++)
+            s_sink += cases[c].scanf_fn();
+        double t1 = _now_ns();
+        for (long i = 0; i < iterations; i++)
+            s_sink += cases[c].fields_fn();
+        double t2 = _now_ns();
+
+        double scanf_ns = (t1 - t0) / iterations;
+        double fields_ns = (t2 - t1) / iterations;
+        printf("%-14s %12.1f %12.1f %7.2fx\n", cases[c].name, scanf_ns, fields_ns, scanf_ns / fields_ns);
+    }
+    return 0;
+}
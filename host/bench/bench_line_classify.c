@@ -0,0 +1,188 @@
+/**
+ * bench_line_classify.c
+ * Host micro-benchmark: per-line cost of the single-pass classifier against the previous
+ * strstr based detection (echo copy, URC strstr chain, reset strstr, final result compare
+ * and the strstr scans of simcom_read_resp_values()).
+ *
+ * Build and run from the repository root:
+ *   gcc -O2 -Isrcs host/bench/bench_line_classify.c srcs/at/sim_at_line.c -o bench_line_classify
+ *   ./bench_line_classify [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "at/sim_at_line.h"
+
+#define BENCH_MAX_LINE 256
+
+/* Lines captured from an A7670 session: bring-up, registration, PDP and an MQTT publish */
+static const char *const s_corpus[] = {
+    "AT+CSQ",
+    "+CSQ: 20,99",
+    "OK",
+    "AT+CREG?",
+    "+CREG: 0,1",
+    "OK",
+    "+CEREG: 0,1",
+    "AT+CGPADDR=1",
+    "+CGPADDR: 1,10.160.42.17",
+    "+CPSI: LTE,Online,722-310,0x2D1F,26890763,338,EUTRAN-BAND28,9410,5,5,-97,-1046,-762,13",
+    "+CCLK: \"24/05/17,14:32:08-12\"",
+    "+CPIN: READY",
+    "+CGEV: ME PDN ACT 1",
+    "*ISIMAID: \"A0000000871004FF49FF0589\"",
+    "SMS DONE",
+    "PB DONE",
+    "*ATREADY: 1",
+    "+CMQTTSTART: 0",
+    "+CMQTTACCQ: 0,0",
+    "+CMQTTCONNECT: 0,0",
+    ">",
+    "sensors/ESP32-0042/telemetry",
+    "{\"temp\":23.5,\"hum\":41,\"status\":\"OK\",\"err\":\"NO ERROR\"}",
+    "+CMQTTPUB: 0,0",
+    "+CMQTTRXSTART: 0,28,57",
+    "+CMQTTRXTOPIC: 0,28",
+    "+CME ERROR: 10",
+    "+CMS ERROR: 500",
+    "ERROR",
+    "861234056789012",
+    "OK",
+};
+#define CORPUS_LEN (sizeof(s_corpus) / sizeof(s_corpus[0]))
+
+/* Key words the services would look for on each information response */
+static const char *s_keys[] = { "+CSQ", "+CREG", "+CGPADDR", "+CMQTTPUB" };
+
+static const char *s_last_cmd = "AT+CSQ\r\n";
+
+static volatile unsigned s_sink;
+
+/* --- Previous detection, as it was in sim_at.c and simcom_read_resp_values() --- */
+
+static int _old_is_echo(const char *line)
+{
+    char stripped[BENCH_MAX_LINE];
+    strncpy(stripped, s_last_cmd, sizeof(stripped) - 1);
+    stripped[sizeof(stripped) - 1] = '\0';
+    int len = strlen(stripped);
+    while (len > 0 && (stripped[len - 1] == '\r' || stripped[len - 1] == '\n'))
+        stripped[--len] = '\0';
+    return strcmp(line, stripped) == 0;
+}
+
+static int _old_is_urc(const char *line)
+{
+    return strstr(line, "+CGEV:") != NULL || strstr(line, "SMS") != NULL ||
+           strstr(line, "*ISIMAID") != NULL;
+}
+
+static int _old_final_type(const char *line, int *code)
+{
+    *code = -1;
+    if (strcmp(line, "OK") == 0)
+        return 1;
+    if (strcmp(line, "ERROR") == 0)
+        return 2;
+    int type;
+    if (strncmp(line, "+CME ERROR:", 11) == 0)
+        type = 3;
+    else if (strncmp(line, "+CMS ERROR:", 11) == 0)
+        type = 4;
+    else
+        return 0;
+    char *end;
+    long value = strtol(line + 11, &end, 10);
+    if (end != line + 11)
+        *code = (int)value;
+    return type;
+}
+
+static int _old_read_values(const char *resp, const char *key_word, const char **index)
+{
+    if (strstr(resp, "ERROR") != NULL)
+        return -3;
+    if (strstr(resp, "OK") != NULL)
+        return -1;
+    if (strstr(resp, key_word) == NULL)
+        return -4;
+    const char *p = strchr(resp, ':');
+    if (!p)
+        return -2;
+    while (*p == ':' || *p == ' ' || *p == '\t')
+        p++;
+    *index = p;
+    return 0;
+}
+
+static unsigned _old_line(const char *line, size_t len, const char *key)
+{
+    unsigned acc = 0;
+    if (_old_is_echo(line))
+        return 1;
+    if (strstr(line, "*ATREADY: 1") != NULL)
+        return 2;
+    if (_old_is_urc(line))
+        return 3;
+    int code;
+    acc += _old_final_type(line, &code) + code;
+    const char *index = NULL;
+    acc += _old_read_values(line, key, &index);
+    return acc + (index ? (unsigned)(index - line) : 0) + (unsigned)len;
+}
+
+/* --- Single-pass classifier, tag read by the service --- */
+
+static unsigned _new_line(const char *line, size_t len, const char *key, size_t key_len)
+{
+    sim_at_line_info_t info;
+    sim_at_line_classify(line, len, "AT+CSQ", 6, &info);
+    if (info.type == SIM_AT_LINE_ECHO)
+        return 1;
+
+    unsigned acc = info.type + info.code;
+    if (info.type == SIM_AT_LINE_INFO && info.key.len == key_len && memcmp(line, key, key_len) == 0)
+        acc += info.value_off;
+    return acc + (unsigned)len;
+}
+
+static double _now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+    long iterations = (argc > 1) ? atol(argv[1]) : 200000;
+    size_t lens[CORPUS_LEN];
+    size_t key_lens[sizeof(s_keys) / sizeof(s_keys[0])];
+    size_t nkeys = sizeof(s_keys) / sizeof(s_keys[0]);
+
+    for (size_t i = 0; i < CORPUS_LEN; i++)
+        lens[i] = strlen(s_corpus[i]);
+    for (size_t k = 0; k < nkeys; k++)
+        key_lens[k] = strlen(s_keys[k]);
+
+    double t0 = _now_ns();
+    for (long it = 0; it < iterations; it++)
+        for (size_t i = 0; i < CORPUS_LEN; i++)
+            s_sink += _old_line(s_corpus[i], lens[i], s_keys[i % nkeys]);
+    double t1 = _now_ns();
+    for (long it = 0; it < iterations; it++)
+        for (size_t i = 0; i < CORPUS_LEN; i++)
+            s_sink += _new_line(s_corpus[i], lens[i], s_keys[i % nkeys], key_lens[i % nkeys]);
+    double t2 = _now_ns();
+
+    double lines = (double)iterations * CORPUS_LEN;
+    double old_ns = (t1 - t0) / lines;
+    double new_ns = (t2 - t1) / lines;
+    printf("corpus: %zu lines, %ld iterations\n", (size_t)CORPUS_LEN, iterations);
+    printf("strstr detection:   %8.1f ns/line\n", old_ns);
+    printf("single-pass tagger: %8.1f ns/line\n", new_ns);
+    printf("speedup:            %8.2fx\n", old_ns / new_ns);
+    return 0;
+}
@@ -0,0 +1,2553 @@
+/**
+ * modem_sim.c
+ * SIMCom A7670 modem simulator for host builds
+ *
+ * A single thread polls the link and a wake pipe. Received command lines are answered with
+ * scheduled output events (echo right away, the response after its latency, result URCs after
+ * the response); events are written in due order, split in chunks if configured. Responses
+ * never overtake each other, as the modem processes one command at a time.
+ *
+ * After AT+CMUX the link carries 3GPP TS 27.010 frames: each DLC is a command interpreter of
+ * its own, with its own line, '>' data input and responses in order; the responses of a DLC do
+ * not wait for the ones of another. URCs are sent on DLC 1.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "modem_sim.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#define MODEM_SIM_KEY_LEN       24
+#define MODEM_SIM_TEXT_LEN      128
+#define MODEM_SIM_MAX_RULES     32
+#define MODEM_SIM_MAX_EVENTS    256
+#define MODEM_SIM_HELD_URCS     32      // unsolicited lines kept while in data mode
+#define MODEM_SIM_MAX_TIMERS    16
+#define MODEM_SIM_LINE_LEN      1100    // AT command line (topics up to 1024 bytes fit)
+#define MODEM_SIM_OUT_LEN       2048
+#define MODEM_SIM_DATA_LEN      10240   // max '>' data input (AT+CMQTTPAYLOAD)
+#define MODEM_SIM_CLIENTS       2
+#define MODEM_SIM_PDP_CONTEXTS  4       // cids 1 to 4
+#define MODEM_SIM_RX_PAYLOAD_LEN 1024   // payload bytes per +CMQTTRXPAYLOAD part
+#define MODEM_SIM_DLCS          4       // DLC 0 (control) to 3, the plain link uses the input of DLC 0
+#define MODEM_SIM_CMUX_N1       1024    // largest information field accepted
+#define MODEM_SIM_LINKS         10      // AT+CIPOPEN links 0 to 9
+#define MODEM_SIM_RX_READ_LEN   1500    // largest AT+CIPRXGET=2 read and +RECEIVE block
+
+/* Per-command behaviour, set by the script */
+typedef struct {
+    char key[MODEM_SIM_KEY_LEN];
+    uint32_t latency_ms;
+    uint32_t jitter_ms;
+    uint32_t result_ms;
+    uint32_t result_jitter_ms;
+    char fail[MODEM_SIM_TEXT_LEN];      // final result instead of OK
+    char reply[MODEM_SIM_TEXT_LEN];     // information line instead of the built-in one
+    char after[MODEM_SIM_TEXT_LEN];     // unsolicited line after the response
+} sim_rule_t;
+
+/* Output scheduled at a time */
+typedef struct {
+    uint64_t due_us;
+    uint32_t seq;
+    bool urc;
+    size_t len;
+    char *data;
+    uint32_t ipr;           // modem rate once written (AT+IPR answers at the old one), 0 for none
+    uint8_t dlc;            // DLC it is framed on, 0 for the plain link
+} sim_event_t;
+
+/* Scripted unsolicited output, once or periodic */
+typedef struct {
+    uint64_t next_us;
+    uint32_t period_ms;     // 0 for a single shot
+    char *text;             // already framed with CR/LF
+    int reg_stat;           // registration state set when it fires, -1 for none
+    int rssi;               // signal quality set when it fires, -1 for none
+} sim_timer_t;
+
+/* What the '>' data input is for */
+typedef enum {
+    SIM_DATA_NONE = 0,
+    SIM_DATA_TOPIC,
+    SIM_DATA_PAYLOAD,
+    SIM_DATA_SUB_TOPIC,
+    SIM_DATA_UNSUB_TOPIC,
+    SIM_DATA_SUB,
+    SIM_DATA_UNSUB,
+    SIM_DATA_SEND,
+} sim_data_kind_t;
+
+/* Command interpreter: the plain link or a DLC */
+typedef struct {
+    char line[MODEM_SIM_LINE_LEN];
+    size_t line_len;
+    bool line_overflow;
+    bool skip_lf;
+    sim_data_kind_t data_kind;
+    int data_client;
+    size_t data_left;
+    char data[MODEM_SIM_DATA_LEN + 1];
+    size_t data_len;
+    char data_key[MODEM_SIM_KEY_LEN];
+    uint64_t busy_until_us; // due time of the last response
+} sim_input_t;
+
+/* 27.010 frame being received */
+typedef struct {
+    int state;              // 0 hunting a flag, then address, control, length(s), info, FCS, end
+    uint8_t hdr[4];
+    size_t hdr_len;
+    uint8_t info[MODEM_SIM_CMUX_N1];
+    size_t info_len;
+    size_t info_pos;
+} sim_frame_t;
+
+struct modem_sim {
+    pthread_t thread;
+    bool running;
+    pthread_mutex_t lock;
+    int wake_fd[2];
+
+    /* link */
+    int fd;                 // pty master or TCP client
+    int pty_slave;          // kept open so the master never sees EIO between clients
+    int listen_fd;
+
+    /* script */
+    sim_rule_t rules[MODEM_SIM_MAX_RULES];
+    size_t rule_count;
+    sim_timer_t timers[MODEM_SIM_MAX_TIMERS];
+    size_t timer_count;
+    size_t chunk;
+    uint32_t chunk_gap_us;
+    uint32_t baud;          // serial line rate to model, 0 for none
+    uint64_t rand_state;
+    bool verbose;
+
+    /* output */
+    sim_event_t events[MODEM_SIM_MAX_EVENTS];
+    size_t event_count;
+    uint32_t event_seq;
+    uint64_t tx_free_us;    // end of the wire time of the output written so far
+    uint64_t start_us;
+
+    /* input */
+    uint64_t rx_free_us;    // end of the wire time of the input received so far
+    sim_input_t inputs[MODEM_SIM_DLCS];
+    sim_input_t *in;        // input being processed
+    uint8_t in_dlc;         // its DLC, 0 on the plain link
+
+    /* multiplexer, AT+CMUX */
+    bool cmux;
+    size_t cmux_n1;         // largest information field sent
+    uint8_t urc_dlc;        // DLC of the unsolicited output
+    sim_frame_t frame;
+
+    /* modem state */
+    bool echo;
+    int cfun;
+    int rssi;
+    int creg;
+    int cereg;
+    int creg_n;             // AT+CREG=<n>, 1 or more reports registration changes
+    int cereg_n;            // AT+CEREG=<n>, 1 or more reports registration changes
+    int cgerep;             // AT+CGEREP=<mode>, 1 or more reports packet domain events
+    int autocsq;            // AT+AUTOCSQ=<auto>, 1 reports signal quality changes
+    uint32_t ipr;           // UART rate, AT+IPR
+    bool ipr_set;           // AT+IPR was used: the host tty must run at ipr
+    int ifc[2];             // flow control, AT+IFC (not modelled, the pty has none)
+    int cgatt;
+    struct {
+        bool defined;
+        bool active;
+        char type[8];
+        char apn[64];
+    } pdp[MODEM_SIM_PDP_CONTEXTS];  // cid 1 is the default bearer, active while registered
+    char pdp_addr[64];              // IPv4 address of cid 1, the others get the next ones
+    char ntp_host[64];
+    int ntp_tz;
+    bool mqtt_started;
+    bool mqtt_acquired[MODEM_SIM_CLIENTS];
+    bool mqtt_connected[MODEM_SIM_CLIENTS];
+    char mqtt_connect_args[MODEM_SIM_CLIENTS][MODEM_SIM_TEXT_LEN];
+    int mqtt_topic_len[MODEM_SIM_CLIENTS];
+    int mqtt_payload_len[MODEM_SIM_CLIENTS];
+    bool net_open;                  // AT+NETOPEN
+    int rxget;                      // AT+CIPRXGET=<mode>, 1 keeps received data until read
+    struct {
+        int fd;                     // host socket, -1 while closed
+        bool udp;
+        bool notified;              // "+CIPRXGET: 1,<link>" sent, not read empty since
+        struct sockaddr_in dest;    // destination of the UDP send in progress
+    } links[MODEM_SIM_LINKS];       // bridged to host sockets, the peers are real
+    int cipmode;                    // AT+CIPMODE=<mode>, 1 makes link 0 transparent
+    bool data_mode;                 // link 0 after CONNECT: the input is its data
+    uint8_t data_dlc;               // DLC of the data mode, 0 on the plain link
+    uint32_t guard_ms;              // "+++" escape guard time
+    int plus;                       // '+' of a possible escape, the first after the guard time
+    uint64_t data_rx_us;            // last byte read in data mode, without the modelled wire time
+    char data_out[MODEM_SIM_RX_READ_LEN]; // data mode input the host socket did not take yet
+    size_t data_out_len;
+    sim_event_t held[MODEM_SIM_HELD_URCS]; // unsolicited lines of the data mode channel
+    size_t held_count;
+
+    modem_sim_stats_t stats;
+};
+
+/* Response being built for a command */
+typedef struct {
+    char text[MODEM_SIM_OUT_LEN];   // information lines and final result
+    size_t len;
+    char result[MODEM_SIM_OUT_LEN]; // unsolicited lines sent after the result delay
+    size_t result_len;
+    bool info;                      // has information lines
+    bool error;
+    uint32_t ipr;                   // modem rate after the response, 0 to keep it
+    bool cmux_end;                  // the modem leaves the multiplexer after the response
+} sim_resp_t;
+
+/* --- Time and randomness --- */
+
+static uint64_t _sim_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Time the bytes take on the serial line, 10 bits each (8N1)
+ */
+static uint64_t _sim_wire_us(const modem_sim_t *sim, size_t len)
+{
+    return (sim->baud > 0) ? (uint64_t)len * 10000000ULL / sim->baud : 0;
+}
+
+/**
+ * @brief Bytes on the line of an output: with the frame overhead on a DLC
+ */
+static size_t _sim_wire_len(const modem_sim_t *sim, const sim_event_t *event)
+{
+    if (event->dlc == 0)
+        return event->len;
+    size_t frames = (event->len + sim->cmux_n1 - 1) / sim->cmux_n1;
+    return event->len + frames * ((sim->cmux_n1 < 128) ? 6 : 7);
+}
+
+/**
+ * @brief Time the input processed now has completely arrived
+ */
+static uint64_t _sim_rx_now(const modem_sim_t *sim)
+{
+    uint64_t now = _sim_now_us();
+    return (sim->rx_free_us > now) ? sim->rx_free_us : now;
+}
+
+/**
+ * @brief Returns a delay in us, ms plus a uniform 0..jitter_ms (xorshift64, reproducible)
+ */
+static uint64_t _sim_delay_us(modem_sim_t *sim, uint32_t ms, uint32_t jitter_ms)
+{
+    uint64_t us = (uint64_t)ms * 1000;
+    if (jitter_ms > 0)
+    {
+        uint64_t x = sim->rand_state;
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        sim->rand_state = x;
+        us += x % ((uint64_t)jitter_ms * 1000 + 1);
+    }
+    return us;
+}
+
+/* --- Rules --- */
+
+/**
+ * @brief Returns the rule of a command, creating it if needed, NULL if the table is full
+ */
+static sim_rule_t *_sim_rule(modem_sim_t *sim, const char *key, bool create)
+{
+    for (size_t i = 0; i < sim->rule_count; i++)
+    {
+        if (strcmp(sim->rules[i].key, key) == 0)
+            return &sim->rules[i];
+    }
+    if (!create || sim->rule_count == MODEM_SIM_MAX_RULES || strlen(key) >= MODEM_SIM_KEY_LEN)
+        return NULL;
+
+    sim_rule_t *rule = &sim->rules[sim->rule_count++];
+    memset(rule, 0, sizeof(*rule));
+    strcpy(rule->key, key);
+
+    // New rules inherit the timing of the default rule
+    sim_rule_t *def = _sim_rule(sim, "*", false);
+    if (def && def != rule)
+    {
+        rule->latency_ms = def->latency_ms;
+        rule->jitter_ms = def->jitter_ms;
+        rule->result_ms = def->result_ms;
+        rule->result_jitter_ms = def->result_jitter_ms;
+    }
+    return rule;
+}
+
+/**
+ * @brief Returns the rule that applies to a command: its own or the default one
+ */
+static const sim_rule_t *_sim_rule_for(modem_sim_t *sim, const char *key)
+{
+    static const sim_rule_t none = { 0 };
+    const sim_rule_t *rule = _sim_rule(sim, key, false);
+    if (rule == NULL)
+        rule = _sim_rule(sim, "*", false);
+    return rule ? rule : &none;
+}
+
+/* --- Output --- */
+
+/**
+ * @brief Schedules output at a time, after the events already due at that time
+ */
+static void _sim_schedule(modem_sim_t *sim, uint64_t due_us, const char *data, size_t len, bool urc)
+{
+    if (len == 0)
+        return;
+    if (sim->event_count == MODEM_SIM_MAX_EVENTS)
+    {
+        fprintf(stderr, "modem_sim: output queue full, dropping %zu bytes\n", len);
+        return;
+    }
+
+    char *copy = malloc(len);
+    if (copy == NULL)
+        return;
+    memcpy(copy, data, len);
+
+    // Like the modem, unsolicited lines do not go into the data of a transparent link: they
+    // wait until it leaves data mode
+    uint8_t dlc = !sim->cmux ? 0 : urc ? sim->urc_dlc : sim->in_dlc;
+    if (urc && sim->data_mode && dlc == sim->data_dlc)
+    {
+        if (sim->held_count == MODEM_SIM_HELD_URCS)
+        {
+            fprintf(stderr, "modem_sim: data mode, dropping an unsolicited line\n");
+            free(copy);
+            return;
+        }
+        sim->held[sim->held_count++] = (sim_event_t){ .urc = true, .len = len, .data = copy, .dlc = dlc };
+        return;
+    }
+
+    size_t pos = sim->event_count;
+    while (pos > 0 && sim->events[pos - 1].due_us > due_us)
+    {
+        sim->events[pos] = sim->events[pos - 1];
+        pos--;
+    }
+    sim->events[pos] = (sim_event_t){ .due_us = due_us, .seq = sim->event_seq++, .urc = urc, .len = len, .data = copy, .dlc = dlc };
+    sim->event_count++;
+}
+
+/**
+ * @brief termios speed of the rates AT+IPR accepts, B0 for the others
+ */
+static speed_t _sim_speed(uint32_t rate)
+{
+    switch (rate)
+    {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    case 921600: return B921600;
+    case 3000000: return B3000000;
+    default: return B0;
+    }
+}
+
+/**
+ * @brief False when the host runs its end of the pty at another rate than the modem, which
+ * garbles the line both ways. Only checked once AT+IPR was used: until then the pty rate is
+ * whatever the host left.
+ */
+static bool _sim_line_ok(modem_sim_t *sim)
+{
+    if (!sim->ipr_set || sim->listen_fd >= 0 || sim->fd < 0)
+        return true;
+    struct termios tio;
+    if (tcgetattr(sim->fd, &tio) != 0)
+        return true;
+    return cfgetospeed(&tio) == _sim_speed(sim->ipr);
+}
+
+/**
+ * @brief Writes bytes to the link, in chunks if configured
+ */
+static void _sim_write(modem_sim_t *sim, const char *data, size_t len)
+{
+    if (sim->fd < 0 || !_sim_line_ok(sim))
+        return;
+
+    size_t step = (sim->chunk > 0) ? sim->chunk : len;
+    size_t off = 0;
+    while (off < len)
+    {
+        size_t n = (len - off < step) ? len - off : step;
+        ssize_t w = write(sim->fd, data + off, n);
+        if (w < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return;
+        }
+        off += w;
+        sim->stats.tx_bytes += w;
+        if (sim->chunk > 0 && sim->chunk_gap_us > 0 && off < len)
+            usleep(sim->chunk_gap_us);
+    }
+}
+
+/**
+ * @brief FCS of 27.010: reflected CRC-8 (x^8 + x^2 + x + 1), initial value 0xFF
+ */
+static uint8_t _sim_fcs(const uint8_t *data, size_t len)
+{
+    uint8_t crc = 0xFF;
+    for (size_t i = 0; i < len; i++)
+    {
+        crc ^= data[i];
+        for (int b = 0; b < 8; b++)
+            crc = (crc & 1) ? (uint8_t)((crc >> 1) ^ 0xE0) : (uint8_t)(crc >> 1);
+    }
+    return (uint8_t)(0xFF - crc);
+}
+
+/**
+ * @brief Writes a frame, the FCS over the header only for UIH
+ */
+static void _sim_write_frame(modem_sim_t *sim, uint8_t addr, uint8_t ctrl, const void *info, size_t len)
+{
+    uint8_t frame[MODEM_SIM_CMUX_N1 + 7];
+    size_t n = 0;
+    frame[n++] = 0xF9;
+    frame[n++] = addr;
+    frame[n++] = ctrl;
+    if (len < 128)
+    {
+        frame[n++] = (uint8_t)((len << 1) | 1);
+    }
+    else
+    {
+        frame[n++] = (uint8_t)(len << 1);
+        frame[n++] = (uint8_t)(len >> 7);
+    }
+    size_t hdr_len = n - 1;
+    if (len > 0)
+        memcpy(&frame[n], info, len);
+    n += len;
+    uint8_t fcs = _sim_fcs(&frame[1], ((ctrl & ~0x10) == 0xEF) ? hdr_len : n - 1);
+    frame[n++] = fcs;
+    frame[n++] = 0xF9;
+    _sim_write(sim, (const char *)frame, n);
+}
+
+/**
+ * @brief Writes output on a DLC in UIH frames of at most N1 bytes. The modem is the
+ * responder: its commands and data have the C/R bit clear.
+ */
+static void _sim_write_uih(modem_sim_t *sim, uint8_t dlc, const char *data, size_t len)
+{
+    for (size_t off = 0; off < len; off += sim->cmux_n1)
+    {
+        size_t n = (len - off < sim->cmux_n1) ? len - off : sim->cmux_n1;
+        _sim_write_frame(sim, (uint8_t)((dlc << 2) | 1), 0xEF, data + off, n);
+    }
+}
+
+/**
+ * @brief Writes the events that are due and fires the timers
+ *
+ * @return Time of the next event or timer, UINT64_MAX if there is none
+ */
+static uint64_t _sim_flush_due(modem_sim_t *sim)
+{
+    uint64_t now = _sim_now_us();
+
+    for (size_t i = 0; i < sim->timer_count; i++)
+    {
+        sim_timer_t *timer = &sim->timers[i];
+        if (timer->text == NULL || timer->next_us > now)
+            continue;
+        if (timer->reg_stat >= 0)
+        {
+            // Registered on LTE: attached with the default bearer active
+            bool registered = (timer->reg_stat == 1 || timer->reg_stat == 5);
+            sim->creg = sim->cereg = timer->reg_stat;
+            sim->cgatt = sim->pdp[0].active = registered;
+            char urc[32];
+            int n;
+            if (sim->creg_n > 0)
+            {
+                n = snprintf(urc, sizeof(urc), "\r\n+CREG: %d\r\n", timer->reg_stat);
+                _sim_schedule(sim, now, urc, (size_t)n, true);
+            }
+            if (sim->cereg_n > 0)
+            {
+                n = snprintf(urc, sizeof(urc), "\r\n+CEREG: %d\r\n", timer->reg_stat);
+                _sim_schedule(sim, now, urc, (size_t)n, true);
+            }
+            if (sim->cgerep > 0 && registered)
+            {
+                n = snprintf(urc, sizeof(urc), "\r\n+CGEV: ME PDN ACT 1\r\n");
+                _sim_schedule(sim, now, urc, (size_t)n, true);
+            }
+        }
+        else if (timer->rssi >= 0)
+        {
+            sim->rssi = timer->rssi;
+            if (sim->autocsq)
+            {
+                char urc[32];
+                int n = snprintf(urc, sizeof(urc), "\r\n+CSQ: %d,99\r\n", timer->rssi);
+                _sim_schedule(sim, now, urc, (size_t)n, true);
+            }
+        }
+        else
+        {
+            _sim_schedule(sim, now, timer->text, strlen(timer->text), true);
+        }
+        if (timer->period_ms > 0)
+        {
+            timer->next_us += (uint64_t)timer->period_ms * 1000;
+        }
+        else
+        {
+            free(timer->text);
+            timer->text = NULL;
+        }
+    }
+
+    size_t done = 0;
+    uint64_t wire_end = 0;
+    while (done < sim->event_count && sim->events[done].due_us <= now)
+    {
+        sim_event_t *event = &sim->events[done];
+        if (sim->baud > 0)
+        {
+            // Written when its last byte would have arrived, after the previous output
+            uint64_t start = (event->due_us > sim->tx_free_us) ? event->due_us : sim->tx_free_us;
+            uint64_t end = start + _sim_wire_us(sim, _sim_wire_len(sim, event));
+            if (end > now)
+            {
+                wire_end = end;
+                break;
+            }
+            sim->tx_free_us = end;
+        }
+        if (event->dlc > 0)
+            _sim_write_uih(sim, event->dlc, event->data, event->len);
+        else
+            _sim_write(sim, event->data, event->len);
+        if (event->urc && sim->fd >= 0)
+            sim->stats.urcs++;
+        if (event->ipr > 0)
+        {
+            sim->ipr = event->ipr;
+            sim->ipr_set = true;
+            if (sim->baud > 0)
+                sim->baud = event->ipr;
+        }
+        free(event->data);
+        done++;
+    }
+    if (done > 0)
+    {
+        memmove(sim->events, &sim->events[done], (sim->event_count - done) * sizeof(sim_event_t));
+        sim->event_count -= done;
+    }
+
+    uint64_t next = (sim->event_count == 0) ? UINT64_MAX : (wire_end > 0) ? wire_end : sim->events[0].due_us;
+    for (size_t i = 0; i < sim->timer_count; i++)
+    {
+        if (sim->timers[i].text && sim->timers[i].next_us < next)
+            next = sim->timers[i].next_us;
+    }
+    return next;
+}
+
+/* --- Response building --- */
+
+static void _resp_append(char *buf, size_t *len, const char *fmt, va_list ap)
+{
+    if (*len >= MODEM_SIM_OUT_LEN - 1)
+        return;
+    int n = vsnprintf(buf + *len, MODEM_SIM_OUT_LEN - *len, fmt, ap);
+    if (n > 0)
+        *len += ((size_t)n < MODEM_SIM_OUT_LEN - *len) ? (size_t)n : MODEM_SIM_OUT_LEN - *len - 1;
+}
+
+/**
+ * @brief Appends a formatted line framed with CR/LF
+ */
+static void _resp_frame(char *buf, size_t *len, const char *fmt, va_list ap)
+{
+    char line[MODEM_SIM_LINE_LEN];
+    vsnprintf(line, sizeof(line), fmt, ap);
+    int n = snprintf(buf + *len, MODEM_SIM_OUT_LEN - *len, "\r\n%s\r\n", line);
+    if (n > 0)
+        *len += ((size_t)n < MODEM_SIM_OUT_LEN - *len) ? (size_t)n : MODEM_SIM_OUT_LEN - *len - 1;
+}
+
+/**
+ * @brief Adds an information line "\r\n<line>\r\n" to the response
+ */
+static void _resp_line(sim_resp_t *resp, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    _resp_frame(resp->text, &resp->len, fmt, ap);
+    va_end(ap);
+    resp->info = true;
+}
+
+/**
+ * @brief Adds a line sent after the result delay, e.g. "+CMQTTPUB: 0,0"
+ */
+static void _resp_result(sim_resp_t *resp, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    _resp_frame(resp->result, &resp->result_len, fmt, ap);
+    va_end(ap);
+}
+
+/**
+ * @brief Adds the final result code
+ */
+static void _resp_final(sim_resp_t *resp, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    _resp_frame(resp->text, &resp->len, fmt, ap);
+    va_end(ap);
+}
+
+/**
+ * @brief Adds raw text, e.g. the '>' prompt
+ */
+static void _resp_raw(sim_resp_t *resp, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    _resp_append(resp->text, &resp->len, fmt, ap);
+    va_end(ap);
+}
+
+static void _resp_ok(sim_resp_t *resp)
+{
+    _resp_final(resp, "OK");
+}
+
+static void _resp_error(sim_resp_t *resp)
+{
+    _resp_final(resp, "ERROR");
+    resp->error = true;
+}
+
+/**
+ * @brief Reads the integer parameters of a command, returns how many were read
+ */
+static int _sim_params(const char *p, int *values, int max)
+{
+    int count = 0;
+    while (count < max && *p)
+    {
+        if (*p == '"')
+        {
+            // Quoted strings count as one parameter with value 0
+            const char *end = strchr(p + 1, '"');
+            if (end == NULL)
+                break;
+            values[count++] = 0;
+            p = end + 1;
+        }
+        else
+        {
+            char *end;
+            long v = strtol(p, &end, 10);
+            if (end == p)
+                break;
+            values[count++] = (int)v;
+            p = end;
+        }
+        if (*p != ',')
+            break;
+        p++;
+    }
+    return count;
+}
+
+/**
+ * @brief Copies a quoted parameter of a command
+ *
+ * @param index Which quoted parameter, 0 for the first one
+ */
+static void _sim_quoted(const char *p, int index, char *out, size_t size)
+{
+    out[0] = '\0';
+    const char *start = strchr(p, '"');
+    const char *end = start ? strchr(start + 1, '"') : NULL;
+    while (end != NULL && index-- > 0)
+    {
+        start = strchr(end + 1, '"');
+        end = start ? strchr(start + 1, '"') : NULL;
+    }
+    if (end == NULL)
+        return;
+    size_t len = end - start - 1;
+    if (len >= size)
+        len = size - 1;
+    memcpy(out, start + 1, len);
+    out[len] = '\0';
+}
+
+/**
+ * @brief Command name used as rule key: "+CSQ" for "AT+CSQ?", "E" for "ATE1", "AT" for "AT"
+ */
+static void _sim_cmd_key(const char *line, char *key, size_t size)
+{
+    const char *p = line + 2;
+    size_t len = strcspn(p, "=?");
+    if (*p != '+' && *p != '*' && *p != '&')
+    {
+        // Basic command: letters only (ATE1 -> E)
+        len = 0;
+        while (isalpha((unsigned char)p[len]))
+            len++;
+    }
+    if (len == 0)
+    {
+        snprintf(key, size, "AT");
+        return;
+    }
+    if (len >= size)
+        len = size - 1;
+    for (size_t i = 0; i < len; i++)
+        key[i] = toupper((unsigned char)p[i]);
+    key[len] = '\0';
+}
+
+/**
+ * @brief Enters '>' data input mode, the response is the prompt
+ */
+static void _sim_data_mode(modem_sim_t *sim, sim_resp_t *resp, sim_data_kind_t kind, int client, int len, const char *key)
+{
+    if (len <= 0 || len > MODEM_SIM_DATA_LEN)
+    {
+        _resp_error(resp);
+        return;
+    }
+    sim->in->data_kind = kind;
+    sim->in->data_client = client;
+    sim->in->data_left = len;
+    sim->in->data_len = 0;
+    snprintf(sim->in->data_key, sizeof(sim->in->data_key), "%s", key);
+    _resp_raw(resp, "\r\n>");
+}
+
+/* --- Commands --- */
+
+static bool _sim_client_ok(int client)
+{
+    return client >= 0 && client < MODEM_SIM_CLIENTS;
+}
+
+/**
+ * @brief Builds the response of the MQTT commands
+ */
+static void _sim_mqtt(modem_sim_t *sim, const char *key, const char *args, bool set, sim_resp_t *resp)
+{
+    int v[4] = { 0 };
+    int n = set ? _sim_params(args, v, 4) : 0;
+    int client = v[0];
+
+    if (strcmp(key, "+CMQTTSTART") == 0)
+    {
+        if (sim->mqtt_started)
+        {
+            _resp_line(resp, "+CMQTTSTART: 23");
+            _resp_error(resp);
+            return;
+        }
+        sim->mqtt_started = true;
+        _resp_ok(resp);
+        _resp_result(resp, "+CMQTTSTART: 0");
+        return;
+    }
+    if (strcmp(key, "+CMQTTSTOP") == 0)
+    {
+        if (!sim->mqtt_started)
+        {
+            _resp_error(resp);
+            return;
+        }
+        sim->mqtt_started = false;
+        memset(sim->mqtt_acquired, 0, sizeof(sim->mqtt_acquired));
+        memset(sim->mqtt_connected, 0, sizeof(sim->mqtt_connected));
+        _resp_ok(resp);
+        _resp_result(resp, "+CMQTTSTOP: 0");
+        return;
+    }
+
+    if (strcmp(key, "+CMQTTCONNECT") == 0 && strcmp(args, "?") == 0)
+    {
+        for (int i = 0; i < MODEM_SIM_CLIENTS; i++)
+            if (sim->mqtt_connected[i])
+                _resp_line(resp, "+CMQTTCONNECT: %s", sim->mqtt_connect_args[i]);
+        _resp_ok(resp);
+        return;
+    }
+
+    if (!set || n < 1 || !_sim_client_ok(client))
+    {
+        _resp_error(resp);
+        return;
+    }
+
+    if (strcmp(key, "+CMQTTACCQ") == 0)
+    {
+        if (!sim->mqtt_started || sim->mqtt_acquired[client])
+        {
+            _resp_line(resp, "+CMQTTACCQ: %d,19", client);
+            _resp_error(resp);
+            return;
+        }
+        sim->mqtt_acquired[client] = true;
+        _resp_ok(resp);
+    }
+    else if (strcmp(key, "+CMQTTREL") == 0)
+    {
+        sim->mqtt_acquired[client] = false;
+        sim->mqtt_connected[client] = false;
+        _resp_ok(resp);
+    }
+    else if (strcmp(key, "+CMQTTCONNECT") == 0)
+    {
+        if (!sim->mqtt_acquired[client] || sim->mqtt_connected[client])
+        {
+            _resp_line(resp, "+CMQTTCONNECT: %d,%d", client, sim->mqtt_connected[client] ? 13 : 20);
+            _resp_error(resp);
+            return;
+        }
+        sim->mqtt_connected[client] = true;
+        snprintf(sim->mqtt_connect_args[client], MODEM_SIM_TEXT_LEN, "%s", args);
+        _resp_ok(resp);
+        _resp_result(resp, "+CMQTTCONNECT: %d,0", client);
+    }
+    else if (strcmp(key, "+CMQTTDISC") == 0)
+    {
+        if (!sim->mqtt_connected[client])
+        {
+            _resp_line(resp, "+CMQTTDISC: %d,11", client);
+            _resp_error(resp);
+            return;
+        }
+        sim->mqtt_connected[client] = false;
+        _resp_ok(resp);
+        _resp_result(resp, "+CMQTTDISC: %d,0", client);
+    }
+    else if (strcmp(key, "+CMQTTTOPIC") == 0 && n >= 2)
+    {
+        _sim_data_mode(sim, resp, SIM_DATA_TOPIC, client, v[1], key);
+    }
+    else if (strcmp(key, "+CMQTTPAYLOAD") == 0 && n >= 2)
+    {
+        _sim_data_mode(sim, resp, SIM_DATA_PAYLOAD, client, v[1], key);
+    }
+    else if (strcmp(key, "+CMQTTSUBTOPIC") == 0 && n >= 2)
+    {
+        _sim_data_mode(sim, resp, SIM_DATA_SUB_TOPIC, client, v[1], key);
+    }
+    else if (strcmp(key, "+CMQTTUNSUBTOPIC") == 0 && n >= 2)
+    {
+        _sim_data_mode(sim, resp, SIM_DATA_UNSUB_TOPIC, client, v[1], key);
+    }
+    else if (strcmp(key, "+CMQTTSUB") == 0 || strcmp(key, "+CMQTTUNSUB") == 0)
+    {
+        bool sub = (strcmp(key, "+CMQTTSUB") == 0);
+        if (!sim->mqtt_connected[client])
+        {
+            _resp_line(resp, "%s: %d,11", key, client);
+            _resp_error(resp);
+            return;
+        }
+        if (n >= 2)
+        {
+            // Topic given in the command: "AT+CMQTTSUB=0,<len>,<qos>" then '>'
+            _sim_data_mode(sim, resp, sub ? SIM_DATA_SUB : SIM_DATA_UNSUB, client, v[1], key);
+            return;
+        }
+        _resp_ok(resp);
+        _resp_result(resp, "%s: %d,0", key, client);
+    }
+    else if (strcmp(key, "+CMQTTPUB") == 0)
+    {
+        if (!sim->mqtt_connected[client] || sim->mqtt_topic_len[client] == 0)
+        {
+            _resp_line(resp, "+CMQTTPUB: %d,%d", client, sim->mqtt_connected[client] ? 14 : 11);
+            _resp_error(resp);
+            return;
+        }
+        sim->stats.publishes++;
+        sim->mqtt_topic_len[client] = 0;
+        sim->mqtt_payload_len[client] = 0;
+        _resp_ok(resp);
+        _resp_result(resp, "+CMQTTPUB: %d,0", client);
+    }
+    else
+    {
+        _resp_error(resp);
+    }
+}
+
+/* --- Sockets --- */
+
+static bool _sim_link_ok(int link)
+{
+    return link >= 0 && link < MODEM_SIM_LINKS;
+}
+
+/**
+ * @brief Closes the host socket of a link
+ */
+static void _sim_link_close(modem_sim_t *sim, int link)
+{
+    if (sim->links[link].fd >= 0)
+        close(sim->links[link].fd);
+    sim->links[link].fd = -1;
+    sim->links[link].notified = false;
+}
+
+/**
+ * @brief Address of a peer: dotted IPv4 or "localhost", there is no DNS
+ */
+static bool _sim_link_addr(const char *host, int port, struct sockaddr_in *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons((uint16_t)port);
+    if (strcmp(host, "localhost") == 0)
+        host = "127.0.0.1";
+    return port > 0 && port < 65536 && inet_pton(AF_INET, host, &addr->sin_addr) == 1;
+}
+
+/**
+ * @brief Opens the host socket of AT+CIPOPEN: connects a TCP link, binds a UDP one on loopback
+ *
+ * @return Error of the "+CIPOPEN: <link>,<err>" result, 0 on success
+ */
+static int _sim_link_open(modem_sim_t *sim, int link, const char *args)
+{
+    char type[8], host[64];
+    _sim_quoted(args, 0, type, sizeof(type));
+    _sim_quoted(args, 1, host, sizeof(host));
+    const char *last = strrchr(args, ',');
+    int port = last ? atoi(last + 1) : 0;   // remote port of TCP, local port of UDP
+    bool udp = (strcmp(type, "UDP") == 0);
+    if (!udp && strcmp(type, "TCP") != 0)
+        return 3;
+
+    struct sockaddr_in addr;
+    if (udp)
+    {
+        _sim_link_addr("127.0.0.1", 1, &addr);
+        addr.sin_port = htons((uint16_t)port);
+    }
+    else if (!_sim_link_addr(host, port, &addr))
+    {
+        return 11;
+    }
+
+    int fd = socket(AF_INET, udp ? SOCK_DGRAM : SOCK_STREAM, 0);
+    if (fd < 0)
+        return 5;
+    if (udp ? bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+            : connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        return udp ? 6 : 1;
+    }
+    sim->links[link].fd = fd;
+    sim->links[link].udp = udp;
+    sim->links[link].notified = false;
+    return 0;
+}
+
+/**
+ * @brief Sends the data of AT+CIPSEND without blocking the modem
+ *
+ * @return Bytes taken by the host socket, less than len if its buffer is full, -1 if the link
+ * is gone
+ */
+static int _sim_link_send(modem_sim_t *sim, int link, const char *data, size_t len)
+{
+    if (sim->links[link].fd < 0)
+        return -1;
+    ssize_t n = sim->links[link].udp
+        ? sendto(sim->links[link].fd, data, len, MSG_DONTWAIT, (struct sockaddr *)&sim->links[link].dest, sizeof(sim->links[link].dest))
+        : send(sim->links[link].fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    return (int)n;
+}
+
+/**
+ * @brief Adds the data of AT+CIPRXGET=2: "+CIPRXGET: 2,<link>,<read>,<rest>" and the bytes
+ */
+static void _sim_link_read(modem_sim_t *sim, int link, int len, sim_resp_t *resp)
+{
+    char data[MODEM_SIM_RX_READ_LEN];
+    if (len > MODEM_SIM_RX_READ_LEN)
+        len = MODEM_SIM_RX_READ_LEN;
+    ssize_t n = recv(sim->links[link].fd, data, len, MSG_DONTWAIT);
+    if (n < 0)
+        n = 0;
+    int rest = 0;
+    ioctl(sim->links[link].fd, FIONREAD, &rest);
+
+    _resp_line(resp, "+CIPRXGET: 2,%d,%d,%d", link, (int)n, rest);
+    memcpy(resp->text + resp->len, data, n);
+    resp->len += n;
+    _resp_ok(resp);
+
+    // Read empty: the next data is announced again
+    if (rest == 0)
+        sim->links[link].notified = false;
+}
+
+/**
+ * @brief Handles a readable host socket: announces the data (AT+CIPRXGET=1) or pushes it with
+ * "+RECEIVE,<link>,<len>", reports the close of a TCP peer with "+IPCLOSE: <link>,1"
+ */
+static void _sim_link_ready(modem_sim_t *sim, int link)
+{
+    int fd = sim->links[link].fd;
+    char urc[32 + MODEM_SIM_RX_READ_LEN];
+    ssize_t n;
+
+    if (sim->rxget == 1)
+    {
+        n = recv(fd, urc, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n > 0)
+        {
+            int len = snprintf(urc, sizeof(urc), "\r\n+CIPRXGET: 1,%d\r\n", link);
+            _sim_schedule(sim, _sim_now_us(), urc, len, true);
+            sim->links[link].notified = true;
+            return;
+        }
+    }
+    else
+    {
+        char data[MODEM_SIM_RX_READ_LEN];
+        n = recv(fd, data, sizeof(data), MSG_DONTWAIT);
+        if (n > 0)
+        {
+            int len = snprintf(urc, sizeof(urc), "\r\n+RECEIVE,%d,%d\r\n", link, (int)n);
+            memcpy(urc + len, data, n);
+            _sim_schedule(sim, _sim_now_us(), urc, len + n, true);
+            return;
+        }
+    }
+
+    if ((n == 0 && !sim->links[link].udp) || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+    {
+        char line[32];
+        int len = snprintf(line, sizeof(line), "\r\n+IPCLOSE: %d,1\r\n", link);
+        _sim_schedule(sim, _sim_now_us(), line, len, true);
+        _sim_link_close(sim, link);
+    }
+}
+
+/**
+ * @brief Schedules output of the data mode, after the response that entered it
+ */
+static void _sim_data_schedule(modem_sim_t *sim, const char *data, size_t len)
+{
+    uint64_t due = _sim_now_us();
+    if (due < sim->inputs[sim->data_dlc].busy_until_us)
+        due = sim->inputs[sim->data_dlc].busy_until_us;
+    _sim_schedule(sim, due, data, len, false);
+    for (size_t i = 0; sim->cmux && i < sim->event_count; i++)
+    {
+        if (sim->events[i].seq == sim->event_seq - 1)
+            sim->events[i].dlc = sim->data_dlc;
+    }
+}
+
+/**
+ * @brief Sends the unsolicited lines held in data mode, after the output queued so far (the
+ * OK of the escape or CLOSED)
+ */
+static void _sim_held_release(modem_sim_t *sim)
+{
+    uint64_t due = _sim_now_us();
+    if (sim->event_count > 0 && sim->events[sim->event_count - 1].due_us > due)
+        due = sim->events[sim->event_count - 1].due_us;
+    for (size_t i = 0; i < sim->held_count; i++)
+    {
+        _sim_schedule(sim, due, sim->held[i].data, sim->held[i].len, true);
+        free(sim->held[i].data);
+    }
+    sim->held_count = 0;
+}
+
+/**
+ * @brief Handles the readable host socket of a transparent link: raw data, "CLOSED" and back to
+ * command mode once the peer closed
+ */
+static void _sim_link_ready_transparent(modem_sim_t *sim, int link)
+{
+    char data[MODEM_SIM_RX_READ_LEN];
+    ssize_t n = recv(sim->links[link].fd, data, sizeof(data), MSG_DONTWAIT);
+    if (n > 0)
+    {
+        _sim_data_schedule(sim, data, n);
+        return;
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+    {
+        _sim_data_schedule(sim, "\r\nCLOSED\r\n", 10);
+        _sim_link_close(sim, link);
+        sim->data_mode = false;
+        sim->data_out_len = 0;
+        _sim_held_release(sim);
+    }
+}
+
+/**
+ * @brief Whether the thread polls the host socket of a link: until its data is announced with
+ * AT+CIPRXGET=1, while the output queue is short otherwise (the peer waits on the TCP window)
+ */
+static bool _sim_link_polled(const modem_sim_t *sim, int link)
+{
+    if (sim->links[link].fd < 0)
+        return false;
+    // A transparent link in command mode keeps its data until ATO
+    if (sim->cipmode == 1 && link == 0)
+        return sim->data_mode && sim->event_count < MODEM_SIM_MAX_EVENTS / 16;
+    return (sim->rxget == 1) ? !sim->links[link].notified : sim->event_count < MODEM_SIM_MAX_EVENTS / 16;
+}
+
+/**
+ * @brief Enters data mode on the input being processed, after the CONNECT response
+ */
+static void _sim_data_start(modem_sim_t *sim, sim_resp_t *resp)
+{
+    sim->data_mode = true;
+    sim->data_dlc = sim->in_dlc;
+    sim->plus = 0;
+    sim->data_rx_us = _sim_now_us();
+    sim->data_out_len = 0;
+    _resp_final(resp, "CONNECT 115200");
+}
+
+/**
+ * @brief Leaves data mode and drops what the host socket did not take
+ */
+static void _sim_data_end(modem_sim_t *sim)
+{
+    sim->data_mode = false;
+    sim->plus = 0;
+    sim->data_out_len = 0;
+    _sim_held_release(sim);
+}
+
+/**
+ * @brief Sends the data mode input to the host socket of link 0, as much as it takes
+ */
+static void _sim_data_flush(modem_sim_t *sim)
+{
+    if (sim->data_out_len == 0)
+        return;
+    int n = _sim_link_send(sim, 0, sim->data_out, sim->data_out_len);
+    if (n < 0)
+        n = (int)sim->data_out_len;     // link gone, the data with it
+    memmove(sim->data_out, sim->data_out + n, sim->data_out_len - n);
+    sim->data_out_len -= n;
+}
+
+/**
+ * @brief Stores a data mode byte for link 0
+ */
+static void _sim_data_put(modem_sim_t *sim, char c)
+{
+    if (sim->data_out_len == sizeof(sim->data_out))
+    {
+        fprintf(stderr, "modem_sim: data mode input full, dropping a byte\n");
+        return;
+    }
+    sim->data_out[sim->data_out_len++] = c;
+    sim->stats.payload_bytes++;
+}
+
+/**
+ * @brief Processes a byte received in data mode. "+++" after the guard time is held back: the
+ * escape if the guard time passes again without input, data otherwise.
+ */
+static void _sim_data_byte(modem_sim_t *sim, char c)
+{
+    // LF of the CR/LF that ended AT+CIPOPEN or ATO
+    if (sim->in->skip_lf && c == '\n')
+    {
+        sim->in->skip_lf = false;
+        return;
+    }
+    sim->in->skip_lf = false;
+
+    // The guard counts from the read: a pty has no output queue the host could wait on, and the
+    // bytes may wait in it while the thread writes, so a tenth of the guard is let go
+    uint64_t now = _sim_now_us();
+    bool quiet = (now - sim->data_rx_us >= (uint64_t)sim->guard_ms * 900);
+    sim->data_rx_us = now;
+    if (c == '+' && sim->plus < 3 && (sim->plus > 0 || quiet))
+    {
+        sim->plus++;
+        return;
+    }
+    for (; sim->plus > 0; sim->plus--)
+        _sim_data_put(sim, '+');
+    _sim_data_put(sim, c);
+}
+
+/**
+ * @brief Leaves data mode with OK once the guard time after "+++" passed
+ *
+ * @return Time the escape is due, UINT64_MAX if none is in progress
+ */
+static uint64_t _sim_escape_due(modem_sim_t *sim)
+{
+    if (!sim->data_mode || sim->plus < 3)
+        return UINT64_MAX;
+
+    uint64_t due = sim->data_rx_us + (uint64_t)sim->guard_ms * 1000;
+    if (_sim_now_us() < due)
+        return due;
+
+    // The connection stays, ATO goes back to it
+    _sim_data_schedule(sim, "\r\nOK\r\n", 6);
+    sim->data_mode = false;
+    sim->plus = 0;
+    _sim_held_release(sim);
+    return UINT64_MAX;
+}
+
+/**
+ * @brief Builds the response of the TCP/IP commands
+ */
+static void _sim_socket(modem_sim_t *sim, const char *key, const char *args, bool set, bool query, sim_resp_t *resp)
+{
+    int v[4] = { 0 };
+    int n = set ? _sim_params(args, v, 4) : 0;
+
+    if (strcmp(key, "+NETOPEN") == 0)
+    {
+        if (query)
+        {
+            _resp_line(resp, "+NETOPEN: %d", sim->net_open);
+            _resp_ok(resp);
+        }
+        else if (sim->net_open)
+        {
+            _resp_line(resp, "+IP ERROR: Network is already opened");
+            _resp_error(resp);
+        }
+        else
+        {
+            sim->net_open = true;
+            _resp_ok(resp);
+            _resp_result(resp, "+NETOPEN: 0");
+        }
+        return;
+    }
+    if (strcmp(key, "+NETCLOSE") == 0)
+    {
+        for (int i = 0; i < MODEM_SIM_LINKS; i++)
+            _sim_link_close(sim, i);
+        _sim_data_end(sim);
+        _resp_ok(resp);
+        _resp_result(resp, "+NETCLOSE: %d", sim->net_open ? 0 : 2);
+        sim->net_open = false;
+        return;
+    }
+    if (strcmp(key, "+CIPMODE") == 0)
+    {
+        // Taken while the network is closed only
+        if (query)
+        {
+            _resp_line(resp, "+CIPMODE: %d", sim->cipmode);
+            _resp_ok(resp);
+        }
+        else if (n == 1 && (v[0] == 0 || v[0] == 1) && !sim->net_open)
+        {
+            sim->cipmode = v[0];
+            _resp_ok(resp);
+        }
+        else
+        {
+            _resp_error(resp);
+        }
+        return;
+    }
+    if (strcmp(key, "+CIPRXGET") == 0)
+    {
+        if (query)
+        {
+            _resp_line(resp, "+CIPRXGET: %d", sim->rxget);
+            _resp_ok(resp);
+        }
+        else if (n == 1 && (v[0] == 0 || v[0] == 1))
+        {
+            sim->rxget = v[0];
+            for (int i = 0; i < MODEM_SIM_LINKS; i++)
+                sim->links[i].notified = false;
+            _resp_ok(resp);
+        }
+        else if (n >= 2 && (v[0] == 2 || v[0] == 4) && sim->rxget == 1 && _sim_link_ok(v[1]) && sim->links[v[1]].fd >= 0)
+        {
+            if (v[0] == 2)
+            {
+                _sim_link_read(sim, v[1], (n >= 3) ? v[2] : MODEM_SIM_RX_READ_LEN, resp);
+                return;
+            }
+            int rest = 0;
+            ioctl(sim->links[v[1]].fd, FIONREAD, &rest);
+            _resp_line(resp, "+CIPRXGET: 4,%d,%d", v[1], rest);
+            _resp_ok(resp);
+        }
+        else
+        {
+            _resp_error(resp);
+        }
+        return;
+    }
+
+    int link = v[0];
+    if (!set || n < 1 || !_sim_link_ok(link))
+    {
+        _resp_error(resp);
+        return;
+    }
+
+    if (strcmp(key, "+CIPOPEN") == 0)
+    {
+        if (!sim->net_open || sim->links[link].fd >= 0)
+        {
+            _resp_line(resp, "+CIPOPEN: %d,%d", link, sim->net_open ? 4 : 2);
+            _resp_error(resp);
+            return;
+        }
+        if (sim->cipmode == 1)
+        {
+            // Transparent mode: TCP on link 0 only, in data mode after CONNECT
+            char type[8];
+            _sim_quoted(args, 0, type, sizeof(type));
+            if (link != 0 || strcmp(type, "TCP") != 0 || _sim_link_open(sim, link, args) != 0)
+            {
+                _resp_final(resp, "CONNECT FAIL");
+                resp->error = true;
+                return;
+            }
+            _sim_data_start(sim, resp);
+            return;
+        }
+        _resp_ok(resp);
+        _resp_result(resp, "+CIPOPEN: %d,%d", link, _sim_link_open(sim, link, args));
+    }
+    else if (strcmp(key, "+CIPSEND") == 0 && n >= 2)
+    {
+        // AT+CIPSEND=<link>,<len>[,"<ip>",<port>], the destination is needed for UDP
+        char host[64];
+        _sim_quoted(args, 0, host, sizeof(host));
+        if (sim->links[link].fd < 0 || (sim->links[link].udp && (n < 4 || !_sim_link_addr(host, v[3], &sim->links[link].dest))))
+        {
+            _resp_error(resp);
+            return;
+        }
+        _sim_data_mode(sim, resp, SIM_DATA_SEND, link, v[1], key);
+    }
+    else if (strcmp(key, "+CIPCLOSE") == 0)
+    {
+        if (sim->links[link].fd < 0)
+        {
+            _resp_line(resp, "+CIPCLOSE: %d,4", link);
+            _resp_error(resp);
+            return;
+        }
+        _sim_link_close(sim, link);
+        _resp_ok(resp);
+        _resp_result(resp, "+CIPCLOSE: %d,0", link);
+    }
+    else
+    {
+        _resp_error(resp);
+    }
+}
+
+/**
+ * @brief Builds the response of a command line
+ */
+static void _sim_command(modem_sim_t *sim, const char *line, const char *key, sim_resp_t *resp)
+{
+    const char *args = line + 2 + strlen(key);
+    if (strcmp(key, "AT") == 0)
+        args = line + 2;
+    bool query = (strcmp(args, "?") == 0);
+    bool set = (args[0] == '=');
+    if (set)
+        args++;
+
+    int v[4] = { 0 };
+    int n = set ? _sim_params(args, v, 4) : 0;
+
+    if (strcmp(key, "AT") == 0)
+    {
+        _resp_ok(resp);
+    }
+    else if (strcmp(key, "E") == 0)
+    {
+        sim->echo = (line[3] == '1');
+        _resp_ok(resp);
+    }
+    else if (strcmp(key, "+CFUN") == 0)
+    {
+        if (query)
+            _resp_line(resp, "+CFUN: %d", sim->cfun);
+        else if (n >= 1)
+            sim->cfun = v[0];
+        _resp_ok(resp);
+    }
+    else if (strcmp(key, "+CSQ") == 0)
+    {
+        _resp_line(resp, "+CSQ: %d,99", sim->rssi);
+        _resp_ok(resp);
+    }
+    else if (strcmp(key, "+CREG") == 0 || strcmp(key, "+CEREG") == 0)
+    {
+        bool creg = (strcmp(key, "+CREG") == 0);
+        if (query)
+            _resp_line(resp, "%s: %d,%d", key, creg ? sim->creg_n : sim->cereg_n, creg ? sim->creg : sim->cereg);
+        else if (n >= 1)
+            *(creg ? &sim->creg_n : &sim->cereg_n) = v[0];
+        _resp_ok(resp);
+    }
+    else if (strcmp(key, "+AUTOCSQ") == 0 || strcmp(key, "+CGEREP") == 0)
+    {
+        bool autocsq = (strcmp(key, "+AUTOCSQ") == 0);
+        if (query)
+            _resp_line(resp, "%s: %d,%d", key, autocsq ? sim->autocsq : sim->cgerep, 0);
+        else if (n >= 1)
+            *(autocsq ? &sim->autocsq : &sim->cgerep) = v[0];
+        _resp_ok(resp);
+    }
+    else if (strcmp(key, "+CGATT") == 0)
+    {
+        if (query)
+            _resp_line(resp, "+CGATT: %d", sim->cgatt);
+        else if (n >= 1)
+            sim->cgatt = v[0];
+        _resp_ok(resp);
+    }
+    else if (strcmp(key, "+CGACT") == 0)
+    {
+        // AT+CGACT=<state>,<cid>
+        if (query)
+        {
+            for (int i = 0; i < MODEM_SIM_PDP_CONTEXTS; i++)
+                if (sim->pdp[i].defined)
+                    _resp_line(resp, "+CGACT: %d,%d", i + 1, sim->pdp[i].active);
+        }
+        else if (n >= 2 && (v[1] < 1 || v[1] > MODEM_SIM_PDP_CONTEXTS || !sim->pdp[v[1] - 1].defined))
+        {
+            _resp_error(resp);
+            return;
+        }
+        else if (n >= 1)
+        {
+            sim->pdp[(n >= 2 ? v[1] : 1) - 1].active = (v[0] == 1);
+        }
+        _resp_ok(resp);
+    }
+    else if (strcmp(key, "+CGDCONT") == 0)
+    {
+        if (query)
+        {
+            for (int i = 0; i < MODEM_SIM_PDP_CONTEXTS; i++)
+                if (sim->pdp[i].defined)
+                    _resp_line(resp, "+CGDCONT: %d,\"%s\",\"%s\",\"0.0.0.0\",0,0", i + 1, sim->pdp[i].type, sim->pdp[i].apn);
+        }
+        else if (n >= 1 && (v[0] < 1 || v[0] > MODEM_SIM_PDP_CONTEXTS))
+        {
+            _resp_error(resp);
+            return;
+        }
+        else if (n >= 1)
+        {
+            sim->pdp[v[0] - 1].defined = true;
+            _sim_quoted(args, 0, sim->pdp[v[0] - 1].type, sizeof(sim->pdp[0].type));
+            _sim_quoted(args, 1, sim->pdp[v[0] - 1].apn, sizeof(sim->pdp[0].apn));
+        }
+        _resp_ok(resp);
+    }
+    else if (strcmp(key, "+CGPADDR") == 0)
+    {
+        // Active contexts get the next IPv4 address after cid 1, and an IPv6 one in the
+        // dotted decimal format of the modem for the IPV6 and IPV4V6 types
+        unsigned a = 0, b = 0, c = 0, d = 0;
+        sscanf(sim->pdp_addr, "%u.%u.%u.%u", &a, &b, &c, &d);
+        for (int i = 0; i < MODEM_SIM_PDP_CONTEXTS; i++)
+        {
+            if (!sim->pdp[i].defined)
+                continue;
+            char v4[20], v6[64];
+            bool has_v4 = strcmp(sim->pdp[i].type, "IPV6") != 0;
+            bool has_v6 = strcmp(sim->pdp[i].type, "IP") != 0;
+            snprintf(v4, sizeof(v4), "%u.%u.%u.%u", a, b, c, sim->pdp[i].active ? d + i : 0);
+            snprintf(v6, sizeof(v6), "36.9.137.0.0.1.0.0.0.0.0.0.0.0.0.%d", sim->pdp[i].active ? i + 1 : 0);
+            if (!sim->pdp[i].active)
+                strcpy(v4, "0.0.0.0");
+            if (has_v4 && has_v6)
+                _resp_line(resp, "+CGPADDR: %d,%s,%s", i + 1, v4, v6);
+            else
+                _resp_line(resp, "+CGPADDR: %d,%s", i + 1, has_v4 ? v4 : v6);
+        }
+        _resp_ok(resp);
+    }
+    else if (strcmp(key, "+CPING") == 0)
+    {
+        char dest[64];
+        _sim_quoted(args, 0, dest, sizeof(dest));
+        _resp_ok(resp);
+        _resp_result(resp, "+CPING: 1,%s,32,47,255", dest);
+        _resp_result(resp, "+CPING: 3,1,1,0,47,47,47");
+    }
+    else if (strcmp(key, "+CNTP") == 0)
+    {
+        if (query)
+            _resp_line(resp, "+CNTP: \"%s\",%d", sim->ntp_host, sim->ntp_tz);
+        else if (set)
+        {
+            _sim_quoted(args, 0, sim->ntp_host, sizeof(sim->ntp_host));
+            if (n >= 2)
+                sim->ntp_tz = v[1];
+        }
+        _resp_ok(resp);
+        if (!query && !set)
+            _resp_result(resp, "+CNTP: 0");
+    }
+    else if (strcmp(key, "+CCLK") == 0)
+    {
+        time_t now = time(NULL) + sim->ntp_tz * 15 * 60;
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        _resp_line(resp, "+CCLK: \"%02d/%02d/%02d,%02d:%02d:%02d%+03d\"", tm.tm_year % 100, tm.tm_mon + 1,
+                   tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, sim->ntp_tz);
+        _resp_ok(resp);
+    }
+    else if (strcmp(key, "+CPIN") == 0)
+    {
+        if (query)
+            _resp_line(resp, "+CPIN: READY");
+        _resp_ok(resp);
+    }
+    else if (strcmp(key, "+CNMI") == 0 || strcmp(key, "+CPOF") == 0)
+    {
+        _resp_ok(resp);
+    }
+    else if (strcmp(key, "+IPR") == 0)
+    {
+        if (!query && (n < 1 || _sim_speed((uint32_t)v[0]) == B0))
+        {
+            _resp_error(resp);
+            return;
+        }
+        if (query)
+            _resp_line(resp, "+IPR: %u", sim->ipr);
+        else
+            resp->ipr = (uint32_t)v[0];
+        _resp_ok(resp);
+    }
+    else if (strcmp(key, "+IFC") == 0)
+    {
+        // 0 none, 2 RTS (DCE by DTE) / CTS (DTE by DCE)
+        if (!query && (n < 2 || (v[0] != 0 && v[0] != 2) || (v[1] != 0 && v[1] != 2)))
+        {
+            _resp_error(resp);
+            return;
+        }
+        if (query)
+        {
+            _resp_line(resp, "+IFC: %d,%d", sim->ifc[0], sim->ifc[1]);
+        }
+        else
+        {
+            sim->ifc[0] = v[0];
+            sim->ifc[1] = v[1];
+        }
+        _resp_ok(resp);
+    }
+    else if (strcmp(key, "+CMUX") == 0)
+    {
+        // Basic option only, N1 from the 4th parameter (31 by default)
+        if (query)
+        {
+            _resp_line(resp, "+CMUX: 0,0,5,%zu,10,3,30,10,2", sim->cmux_n1);
+        }
+        else if (n < 1 || v[0] != 0 || (n >= 4 && (v[3] < 1 || v[3] > MODEM_SIM_CMUX_N1)))
+        {
+            _resp_error(resp);
+            return;
+        }
+        else
+        {
+            // Frames are expected right after the command, the OK still goes plain
+            sim->cmux = true;
+            sim->cmux_n1 = (n >= 4) ? (size_t)v[3] : 31;
+            memset(&sim->frame, 0, sizeof(sim->frame));
+        }
+        _resp_ok(resp);
+    }
+    else if (strcmp(key, "+CRESET") == 0)
+    {
+        // AT+IPR, AT+IFC and the multiplexer do not survive the restart
+        if (sim->ipr != 115200)
+            resp->ipr = 115200;
+        resp->cmux_end = sim->cmux;
+        sim->ifc[0] = sim->ifc[1] = 0;
+        sim->mqtt_started = false;
+        memset(sim->mqtt_acquired, 0, sizeof(sim->mqtt_acquired));
+        memset(sim->mqtt_connected, 0, sizeof(sim->mqtt_connected));
+        sim->net_open = false;
+        sim->rxget = 0;
+        sim->cipmode = 0;
+        for (int i = 0; i < MODEM_SIM_LINKS; i++)
+            _sim_link_close(sim, i);
+        _sim_data_end(sim);
+        _resp_ok(resp);
+        _resp_result(resp, "*ATREADY: 1");
+    }
+    else if (strncmp(key, "+CMQTT", 6) == 0)
+    {
+        _sim_mqtt(sim, key, args, set, resp);
+    }
+    else if (strcmp(key, "+NETOPEN") == 0 || strcmp(key, "+NETCLOSE") == 0 || strncmp(key, "+CIP", 4) == 0)
+    {
+        _sim_socket(sim, key, args, set, query, resp);
+    }
+    else if (strcmp(key, "O") == 0)
+    {
+        // Back to the data mode of a transparent link left with "+++"
+        if (sim->cipmode == 1 && sim->links[0].fd >= 0)
+            _sim_data_start(sim, resp);
+        else
+            _resp_error(resp);
+    }
+    else
+    {
+        _resp_error(resp);
+    }
+}
+
+/**
+ * @brief Leaves the multiplexer, the plain link goes on with the input of DLC 0
+ */
+static void _sim_cmux_end(modem_sim_t *sim)
+{
+    sim->cmux = false;
+    sim->in = &sim->inputs[0];
+    sim->in_dlc = 0;
+}
+
+/**
+ * @brief Schedules a response: after the latency of the command and after the previous one
+ */
+static void _sim_respond(modem_sim_t *sim, const char *key, sim_resp_t *resp)
+{
+    const sim_rule_t *rule = _sim_rule_for(sim, key);
+
+    uint64_t due = _sim_rx_now(sim) + _sim_delay_us(sim, rule->latency_ms, rule->jitter_ms);
+    if (due < sim->in->busy_until_us)
+        due = sim->in->busy_until_us;
+    sim->in->busy_until_us = due;
+
+    if (resp->error)
+        sim->stats.errors++;
+    _sim_schedule(sim, due, resp->text, resp->len, false);
+    for (size_t i = 0; resp->ipr > 0 && i < sim->event_count; i++)
+    {
+        if (sim->events[i].seq == sim->event_seq - 1)
+            sim->events[i].ipr = resp->ipr;
+    }
+
+    if (resp->cmux_end)
+        _sim_cmux_end(sim);
+
+    if (rule->after[0])
+    {
+        char line[MODEM_SIM_TEXT_LEN + 4];
+        int len = snprintf(line, sizeof(line), "\r\n%s\r\n", rule->after);
+        _sim_schedule(sim, due, line, len, true);
+    }
+    if (resp->result_len > 0)
+    {
+        uint64_t result_due = due + _sim_delay_us(sim, rule->result_ms, rule->result_jitter_ms);
+        _sim_schedule(sim, result_due, resp->result, resp->result_len, true);
+    }
+}
+
+/**
+ * @brief Processes a complete command line
+ */
+static void _sim_line(modem_sim_t *sim, const char *line)
+{
+    if (sim->echo)
+    {
+        _sim_schedule(sim, _sim_rx_now(sim), line, strlen(line), false);
+        _sim_schedule(sim, _sim_rx_now(sim), "\r", 1, false);
+    }
+    if (sim->verbose)
+        fprintf(stderr, "modem_sim: <- %s\n", line);
+
+    sim->stats.commands++;
+    sim_resp_t *resp = calloc(1, sizeof(*resp));
+    if (resp == NULL)
+        return;
+
+    char key[MODEM_SIM_KEY_LEN];
+    if (strncasecmp(line, "AT", 2) != 0)
+    {
+        _resp_error(resp);
+        _sim_respond(sim, "*", resp);
+        free(resp);
+        return;
+    }
+    _sim_cmd_key(line, key, sizeof(key));
+
+    const sim_rule_t *rule = _sim_rule_for(sim, key);
+    if (rule->fail[0])
+    {
+        _resp_final(resp, "%s", rule->fail);
+        resp->error = true;
+    }
+    else
+    {
+        _sim_command(sim, line, key, resp);
+        if (rule->reply[0] && resp->info && !resp->error)
+        {
+            // Scripted information line, keep the final result
+            resp->len = 0;
+            _resp_line(resp, "%s", rule->reply);
+            _resp_ok(resp);
+        }
+    }
+
+    _sim_respond(sim, key, resp);
+    free(resp);
+}
+
+/**
+ * @brief Completes a '>' data input
+ */
+static void _sim_data_done(modem_sim_t *sim)
+{
+    sim_resp_t *resp = calloc(1, sizeof(*resp));
+    if (resp == NULL)
+        return;
+
+    int client = sim->in->data_client;
+    sim->in->data[sim->in->data_len] = '\0';
+    sim->stats.payload_bytes += sim->in->data_len;
+
+    switch (sim->in->data_kind)
+    {
+    case SIM_DATA_TOPIC:
+        sim->mqtt_topic_len[client] = (int)sim->in->data_len;
+        _resp_ok(resp);
+        break;
+    case SIM_DATA_PAYLOAD:
+        sim->mqtt_payload_len[client] = (int)sim->in->data_len;
+        _resp_ok(resp);
+        break;
+    case SIM_DATA_SUB:
+        _resp_ok(resp);
+        _resp_result(resp, "+CMQTTSUB: %d,0", client);
+        break;
+    case SIM_DATA_UNSUB:
+        _resp_ok(resp);
+        _resp_result(resp, "+CMQTTUNSUB: %d,0", client);
+        break;
+    case SIM_DATA_SEND:
+        _resp_ok(resp);
+        _resp_result(resp, "+CIPSEND: %d,%zu,%d", client, sim->in->data_len,
+                     _sim_link_send(sim, client, sim->in->data, sim->in->data_len));
+        break;
+    default:
+        _resp_ok(resp);
+        break;
+    }
+
+    sim->in->data_kind = SIM_DATA_NONE;
+    _sim_respond(sim, sim->in->data_key, resp);
+    free(resp);
+}
+
+/**
+ * @brief Processes the bytes of a command interpreter (sim->in)
+ *
+ * @return Bytes processed, less than len if the link moved to the multiplexer
+ */
+static size_t _sim_input_at(modem_sim_t *sim, const char *buf, size_t len)
+{
+    bool framed = sim->cmux;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        if (sim->cmux != framed)
+            return i;
+
+        char c = buf[i];
+
+        if (sim->data_mode && sim->in_dlc == sim->data_dlc)
+        {
+            _sim_data_byte(sim, c);
+            continue;
+        }
+
+        if (sim->in->data_kind != SIM_DATA_NONE)
+        {
+            // LF of the CR/LF that ended the command line
+            if (sim->in->skip_lf && c == '\n')
+            {
+                sim->in->skip_lf = false;
+                continue;
+            }
+            sim->in->skip_lf = false;
+
+            // ESC before any data leaves data input without a response; afterwards the input
+            // is length-counted and binary
+            if (c == 0x1B && sim->in->data_len == 0)
+            {
+                sim->in->data_kind = SIM_DATA_NONE;
+                continue;
+            }
+            if (sim->in->data_len < MODEM_SIM_DATA_LEN)
+                sim->in->data[sim->in->data_len++] = c;
+            if (--sim->in->data_left == 0)
+                _sim_data_done(sim);
+            continue;
+        }
+
+        if (c == '\r' || c == '\n')
+        {
+            sim->in->skip_lf = (c == '\r');
+            if (sim->in->line_len > 0 && !sim->in->line_overflow)
+            {
+                sim->in->line[sim->in->line_len] = '\0';
+                _sim_line(sim, sim->in->line);
+            }
+            sim->in->line_len = 0;
+            sim->in->line_overflow = false;
+            continue;
+        }
+
+        if (sim->in->line_len < MODEM_SIM_LINE_LEN - 1)
+            sim->in->line[sim->in->line_len++] = c;
+        else
+            sim->in->line_overflow = true;
+    }
+    return len;
+}
+
+/**
+ * @brief Handles a control message received on DLC 0
+ */
+static void _sim_cmux_msg(modem_sim_t *sim, const uint8_t *msg, size_t len)
+{
+    if (len < 2 || (msg[0] & 0x02) == 0)
+        return;     // answers to ours, none are sent
+
+    uint8_t reply[8];
+    size_t n = (len < sizeof(reply)) ? len : sizeof(reply);
+    memcpy(reply, msg, n);
+    reply[0] &= (uint8_t)~0x02;
+    switch (msg[0] & ~0x02)
+    {
+    case 0xC1:      // CLD: answered, then back to plain AT
+        _sim_write_frame(sim, 0x01, 0xEF, reply, n);
+        _sim_cmux_end(sim);
+        break;
+    case 0xE1:      // MSC: same status back
+        _sim_write_frame(sim, 0x01, 0xEF, reply, n);
+        break;
+    default:        // not supported
+        reply[0] = 0x11;
+        reply[1] = 0x03;
+        reply[2] = msg[0];
+        _sim_write_frame(sim, 0x01, 0xEF, reply, 3);
+        break;
+    }
+}
+
+/**
+ * @brief Handles a complete frame from the host
+ */
+static void _sim_cmux_frame(modem_sim_t *sim, uint8_t dlc, uint8_t ctrl, const uint8_t *info, size_t len)
+{
+    switch (ctrl & ~0x10)
+    {
+    case 0x2F:      // SABM: UA
+    case 0x43:      // DISC: UA, on DLC 0 the multiplexer ends
+        _sim_write_frame(sim, (uint8_t)((dlc << 2) | 0x03), 0x73, NULL, 0);
+        if ((ctrl & ~0x10) == 0x43 && dlc == 0)
+            _sim_cmux_end(sim);
+        break;
+    case 0xEF:      // UIH
+    case 0x03:      // UI
+        if (dlc == 0)
+        {
+            _sim_cmux_msg(sim, info, len);
+        }
+        else if (dlc < MODEM_SIM_DLCS)
+        {
+            sim->in = &sim->inputs[dlc];
+            sim->in_dlc = dlc;
+            _sim_input_at(sim, (const char *)info, len);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * @brief Feeds a byte to the frame decoder
+ */
+static void _sim_cmux_byte(modem_sim_t *sim, uint8_t c)
+{
+    sim_frame_t *f = &sim->frame;
+    switch (f->state)
+    {
+    case 0:         // hunting a flag
+        if (c == 0xF9)
+            f->state = 1;
+        break;
+    case 1:         // address, or another flag
+        if (c == 0xF9)
+            break;
+        f->hdr[0] = c;
+        f->hdr_len = 1;
+        f->state = 2;
+        break;
+    case 2:         // control
+        f->hdr[f->hdr_len++] = c;
+        f->state = 3;
+        break;
+    case 3:         // length
+    case 4:         // second length octet
+        f->hdr[f->hdr_len++] = c;
+        if (f->state == 3)
+            f->info_len = c >> 1;
+        else
+            f->info_len |= (size_t)c << 7;
+        if (f->state == 3 && (c & 1) == 0)
+        {
+            f->state = 4;
+            break;
+        }
+        f->info_pos = 0;
+        f->state = (f->info_len > MODEM_SIM_CMUX_N1) ? 0 : (f->info_len > 0) ? 5 : 6;
+        break;
+    case 5:         // information
+        f->info[f->info_pos++] = c;
+        if (f->info_pos == f->info_len)
+            f->state = 6;
+        break;
+    case 6:         // FCS
+    {
+        bool uih = ((f->hdr[1] & ~0x10) == 0xEF);
+        uint8_t buf[sizeof(f->hdr) + MODEM_SIM_CMUX_N1];
+        memcpy(buf, f->hdr, f->hdr_len);
+        memcpy(&buf[f->hdr_len], f->info, f->info_len);
+        f->state = (_sim_fcs(buf, f->hdr_len + (uih ? 0 : f->info_len)) == c) ? 7 : 0;
+        if (f->state == 0)
+            sim->stats.errors++;
+        break;
+    }
+    case 7:         // closing flag, it may open the next frame
+        f->state = (c == 0xF9) ? 1 : 0;
+        if (c == 0xF9)
+            _sim_cmux_frame(sim, f->hdr[0] >> 2, f->hdr[1], f->info, f->info_len);
+        break;
+    }
+}
+
+/**
+ * @brief Processes received bytes
+ */
+static void _sim_input(modem_sim_t *sim, const char *buf, size_t len)
+{
+    sim->stats.rx_bytes += len;
+    if (!_sim_line_ok(sim))
+        return;
+    if (sim->baud > 0)
+        sim->rx_free_us = _sim_rx_now(sim) + _sim_wire_us(sim, len);
+
+    size_t i = 0;
+    while (i < len)
+    {
+        if (!sim->cmux)
+        {
+            i += _sim_input_at(sim, buf + i, len - i);
+            continue;
+        }
+        // Until a control frame ends the multiplexer
+        while (i < len && sim->cmux)
+            _sim_cmux_byte(sim, (uint8_t)buf[i++]);
+    }
+    _sim_data_flush(sim);
+}
+
+/* --- Script --- */
+
+/**
+ * @brief Splits the next word of a directive
+ */
+static const char *_sim_word(const char *p, char *word, size_t size)
+{
+    while (*p == ' ' || *p == '\t')
+        p++;
+    size_t len = 0;
+    while (*p && *p != ' ' && *p != '\t')
+    {
+        if (len < size - 1)
+            word[len++] = *p;
+        p++;
+    }
+    word[len] = '\0';
+    while (*p == ' ' || *p == '\t')
+        p++;
+    return p;
+}
+
+/**
+ * @brief Adds a scripted unsolicited output
+ */
+static int _sim_add_timer(modem_sim_t *sim, const char *when, uint32_t ms, const char *text)
+{
+    bool every = (strcmp(when, "every") == 0);
+    if ((!every && strcmp(when, "at") != 0) || (every && ms == 0))
+        return -1;
+    if (sim->timer_count == MODEM_SIM_MAX_TIMERS)
+        return -1;
+
+    sim_timer_t *timer = &sim->timers[sim->timer_count];
+    timer->text = strdup(text);
+    if (timer->text == NULL)
+        return -1;
+    timer->period_ms = every ? ms : 0;
+    timer->next_us = sim->start_us + (uint64_t)ms * 1000;
+    timer->reg_stat = -1;
+    timer->rssi = -1;
+    sim->timer_count++;
+    return 0;
+}
+
+/**
+ * @brief Builds the +CMQTTRX* block of an incoming message. Like the modem, payloads longer
+ * than MODEM_SIM_RX_PAYLOAD_LEN are sent in several +CMQTTRXPAYLOAD parts.
+ */
+static char *_sim_rx_block(int client, const char *topic, const char *payload)
+{
+    size_t topic_len = strlen(topic);
+    size_t payload_len = strlen(payload);
+    size_t parts = (payload_len + MODEM_SIM_RX_PAYLOAD_LEN - 1) / MODEM_SIM_RX_PAYLOAD_LEN;
+    size_t size = topic_len + payload_len + 128 + (parts + 1) * 48;
+    char *text = malloc(size);
+    if (text == NULL)
+        return NULL;
+
+    size_t pos = (size_t)snprintf(text, size,
+                                  "\r\n+CMQTTRXSTART: %d,%zu,%zu\r\n"
+                                  "\r\n+CMQTTRXTOPIC: %d,%zu\r\n%s\r\n",
+                                  client, topic_len, payload_len, client, topic_len, topic);
+    size_t off = 0;
+    do
+    {
+        size_t n = payload_len - off;
+        if (n > MODEM_SIM_RX_PAYLOAD_LEN)
+            n = MODEM_SIM_RX_PAYLOAD_LEN;
+        pos += (size_t)snprintf(text + pos, size - pos, "\r\n+CMQTTRXPAYLOAD: %d,%zu\r\n%.*s\r\n",
+                                client, n, (int)n, payload + off);
+        off += n;
+    } while (off < payload_len);
+    snprintf(text + pos, size - pos, "\r\n+CMQTTRXEND: %d\r\n", client);
+    return text;
+}
+
+int modem_sim_config(modem_sim_t *sim, const char *directive)
+{
+    char cmd[16], arg[MODEM_SIM_TEXT_LEN], arg2[MODEM_SIM_TEXT_LEN];
+    const char *rest = _sim_word(directive, cmd, sizeof(cmd));
+    int ret = 0;
+
+    if (cmd[0] == '\0' || cmd[0] == '#')
+        return 0;
+
+    pthread_mutex_lock(&sim->lock);
+    if (strcmp(cmd, "echo") == 0 || strcmp(cmd, "verbose") == 0)
+    {
+        _sim_word(rest, arg, sizeof(arg));
+        bool on = (strcmp(arg, "on") == 0);
+        if (!on && strcmp(arg, "off") != 0)
+            ret = -1;
+        else if (cmd[0] == 'e')
+            sim->echo = on;
+        else
+            sim->verbose = on;
+    }
+    else if (strcmp(cmd, "seed") == 0)
+    {
+        sim->rand_state = strtoull(rest, NULL, 0) | 1;
+    }
+    else if (strcmp(cmd, "latency") == 0 || strcmp(cmd, "result") == 0)
+    {
+        unsigned ms = 0, jitter = 0;
+        rest = _sim_word(rest, arg, sizeof(arg));
+        sim_rule_t *rule = _sim_rule(sim, arg, true);
+        if (rule == NULL || sscanf(rest, "%u %u", &ms, &jitter) < 1)
+        {
+            ret = -1;
+        }
+        else if (cmd[0] == 'l')
+        {
+            rule->latency_ms = ms;
+            rule->jitter_ms = jitter;
+        }
+        else
+        {
+            rule->result_ms = ms;
+            rule->result_jitter_ms = jitter;
+        }
+    }
+    else if (strcmp(cmd, "fail") == 0 || strcmp(cmd, "reply") == 0 || strcmp(cmd, "after") == 0)
+    {
+        rest = _sim_word(rest, arg, sizeof(arg));
+        sim_rule_t *rule = _sim_rule(sim, arg, true);
+        if (rule == NULL || *rest == '\0' || strlen(rest) >= MODEM_SIM_TEXT_LEN)
+            ret = -1;
+        else
+            strcpy(cmd[0] == 'f' ? rule->fail : cmd[0] == 'r' ? rule->reply : rule->after, rest);
+    }
+    else if (strcmp(cmd, "chunk") == 0)
+    {
+        unsigned bytes = 0, gap = 0;
+        if (sscanf(rest, "%u %u", &bytes, &gap) < 1)
+            ret = -1;
+        sim->chunk = bytes;
+        sim->chunk_gap_us = gap;
+    }
+    else if (strcmp(cmd, "guard") == 0)
+    {
+        char *end;
+        unsigned long ms = strtoul(rest, &end, 10);
+        if (end == rest)
+            ret = -1;
+        else
+            sim->guard_ms = (uint32_t)ms;
+    }
+    else if (strcmp(cmd, "baud") == 0)
+    {
+        char *end;
+        unsigned long baud = strtoul(rest, &end, 10);
+        if (end == rest)
+            ret = -1;
+        else
+            sim->baud = (uint32_t)baud;
+    }
+    else if (strcmp(cmd, "urc") == 0)
+    {
+        rest = _sim_word(rest, arg, sizeof(arg));
+        rest = _sim_word(rest, arg2, sizeof(arg2));
+        char text[MODEM_SIM_TEXT_LEN + 4];
+        snprintf(text, sizeof(text), "\r\n%s\r\n", rest);
+        ret = (*rest == '\0') ? -1 : _sim_add_timer(sim, arg, strtoul(arg2, NULL, 10), text);
+    }
+    else if (strcmp(cmd, "register") == 0)
+    {
+        unsigned ms = 0;
+        int stat = 1;
+        if (sscanf(rest, "%u %d", &ms, &stat) < 1 || _sim_add_timer(sim, "at", ms, "") != 0)
+        {
+            ret = -1;
+        }
+        else
+        {
+            sim->timers[sim->timer_count - 1].reg_stat = stat;
+            sim->creg = sim->cereg = 2;
+            sim->cgatt = sim->pdp[0].active = false;
+        }
+    }
+    else if (strcmp(cmd, "signal") == 0)
+    {
+        unsigned ms = 0;
+        int rssi = -1;
+        if (sscanf(rest, "%u %d", &ms, &rssi) < 2 || rssi < 0 || _sim_add_timer(sim, "at", ms, "") != 0)
+            ret = -1;
+        else
+            sim->timers[sim->timer_count - 1].rssi = rssi;
+    }
+    else if (strcmp(cmd, "rx") == 0)
+    {
+        char client[8], topic[MODEM_SIM_TEXT_LEN];
+        rest = _sim_word(rest, arg, sizeof(arg));
+        rest = _sim_word(rest, arg2, sizeof(arg2));
+        rest = _sim_word(rest, client, sizeof(client));
+        rest = _sim_word(rest, topic, sizeof(topic));
+        char *text = _sim_rx_block(atoi(client), topic, rest);
+        ret = (text == NULL || topic[0] == '\0') ? -1 : _sim_add_timer(sim, arg, strtoul(arg2, NULL, 10), text);
+        free(text);
+    }
+    else
+    {
+        ret = -1;
+    }
+    pthread_mutex_unlock(&sim->lock);
+
+    if (ret != 0)
+        fprintf(stderr, "modem_sim: invalid directive: %s\n", directive);
+    return ret;
+}
+
+int modem_sim_load(modem_sim_t *sim, const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        fprintf(stderr, "modem_sim: cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    char line[512];
+    int ret = 0;
+    while (ret == 0 && fgets(line, sizeof(line), f))
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        ret = modem_sim_config(sim, line);
+    }
+    fclose(f);
+    return ret;
+}
+
+/* --- Link --- */
+
+int modem_sim_open_pty(modem_sim_t *sim, char *path, size_t size)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+        goto fail;
+
+    const char *name = ptsname(master);
+    if (name == NULL || strlen(name) >= size)
+        goto fail;
+    strcpy(path, name);
+
+    // Raw slave: the line discipline must not echo the modem output back
+    sim->pty_slave = open(name, O_RDWR | O_NOCTTY);
+    if (sim->pty_slave < 0)
+        goto fail;
+    struct termios tio;
+    tcgetattr(sim->pty_slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(sim->pty_slave, TCSANOW, &tio);
+
+    sim->fd = master;
+    return 0;
+
+fail:
+    if (master >= 0)
+        close(master);
+    return -1;
+}
+
+int modem_sim_listen_tcp(modem_sim_t *sim, uint16_t port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 1) != 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &addr_len) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    sim->listen_fd = fd;
+    return ntohs(addr.sin_port);
+}
+
+/* Simulator thread */
+static void *_sim_thread(void *arg)
+{
+    modem_sim_t *sim = arg;
+    char buf[512];
+
+    pthread_mutex_lock(&sim->lock);
+    while (sim->running)
+    {
+        uint64_t escape = _sim_escape_due(sim);
+        uint64_t next = _sim_flush_due(sim);
+        if (escape < next)
+            next = escape;
+        uint64_t now = _sim_now_us();
+        int timeout = (next == UINT64_MAX) ? -1 : (next <= now) ? 0 : (int)((next - now + 999) / 1000);
+
+        // Data mode input the peer did not take holds back the link, like the modem does
+        struct pollfd fds[2 + MODEM_SIM_LINKS] = {
+            { .fd = (sim->fd >= 0) ? sim->fd : sim->listen_fd, .events = (sim->data_out_len > 0) ? 0 : POLLIN },
+            { .fd = sim->wake_fd[0], .events = POLLIN },
+        };
+        int links[MODEM_SIM_LINKS];
+        nfds_t nfds = 2;
+        for (int i = 0; i < MODEM_SIM_LINKS; i++)
+        {
+            short events = _sim_link_polled(sim, i) ? POLLIN : 0;
+            if (i == 0 && sim->data_out_len > 0 && sim->links[0].fd >= 0)
+                events |= POLLOUT;
+            if (events)
+            {
+                links[nfds - 2] = i;
+                fds[nfds++] = (struct pollfd){ .fd = sim->links[i].fd, .events = events };
+            }
+        }
+        int conn_fd = fds[0].fd;
+        pthread_mutex_unlock(&sim->lock);
+        int ready = poll(fds, nfds, timeout);
+        pthread_mutex_lock(&sim->lock);
+
+        if (ready <= 0)
+            continue;
+        if (fds[1].revents & POLLIN)
+        {
+            while (read(sim->wake_fd[0], buf, sizeof(buf)) > 0) { }
+        }
+        for (nfds_t i = 2; i < nfds; i++)
+        {
+            // Skipped if a command closed or reopened the link meanwhile
+            int link = links[i - 2];
+            if (sim->links[link].fd != fds[i].fd)
+                continue;
+            if (fds[i].revents & POLLOUT)
+                _sim_data_flush(sim);
+            if ((fds[i].events & POLLIN) == 0 || (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) == 0)
+                continue;
+            if (sim->cipmode == 1 && link == 0)
+                _sim_link_ready_transparent(sim, link);
+            else
+                _sim_link_ready(sim, link);
+        }
+        if (fds[0].events == 0 || (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) == 0)
+            continue;
+
+        if (conn_fd == sim->listen_fd)
+        {
+            sim->fd = accept(sim->listen_fd, NULL, NULL);
+            continue;
+        }
+
+        ssize_t len = read(sim->fd, buf, sizeof(buf));
+        if (len > 0)
+        {
+            _sim_input(sim, buf, len);
+        }
+        else if (len == 0 || (errno != EINTR && errno != EAGAIN))
+        {
+            if (sim->listen_fd >= 0)
+            {
+                // TCP client gone, wait for the next one
+                close(sim->fd);
+                sim->fd = -1;
+            }
+            else
+            {
+                // pty without any slave open yet
+                pthread_mutex_unlock(&sim->lock);
+                usleep(10000);
+                pthread_mutex_lock(&sim->lock);
+            }
+        }
+    }
+    pthread_mutex_unlock(&sim->lock);
+    return NULL;
+}
+
+/**
+ * @brief Wakes up the simulator thread to reschedule
+ */
+static void _sim_wake(modem_sim_t *sim)
+{
+    char kick = 0;
+    ssize_t n = write(sim->wake_fd[1], &kick, 1);
+    (void)n;
+}
+
+int modem_sim_start(modem_sim_t *sim)
+{
+    if (sim->fd < 0 && sim->listen_fd < 0)
+        return -1;
+
+    sim->running = true;
+    if (pthread_create(&sim->thread, NULL, _sim_thread, sim) != 0)
+    {
+        sim->running = false;
+        return -1;
+    }
+    return 0;
+}
+
+void modem_sim_inject(modem_sim_t *sim, const char *line)
+{
+    char text[MODEM_SIM_LINE_LEN];
+    int len = snprintf(text, sizeof(text), "\r\n%s\r\n", line);
+    if (len >= (int)sizeof(text))
+        len = sizeof(text) - 1;
+
+    pthread_mutex_lock(&sim->lock);
+    _sim_schedule(sim, _sim_now_us(), text, len, true);
+    pthread_mutex_unlock(&sim->lock);
+    _sim_wake(sim);
+}
+
+void modem_sim_mqtt_rx(modem_sim_t *sim, int client, const char *topic, const char *payload)
+{
+    char *text = _sim_rx_block(client, topic, payload);
+    if (text == NULL)
+        return;
+
+    pthread_mutex_lock(&sim->lock);
+    _sim_schedule(sim, _sim_now_us(), text, strlen(text), true);
+    pthread_mutex_unlock(&sim->lock);
+    free(text);
+    _sim_wake(sim);
+}
+
+void modem_sim_get_stats(modem_sim_t *sim, modem_sim_stats_t *stats)
+{
+    pthread_mutex_lock(&sim->lock);
+    *stats = sim->stats;
+    pthread_mutex_unlock(&sim->lock);
+}
+
+modem_sim_t *modem_sim_create(void)
+{
+    modem_sim_t *sim = calloc(1, sizeof(*sim));
+    if (sim == NULL)
+        return NULL;
+
+    if (pipe(sim->wake_fd) != 0)
+    {
+        free(sim);
+        return NULL;
+    }
+    for (size_t i = 0; i < 2; i++)
+        fcntl(sim->wake_fd[i], F_SETFL, fcntl(sim->wake_fd[i], F_GETFL) | O_NONBLOCK);
+
+    pthread_mutex_init(&sim->lock, NULL);
+    sim->fd = -1;
+    sim->pty_slave = -1;
+    sim->listen_fd = -1;
+    sim->rand_state = 0x9E3779B97F4A7C15ULL;
+    sim->in = &sim->inputs[0];
+    sim->cmux_n1 = 31;
+    sim->urc_dlc = 1;
+    sim->start_us = _sim_now_us();
+    for (size_t i = 0; i < MODEM_SIM_LINKS; i++)
+        sim->links[i].fd = -1;
+
+    /* registered, attached, PDP context active */
+    sim->echo = true;
+    sim->cfun = 1;
+    sim->rssi = 21;
+    sim->ipr = 115200;
+    sim->guard_ms = 1000;
+    sim->creg = 1;
+    sim->cereg = 1;
+    sim->cgatt = 1;
+    sim->pdp[0].defined = sim->pdp[0].active = true;
+    strcpy(sim->pdp[0].type, "IP");
+    strcpy(sim->pdp[0].apn, "internet");
+    strcpy(sim->pdp_addr, "10.160.42.17");
+    strcpy(sim->ntp_host, "pool.ntp.org");
+    return sim;
+}
+
+void modem_sim_destroy(modem_sim_t *sim)
+{
+    if (sim == NULL)
+        return;
+
+    if (sim->running)
+    {
+        pthread_mutex_lock(&sim->lock);
+        sim->running = false;
+        pthread_mutex_unlock(&sim->lock);
+        _sim_wake(sim);
+        pthread_join(sim->thread, NULL);
+    }
+
+    for (size_t i = 0; i < sim->event_count; i++)
+        free(sim->events[i].data);
+    for (size_t i = 0; i < sim->held_count; i++)
+        free(sim->held[i].data);
+    for (size_t i = 0; i < sim->timer_count; i++)
+        free(sim->timers[i].text);
+    for (int i = 0; i < MODEM_SIM_LINKS; i++)
+        _sim_link_close(sim, i);
+
+    int fds[] = { sim->fd, sim->pty_slave, sim->listen_fd, sim->wake_fd[0], sim->wake_fd[1] };
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++)
+    {
+        if (fds[i] >= 0)
+            close(fds[i]);
+    }
+    pthread_mutex_destroy(&sim->lock);
+    free(sim);
+}
+
+/* End of file */
@@ -0,0 +1,135 @@
+#ifndef MODEM_SIM_H
+#define MODEM_SIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * SIMCom A7670 modem simulator for host builds.
+ *
+ * Speaks the command set used by the library on a pseudo-terminal or a TCP port, with scripted
+ * per-command latency and jitter, byte-level chunking of the output and injected unsolicited
+ * lines. Used as the load generator of the host benchmarks.
+ *
+ * AT+IPR switches the modem rate after its OK, and back to 115200 on AT+CRESET. From the first
+ * AT+IPR on, a pty link only carries bytes while the host runs its end at the modem rate.
+ * AT+IFC is accepted and reported, but a pty has no RTS/CTS to model.
+ * AT+CMUX (basic option) moves the link to 27.010 frames until CLD, DISC of DLC 0 or
+ * AT+CRESET: DLCs 1 to 3 answer commands independently, URCs go out on DLC 1.
+ * AT+NETOPEN, AT+CIPOPEN, AT+CIPSEND, AT+CIPRXGET and AT+CIPCLOSE bridge links 0 to 9 to host
+ * sockets: TCP links connect to a dotted IPv4 address (or "localhost"), UDP links bind the
+ * loopback interface. The peers, e.g. an echo server of the benchmark, are real sockets.
+ * After AT+CIPMODE=1, AT+CIPOPEN of TCP link 0 answers CONNECT and the link carries raw data
+ * both ways until "+++" between two guard times (OK, the connection stays and ATO resumes it)
+ * or the close of the peer ("CLOSED"); unsolicited lines wait until then. The guard times
+ * count on the reads of the link, without the baud wire time, and the one before "+++" lets a
+ * tenth go for the bytes that wait in the pty. Input the peer socket does not take holds back
+ * the read of the link.
+ *
+ * Script directives, one per line ('#' starts a comment). <cmd> is the command name without
+ * "AT" and parameters ("+CSQ", "+CMQTTPUB", "E" for ATE, "AT" for the bare AT), or "*" for
+ * every command without its own rule:
+ *
+ *   echo on|off                       command echo (ATE), on by default
+ *   seed <n>                          jitter random seed
+ *   latency <cmd> <ms> [jitter_ms]    delay before the response, plus a uniform 0..jitter
+ *   result <cmd> <ms> [jitter_ms]     delay between the OK and the result URC (+CMQTTPUB:...)
+ *   fail <cmd> <final>                final result instead of OK, e.g. "fail +CGACT +CME ERROR: 4"
+ *   reply <cmd> <line>                information line instead of the built-in one
+ *   after <cmd> <line>                unsolicited line sent right after the response of <cmd>
+ *   chunk <bytes> [gap_us]            write the output in chunks, 0 writes each response whole
+ *   guard <ms>                        guard time around the "+++" escape, 1000 by default
+ *   baud <rate>                       model the wire time of a serial line (10 bits per byte)
+ *                                     in both directions, 0 (default) for none
+ *   urc at|every <ms> <line>          unsolicited line once / periodically, from start
+ *   register <ms> [stat]              not registered (searching) until <ms> from start, then
+ *                                     <stat> (1 by default), reported with "+CEREG: <stat>"
+ *                                     after AT+CEREG=1 (and "+CREG: <stat>" after AT+CREG=1)
+ *   signal <ms> <rssi>                signal quality from <ms> from start, reported with
+ *                                     "+CSQ: <rssi>,99" after AT+AUTOCSQ=1
+ *   rx at|every <ms> <client> <topic> <payload>   incoming MQTT message (+CMQTTRX* block)
+ *   verbose on|off                    log the received commands to stderr
+ */
+
+typedef struct modem_sim modem_sim_t;
+
+typedef struct {
+    uint32_t commands;          // command lines processed
+    uint32_t errors;            // commands answered with an error
+    uint32_t publishes;         // accepted AT+CMQTTPUB
+    uint32_t urcs;              // unsolicited lines sent (results after OK included)
+    uint64_t payload_bytes;     // bytes received in '>' data input and in data mode
+    uint64_t rx_bytes;          // bytes received
+    uint64_t tx_bytes;          // bytes sent
+} modem_sim_stats_t;
+
+/**
+ * @brief Creates a simulator with the default state (registered, attached, PDP active)
+ *
+ * @return NULL if there is no memory
+ */
+modem_sim_t *modem_sim_create(void);
+
+/**
+ * @brief Stops the simulator and frees it
+ */
+void modem_sim_destroy(modem_sim_t *sim);
+
+/**
+ * @brief Applies one script directive
+ *
+ * @return 0 on success, -1 if the directive is not valid
+ */
+int modem_sim_config(modem_sim_t *sim, const char *directive);
+
+/**
+ * @brief Applies every directive of a script file
+ *
+ * @return 0 on success, -1 if the file cannot be read or a directive is not valid
+ */
+int modem_sim_load(modem_sim_t *sim, const char *path);
+
+/**
+ * @brief Opens a pseudo-terminal, the library opens its slave side
+ *
+ * @param path Slave device path (e.g. "/dev/pts/3")
+ * @param size Path buffer size
+ *
+ * @return 0 on success, -1 on error
+ */
+int modem_sim_open_pty(modem_sim_t *sim, char *path, size_t size);
+
+/**
+ * @brief Listens on a TCP port of the loopback interface, one client at a time
+ *
+ * @param port Port, 0 for any free port
+ *
+ * @return Listening port, -1 on error
+ */
+int modem_sim_listen_tcp(modem_sim_t *sim, uint16_t port);
+
+/**
+ * @brief Starts the simulator thread
+ *
+ * @return 0 on success, -1 on error
+ */
+int modem_sim_start(modem_sim_t *sim);
+
+/**
+ * @brief Sends an unsolicited line now (thread-safe)
+ */
+void modem_sim_inject(modem_sim_t *sim, const char *line);
+
+/**
+ * @brief Sends an incoming MQTT message now (thread-safe). Payloads longer than 1024 bytes go
+ * in several +CMQTTRXPAYLOAD parts, like the modem does.
+ */
+void modem_sim_mqtt_rx(modem_sim_t *sim, int client, const char *topic, const char *payload);
+
+/**
+ * @brief Copies the counters (thread-safe)
+ */
+void modem_sim_get_stats(modem_sim_t *sim, modem_sim_stats_t *stats);
+
+#endif // MODEM_SIM_H
@@ -0,0 +1,100 @@
+/**
+ * modem_sim_main.c
+ * Command line front end of the modem simulator
+ *
+ *   modem_sim [-s script] [-e directive]... [-t port]
+ *
+ * Prints the pseudo-terminal to open (or the TCP port) and runs until interrupted.
+ */
+
+#include "modem_sim.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static volatile sig_atomic_t s_stop = 0;
+
+static void _on_signal(int sig)
+{
+    (void)sig;
+    s_stop = 1;
+}
+
+static void _usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-s script] [-e directive]... [-t port]\n"
+                    "  -s  load a script file (see modem_sim.h)\n"
+                    "  -e  apply one directive, e.g. -e \"latency +CMQTTPUB 40 10\"\n"
+                    "  -t  listen on a loopback TCP port instead of a pseudo-terminal\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    modem_sim_t *sim = modem_sim_create();
+    if (sim == NULL)
+        return 1;
+
+    int tcp_port = -1;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:e:t:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            if (modem_sim_load(sim, optarg) != 0)
+                return 1;
+            break;
+        case 'e':
+            if (modem_sim_config(sim, optarg) != 0)
+                return 1;
+            break;
+        case 't':
+            tcp_port = atoi(optarg);
+            break;
+        default:
+            _usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (tcp_port >= 0)
+    {
+        int port = modem_sim_listen_tcp(sim, (uint16_t)tcp_port);
+        if (port < 0)
+        {
+            perror("listen");
+            return 1;
+        }
+        printf("tcp:127.0.0.1:%d\n", port);
+    }
+    else
+    {
+        char path[64];
+        if (modem_sim_open_pty(sim, path, sizeof(path)) != 0)
+        {
+            perror("pty");
+            return 1;
+        }
+        printf("%s\n", path);
+    }
+    fflush(stdout);
+
+    signal(SIGINT, _on_signal);
+    signal(SIGTERM, _on_signal);
+    if (modem_sim_start(sim) != 0)
+        return 1;
+    while (!s_stop)
+        pause();
+
+    modem_sim_stats_t stats;
+    modem_sim_get_stats(sim, &stats);
+    fprintf(stderr, "commands %u, errors %u, publishes %u, urcs %u, rx %llu B, tx %llu B\n",
+            stats.commands, stats.errors, stats.publishes, stats.urcs,
+            (unsigned long long)stats.rx_bytes, (unsigned long long)stats.tx_bytes);
+    modem_sim_destroy(sim);
+    return 0;
+}
+
+/* End of file */
@@ -0,0 +1,464 @@
+/**
+ * freertos_posix.c
+ * Host port: FreeRTOS tasks, semaphores and queues on POSIX threads
+ *
+ * Only what the library uses. Every object waits on a mutex and a condition variable bound to
+ * CLOCK_MONOTONIC; blocking calls are cancellation points so vTaskDelete() can stop a task
+ * blocked on them.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#endif
+
+struct host_task {
+    pthread_t thread;
+    TaskFunction_t fn;
+    void *arg;
+    pid_t tid;              // kernel thread id, for the counters in /proc
+    bool foreign;           // thread not created by xTaskCreate()
+    char name[16];
+    struct host_task *next; // list of the tasks created by xTaskCreate()
+};
+
+struct host_sem {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    UBaseType_t count;
+    UBaseType_t max;
+};
+
+struct host_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t head;
+    UBaseType_t count;
+    uint8_t *items;
+};
+
+static __thread struct host_task *t_self = NULL;
+static __thread struct host_task t_foreign;
+#ifdef __SANITIZE_ADDRESS__
+static __thread void *t_stack;          // stack of a task, unpoisoned when it ends unwound
+static __thread size_t t_stack_size;
+#endif
+
+static pthread_mutex_t s_tasks_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct host_task *s_tasks = NULL;
+
+static pthread_once_t s_clock_once = PTHREAD_ONCE_INIT;
+static struct timespec s_clock_base;
+
+/* --- Time --- */
+
+static void _clock_init(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &s_clock_base);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    pthread_once(&s_clock_once, _clock_init);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t ms = (int64_t)(now.tv_sec - s_clock_base.tv_sec) * 1000 +
+                 (now.tv_nsec - s_clock_base.tv_nsec) / 1000000;
+    return (TickType_t)(ms * configTICK_RATE_HZ / 1000);
+}
+
+/**
+ * @brief Absolute CLOCK_MONOTONIC time, ticks from now
+ */
+static struct timespec _deadline(TickType_t ticks)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t ns = (uint64_t)ticks * (1000000000ULL / configTICK_RATE_HZ);
+    ts.tv_sec += ns / 1000000000ULL;
+    ts.tv_nsec += ns % 1000000000ULL;
+    if (ts.tv_nsec >= 1000000000L)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    return ts;
+}
+
+/**
+ * @brief Waits on a condition. Call with the mutex locked, cancellation unlocks it.
+ *
+ * @return False on timeout
+ */
+static bool _cond_wait(pthread_cond_t *cond, pthread_mutex_t *lock, const struct timespec *deadline)
+{
+    int ret;
+    pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock, lock);
+    if (deadline == NULL)
+        ret = pthread_cond_wait(cond, lock);
+    else
+        ret = pthread_cond_timedwait(cond, lock, deadline);
+    pthread_cleanup_pop(0);
+    return ret != ETIMEDOUT;
+}
+
+static void _cond_init(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/* --- Tasks --- */
+
+static void _task_unlink(struct host_task *task)
+{
+    pthread_mutex_lock(&s_tasks_lock);
+    for (struct host_task **it = &s_tasks; *it != NULL; it = &(*it)->next)
+    {
+        if (*it == task)
+        {
+            *it = task->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s_tasks_lock);
+}
+
+/**
+ * @brief Cleanup of a task that ends inside its function (cancelled or vTaskDelete(NULL)). The
+ * frames it was in are unwound without returning, so AddressSanitizer would find their redzones
+ * still poisoned when it tears the thread down.
+ */
+static void _task_unwound(void *arg)
+{
+    (void)arg;
+#ifdef __SANITIZE_ADDRESS__
+    if (t_stack != NULL)
+        __asan_unpoison_memory_region(t_stack, t_stack_size);
+#endif
+}
+
+static void *_task_entry(void *arg)
+{
+    struct host_task *task = arg;
+    task->tid = (pid_t)syscall(SYS_gettid);
+    t_self = task;
+#ifdef __SANITIZE_ADDRESS__
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0)
+    {
+        pthread_attr_getstack(&attr, &t_stack, &t_stack_size);
+        pthread_attr_destroy(&attr);
+    }
+#endif
+    pthread_cleanup_push(_task_unwound, NULL);
+    task->fn(task->arg);
+    pthread_cleanup_pop(0);
+
+    // FreeRTOS tasks must not return, behave as vTaskDelete(NULL)
+    vTaskDelete(NULL);
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack_depth, void *arg,
+                       UBaseType_t priority, TaskHandle_t *handle)
+{
+    struct host_task *task = calloc(1, sizeof(*task));
+    if (task == NULL)
+        return pdFAIL;
+    task->fn = fn;
+    task->arg = arg;
+    if (name)
+        snprintf(task->name, sizeof(task->name), "%s", name);
+
+    // Linked before the thread starts, so it can unlink itself
+    pthread_mutex_lock(&s_tasks_lock);
+    task->next = s_tasks;
+    s_tasks = task;
+    pthread_mutex_unlock(&s_tasks_lock);
+
+    if (pthread_create(&task->thread, NULL, _task_entry, task) != 0)
+    {
+        _task_unlink(task);
+        free(task);
+        return pdFAIL;
+    }
+#ifdef __GLIBC__
+    if (name)
+        pthread_setname_np(task->thread, task->name);
+#endif
+
+    if (handle)
+        *handle = task;
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    if (task == NULL || task == t_self)
+    {
+        task = t_self;
+        if (task && !task->foreign)
+        {
+            _task_unlink(task);
+            pthread_detach(task->thread);
+            free(task);
+        }
+        t_self = NULL;
+        pthread_exit(NULL);
+    }
+
+    _task_unlink(task);
+    pthread_cancel(task->thread);
+    pthread_join(task->thread, NULL);
+    free(task);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    if (t_self == NULL)
+    {
+        t_foreign.thread = pthread_self();
+        t_foreign.tid = (pid_t)syscall(SYS_gettid);
+        t_foreign.foreign = true;
+        t_self = &t_foreign;
+    }
+    return t_self;
+}
+
+TaskHandle_t xTaskGetHandle(const char *name)
+{
+    struct host_task *found = NULL;
+    pthread_mutex_lock(&s_tasks_lock);
+    for (struct host_task *it = s_tasks; it != NULL && found == NULL; it = it->next)
+    {
+        if (strncmp(it->name, name, sizeof(it->name) - 1) == 0)
+            found = it;
+    }
+    pthread_mutex_unlock(&s_tasks_lock);
+    return found;
+}
+
+uint32_t ulTaskGetRunTimeCounter(TaskHandle_t task)
+{
+    if (task == NULL)
+        task = xTaskGetCurrentTaskHandle();
+
+    clockid_t clock;
+    struct timespec ts;
+    if (pthread_getcpuclockid(task->thread, &clock) != 0 || clock_gettime(clock, &ts) != 0)
+        return 0;
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000);
+}
+
+uint32_t ulTaskGetWakeCounter(TaskHandle_t task)
+{
+    if (task == NULL)
+        task = xTaskGetCurrentTaskHandle();
+
+    // Each time the thread blocked (and so woke up again) is a voluntary context switch
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/status", (int)task->tid);
+    FILE *status = fopen(path, "r");
+    if (status == NULL)
+        return 0;
+    char line[128];
+    unsigned long switches = 0;
+    while (fgets(line, sizeof(line), status) != NULL)
+    {
+        if (sscanf(line, "voluntary_ctxt_switches: %lu", &switches) == 1)
+            break;
+    }
+    fclose(status);
+    return (uint32_t)switches;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    struct timespec deadline = _deadline(ticks);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) { }
+}
+
+/* --- Semaphores --- */
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial)
+{
+    struct host_sem *sem = calloc(1, sizeof(*sem));
+    if (sem == NULL)
+        return NULL;
+    pthread_mutex_init(&sem->lock, NULL);
+    _cond_init(&sem->cond);
+    sem->max = max;
+    sem->count = initial;
+    return sem;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    struct timespec deadline = _deadline(ticks);
+    BaseType_t ret = pdTRUE;
+
+    pthread_mutex_lock(&sem->lock);
+    while (sem->count == 0)
+    {
+        if (ticks == 0 || !_cond_wait(&sem->cond, &sem->lock, (ticks == portMAX_DELAY) ? NULL : &deadline))
+        {
+            ret = pdFALSE;
+            break;
+        }
+    }
+    if (ret == pdTRUE)
+        sem->count--;
+    pthread_mutex_unlock(&sem->lock);
+    return ret;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    BaseType_t ret = pdFALSE;
+    pthread_mutex_lock(&sem->lock);
+    if (sem->count < sem->max)
+    {
+        sem->count++;
+        pthread_cond_signal(&sem->cond);
+        ret = pdTRUE;
+    }
+    pthread_mutex_unlock(&sem->lock);
+    return ret;
+}
+
+UBaseType_t uxSemaphoreGetCount(SemaphoreHandle_t sem)
+{
+    pthread_mutex_lock(&sem->lock);
+    UBaseType_t count = sem->count;
+    pthread_mutex_unlock(&sem->lock);
+    return count;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+    pthread_cond_destroy(&sem->cond);
+    pthread_mutex_destroy(&sem->lock);
+    free(sem);
+}
+
+/* --- Queues --- */
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    struct host_queue *queue = calloc(1, sizeof(*queue));
+    if (queue == NULL)
+        return NULL;
+    queue->items = malloc(length * item_size);
+    if (queue->items == NULL)
+    {
+        free(queue);
+        return NULL;
+    }
+    pthread_mutex_init(&queue->lock, NULL);
+    _cond_init(&queue->not_empty);
+    _cond_init(&queue->not_full);
+    queue->length = length;
+    queue->item_size = item_size;
+    return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks)
+{
+    struct timespec deadline = _deadline(ticks);
+    BaseType_t ret = pdTRUE;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->length)
+    {
+        if (ticks == 0 || !_cond_wait(&queue->not_full, &queue->lock, (ticks == portMAX_DELAY) ? NULL : &deadline))
+        {
+            ret = pdFALSE;
+            break;
+        }
+    }
+    if (ret == pdTRUE)
+    {
+        UBaseType_t tail = (queue->head + queue->count) % queue->length;
+        memcpy(&queue->items[tail * queue->item_size], item, queue->item_size);
+        queue->count++;
+        pthread_cond_signal(&queue->not_empty);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return ret;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks)
+{
+    struct timespec deadline = _deadline(ticks);
+    BaseType_t ret = pdTRUE;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0)
+    {
+        if (ticks == 0 || !_cond_wait(&queue->not_empty, &queue->lock, (ticks == portMAX_DELAY) ? NULL : &deadline))
+        {
+            ret = pdFALSE;
+            break;
+        }
+    }
+    if (ret == pdTRUE)
+    {
+        memcpy(item, &queue->items[queue->head * queue->item_size], queue->item_size);
+        queue->head = (queue->head + 1) % queue->length;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return ret;
+}
+
+BaseType_t xQueueReset(QueueHandle_t queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->head = 0;
+    queue->count = 0;
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+    return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    UBaseType_t count = queue->count;
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+    pthread_cond_destroy(&queue->not_full);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->items);
+    free(queue);
+}
+
+/* End of file */
@@ -0,0 +1,24 @@
+#ifndef HOST_DRIVER_GPIO_H
+#define HOST_DRIVER_GPIO_H
+
+/**
+ * Host port: there are no control pins, configuration and levels are ignored.
+ */
+
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef int gpio_num_t;
+
+typedef enum {
+    GPIO_MODE_DISABLE = 0,
+    GPIO_MODE_INPUT,
+    GPIO_MODE_OUTPUT,
+} gpio_mode_t;
+
+#define GPIO_NUM_NC ((gpio_num_t)-1)
+
+static inline esp_err_t gpio_set_direction(gpio_num_t gpio, gpio_mode_t mode) { (void)gpio; (void)mode; return ESP_OK; }
+static inline esp_err_t gpio_set_level(gpio_num_t gpio, uint32_t level) { (void)gpio; (void)level; return ESP_OK; }
+
+#endif // HOST_DRIVER_GPIO_H
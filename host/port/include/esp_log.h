@@ -0,0 +1,29 @@
+#ifndef HOST_ESP_LOG_H
+#define HOST_ESP_LOG_H
+
+/**
+ * Host port: ESP_LOGx print to stderr, levels above HOST_LOG_LEVEL are compiled out
+ * (0 none, 1 error, 2 warning, 3 info, 4 debug, 5 verbose).
+ */
+
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#ifndef HOST_LOG_LEVEL
+#define HOST_LOG_LEVEL 3
+#endif
+
+#define HOST_LOG(level, letter, tag, format, ...) \
+    do { \
+        if (HOST_LOG_LEVEL >= (level)) \
+            fprintf(stderr, letter " (%u) %s: " format "\n", (unsigned)xTaskGetTickCount(), tag, ##__VA_ARGS__); \
+    } while (0)
+
+#define ESP_LOGE(tag, format, ...)  HOST_LOG(1, "E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...)  HOST_LOG(2, "W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...)  HOST_LOG(3, "I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...)  HOST_LOG(4, "D", tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...)  HOST_LOG(5, "V", tag, format, ##__VA_ARGS__)
+
+#endif // HOST_ESP_LOG_H
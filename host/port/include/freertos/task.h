@@ -0,0 +1,46 @@
+#ifndef HOST_FREERTOS_TASK_H
+#define HOST_FREERTOS_TASK_H
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct host_task *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+/**
+ * @brief Runs the task function on a new thread
+ */
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack_depth, void *arg,
+                       UBaseType_t priority, TaskHandle_t *handle);
+
+/**
+ * @brief Cancels and joins a task, NULL for the calling task. Tasks are cancelled at their
+ * blocking points (semaphores, queues, delays, poll()).
+ */
+void vTaskDelete(TaskHandle_t task);
+
+/**
+ * @brief Handle of the calling thread, also for threads not created by xTaskCreate()
+ */
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+
+/**
+ * @brief Task created with the given name, NULL if there is none
+ */
+TaskHandle_t xTaskGetHandle(const char *name);
+
+/**
+ * @brief CPU time used by a task, NULL for the calling task. The run time counter is the CPU
+ * time of the thread in microseconds.
+ */
+uint32_t ulTaskGetRunTimeCounter(TaskHandle_t task);
+
+/**
+ * @brief Times a task blocked and woke up again, NULL for the calling task. Host only (no
+ * FreeRTOS counterpart): the voluntary context switches of the thread, 0 if unknown.
+ */
+uint32_t ulTaskGetWakeCounter(TaskHandle_t task);
+
+TickType_t xTaskGetTickCount(void);
+void vTaskDelay(TickType_t ticks);
+
+#endif // HOST_FREERTOS_TASK_H
@@ -0,0 +1,47 @@
+#ifndef SIMCOM_TEST_H
+#define SIMCOM_TEST_H
+
+/**
+ * test.h
+ * Checks of the host tests. A failed check prints its line and is counted, the test goes on
+ * so one run shows every failure; the group fails if any check did.
+ */
+
+#include <stdio.h>
+#include "simcom.h"
+
+extern int test_failures;
+
+#define TEST_CHECK(cond)                                                                    \
+    do {                                                                                    \
+        if (!(cond))                                                                        \
+        {                                                                                   \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);        \
+            test_failures++;                                                                \
+        }                                                                                   \
+    } while (0)
+
+// Checks that a library call returns err
+#define TEST_ERR(err, call)                                                                 \
+    do {                                                                                    \
+        simcom_err_t _err = (call);                                                         \
+        if (_err != (err))                                                                  \
+        {                                                                                   \
+            fprintf(stderr, "%s:%d: %s returned %d, expected %d\n", __FILE__, __LINE__,     \
+                    #call, _err, (err));                                                    \
+            test_failures++;                                                                \
+        }                                                                                   \
+    } while (0)
+
+#define TEST_OK(call) TEST_ERR(SIM_AT_OK, call)
+
+/**
+ * Test groups, run by name from test_main.c with the arguments after the name: simulator
+ * directives (see modem_sim.h) applied to every simulator the group starts, or the group's
+ * own (see its file).
+ */
+int test_services(int argc, char **argv);
+int test_lines(int argc, char **argv);
+int test_registry(int argc, char **argv);
+
+#endif // SIMCOM_TEST_H
@@ -0,0 +1,499 @@
+/**
+ * test_lines.c
+ * Line classifier (sim_at_line) and field reader (sim_at_fields) against random input:
+ *   classify   random lines, mostly made of the characters of modem responses, each in a
+ *              buffer of its exact length (no NUL), compared with a plain reference of the
+ *              classification rules; plus a table of known lines
+ *   match      the markers that end data mode ("\r\nOK\r\n", "\r\nCLOSED\r\n") followed
+ *              byte by byte through random streams, compared with the stream's own tail
+ *   fields     value lists built from known fields (numbers, quoted strings with commas,
+ *              bare strings, empty) read back with the matching calls; then random strings
+ *              read with random calls, checking that a failed read leaves the cursor where it
+ *              was and that the cursor never leaves the string
+ *
+ * Arguments: [iterations] [seed]. The sequence only depends on the seed, a failure prints
+ * the iteration to run it again. Built with -DSIMCOM_SANITIZE=ON, AddressSanitizer catches
+ * any read past a line or a value list.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "test.h"
+#include "at/sim_at_line.h"
+#include "at/sim_at_fields.h"
+
+#define TEST_LINES_ITERATIONS   200000
+#define TEST_LINES_SEED         0x5eed5eedULL
+#define TEST_LINE_MAX           1023    // longest line of the parser (SIM_AT_MAX_RESP_LEN - 1)
+#define TEST_FIELDS_MAX         12
+
+static uint64_t s_rand;
+static unsigned long s_iter;
+
+static uint32_t _rand(void)
+{
+    // xorshift64*
+    s_rand ^= s_rand >> 12;
+    s_rand ^= s_rand << 25;
+    s_rand ^= s_rand >> 27;
+    return (uint32_t)((s_rand * 2685821657736338717ULL) >> 32);
+}
+
+static uint32_t _rand_below(uint32_t n)
+{
+    return n ? _rand() % n : 0;
+}
+
+// Reports the iteration once per failed check
+#define TEST_FUZZ_CHECK(cond)                                                               \
+    do {                                                                                    \
+        if (!(cond))                                                                        \
+        {                                                                                   \
+            fprintf(stderr, "iteration %lu: ", s_iter);                                     \
+            TEST_CHECK(cond);                                                               \
+        }                                                                                   \
+    } while (0)
+
+/* --- Classifier --- */
+
+/**
+ * @brief Random character, mostly the ones that matter to the classifier
+ */
+static char _line_char(void)
+{
+    static const char common[] = "+*:, \t0123456789OKERRORCMESCONNECTFAIL>\"";
+    switch (_rand_below(8))
+    {
+    case 0:
+        return (char)_rand_below(256);
+    case 1:
+        return (char)('a' + _rand_below(26));
+    default:
+        return common[_rand_below(sizeof(common) - 1)];
+    }
+}
+
+/**
+ * @brief Random line: random characters, or a known head (final results, prefixes) followed
+ * by them; lengths up to TEST_LINE_MAX, short ones more often
+ */
+static size_t _line_random(char *line)
+{
+    static const char *const heads[] = {
+        "OK", "ERROR", ">", "CONNECT", "CONNECT ", "CONNECT FAIL", "CONNECT 115200", "+CME ERROR: ",
+        "+CMS ERROR: ", "+CME ERROR:", "+CMX ERROR: ", "+CSQ: ", "+RECEIVE,", "*ATREADY: ", "+CMQTTRXPAYLOAD: ",
+        "+ABCDEFGHIJKLMNOPQRSTUVW:", "+ABCDEFGHIJKLMNOPQRSTUVWX:", "+ABCDEFGHIJKLMNOPQRSTUVWXY:", "12:30:00", "PB DONE",
+    };
+    size_t max = (_rand_below(4) == 0) ? TEST_LINE_MAX : 40;
+    size_t len = _rand_below((uint32_t)max + 1);
+    size_t pos = 0;
+    if (_rand_below(2))
+    {
+        const char *head = heads[_rand_below(sizeof(heads) / sizeof(heads[0]))];
+        pos = strlen(head);
+        memcpy(line, head, pos);
+        if (len < pos)
+            len = pos + _rand_below(3);
+    }
+    // Long runs of blanks after the separator
+    bool blanks = (_rand_below(8) == 0);
+    for (; pos < len; pos++)
+        line[pos] = blanks ? ' ' : _line_char();
+    return len;
+}
+
+/**
+ * @brief The classification rules, written plainly; the value offset is returned apart, in
+ * a size_t, so a field too narrow for it shows
+ */
+static void _line_reference(const char *line, size_t len, const char *echo, size_t echo_len, sim_at_line_info_t *info,
+                            size_t *value_off)
+{
+    memset(info, 0, sizeof(*info));
+    *value_off = 0;
+    info->type = SIM_AT_LINE_DATA;
+    info->code = -1;
+    if (len == 0)
+        return;
+    if (echo && len == echo_len && memcmp(line, echo, len) == 0)
+    {
+        info->type = SIM_AT_LINE_ECHO;
+        return;
+    }
+
+#define LINE_IS(text) (len == sizeof(text) - 1 && memcmp(line, text, len) == 0)
+    if (LINE_IS("OK"))
+        info->type = SIM_AT_LINE_OK;
+    else if (LINE_IS("ERROR") || LINE_IS("CONNECT FAIL"))
+        info->type = SIM_AT_LINE_ERROR;
+    else if (LINE_IS(">"))
+        info->type = SIM_AT_LINE_PROMPT;
+    else if (LINE_IS("CONNECT") || (len > 7 && memcmp(line, "CONNECT ", 8) == 0))
+        info->type = SIM_AT_LINE_CONNECT;
+    if (info->type != SIM_AT_LINE_DATA)
+        return;
+#undef LINE_IS
+
+    // Prefix: up to ':' (or ',' in lines starting with '+'), at most SIM_AT_URC_PREFIX_LEN
+    size_t end = 0;
+    while (end < len && line[end] != ':' && !(line[0] == '+' && line[end] == ','))
+        end++;
+    if (end > SIM_AT_URC_PREFIX_LEN)
+        return;
+    uint32_t hash = SIM_AT_LINE_HASH_INIT;
+    for (size_t i = 0; i < end; i++)
+        hash = SIM_AT_LINE_HASH_STEP(hash, line[i]);
+    info->key.hash = hash;
+    info->key.len = (uint8_t)end;
+    if (end == len)
+        return;
+    if (line[0] != '+' && line[0] != '*')
+    {
+        info->key.hash = 0;
+        info->key.len = 0;
+        return;
+    }
+
+    // Values after the blanks
+    size_t value = end + 1;
+    while (value < len && (line[value] == ' ' || line[value] == '\t'))
+        value++;
+    info->type = SIM_AT_LINE_INFO;
+    *value_off = value;
+
+    if (end == 10 && memcmp(line, "+CME ERROR", 10) == 0)
+        info->type = SIM_AT_LINE_CME_ERROR;
+    else if (end == 10 && memcmp(line, "+CMS ERROR", 10) == 0)
+        info->type = SIM_AT_LINE_CMS_ERROR;
+    else
+        return;
+    long code = -1;
+    for (size_t i = value; i < len && line[i] >= '0' && line[i] <= '9' && code <= INT16_MAX; i++)
+        code = (code < 0 ? 0 : code * 10) + (line[i] - '0');
+    info->code = (code > INT16_MAX) ? -1 : (int16_t)code;
+}
+
+/**
+ * @brief Classifies a copy of the line in a buffer of its length, so a read past it is caught
+ */
+static void _line_check(const char *text, size_t len, const char *echo)
+{
+    char *line = malloc(len ? len : 1);
+    memcpy(line, text, len);
+    size_t echo_len = echo ? strlen(echo) : 0;
+
+    sim_at_line_info_t info, ref;
+    size_t value_off;
+    memset(&info, 0xA5, sizeof(info));
+    sim_at_line_classify(line, len, echo, echo_len, &info);
+    _line_reference(line, len, echo, echo_len, &ref, &value_off);
+
+    TEST_FUZZ_CHECK(info.type == ref.type);
+    TEST_FUZZ_CHECK(info.key.hash == ref.key.hash && info.key.len == ref.key.len);
+    TEST_FUZZ_CHECK(info.value_off == value_off);
+    TEST_FUZZ_CHECK(info.code == ref.code);
+    TEST_FUZZ_CHECK(info.value_off <= len);
+    TEST_FUZZ_CHECK(sim_at_line_is_final(info.type) ==
+                    (info.type >= SIM_AT_LINE_OK && info.type <= SIM_AT_LINE_CONNECT));
+    if (info.type != ref.type)
+        fprintf(stderr, "  line \"%.*s\": %d, expected %d\n", (int)len, line, info.type, ref.type);
+    free(line);
+}
+
+static void _test_classify(unsigned long iterations)
+{
+    static const struct {
+        const char *line;
+        sim_at_line_type_t type;
+        int code;
+    } known[] = {
+        { "OK", SIM_AT_LINE_OK, -1 },
+        { "OK ", SIM_AT_LINE_DATA, -1 },
+        { "ERROR", SIM_AT_LINE_ERROR, -1 },
+        { ">", SIM_AT_LINE_PROMPT, -1 },
+        { "CONNECT", SIM_AT_LINE_CONNECT, -1 },
+        { "CONNECT 115200", SIM_AT_LINE_CONNECT, -1 },
+        { "CONNECT FAIL", SIM_AT_LINE_ERROR, -1 },
+        { "CONNECTED", SIM_AT_LINE_DATA, -1 },
+        { "+CME ERROR: 10", SIM_AT_LINE_CME_ERROR, 10 },
+        { "+CMS ERROR: 500", SIM_AT_LINE_CMS_ERROR, 500 },
+        { "+CME ERROR: SIM not inserted", SIM_AT_LINE_CME_ERROR, -1 },
+        { "+CME ERROR: 99999", SIM_AT_LINE_CME_ERROR, -1 },
+        { "+CSQ: 20,99", SIM_AT_LINE_INFO, -1 },
+        { "+RECEIVE,0,16", SIM_AT_LINE_INFO, -1 },
+        { "*ATREADY: 1", SIM_AT_LINE_INFO, -1 },
+        { "12:30:00", SIM_AT_LINE_DATA, -1 },
+        { "PB DONE", SIM_AT_LINE_DATA, -1 },
+        { "AT+CSQ", SIM_AT_LINE_ECHO, -1 },
+    };
+    for (size_t i = 0; i < sizeof(known) / sizeof(known[0]); i++)
+    {
+        sim_at_line_info_t info;
+        sim_at_line_classify(known[i].line, strlen(known[i].line), "AT+CSQ", 6, &info);
+        TEST_CHECK(info.type == known[i].type && info.code == known[i].code);
+        _line_check(known[i].line, strlen(known[i].line), "AT+CSQ");
+    }
+
+    // Values past the first 255 bytes
+    static char blanks[600] = "+CSQ:";
+    memset(blanks + 5, ' ', sizeof(blanks) - 8);
+    memcpy(blanks + sizeof(blanks) - 3, "1,2", 3);
+    _line_check(blanks, sizeof(blanks), NULL);
+
+    static char line[TEST_LINE_MAX];
+    for (s_iter = 0; s_iter < iterations; s_iter++)
+    {
+        size_t len = _line_random(line);
+        // The echo is the line itself now and then
+        const char *echo = NULL;
+        char echo_buf[48];
+        if (_rand_below(16) == 0 && len < sizeof(echo_buf))
+        {
+            memcpy(echo_buf, line, len);
+            echo_buf[len] = '\0';
+            echo = echo_buf;
+        }
+        _line_check(line, len, echo);
+    }
+}
+
+/* --- Marker matching --- */
+
+static void _test_match(unsigned long iterations)
+{
+    static const char *const markers[] = { "\r\nOK\r\n", "\r\nCLOSED\r\n", "aabaa" };
+    static const char chars[] = "\r\nOKCLSEDab";
+    static char stream[64];
+
+    for (s_iter = 0; s_iter < iterations; s_iter++)
+    {
+        const char *marker = markers[_rand_below(3)];
+        size_t len = strlen(marker);
+        size_t held = 0;
+        for (size_t n = 1; n <= sizeof(stream); n++)
+        {
+            // Mostly bytes of the marker, so it shows up whole and in overlapping parts
+            stream[n - 1] = _rand_below(4) ? marker[_rand_below((uint32_t)len)] : chars[_rand_below(sizeof(chars) - 1)];
+            held = sim_at_line_match(marker, len, held, (uint8_t)stream[n - 1]);
+
+            // The longest start of the marker the stream ends with
+            size_t expected = (n < len) ? n : len;
+            while (expected > 0 && memcmp(&stream[n - expected], marker, expected) != 0)
+                expected--;
+            TEST_FUZZ_CHECK(held == expected);
+        }
+    }
+}
+
+/* --- Field reader --- */
+
+typedef enum {
+    FIELD_INT = 0,
+    FIELD_QUOTED,
+    FIELD_BARE,
+    FIELD_EMPTY,
+    FIELD_KINDS,
+} field_kind_t;
+
+typedef struct {
+    field_kind_t kind;
+    int value;
+    char text[24];
+} field_t;
+
+static void _blanks(char **p)
+{
+    for (uint32_t n = _rand_below(4) == 0 ? _rand_below(3) : 0; n > 0; n--)
+        *(*p)++ = ' ';
+}
+
+/**
+ * @brief Builds a value list from random fields, returns its field count
+ */
+static size_t _fields_build(field_t *fields, char *values)
+{
+    size_t count = 1 + _rand_below(TEST_FIELDS_MAX);
+    char *p = values;
+    for (size_t i = 0; i < count; i++)
+    {
+        field_t *f = &fields[i];
+        f->kind = (field_kind_t)_rand_below(FIELD_KINDS);
+        if (i > 0)
+            *p++ = ',';
+        switch (f->kind)
+        {
+        case FIELD_INT:
+        {
+            static const int edges[] = { 0, 1, -1, INT_MAX, INT_MIN, INT_MAX - 1, INT_MIN + 1 };
+            f->value = _rand_below(3) == 0 ? edges[_rand_below(7)] : (int)_rand();
+            _blanks(&p);
+            if (f->value >= 0 && _rand_below(4) == 0)
+                *p++ = '+';
+            p += sprintf(p, "%d", f->value);
+            _blanks(&p);
+            break;
+        }
+        case FIELD_QUOTED:
+        {
+            // Anything but quotes and NUL, commas and blanks included
+            static const char chars[] = "ab ,.:-+09\t";
+            size_t n = _rand_below(sizeof(f->text));
+            for (size_t k = 0; k < n; k++)
+                f->text[k] = chars[_rand_below(sizeof(chars) - 1)];
+            f->text[n] = '\0';
+            p += sprintf(p, "\"%s\"", f->text);
+            break;
+        }
+        case FIELD_BARE:
+        {
+            // No commas nor quotes, blanks around are dropped
+            static const char chars[] = "ab.:-+09";
+            size_t n = 1 + _rand_below(sizeof(f->text) - 1);
+            for (size_t k = 0; k < n; k++)
+                f->text[k] = chars[_rand_below(sizeof(chars) - 1)];
+            f->text[n] = '\0';
+            _blanks(&p);
+            p += sprintf(p, "%s", f->text);
+            _blanks(&p);
+            break;
+        }
+        default:
+            f->text[0] = '\0';
+            break;
+        }
+    }
+    *p = '\0';
+    return count;
+}
+
+/**
+ * @brief Reads a built value list back
+ */
+static void _fields_known(void)
+{
+    static field_t fields[TEST_FIELDS_MAX];
+    static char values[TEST_FIELDS_MAX * 32];
+    size_t count = _fields_build(fields, values);
+
+    size_t len = strlen(values);
+    char *copy = malloc(len + 1);
+    memcpy(copy, values, len + 1);
+
+    sim_at_fields_t cur;
+    sim_at_fields_init(&cur, copy);
+    for (size_t i = 0; i < count; i++)
+    {
+        const field_t *f = &fields[i];
+        TEST_FUZZ_CHECK(sim_at_fields_more(&cur));
+        int value;
+        char buf[sizeof(f->text)];
+        switch (f->kind)
+        {
+        case FIELD_INT:
+            if (_rand_below(2))
+                TEST_FUZZ_CHECK(sim_at_fields_int(&cur, &value) && value == f->value);
+            else
+                TEST_FUZZ_CHECK(sim_at_fields_opt_int(&cur, &value, 7) && value == f->value);
+            break;
+        case FIELD_EMPTY:
+            if (_rand_below(2))
+            {
+                TEST_FUZZ_CHECK(!sim_at_fields_int(&cur, &value));
+                TEST_FUZZ_CHECK(sim_at_fields_opt_int(&cur, &value, 7) && value == 7);
+            }
+            else
+                TEST_FUZZ_CHECK(sim_at_fields_str(&cur, buf, sizeof(buf)) && buf[0] == '\0');
+            break;
+        default:
+        {
+            // One byte short fails without moving, the exact size reads it
+            size_t n = strlen(f->text);
+            sim_at_fields_t before = cur;
+            TEST_FUZZ_CHECK(!sim_at_fields_str(&cur, buf, n));
+            TEST_FUZZ_CHECK(cur.pos == before.pos && cur.end == before.end);
+            TEST_FUZZ_CHECK(sim_at_fields_str(&cur, buf, n + 1) && strcmp(buf, f->text) == 0);
+            break;
+        }
+        }
+    }
+    TEST_FUZZ_CHECK(!sim_at_fields_more(&cur));
+    TEST_FUZZ_CHECK(!sim_at_fields_skip(&cur));
+    free(copy);
+}
+
+/**
+ * @brief Random calls on a random string
+ */
+static void _fields_random(void)
+{
+    static const char chars[] = "0123456789-+ ,\"\"ab\t";
+    size_t len = _rand_below(64);
+    char *values = malloc(len + 1);
+    for (size_t i = 0; i < len; i++)
+        values[i] = (_rand_below(16) == 0) ? (char)(1 + _rand_below(255)) : chars[_rand_below(sizeof(chars) - 1)];
+    values[len] = '\0';
+
+    sim_at_fields_t cur;
+    sim_at_fields_init(&cur, values);
+    // Each successful call moves the cursor: the fields run out within len + 1 of them
+    for (size_t calls = 0; calls <= len + 1 && sim_at_fields_more(&cur); calls++)
+    {
+        sim_at_fields_t before = cur;
+        int value;
+        bool ok;
+        size_t size = _rand_below(8);
+        char *buf = malloc(size ? size : 1);
+        switch (_rand_below(4))
+        {
+        case 0:
+            ok = sim_at_fields_int(&cur, &value);
+            break;
+        case 1:
+            ok = sim_at_fields_opt_int(&cur, &value, 0);
+            break;
+        case 2:
+            ok = sim_at_fields_str(&cur, buf, size);
+            if (ok)
+                TEST_FUZZ_CHECK(memchr(buf, '\0', size) != NULL);
+            break;
+        default:
+            ok = sim_at_fields_skip(&cur);
+            break;
+        }
+        free(buf);
+
+        TEST_FUZZ_CHECK(cur.pos >= values && cur.pos <= values + len);
+        if (!ok)
+        {
+            TEST_FUZZ_CHECK(cur.pos == before.pos && cur.end == before.end);
+            TEST_FUZZ_CHECK(sim_at_fields_skip(&cur));
+        }
+        else
+            TEST_FUZZ_CHECK(cur.pos > before.pos || cur.end);
+    }
+    TEST_FUZZ_CHECK(!sim_at_fields_more(&cur));
+    free(values);
+}
+
+static void _test_fields(unsigned long iterations)
+{
+    for (s_iter = 0; s_iter < iterations; s_iter++)
+    {
+        _fields_known();
+        _fields_random();
+    }
+}
+
+int test_lines(int argc, char **argv)
+{
+    unsigned long iterations = (argc > 0) ? strtoul(argv[0], NULL, 0) : TEST_LINES_ITERATIONS;
+    s_rand = (argc > 1) ? strtoull(argv[1], NULL, 0) : TEST_LINES_SEED;
+    if (s_rand == 0)
+        s_rand = TEST_LINES_SEED;
+
+    _test_classify(iterations);
+    _test_match(iterations / 16);
+    _test_fields(iterations);
+    return 0;
+}
@@ -0,0 +1,56 @@
+/**
+ * test_main.c
+ * Host tests of the library, run by CTest (see host/CMakeLists.txt):
+ *
+ *   simcom_test <group> [argument]...
+ *
+ * Groups:
+ *   services   every public service against the modem simulator; the arguments are
+ *              directives (see modem_sim.h) applied to each simulator, e.g. "chunk 1" to
+ *              split every response into single bytes
+ *   registry   services set up with the URC registry full, then with room; the
+ *              arguments are simulator directives as for services
+ *   lines      line classifier and field reader against random input; the arguments are
+ *              the iteration count and the seed (see test_lines.c)
+ *
+ * Exit status 0 when every check passed. Build with -DSIMCOM_SANITIZE=ON to run them under
+ * AddressSanitizer and UndefinedBehaviorSanitizer.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "test.h"
+
+int test_failures;
+
+static const struct {
+    const char *name;
+    int (*run)(int argc, char **argv);
+} s_groups[] = {
+    { "services", test_services },
+    { "lines", test_lines },
+    { "registry", test_registry },
+};
+
+int main(int argc, char **argv)
+{
+    for (size_t i = 0; argc > 1 && i < sizeof(s_groups) / sizeof(s_groups[0]); i++)
+    {
+        if (strcmp(argv[1], s_groups[i].name) != 0)
+            continue;
+        int ret = s_groups[i].run(argc - 2, argv + 2);
+        if (ret != 0 || test_failures != 0)
+        {
+            fprintf(stderr, "%s: %d checks failed\n", argv[1], test_failures);
+            return 1;
+        }
+        printf("%s: passed\n", argv[1]);
+        return 0;
+    }
+
+    fprintf(stderr, "usage: simcom_test <group> [argument]...\ngroups:");
+    for (size_t i = 0; i < sizeof(s_groups) / sizeof(s_groups[0]); i++)
+        fprintf(stderr, " %s", s_groups[i].name);
+    fprintf(stderr, "\n");
+    return 2;
+}
@@ -0,0 +1,790 @@
+/**
+ * test_services.c
+ * Every public service of the library against the modem simulator, each part on a fresh
+ * simulator and library:
+ *   basic      AT, echo, status control, network registration, packet domain, PDP contexts,
+ *              ping, SIM card, SMS indications, NTP, URC handlers, flow control, baud rate
+ *              negotiation and module reset
+ *   mqtt       service, client, connect, the publish variants, outbound queue, coalesced
+ *              topics, subscriptions and incoming messages, spool
+ *   cache      modem state cache and the _cached() queries
+ *   bringup    simcom_bringup() cold and warm
+ *   cmux       27.010 multiplexer, routes and channel counters
+ *   socket     TCP echo through the simulator, in command mode and in transparent mode
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "test.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "modem_sim.h"
+
+#define TEST_WAIT_MS        5000    // longest wait for a callback
+#define TEST_BROKER         "tcp://broker.test:1883"
+#define TEST_TOPIC          "test/topic"
+#define TEST_GUARD_MS       50      // "+++" guard time of the transparent link
+#define TEST_LINK           0
+
+static int s_argc;
+static char **s_argv;
+static modem_sim_t *s_sim;
+
+/* --- Helpers --- */
+
+/**
+ * @brief Starts a fresh simulator with the group directives plus extra ones and initializes
+ * the library on it
+ */
+static bool _open(const char *const *extra)
+{
+    char path[64];
+    s_sim = modem_sim_create();
+    if (s_sim == NULL)
+        return false;
+    for (int i = 0; i < s_argc; i++)
+    {
+        if (modem_sim_config(s_sim, s_argv[i]) != 0)
+            return false;
+    }
+    for (; extra && *extra; extra++)
+        modem_sim_config(s_sim, *extra);
+    if (modem_sim_open_pty(s_sim, path, sizeof(path)) != 0 || modem_sim_start(s_sim) != 0)
+        return false;
+
+    simcom_config_t cfg = {
+        .uart_conf = { .baud_rate = 115200 },
+        .control_pins = { .dtr_pin = -1, .pwrkey_pin = -1, .rst_pin = -1 },
+        .default_cmd_timeout_ms = 5000,
+        .rts_pin = -1,
+        .cts_pin = -1,
+        .transport = simcom_transport_posix(path),
+    };
+    TEST_OK(simcom_init(&cfg));
+    TEST_OK(simcom_enable_echo(false));
+    return true;
+}
+
+static void _close(void)
+{
+    TEST_OK(simcom_deinit());
+    modem_sim_destroy(s_sim);
+    s_sim = NULL;
+}
+
+/**
+ * @brief Waits until a callback counter reaches count
+ */
+static bool _wait_count(atomic_int *counter, int count)
+{
+    for (int ms = 0; atomic_load(counter) < count; ms++)
+    {
+        if (ms == TEST_WAIT_MS)
+            return false;
+        vTaskDelay(pdMS_TO_TICKS(1));
+    }
+    return true;
+}
+
+/* --- Basic services --- */
+
+static atomic_int s_urcs;
+static atomic_int s_ping_done;
+static simcom_ping_result_t s_ping;
+static atomic_int s_ntp_done;
+
+static void _urc_cb(const char *line, size_t len, void *ctx)
+{
+    if (len >= 5 && strncmp(line, "+TEST", 5) == 0)
+        atomic_fetch_add(&s_urcs, 1);
+}
+
+static void _ping_cb(simcom_err_t err, const simcom_ping_result_t *result, void *ctx)
+{
+    TEST_CHECK(err == SIM_AT_OK);
+    s_ping = *result;
+    atomic_fetch_add(&s_ping_done, 1);
+}
+
+static void _ntp_cb(simcom_err_t err, sim_at_ntp_err_code_t ntp_err, void *ctx)
+{
+    TEST_CHECK(err == SIM_AT_OK);
+    atomic_fetch_add(&s_ntp_done, 1);
+}
+
+static void _test_basic(void)
+{
+    if (!_open(NULL))
+    {
+        TEST_CHECK(!"simulator");
+        return;
+    }
+
+    TEST_OK(simcom_comm_test());
+    TEST_OK(simcom_enable_echo(true));
+    TEST_OK(simcom_comm_test());
+    TEST_OK(simcom_enable_echo(false));
+
+    // Status control
+    sim_status_control_fun_t fun;
+    int rssi, ber;
+    char rtc[SIMCOM_RTC_TIME_LEN];
+    TEST_OK(simcom_set_phone_func(FUN_FULL_FUNCTIONALITY));
+    TEST_OK(simcom_get_phone_func(&fun));
+    TEST_CHECK(fun == FUN_FULL_FUNCTIONALITY);
+    TEST_OK(simcom_query_signal_quality(&rssi, &ber));
+    TEST_CHECK(rssi >= 0 && rssi <= 31);
+    TEST_CHECK(simcom_rssi_to_dbm(0) == -113 && simcom_rssi_to_dbm(31) == -51);
+    TEST_OK(simcom_get_rtc_time(rtc));
+    TEST_CHECK(strlen(rtc) > 0);
+
+    // Network
+    sim_network_registration_stat_t reg;
+    sim_eps_network_registration_stat_t eps_reg;
+    int attach;
+    TEST_OK(simcom_net_reg(&reg));
+    TEST_OK(simcom_eps_net_reg(&eps_reg));
+    TEST_OK(simcom_set_packet_domain_attach(1));
+    TEST_OK(simcom_get_packet_domain_attach(&attach));
+    TEST_CHECK(attach == 1);
+
+    // PDP contexts
+    simcom_pdp_context_t ctx[4];
+    size_t count = 0;
+    int cid, state;
+    char addr[SIMCOM_PDP_ADDR_LEN];
+    TEST_OK(simcom_set_pdp_context(1, PDP_IP, "apn.test"));
+    TEST_OK(simcom_get_pdp_context(ctx, 4, &count));
+    TEST_CHECK(count >= 1 && ctx[0].cid == 1 && strcmp(ctx[0].apn, "apn.test") == 0);
+    TEST_OK(simcom_set_pdp_context_activate(1, 1));
+    TEST_OK(simcom_get_pdp_context_activate(&cid, &state));
+    TEST_CHECK(cid == 1 && state == 1);
+    TEST_OK(simcom_get_pdp_context_activate_list(ctx, 4, &count));
+    TEST_CHECK(count >= 1 && ctx[0].state == 1);
+    TEST_OK(simcom_show_pdp_addr(&cid, addr));
+    TEST_CHECK(cid == 1 && strlen(addr) > 0);
+    TEST_OK(simcom_show_pdp_addr_list(ctx, 4, &count));
+    TEST_CHECK(count >= 1 && strlen(ctx[0].ipv4) > 0);
+    TEST_OK(simcom_get_pdp_contexts(ctx, 4, &count));
+    TEST_CHECK(count >= 1 && ctx[0].state == 1 && strcmp(ctx[0].apn, "apn.test") == 0);
+
+    // Ping, both ways
+    TEST_OK(simcom_ping("8.8.8.8"));
+    atomic_store(&s_ping_done, 0);
+    TEST_OK(simcom_ping_async("8.8.8.8", _ping_cb, NULL));
+    TEST_CHECK(_wait_count(&s_ping_done, 1));
+    TEST_CHECK(s_ping.sent == 1 && s_ping.received == 1);
+
+    // SIM card, SMS, NTP
+    sim_simcard_pin_code_t pin;
+    sim_at_ntp_err_code_t ntp_err;
+    TEST_OK(simcom_get_simcard_pin_info(&pin));
+    TEST_OK(simcom_sms_new_indications_set(2, 1, 0, 0, 0));
+    TEST_OK(simcom_ntp_config_set("pool.ntp.org", -3));
+    TEST_OK(simcom_ntp_config_get());
+    TEST_OK(simcom_ntp_sys_time_update(&ntp_err));
+    atomic_store(&s_ntp_done, 0);
+    TEST_OK(simcom_ntp_sys_time_update_async(_ntp_cb, NULL));
+    TEST_CHECK(_wait_count(&s_ntp_done, 1));
+
+    // URC handlers: injected lines reach the handler until it is unregistered
+    atomic_store(&s_urcs, 0);
+    TEST_OK(simcom_urc_register("+TEST", _urc_cb, NULL));
+    modem_sim_inject(s_sim, "+TEST: 1");
+    modem_sim_inject(s_sim, "+TEST: 2");
+    TEST_CHECK(_wait_count(&s_urcs, 2));
+    TEST_OK(simcom_urc_unregister("+TEST", _urc_cb, NULL));
+    TEST_ERR(SIM_AT_ERR_INVALID_ARG, simcom_urc_unregister("+TEST", _urc_cb, NULL));
+    TEST_CHECK(simcom_urc_dropped() == 0);
+
+    // Transmit counters, flow control and rate
+    simcom_tx_stats_t tx;
+    uint32_t baud = 0;
+    static const uint32_t rates[] = { 921600, 460800, 115200 };
+    simcom_baud_config_t baud_cfg = { .rates = rates, .rate_count = 3 };
+    TEST_OK(simcom_tx_stats(&tx));
+    TEST_CHECK(tx.bytes > 0 && tx.writes > 0);
+    TEST_OK(simcom_set_flow_control(true));
+    TEST_OK(simcom_set_flow_control(false));
+    TEST_OK(simcom_baud_negotiate(&baud_cfg, &baud));
+    TEST_CHECK(baud == 921600);
+    TEST_OK(simcom_comm_test());
+
+    // The restart brings the modem back to 115200, where it is found again
+    TEST_OK(simcom_reset_module());
+    baud_cfg.last_rate = baud;
+    TEST_OK(simcom_baud_negotiate(&baud_cfg, &baud));
+    TEST_CHECK(baud == 921600);
+    TEST_OK(simcom_comm_test());
+    TEST_OK(simcom_power_down_module());
+
+    _close();
+}
+
+/* --- MQTT --- */
+
+static atomic_int s_mqtt_done;
+static atomic_int s_mqtt_errors;
+static atomic_int s_rx_msgs;
+static atomic_size_t s_rx_bytes;
+
+static void _mqtt_cb(int client_index, simcom_err_t err, int mqtt_err, void *ctx)
+{
+    if (err != SIM_AT_OK || client_index != 0)
+        atomic_fetch_add(&s_mqtt_errors, 1);
+    atomic_fetch_add(&s_mqtt_done, 1);
+}
+
+static void _rx_cb(const simcom_mqtt_msg_t *msg, void *ctx)
+{
+    if (msg->client_index != 0 || strcmp(msg->topic, TEST_TOPIC) != 0)
+        atomic_fetch_add(&s_mqtt_errors, 1);
+    for (size_t i = 0; i < msg->len; i++)
+    {
+        if (msg->payload[i] != (uint8_t)('a' + (msg->offset + i) % 26))
+        {
+            atomic_fetch_add(&s_mqtt_errors, 1);
+            break;
+        }
+    }
+    atomic_fetch_add(&s_rx_bytes, msg->len);
+    if (msg->last)
+        atomic_fetch_add(&s_rx_msgs, 1);
+}
+
+static void _test_mqtt(void)
+{
+    if (!_open(NULL))
+    {
+        TEST_CHECK(!"simulator");
+        return;
+    }
+
+    atomic_store(&s_mqtt_done, 0);
+    atomic_store(&s_mqtt_errors, 0);
+
+    // A second start finds the service started
+    TEST_OK(simcom_mqtt_service_start());
+    TEST_OK(simcom_mqtt_service_start());
+    TEST_OK(simcom_mqtt_client_acquire(0, "test"));
+    TEST_OK(simcom_mqtt_server_connect(0, TEST_BROKER, 60, 1));
+
+    // Step by step, the modem forgets the topic after each publish
+    static const uint8_t binary[] = { 0x00, 0x0d, 0x0a, 'O', 'K', 0x0d, 0x0a, 0xff };
+    simcom_iov_t iov[] = { { "{\"v\":", 5 }, { "42", 2 }, { "}", 1 } };
+    TEST_OK(simcom_mqtt_topic_set(0, TEST_TOPIC));
+    TEST_OK(simcom_mqtt_payload_set(0, "{\"v\":42}"));
+    TEST_OK(simcom_mqtt_publish(0, 1, 60));
+    TEST_OK(simcom_mqtt_topic_set(0, TEST_TOPIC));
+    TEST_OK(simcom_mqtt_payload_set_buf(0, binary, sizeof(binary)));
+    TEST_OK(simcom_mqtt_publish(0, 0, 60));
+    TEST_OK(simcom_mqtt_topic_set(0, TEST_TOPIC));
+    TEST_OK(simcom_mqtt_payload_set_iov(0, iov, 3));
+    TEST_OK(simcom_mqtt_publish(0, 2, 60));
+    TEST_OK(simcom_mqtt_topic_set(0, TEST_TOPIC));
+    TEST_OK(simcom_mqtt_payload_set(0, "async"));
+    TEST_OK(simcom_mqtt_publish_async(0, 1, 60, _mqtt_cb, NULL));
+    TEST_CHECK(_wait_count(&s_mqtt_done, 1));
+
+    // One transaction
+    TEST_OK(simcom_mqtt_publish_msg(0, TEST_TOPIC, binary, sizeof(binary), 1, 60));
+    TEST_OK(simcom_mqtt_publish_msg(0, TEST_TOPIC, "", 0, 0, 60));
+    TEST_OK(simcom_mqtt_publish_msg_async(0, TEST_TOPIC, binary, sizeof(binary), 1, 60, _mqtt_cb, NULL));
+    TEST_CHECK(_wait_count(&s_mqtt_done, 2));
+
+    // Outbound queue
+    TEST_OK(simcom_mqtt_queue_config(0, 2, 1));
+    TEST_ERR(SIM_AT_ERR_INVALID_ARG, simcom_mqtt_queue_config(0, 0, 1));
+    for (int i = 0; i < 10; )
+    {
+        simcom_err_t err = simcom_mqtt_enqueue(0, TEST_TOPIC, binary, sizeof(binary), 1, 60, _mqtt_cb, NULL);
+        if (err == SIM_AT_ERR_BUSY)
+            vTaskDelay(1);
+        else
+        {
+            TEST_CHECK(err == SIM_AT_OK);
+            i++;
+        }
+    }
+    TEST_CHECK(_wait_count(&s_mqtt_done, 12));
+    TEST_CHECK(simcom_mqtt_queue_pending(0) == 0);
+
+    // Coalesced topic: 20 records in one publish on flush
+    int handle;
+    simcom_mqtt_coalesce_stats_t co;
+    simcom_mqtt_coalesce_config_t co_cfg = {
+        .client_index = 0, .topic = TEST_TOPIC, .qos = 1, .framing = SIMCOM_MQTT_FRAME_LEN16,
+        .cb = _mqtt_cb,
+    };
+    TEST_OK(simcom_mqtt_coalesce_open(&co_cfg, &handle));
+    for (int i = 0; i < 20; i++)
+        TEST_OK(simcom_mqtt_coalesce_add(handle, binary, sizeof(binary)));
+    TEST_OK(simcom_mqtt_coalesce_flush(handle));
+    TEST_CHECK(_wait_count(&s_mqtt_done, 13));
+    TEST_OK(simcom_mqtt_coalesce_get_stats(handle, &co));
+    TEST_CHECK(co.records == 20 && co.publishes == 1 && co.failed == 0);
+    TEST_CHECK(co.bytes == 20 * (2 + sizeof(binary)));
+    TEST_OK(simcom_mqtt_coalesce_close(handle));
+
+    // Incoming messages, one in a single part and one in several
+    static char big[3000];
+    for (size_t i = 0; i < sizeof(big) - 1; i++)
+        big[i] = (char)('a' + i % 26);
+    atomic_store(&s_rx_msgs, 0);
+    atomic_store(&s_rx_bytes, 0);
+    TEST_OK(simcom_mqtt_rx_register(_rx_cb, NULL));
+    TEST_OK(simcom_mqtt_subscribe(0, TEST_TOPIC, 1));
+    modem_sim_mqtt_rx(s_sim, 0, TEST_TOPIC, "abcdef");
+    modem_sim_mqtt_rx(s_sim, 0, TEST_TOPIC, big);
+    TEST_CHECK(_wait_count(&s_rx_msgs, 2));
+    TEST_CHECK(atomic_load(&s_rx_bytes) == 6 + sizeof(big) - 1);
+    TEST_CHECK(simcom_mqtt_rx_dropped() == 0);
+    TEST_OK(simcom_mqtt_unsubscribe(0, TEST_TOPIC));
+    TEST_OK(simcom_mqtt_rx_register(NULL, NULL));
+
+    // Spool: stored while disconnected, published on the next connect
+    char spool_path[] = "/tmp/simcom_test_spoolXXXXXX";
+    int fd = mkstemp(spool_path);
+    TEST_CHECK(fd >= 0);
+    close(fd);
+    simcom_spool_stats_t spool;
+    const simcom_spool_storage_t *storage = simcom_spool_file(spool_path, 4 * 4096, 4096);
+    TEST_CHECK(storage != NULL);
+    TEST_OK(simcom_spool_open(storage, 0, 1));
+    TEST_OK(simcom_mqtt_server_disconnect(0, 60));
+    for (int i = 0; i < 5; i++)
+        TEST_OK(simcom_spool_append(TEST_TOPIC, binary, sizeof(binary)));
+    TEST_OK(simcom_spool_get_stats(&spool));
+    TEST_CHECK(spool.pending == 5);
+    TEST_OK(simcom_mqtt_server_connect(0, TEST_BROKER, 60, 1));
+    for (int ms = 0; ms < TEST_WAIT_MS && simcom_spool_get_stats(&spool) == SIM_AT_OK && spool.pending > 0; ms++)
+        vTaskDelay(pdMS_TO_TICKS(1));
+    TEST_CHECK(spool.pending == 0);
+    TEST_OK(simcom_spool_drain());
+    simcom_spool_close();
+    unlink(spool_path);
+
+    // Asynchronous connect
+    TEST_OK(simcom_mqtt_server_disconnect(0, 60));
+    int done = atomic_load(&s_mqtt_done);
+    TEST_OK(simcom_mqtt_server_connect_async(0, TEST_BROKER, 60, 1, _mqtt_cb, NULL));
+    TEST_CHECK(_wait_count(&s_mqtt_done, done + 1));
+    TEST_OK(simcom_mqtt_publish_msg(0, TEST_TOPIC, "1", 1, 1, 60));
+
+    TEST_OK(simcom_mqtt_server_disconnect(0, 60));
+    TEST_OK(simcom_mqtt_client_release(0));
+    TEST_OK(simcom_mqtt_service_stop());
+    TEST_CHECK(atomic_load(&s_mqtt_errors) == 0);
+
+    _close();
+}
+
+/* --- State cache --- */
+
+static void _test_cache(void)
+{
+    if (!_open(NULL))
+    {
+        TEST_CHECK(!"simulator");
+        return;
+    }
+
+    int rssi, ber, attach;
+    sim_status_control_fun_t fun;
+    sim_network_registration_stat_t reg;
+    sim_eps_network_registration_stat_t eps_reg;
+    simcom_state_t state;
+
+    TEST_OK(simcom_state_cache_start());
+    modem_sim_stats_t before, after;
+    modem_sim_get_stats(s_sim, &before);
+    TEST_OK(simcom_query_signal_quality_cached(&rssi, &ber, 0));
+    TEST_OK(simcom_net_reg_cached(&reg, 0));
+    TEST_OK(simcom_eps_net_reg_cached(&eps_reg, 0));
+    TEST_OK(simcom_get_packet_domain_attach_cached(&attach, 0));
+    TEST_OK(simcom_get_phone_func_cached(&fun, 60000));
+    modem_sim_get_stats(s_sim, &after);
+    TEST_CHECK(after.commands == before.commands);
+
+    // A report changes the cached value without a command
+    modem_sim_inject(s_sim, "+CSQ: 7,99");
+    for (int ms = 0; ms < TEST_WAIT_MS; ms++)
+    {
+        simcom_state_cache_get(&state);
+        if (state.rssi == 7)
+            break;
+        vTaskDelay(pdMS_TO_TICKS(1));
+    }
+    TEST_CHECK(state.rssi == 7 && state.age_ms[SIMCOM_STATE_CSQ] == 0);
+    TEST_OK(simcom_state_cache_stop());
+
+    // Stopped, the values age and a zero max age asks the modem
+    TEST_OK(simcom_query_signal_quality_cached(&rssi, &ber, 0));
+    modem_sim_get_stats(s_sim, &before);
+    TEST_CHECK(before.commands > after.commands);
+
+    _close();
+}
+
+/* --- Bring-up --- */
+
+static void _test_bringup(void)
+{
+    if (!_open(NULL))
+    {
+        TEST_CHECK(!"simulator");
+        return;
+    }
+
+    simcom_bringup_config_t cfg = {
+        .apn = "apn.test", .pdp_type = PDP_IP, .cid = 1,
+        .client_index = 0, .client_id = "test", .server_addr = TEST_BROKER, .keepalive_time = 60, .clean_session = 1,
+    };
+    simcom_bringup_stats_t stats;
+    TEST_OK(simcom_bringup(&cfg, &stats));
+    TEST_CHECK(stats.phase == SIMCOM_BRINGUP_MQTT_CONNECT && stats.commands > 0);
+    TEST_OK(simcom_mqtt_publish_msg(0, TEST_TOPIC, "1", 1, 1, 60));
+
+    // Warm: every phase is already done
+    TEST_OK(simcom_bringup(&cfg, &stats));
+    TEST_CHECK(stats.skipped & (1u << SIMCOM_BRINGUP_MQTT_CONNECT));
+    TEST_CHECK(strlen(simcom_bringup_phase_to_str(SIMCOM_BRINGUP_PDP)) > 0);
+
+    _close();
+}
+
+/* --- CMUX --- */
+
+static void _test_cmux(void)
+{
+    if (!_open(NULL))
+    {
+        TEST_CHECK(!"simulator");
+        return;
+    }
+
+    int rssi, ber;
+    simcom_chan_stats_t chan0, chan1;
+    TEST_OK(simcom_mqtt_service_start());
+    TEST_OK(simcom_mqtt_client_acquire(0, "test"));
+    TEST_OK(simcom_mqtt_server_connect(0, TEST_BROKER, 60, 1));
+
+    TEST_OK(simcom_cmux_start(2));
+    TEST_ERR(SIM_AT_ERR_BUSY, simcom_cmux_start(2));
+    TEST_OK(simcom_chan_route("+CSQ", 1));
+    TEST_ERR(SIM_AT_ERR_INVALID_ARG, simcom_chan_route("+CSQ", 9));
+    TEST_OK(simcom_comm_test());
+    TEST_OK(simcom_query_signal_quality(&rssi, &ber));
+    TEST_OK(simcom_mqtt_publish_msg(0, TEST_TOPIC, "1", 1, 1, 60));
+    // AT on the first channel; AT+CSQ and the publish on the second, "+CMQTT" by default
+    TEST_OK(simcom_chan_stats(0, &chan0));
+    TEST_OK(simcom_chan_stats(1, &chan1));
+    TEST_CHECK(chan0.commands >= 1 && chan1.commands >= 4);
+    TEST_OK(simcom_chan_route("+CSQ", 0));
+    TEST_OK(simcom_cmux_stop());
+
+    // Plain AT again
+    TEST_OK(simcom_comm_test());
+    TEST_OK(simcom_mqtt_publish_msg(0, TEST_TOPIC, "1", 1, 1, 60));
+
+    _close();
+}
+
+/* --- Sockets --- */
+
+static int s_echo_fd = -1;
+static atomic_int s_echo_conn = -1;     // connection of the echo server, shut down to close it
+
+static void *_echo_thread(void *arg)
+{
+    int fd = accept(s_echo_fd, NULL, NULL);
+    atomic_store(&s_echo_conn, fd);
+    char buf[4096];
+    ssize_t n;
+    while (fd >= 0 && (n = read(fd, buf, sizeof(buf))) > 0)
+    {
+        for (ssize_t done = 0, w; done < n; done += w)
+        {
+            w = write(fd, buf + done, n - done);
+            if (w <= 0)
+                break;
+        }
+    }
+    atomic_store(&s_echo_conn, -1);
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+/**
+ * @brief Starts an echo server on a free loopback port for one connection, returns the port
+ */
+static uint16_t _echo_start(pthread_t *thread)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+    s_echo_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (s_echo_fd < 0 || bind(s_echo_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(s_echo_fd, 1) != 0
+        || getsockname(s_echo_fd, (struct sockaddr *)&addr, &len) != 0 || pthread_create(thread, NULL, _echo_thread, NULL) != 0)
+        return 0;
+    return ntohs(addr.sin_port);
+}
+
+/**
+ * @brief Sends blocks of every byte value and reads them back
+ */
+static void _echo_check(size_t block, int blocks)
+{
+    static uint8_t data[2048], buf[2048];
+    for (size_t i = 0; i < block; i++)
+        data[i] = (uint8_t)i;
+
+    for (int b = 0; b < blocks; b++)
+    {
+        TEST_OK(simcom_socket_send(TEST_LINK, data, block));
+        size_t got = 0;
+        while (got < block)
+        {
+            size_t len = 0;
+            simcom_err_t err = simcom_socket_recv(TEST_LINK, buf, block - got, &len, TEST_WAIT_MS);
+            TEST_CHECK(err == SIM_AT_OK && len > 0);
+            if (err != SIM_AT_OK || len == 0)
+                return;
+            TEST_CHECK(memcmp(buf, data + got, len) == 0);
+            got += len;
+        }
+    }
+}
+
+static void _test_socket(bool transparent)
+{
+    pthread_t echo;
+    uint16_t port = _echo_start(&echo);
+    TEST_CHECK(port != 0);
+
+    char guard[32];
+    snprintf(guard, sizeof(guard), "guard %d", TEST_GUARD_MS);
+    const char *extra[] = { guard, NULL };
+    if (port == 0 || !_open(extra))
+    {
+        TEST_CHECK(!"simulator");
+        return;
+    }
+
+    simcom_socket_stats_t stats;
+    TEST_OK(transparent ? simcom_net_open_transparent() : simcom_net_open());
+    TEST_OK(simcom_socket_open(TEST_LINK, SIMCOM_SOCKET_TCP, "127.0.0.1", port, 0));
+    TEST_ERR(SIM_AT_ERR_BUSY, simcom_socket_open(TEST_LINK, SIMCOM_SOCKET_TCP, "127.0.0.1", port, 0));
+    _echo_check(1500, 4);
+    _echo_check(7, 4);
+    if (transparent)
+    {
+        // Command mode and back with the connection open
+        TEST_OK(simcom_socket_escape(TEST_LINK, TEST_GUARD_MS));
+        TEST_OK(simcom_comm_test());
+        TEST_OK(simcom_socket_resume(TEST_LINK));
+        _echo_check(256, 2);
+        TEST_OK(simcom_socket_escape(TEST_LINK, TEST_GUARD_MS));
+        TEST_OK(simcom_socket_resume(TEST_LINK));
+
+        // The peer closes: "\r\nCLOSED\r\n" ends the data, none of it in the ring
+        int conn = atomic_load(&s_echo_conn);
+        TEST_CHECK(conn >= 0 && shutdown(conn, SHUT_RDWR) == 0);
+        uint8_t buf[16];
+        size_t len = 1;
+        TEST_OK(simcom_socket_recv(TEST_LINK, buf, sizeof(buf), &len, TEST_WAIT_MS));
+        TEST_CHECK(len == 0);
+        TEST_OK(simcom_comm_test());
+    }
+    TEST_OK(simcom_socket_stats(TEST_LINK, &stats));
+    TEST_CHECK(stats.rx_bytes == 4 * 1500 + 4 * 7 + (transparent ? 2 * 256 : 0) && stats.rx_dropped == 0);
+    TEST_OK(simcom_socket_close(TEST_LINK));
+    TEST_OK(simcom_net_close());
+    TEST_OK(simcom_comm_test());
+    TEST_CHECK(strlen(simcom_socket_err_to_str(0)) > 0);
+
+    _close();
+    pthread_join(echo, NULL);
+    close(s_echo_fd);
+    s_echo_fd = -1;
+}
+
+int test_services(int argc, char **argv)
+{
+    s_argc = argc;
+    s_argv = argv;
+
+    _test_basic();
+    _test_mqtt();
+    _test_cache();
+    _test_bringup();
+    _test_cmux();
+    _test_socket(false);
+    _test_socket(true);
+    return 0;
+}
+
+/* --- URC registry --- */
+
+#define TEST_FILL_MAX       64
+
+static char s_fill[TEST_FILL_MAX][12];
+static int s_fill_count;
+
+static void _fill_cb(const char *line, size_t len, void *ctx)
+{
+}
+
+/**
+ * @brief Takes every free registry entry with placeholder handlers, returns how many
+ */
+static int _registry_fill(void)
+{
+    int added = 0;
+    while (s_fill_count < TEST_FILL_MAX)
+    {
+        snprintf(s_fill[s_fill_count], sizeof(s_fill[0]), "+FILL%d", s_fill_count);
+        if (simcom_urc_register(s_fill[s_fill_count], _fill_cb, NULL) != SIM_AT_OK)
+            break;
+        s_fill_count++;
+        added++;
+    }
+    return added;
+}
+
+/**
+ * @brief Gives count placeholder entries back
+ */
+static void _registry_release(int count)
+{
+    for (; count > 0 && s_fill_count > 0; count--)
+        TEST_OK(simcom_urc_unregister(s_fill[--s_fill_count], _fill_cb, NULL));
+}
+
+/**
+ * @brief A service that finds the registry full leaves it as it was, and a later call sets
+ * it up whole
+ */
+static void _test_registry_full(void)
+{
+    if (!_open(NULL))
+    {
+        TEST_CHECK(!"simulator");
+        return;
+    }
+
+    // Room for two of the four +CMQTTRX* handlers
+    int free_entries = _registry_fill();
+    TEST_CHECK(free_entries > 0);
+    _registry_release(2);
+    TEST_ERR(SIM_AT_ERR_NO_MEM, simcom_mqtt_rx_register(_rx_cb, NULL));
+    TEST_CHECK(_registry_fill() == 2);
+    _registry_release(s_fill_count);
+
+    // Retried with room, messages arrive
+    TEST_OK(simcom_mqtt_rx_register(_rx_cb, NULL));
+    TEST_CHECK(_registry_fill() == free_entries - 4);
+    _registry_release(s_fill_count);
+    atomic_store(&s_rx_msgs, 0);
+    TEST_OK(simcom_mqtt_service_start());
+    TEST_OK(simcom_mqtt_client_acquire(0, "test"));
+    TEST_OK(simcom_mqtt_server_connect(0, TEST_BROKER, 60, 1));
+    TEST_OK(simcom_mqtt_subscribe(0, TEST_TOPIC, 1));
+    modem_sim_mqtt_rx(s_sim, 0, TEST_TOPIC, "abcdef");
+    TEST_CHECK(_wait_count(&s_rx_msgs, 1));
+    TEST_OK(simcom_mqtt_rx_register(NULL, NULL));
+    TEST_OK(simcom_mqtt_server_disconnect(0, 60));
+    TEST_OK(simcom_mqtt_client_release(0));
+    TEST_OK(simcom_mqtt_service_stop());
+
+    _close();
+}
+
+/**
+ * @brief The state cache, MQTT receive and sockets hold their handlers together, and a socket
+ * setup that finds the registry full leaves nothing behind
+ */
+static void _test_registry_services(void)
+{
+    pthread_t echo;
+    uint16_t port = _echo_start(&echo);
+    TEST_CHECK(port != 0);
+
+    char guard[32];
+    snprintf(guard, sizeof(guard), "guard %d", TEST_GUARD_MS);
+    const char *extra[] = { guard, NULL };
+    if (port == 0 || !_open(extra))
+    {
+        TEST_CHECK(!"simulator");
+        return;
+    }
+
+    TEST_OK(simcom_state_cache_start());
+    TEST_OK(simcom_mqtt_rx_register(_rx_cb, NULL));
+
+    // Room for two of the four socket handlers
+    int free_entries = _registry_fill();
+    TEST_CHECK(free_entries > 4);
+    _registry_release(2);
+    TEST_ERR(SIM_AT_ERR_NO_MEM, simcom_net_open());
+    TEST_CHECK(_registry_fill() == 2);
+    _registry_release(s_fill_count);
+
+    simcom_socket_stats_t stats;
+    simcom_state_t state;
+    TEST_OK(simcom_net_open());
+    TEST_CHECK(_registry_fill() == free_entries - 4);
+    _registry_release(s_fill_count);
+    TEST_OK(simcom_socket_open(TEST_LINK, SIMCOM_SOCKET_TCP, "127.0.0.1", port, 0));
+    _echo_check(7, 4);
+    TEST_OK(simcom_socket_stats(TEST_LINK, &stats));
+    TEST_CHECK(stats.rx_bytes == 4 * 7 && stats.rx_dropped == 0);
+
+    // Every service still gets its URCs
+    modem_sim_inject(s_sim, "+CSQ: 7,99");
+    for (int ms = 0; ms < TEST_WAIT_MS; ms++)
+    {
+        simcom_state_cache_get(&state);
+        if (state.rssi == 7)
+            break;
+        vTaskDelay(pdMS_TO_TICKS(1));
+    }
+    TEST_CHECK(state.rssi == 7);
+    atomic_store(&s_rx_msgs, 0);
+    TEST_OK(simcom_mqtt_service_start());
+    TEST_OK(simcom_mqtt_client_acquire(0, "test"));
+    TEST_OK(simcom_mqtt_server_connect(0, TEST_BROKER, 60, 1));
+    TEST_OK(simcom_mqtt_subscribe(0, TEST_TOPIC, 1));
+    modem_sim_mqtt_rx(s_sim, 0, TEST_TOPIC, "abcdef");
+    TEST_CHECK(_wait_count(&s_rx_msgs, 1));
+    _echo_check(7, 1);
+
+    TEST_OK(simcom_mqtt_server_disconnect(0, 60));
+    TEST_OK(simcom_mqtt_client_release(0));
+    TEST_OK(simcom_mqtt_service_stop());
+    TEST_OK(simcom_mqtt_rx_register(NULL, NULL));
+    TEST_OK(simcom_socket_close(TEST_LINK));
+    TEST_OK(simcom_net_close());
+    TEST_OK(simcom_state_cache_stop());
+
+    _close();
+    pthread_join(echo, NULL);
+    close(s_echo_fd);
+    s_echo_fd = -1;
+}
+
+int test_registry(int argc, char **argv)
+{
+    s_argc = argc;
+    s_argv = argv;
+
+    _test_registry_full();
+    _test_registry_services();
+    return 0;
+}
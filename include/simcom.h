@@ -12,6 +12,7 @@ extern "C" {
 
 #include "simcom_types.h"
 #include "simcom_config.h"
+#include "simcom_spool.h"
 
 /**
  * -----------------------------------
@@ -23,7 +24,7 @@ simcom_err_t simcom_uart_debug(bool en);
 
 /**
  * @brief Initialize the SIM AT core library.
- * - This function configures UART, creates internal static resources and starts the parser task.
+ * - This function opens the modem link (cfg->transport, the ESP-IDF UART if NULL), creates internal static resources and starts the parser task.
  * - No dynamic allocation is performed for public structures; internal static buffers are allocated inside the implementation.
  *
  * @param cfg Configuration struct pointer
@@ -31,7 +32,7 @@ simcom_err_t simcom_uart_debug(bool en);
  * @return 
  *  - SIM_AT_OK on success.
  *  - SIM_AT_ERR_ABORTED API already initialized
- *  - SIM_AT_ERR_INVALID_ARG on empty config 
+ *  - SIM_AT_ERR_INVALID_ARG on empty config or no transport (host builds)
  *  - SIM_AT_ERR_NO_MEM no memory available
  *  - SIM_AT_ERR_UART error initializing UART
  *  - SIM_AT_ERR_INTERNAL error creating parser task
@@ -51,6 +52,78 @@ simcom_err_t simcom_deinit(void);
 
 simcom_err_t simcom_control_pwrkey(bool state);
 
+/**
+ * -----------------------------------------
+ * ----- [ Core API: URC handlers ] -----
+ * -----------------------------------------
+ */
+
+/**
+ * @brief URC handler. Runs in the URC task, not in the parser: it can block and issue
+ * commands, but while it runs the following URCs wait in the URC queue.
+ *
+ * @param line NUL-terminated URC line (e.g. "+CMQTTCONNLOST: 0,1")
+ * @param len Line length
+ * @param ctx Context given on registration
+ */
+typedef void (*simcom_urc_cb_t)(const char *line, size_t len, void *ctx);
+
+/**
+ * @brief Register a handler for a URC prefix.
+ *
+ * The prefix is the text before ':' (e.g. "+CGEV" or "+CGEV:"), or the whole line for URCs
+ * without parameters (e.g. "PB DONE"). Lines with a registered prefix are delivered to every
+ * handler of the prefix instead of being stored as responses, unless they are the information
+ * responses of the command in flight (e.g. "+CREG: 0,1" while AT+CREG? is running).
+ *
+ * @param prefix URC prefix, up to SIM_AT_URC_PREFIX_LEN characters
+ * @param cb Handler
+ * @param ctx Handler context
+ *
+ * @return
+ *  - SIM_AT_OK on success
+ *  - SIM_AT_ERR_INVALID_ARG empty or too long prefix, or NULL handler
+ *  - SIM_AT_ERR_NO_MEM no free handler entries (SIM_AT_URC_MAX_HANDLERS)
+ */
+simcom_err_t simcom_urc_register(const char *prefix, simcom_urc_cb_t cb, void *ctx);
+
+/**
+ * @brief Unregister a handler registered with simcom_urc_register().
+ *
+ * @return
+ *  - SIM_AT_OK on success
+ *  - SIM_AT_ERR_INVALID_ARG if the handler is not registered
+ */
+simcom_err_t simcom_urc_unregister(const char *prefix, simcom_urc_cb_t cb, void *ctx);
+
+/**
+ * @brief Number of URC lines dropped because the URC queue was full
+ */
+uint32_t simcom_urc_dropped(void);
+
+/**
+ * Transmit counters of the modem link, since simcom_init()
+ */
+typedef struct {
+    uint32_t bytes;             // bytes written
+    uint32_t writes;
+    uint32_t queued;            // bytes written and not transmitted yet, 0 if the transport cannot tell
+    uint32_t queued_peak;       // highest queued seen after a write
+    uint32_t stalls;            // writes that waited for room in the transmit buffer
+    uint64_t stall_us;          // time those writes waited
+} simcom_tx_stats_t;
+
+/**
+ * @brief Read the transmit counters. Stalls grow when the line is slower than the writes or
+ * the modem holds CTS.
+ *
+ * @return
+ *  - SIM_AT_OK on success
+ *  - SIM_AT_ERR_INVALID_ARG
+ *  - SIM_AT_ERR_NOT_INIT
+ */
+simcom_err_t simcom_tx_stats(simcom_tx_stats_t *stats);
+
 
 /* ================================================== */
 /* =============== [ Basic Commands ] =============== */
@@ -60,6 +133,50 @@ simcom_err_t simcom_wait_atready(void);
 simcom_err_t simcom_comm_test(void);
 simcom_err_t simcom_enable_echo(bool enable);
 
+/**
+ * @brief Enable or disable RTS/CTS flow control on the modem side (AT+IFC=2,2 / AT+IFC=0,0).
+ * The local side follows use_hw_flow_control of the configuration; simcom_bringup() sends
+ * this when it is set.
+ *
+ * @returns
+ *  - SIM_AT_OK on success
+ *  - SIM_AT_ERR_RESPONSE if the modem refused it
+ *  - Errors of simcom_cmd_transact()
+ */
+simcom_err_t simcom_set_flow_control(bool enable);
+
+/**
+ * Rates for simcom_baud_negotiate()
+ */
+typedef struct {
+    const uint32_t *rates;              // rates to try, fastest first (e.g. 3000000, 921600, 460800)
+    size_t rate_count;
+    uint32_t last_rate;                 // rate chosen last time (0 for none), tried first to find the modem
+} simcom_baud_config_t;
+
+/**
+ * @brief Move the modem (AT+IPR) and the local UART to the fastest rate of the list that
+ * carries an AT round trip.
+ *
+ * The modem is first looked for at last_rate, at the rate in use and at the rates of the list:
+ * the MCU may have restarted with the modem still at a faster rate. Then each faster rate of
+ * the list is tried in order: AT+IPR, switch of the local UART and AT. If the modem does not
+ * answer at the new rate the link falls back to the previous one and the next rate is tried.
+ * A rate the local UART does not support is skipped before the modem is told.
+ *
+ * AT+IPR lasts until the modem restarts, which brings it back to its default rate. Keep the
+ * chosen rate across MCU restarts (e.g. NVS or RTC memory) and pass it as last_rate.
+ *
+ * @param cfg Rates
+ * @param baud_rate Rate in use at the end (may be NULL)
+ *
+ * @returns
+ *  - SIM_AT_OK if the modem answers, at the fastest rate possible
+ *  - SIM_AT_ERR_INVALID_ARG
+ *  - SIMCOM_ERR_TIMEOUT if the modem was not found at any rate; it must be reset
+ */
+simcom_err_t simcom_baud_negotiate(const simcom_baud_config_t *cfg, uint32_t *baud_rate);
+
 /* ================================================== */
 /* =============== [ Status Control ] =============== */
 /* ================================================== */
@@ -69,7 +186,7 @@ simcom_err_t simcom_enable_echo(bool enable);
  * 
  * [x] AT+CFUN      = Set phone functionality
  * [x] AT+CSQ       = Query signal quality
- * [ ] AT+AUTOCSQ   = Set CSQ report
+ * [x] AT+AUTOCSQ   = Set CSQ report
  * [ ] AT+CSQDELTA  = Set RSSI delta change threshold
  * [x] AT+CPOF      = Power down the module
  * [x] AT+CRESET    = Reset the module
@@ -174,10 +291,13 @@ simcom_err_t simcom_power_down_module(void);
  */
 simcom_err_t simcom_reset_module(void);
 
+// RTC time string length, "yy/MM/dd,hh:mm:ss±zz" plus NUL
+#define SIMCOM_RTC_TIME_LEN     21
+
 /**
  * @brief Get current RTC time in the "yy/MM/dd,hh:mm:ss±zz" format
- * 
- * @param rtc_time String where the RTC time will be stored
+ *
+ * @param rtc_time String where the RTC time will be stored, at least SIMCOM_RTC_TIME_LEN long
  * 
  * @return SIM_AT_OK if succeded, Error Code if failed
  */
@@ -249,7 +369,7 @@ const char* simcom_net_stat_to_str(sim_network_registration_stat_t stat);
  * [ ] AT+CGDATA        = Enter data state
  * [x] AT+CGPADDR       = Show PDP address
  * [ ] AT+CGCLASS       = GPRS mobile station class
- * [ ] AT+CGEREP        = GPRS event reporting
+ * [x] AT+CGEREP        = GPRS event reporting
  * [ ] AT+CGAUTH        = Set type of authentication for PDP-IP connections of GPRS
  * [x] AT+CPING         = Ping destination address
  * 
@@ -299,6 +419,25 @@ simcom_err_t simcom_get_packet_domain_attach(int* state);
  */
 simcom_err_t simcom_set_packet_domain_attach(int state);
 
+// PDP address string length, an IPv6 address in dotted decimal format plus NUL
+#define SIMCOM_PDP_ADDR_LEN     64
+
+// APN string length, plus NUL
+#define SIMCOM_PDP_APN_LEN      100
+
+/**
+ * A PDP context, as listed by the AT+CGDCONT?, AT+CGACT? and AT+CGPADDR queries. Each
+ * query fills its own fields, the others are left empty.
+ */
+typedef struct {
+    int cid;                            // context identifier (1-15)
+    int state;                          // AT+CGACT?: 0 deactivated, 1 activated, -1 not read
+    sim_pdp_type_t pdp_type;            // AT+CGDCONT?
+    char apn[SIMCOM_PDP_APN_LEN];       // AT+CGDCONT?
+    char ipv4[SIMCOM_PDP_ADDR_LEN];     // AT+CGPADDR, "" if none
+    char ipv6[SIMCOM_PDP_ADDR_LEN];     // AT+CGPADDR in dotted decimal format, "" if none
+} simcom_pdp_context_t;
+
 /**
  * @brief Gets the state of a particular PDP context.
  * A PDP (Packet Data Protocol) context is a data structure in mobile networks that defines a user’s session 
@@ -306,6 +445,8 @@ simcom_err_t simcom_set_packet_domain_attach(int state);
  * and routing information. When a PDP context is activated, it establishes a logical connection between the user’s 
  * device and the network’s gateway, enabling internet or data access.
  * 
+ * Only the first context listed is returned, see simcom_get_pdp_context_activate_list().
+ * 
  * @param cid A numeric parameter which specifies a particular PDP context definition
  * @param state Indicates the state of PDP context activation
  *  - 0 deactivated
@@ -315,6 +456,22 @@ simcom_err_t simcom_set_packet_domain_attach(int state);
  */
 simcom_err_t simcom_get_pdp_context_activate(int* cid, int* state);
 
+/**
+ * @brief Gets the state of every defined PDP context (AT+CGACT?), read in a single pass up to
+ * the final OK. Fills cid and state of each entry.
+ *
+ * @param contexts Array for the contexts
+ * @param max Entries of the array
+ * @param count Number of entries filled
+ *
+ * @returns
+ *  - SIM_AT_OK if succeded
+ *  - SIM_AT_ERR_INVALID_ARG
+ *  - SIM_AT_ERR_OVERFLOW if the modem listed more than max contexts, the first max are filled
+ *  - Error Code if failed
+ */
+simcom_err_t simcom_get_pdp_context_activate_list(simcom_pdp_context_t *contexts, size_t max, size_t *count);
+
 /**
  * @brief Sets the state of a particular PDP context.
  * A PDP (Packet Data Protocol) context is a data structure in mobile networks that defines a user’s session 
@@ -332,13 +489,16 @@ simcom_err_t simcom_get_pdp_context_activate(int* cid, int* state);
 simcom_err_t simcom_set_pdp_context_activate(int cid, int state);
 
 /**
- * @brief Get the specified PDP context parameter values for a PDP context identified by the (local)context 
- * identification parameter.
- * Just logs the result in the console.
+ * @brief Get the parameter values of every defined PDP context (AT+CGDCONT?), read in a single
+ * pass up to the final OK. Fills cid, pdp_type and apn of each entry.
+ *
+ * @param contexts Array for the contexts
+ * @param max Entries of the array
+ * @param count Number of entries filled
  * 
- * @returns SIM_AT_OK if succeded, Error Code if failed
+ * @returns Same as simcom_get_pdp_context_activate_list()
  */
-simcom_err_t simcom_get_pdp_context(void);
+simcom_err_t simcom_get_pdp_context(simcom_pdp_context_t *contexts, size_t max, size_t *count);
 
 /**
  * @brief Specifies PDP context parameter values for a PDP context identified by the (local)context 
@@ -362,24 +522,87 @@ simcom_err_t simcom_set_pdp_context(int cid, sim_pdp_type_t pdp_type, const char
 const char* simcom_pdp_type_to_str(sim_pdp_type_t pdp_type);
 
 /**
- * @brief Returns a list of PDP addresses for the specified context identifiers
- * 
+ * @brief Returns the PDP address of the first context listed, see simcom_show_pdp_addr_list()
+ *
  * @param cid A numeric parameter which specifies a particular PDP context definition
- * @param addr A string that identifies the MT in the address space applicable to the PDP
+ * @param addr A string that identifies the MT in the address space applicable to the PDP,
+ *             at least SIMCOM_PDP_ADDR_LEN long
  * 
  * @return SIM_AT_OK if succeded, Error Code if failed 
  */
 simcom_err_t simcom_show_pdp_addr(int* cid, char* addr);
 
 /**
- * @brief Ping destination address.
+ * @brief Returns the addresses of every defined PDP context (AT+CGPADDR), read in a single
+ * pass up to the final OK. Fills cid, ipv4 and ipv6 of each entry.
+ *
+ * @param contexts Array for the contexts
+ * @param max Entries of the array
+ * @param count Number of entries filled
+ *
+ * @returns Same as simcom_get_pdp_context_activate_list()
+ */
+simcom_err_t simcom_show_pdp_addr_list(simcom_pdp_context_t *contexts, size_t max, size_t *count);
+
+/**
+ * @brief Every defined PDP context with all its fields: AT+CGDCONT?, AT+CGACT? and
+ * AT+CGPADDR, merged by cid
+ *
+ * @param contexts Array for the contexts
+ * @param max Entries of the array
+ * @param count Number of entries filled
+ *
+ * @returns Same as simcom_get_pdp_context_activate_list()
+ */
+simcom_err_t simcom_get_pdp_contexts(simcom_pdp_context_t *contexts, size_t max, size_t *count);
+
+/**
+ * @brief Ping destination address. Waits for the summary the modem sends after the echoes,
+ * the link being free for other commands in the meantime.
  * 
  * @param dest_addr The destination is to be pinged; it can be an IP address or a domain name.
  * 
- * @return SIM_AT_OK if succeded, Error Code if failed 
+ * @return SIM_AT_OK if the summary was received, Error Code if failed 
  */
 simcom_err_t simcom_ping(const char* dest_addr);
 
+/**
+ * Summary of a ping ("+CPING: 3,...").
+ */
+typedef struct {
+    int sent;                   // echo requests sent
+    int received;               // echo replies received
+    int lost;                   // echo requests lost
+    int min_rtt;                // round trip times in ms
+    int max_rtt;
+    int avg_rtt;
+} simcom_ping_result_t;
+
+/**
+ * @brief Completion callback of simcom_ping_async(). Runs in the parser task: it must not
+ * block nor issue synchronous commands.
+ *
+ * @param err SIM_AT_OK if the summary was received, Error Code if failed
+ * @param result Ping summary, zeroed on error
+ * @param ctx Callback context
+ */
+typedef void (*simcom_ping_cb_t)(simcom_err_t err, const simcom_ping_result_t *result, void *ctx);
+
+/**
+ * @brief Starts a ping and returns, the summary completes it through the callback. One ping
+ * at a time.
+ *
+ * @param dest_addr The destination is to be pinged; it can be an IP address or a domain name.
+ * @param cb Completion callback (may be NULL)
+ * @param ctx Callback context
+ *
+ * @returns
+ *  - SIM_AT_OK if the ping was queued
+ *  - SIM_AT_ERR_INVALID_ARG
+ *  - SIM_AT_ERR_BUSY if a ping is in progress or every command slot is in use
+ */
+simcom_err_t simcom_ping_async(const char* dest_addr, simcom_ping_cb_t cb, void* ctx);
+
 
 /* ============================================ */
 /* =============== [ SIM Card ] =============== */
@@ -500,12 +723,40 @@ simcom_err_t simcom_ntp_config_get(void);
 simcom_err_t simcom_ntp_config_set(const char* host, int timezone);
 
 /**
- * @brief Updates the local system time with the configured NTP server configuration
+ * @brief Updates the local system time with the configured NTP server configuration. Waits
+ * for the +CNTP result the modem sends after the OK, the link being free for other commands
+ * in the meantime.
  * 
- * @returns SIM_AT_OK if succeded, Error Code if failed
+ * @param ntp_err Error code of the update reported by the modem
+ *
+ * @returns SIM_AT_OK if the result was received, Error Code if failed (SIMCOM_ERR_TIMEOUT if
+ * it did not arrive in SIM_NTP_RESULT_TIMEOUT_MS)
  */
 simcom_err_t simcom_ntp_sys_time_update(sim_at_ntp_err_code_t* ntp_err);
 
+/**
+ * @brief Completion callback of simcom_ntp_sys_time_update_async(). Runs in the parser task: it
+ * must not block nor issue synchronous commands.
+ *
+ * @param err SIM_AT_OK if the result was received, Error Code if failed
+ * @param ntp_err Error code of the update reported by the modem
+ * @param ctx Callback context
+ */
+typedef void (*simcom_ntp_cb_t)(simcom_err_t err, sim_at_ntp_err_code_t ntp_err, void *ctx);
+
+/**
+ * @brief Starts a time update and returns, the +CNTP result completes it through the callback.
+ * One update at a time.
+ *
+ * @param cb Completion callback (may be NULL)
+ * @param ctx Callback context
+ *
+ * @returns
+ *  - SIM_AT_OK if the update was queued
+ *  - SIM_AT_ERR_BUSY if an update is in progress or every command slot is in use
+ */
+simcom_err_t simcom_ntp_sys_time_update_async(simcom_ntp_cb_t cb, void* ctx);
+
 
 /* ================================================= */
 /* =============== [ MQTT commands ] =============== */
@@ -527,9 +778,9 @@ simcom_err_t simcom_ntp_sys_time_update(sim_at_ntp_err_code_t* ntp_err);
  * [x] AT+CMQTTPAYLOAD       = Input the publish message
  * [x] AT+CMQTTPUB           = Publish a message to server
  * [ ] AT+CMQTTSUBTOPIC      = Input the topic of subscribe message
- * [ ] AT+CMQTTSUB           = Subscribe a message to server
+ * [x] AT+CMQTTSUB           = Subscribe a message to server
  * [ ] AT+CMQTTUNSUBTOPIC    = Input the topic of unsubscribe message
- * [ ] AT+CMQTTUNSUB         = Unsubscribe a message to server
+ * [x] AT+CMQTTUNSUB         = Unsubscribe a message to server
  * [ ] AT+CMQTTCFG           = Configure the MQTT Context 
  * 
  */
@@ -547,7 +798,7 @@ simcom_err_t simcom_ntp_sys_time_update(sim_at_ntp_err_code_t* ntp_err);
   * @brief Start MQTT service by activating PDP context. This command must be executed before any other 
   * MQTT related operations.
   * 
-  * @returns SIM_AT_OK if succeded, Error Code if failed
+  * @returns SIM_AT_OK if succeded or already started, Error Code if failed
   */
  simcom_err_t simcom_mqtt_service_start(void);
 
@@ -593,6 +844,34 @@ simcom_err_t simcom_mqtt_client_release(int client_index);
  */
 simcom_err_t simcom_mqtt_server_connect(int client_index, const char* server_addr, int keepalive_time, int clean_session);
 
+/**
+ * @brief Completion callback of the asynchronous MQTT requests. Runs in the parser task: it
+ * must not block nor issue synchronous commands, but it can start the next request.
+ *
+ * @param client_index Client of the request
+ * @param err SIM_AT_OK once the modem reported the request done, SIM_AT_ERR_RESPONSE if it
+ * refused it, or the error of the command that failed (e.g. SIMCOM_ERR_TIMEOUT)
+ * @param mqtt_err MQTT error code reported by the modem, SIM_MQTT_OK if none
+ * @param ctx Context given with the request
+ */
+typedef void (*simcom_mqtt_cb_t)(int client_index, simcom_err_t err, int mqtt_err, void *ctx);
+
+/**
+ * @brief Connect to a MQTT server without waiting for the result. The link is free for other
+ * commands once the modem accepted the command; the +CMQTTCONNECT result completes the
+ * request through the callback. One asynchronous request per client at a time.
+ *
+ * @param cb Completion callback (may be NULL)
+ * @param ctx Callback context
+ *
+ * @returns
+ *  - SIM_AT_OK if the request was queued, the result comes through the callback
+ *  - SIM_AT_ERR_INVALID_ARG (same ranges as simcom_mqtt_server_connect())
+ *  - SIM_AT_ERR_BUSY if a request of the client is in progress or every command slot is in use
+ */
+simcom_err_t simcom_mqtt_server_connect_async(int client_index, const char* server_addr, int keepalive_time, int clean_session,
+                                              simcom_mqtt_cb_t cb, void* ctx);
+
 /**
  * @brief Disconnects from the server.
  * 
@@ -627,6 +906,31 @@ simcom_err_t simcom_mqtt_topic_set(int client_index, const char* topic);
  */
 simcom_err_t simcom_mqtt_payload_set(int client_index, const char* payload);
 
+/**
+ * @brief Input the message body of a publish message from a buffer. The bytes are written to the
+ * modem straight from the buffer after the '>' prompt, so the payload can be binary.
+ * 
+ * @param client_index A numeric parameter that identifies a client. The range of permitted values is 0 to 1.
+ * @param data Message body
+ * @param len Message length. The range is from 1 to 10240 bytes.
+ * 
+ * @returns SIM_AT_OK if succeded, Error Code if failed
+ */
+simcom_err_t simcom_mqtt_payload_set_buf(int client_index, const void* data, size_t len);
+
+/**
+ * @brief Input the message body of a publish message gathered from several buffers (e.g. a
+ * header and a sensor frame), written in order with no intermediate copy.
+ * 
+ * @param client_index A numeric parameter that identifies a client. The range of permitted values is 0 to 1.
+ * @param iov Message body buffers
+ * @param iov_count Number of buffers
+ * The total length range is from 1 to 10240 bytes.
+ * 
+ * @returns SIM_AT_OK if succeded, Error Code if failed
+ */
+simcom_err_t simcom_mqtt_payload_set_iov(int client_index, const simcom_iov_t* iov, size_t iov_count);
+
 /**
  * @brief Publish a message to MQTT server.
  * 
@@ -641,6 +945,696 @@ simcom_err_t simcom_mqtt_payload_set(int client_index, const char* payload);
  */
 simcom_err_t simcom_mqtt_publish(int client_index, int qos, int pub_timeout);
 
+/**
+ * @brief Publish the topic and payload set on the client without waiting for the result. The
+ * link is free for other commands once the modem accepted the command; the +CMQTTPUB result
+ * completes the request through the callback. One asynchronous request per client at a time.
+ *
+ * @param cb Completion callback (may be NULL)
+ * @param ctx Callback context
+ *
+ * @returns
+ *  - SIM_AT_OK if the request was queued, the result comes through the callback
+ *  - SIM_AT_ERR_INVALID_ARG (same ranges as simcom_mqtt_publish())
+ *  - SIM_AT_ERR_BUSY if a request of the client is in progress or every command slot is in use
+ */
+simcom_err_t simcom_mqtt_publish_async(int client_index, int qos, int pub_timeout, simcom_mqtt_cb_t cb, void* ctx);
+
+/**
+ * @brief Completion callback of simcom_mqtt_publish_msg_async(), see simcom_mqtt_cb_t
+ */
+typedef simcom_mqtt_cb_t simcom_mqtt_pub_cb_t;
+
+/**
+ * @brief Publish a message in one transaction: topic input, payload input and publish.
+ *
+ * The three commands are queued at once and driven by the parser: each '>' prompt is answered
+ * with the data as soon as it arrives and each OK writes the next command, so the caller is
+ * not involved between steps. The link is free for other commands while the +CMQTTPUB
+ * result is awaited. A failed step aborts the following ones. Do not mix it with
+ * simcom_mqtt_topic_set()/simcom_mqtt_payload_set()/simcom_mqtt_publish() on the same client
+ * while a message is in progress.
+ *
+ * @param client_index A numeric parameter that identifies a client. The range of permitted values is 0 to 1.
+ * @param topic Publish message topic. The range is from 1 to 1024 bytes.
+ * @param payload Message body, written as is (may be binary). Must stay valid until the callback.
+ * @param len Message length. The range is from 0 to 10240 bytes.
+ * @param qos The publish message’s qos. The range is from 0 to 2.
+ * @param pub_timeout The publishing timeout interval value. The range is from 1s to 180s.
+ * @param cb Completion callback (may be NULL)
+ * @param ctx Callback context
+ *
+ * @returns
+ *  - SIM_AT_OK if the message was queued, the result comes through the callback
+ *  - SIM_AT_ERR_INVALID_ARG
+ *  - SIM_AT_ERR_BUSY if a request of the client is in progress or there are not enough free command slots
+ */
+simcom_err_t simcom_mqtt_publish_msg_async(int client_index, const char* topic, const void* payload, size_t len,
+                                           int qos, int pub_timeout, simcom_mqtt_pub_cb_t cb, void* ctx);
+
+/**
+ * @brief Publish a message in one transaction and wait for the +CMQTTPUB result. Same as
+ * simcom_mqtt_publish_msg_async(), do not call from a completion callback.
+ *
+ * @returns SIM_AT_OK if succeded, Error Code if failed
+ */
+simcom_err_t simcom_mqtt_publish_msg(int client_index, const char* topic, const void* payload, size_t len,
+                                     int qos, int pub_timeout);
+
+/**
+ * @brief Set the outbound queue of a client (simcom_mqtt_enqueue()).
+ *
+ * The window is also bounded by the command slots (SIM_AT_MAX_PENDING_COMMANDS): a message
+ * waiting for its +CMQTTPUB result holds one and a message being written needs up to three,
+ * raise it with the window.
+ *
+ * @param client_index A numeric parameter that identifies a client (0-1)
+ * @param window Messages in flight, written before the results of the previous ones (1 to SIM_MQTT_QUEUE_LEN, default 2)
+ * @param retries Times a failed message is published again before it is reported (0-255, default 2)
+ *
+ * @returns SIM_AT_OK if succeded, SIM_AT_ERR_INVALID_ARG
+ */
+simcom_err_t simcom_mqtt_queue_config(int client_index, int window, int retries);
+
+/**
+ * @brief Queue a message for publishing and return at once.
+ *
+ * The messages of a client are published in order, up to the queue window in flight: the next
+ * one is written as soon as the modem takes the previous one, while QoS 1/2 messages wait for
+ * their +CMQTTPUB results. A failed message is retried first, so it may end up after later
+ * ones. Can be called from completion and receive callbacks. Do not mix it with the other
+ * publish calls on the same client while messages are queued.
+ *
+ * @param client_index A numeric parameter that identifies a client. The range of permitted values is 0 to 1.
+ * @param topic Publish message topic (1-1024 bytes). Must stay valid until the callback.
+ * @param payload Message body, written as is (may be binary). Must stay valid until the callback.
+ * @param len Message length. The range is from 0 to 10240 bytes.
+ * @param qos The publish message’s qos. The range is from 0 to 2.
+ * @param pub_timeout The publishing timeout interval value. The range is from 1s to 180s.
+ * @param cb Completion callback of the message (may be NULL), called once after its retries
+ * @param ctx Callback context
+ *
+ * @returns
+ *  - SIM_AT_OK if the message was queued, the result comes through the callback
+ *  - SIM_AT_ERR_INVALID_ARG
+ *  - SIM_AT_ERR_BUSY if the queue of the client is full (SIM_MQTT_QUEUE_LEN messages)
+ */
+simcom_err_t simcom_mqtt_enqueue(int client_index, const char* topic, const void* payload, size_t len,
+                                 int qos, int pub_timeout, simcom_mqtt_cb_t cb, void* ctx);
+
+/**
+ * @brief Messages of a client in the outbound queue, waiting or in flight
+ */
+int simcom_mqtt_queue_pending(int client_index);
+
+/**
+ * Framing of the records of a coalesced publish.
+ */
+typedef enum {
+    SIMCOM_MQTT_FRAME_NEWLINE = 0,      // each record followed by '\n' (text records without line feeds)
+    SIMCOM_MQTT_FRAME_LEN16,            // each record after its length, 2 bytes big-endian (binary records)
+} simcom_mqtt_framing_t;
+
+/**
+ * Coalesced topic, see simcom_mqtt_coalesce_open()
+ */
+typedef struct {
+    int client_index;                   // 0-1
+    const char *topic;                  // 1-1024 bytes, must stay valid while open
+    int qos;                            // 0-2
+    simcom_mqtt_framing_t framing;
+    size_t flush_size;                  // publish once the buffer holds this many bytes, 0 for SIM_MQTT_COALESCE_SIZE
+    uint32_t max_age_ms;                // publish this long after the first record of the buffer, 0 for never
+    simcom_mqtt_cb_t cb;                // outcome of each publish (may be NULL)
+    void *ctx;
+} simcom_mqtt_coalesce_config_t;
+
+/**
+ * Counters of a coalesced topic
+ */
+typedef struct {
+    uint32_t records;                   // records added
+    uint32_t publishes;                 // successful publishes
+    uint32_t bytes;                     // payload bytes of those publishes, framing included
+    uint32_t bytes_per_publish;
+    uint32_t records_per_publish;
+    uint32_t failed;                    // records lost in failed publishes
+} simcom_mqtt_coalesce_stats_t;
+
+/**
+ * @brief Open a coalesced topic: small records are collected and published together, so a
+ * publish (three AT commands and a broker round trip) carries many of them.
+ *
+ * Each topic has two buffers of SIM_MQTT_COALESCE_SIZE bytes: one collects records while the
+ * other is published through simcom_mqtt_enqueue(). A buffer is published when it reaches
+ * flush_size, max_age_ms after its first record, or on simcom_mqtt_coalesce_flush(). At most
+ * SIM_MQTT_COALESCE_TOPICS topics are open at the same time.
+ *
+ * @param cfg Topic configuration, copied
+ * @param handle Handle of the topic
+ *
+ * @returns
+ *  - SIM_AT_OK if succeded
+ *  - SIM_AT_ERR_INVALID_ARG
+ *  - SIM_AT_ERR_BUSY if every topic is in use
+ */
+simcom_err_t simcom_mqtt_coalesce_open(const simcom_mqtt_coalesce_config_t *cfg, int *handle);
+
+/**
+ * @brief Add a record to a coalesced topic. The data is copied. Can be called from
+ * completion and receive callbacks.
+ *
+ * @param handle Topic handle
+ * @param data Record
+ * @param len Record length; with its framing, up to SIM_MQTT_COALESCE_SIZE bytes
+ *
+ * @returns
+ *  - SIM_AT_OK if the record was added
+ *  - SIM_AT_ERR_INVALID_ARG
+ *  - SIM_AT_ERR_BUSY if both buffers are waiting to be published, the record was not added
+ */
+simcom_err_t simcom_mqtt_coalesce_add(int handle, const void *data, size_t len);
+
+/**
+ * @brief Publish the records collected so far
+ *
+ * @returns SIM_AT_OK if queued (or nothing to publish), SIM_AT_ERR_BUSY if the outbound queue
+ * is full (published later on its own), SIM_AT_ERR_INVALID_ARG
+ */
+simcom_err_t simcom_mqtt_coalesce_flush(int handle);
+
+/**
+ * @brief Publish the records left and close the topic; it is freed once they are reported.
+ *
+ * @returns SIM_AT_OK, SIM_AT_ERR_BUSY if the outbound queue is full (call again), SIM_AT_ERR_INVALID_ARG
+ */
+simcom_err_t simcom_mqtt_coalesce_close(int handle);
+
+/**
+ * @brief Counters of a coalesced topic, with the bytes and records carried by each publish
+ */
+simcom_err_t simcom_mqtt_coalesce_get_stats(int handle, simcom_mqtt_coalesce_stats_t *stats);
+
+/**
+ * @brief Subscribe to a topic. The topic goes in the command (AT+CMQTTSUB=<client>,<len>,<qos>),
+ * the call returns on the +CMQTTSUB result. Messages are delivered to the callback of
+ * simcom_mqtt_rx_register().
+ *
+ * @param client_index A numeric parameter that identifies a client (0-1)
+ * @param topic Topic filter (1-1024 bytes)
+ * @param qos Quality of service (0-2)
+ *
+ * @returns SIM_AT_OK if succeded, Error Code if failed
+ */
+simcom_err_t simcom_mqtt_subscribe(int client_index, const char* topic, int qos);
+
+/**
+ * @brief Unsubscribe from a topic, returns on the +CMQTTUNSUB result.
+ *
+ * @param client_index A numeric parameter that identifies a client (0-1)
+ * @param topic Topic filter given to simcom_mqtt_subscribe()
+ *
+ * @returns SIM_AT_OK if succeded, Error Code if failed
+ */
+simcom_err_t simcom_mqtt_unsubscribe(int client_index, const char* topic);
+
+/**
+ * Part of an incoming message. A message that fits in one receive block (SIM_MQTT_RX_BLOCK_SIZE,
+ * topic and payload plus their terminators) comes in a single part; a bigger one comes in
+ * parts of up to one block, in order, the last one with last set.
+ */
+typedef struct {
+    int client_index;
+    const char *topic;          // NUL-terminated topic
+    size_t topic_len;
+    const uint8_t *payload;     // payload bytes of this part, NUL-terminated for single parts
+    size_t len;                 // bytes of this part
+    size_t offset;              // position of this part in the payload
+    size_t total_len;           // payload length announced by the modem
+    bool last;                  // last part of the message
+    bool truncated;             // payload bytes were lost so far (slow callback, RX overflow)
+} simcom_mqtt_msg_t;
+
+/**
+ * @brief Receive callback. Runs in the URC task, like the URC handlers; the message memory is
+ * only valid until it returns. While it runs, the parser keeps filling the free receive
+ * blocks, parts that find none are lost.
+ */
+typedef void (*simcom_mqtt_rx_cb_t)(const simcom_mqtt_msg_t *msg, void *ctx);
+
+/**
+ * @brief Set the callback of the incoming messages (+CMQTTRXSTART ... +CMQTTRXEND blocks) of
+ * both clients. The messages are read straight into a static pool of SIM_MQTT_RX_BLOCKS blocks,
+ * large payloads are never held whole.
+ *
+ * @param cb Callback, NULL to drop the messages
+ * @param ctx Callback context
+ *
+ * @return
+ *  - SIM_AT_OK on success
+ *  - SIM_AT_ERR_NO_MEM no free URC handler entries
+ */
+simcom_err_t simcom_mqtt_rx_register(simcom_mqtt_rx_cb_t cb, void *ctx);
+
+/**
+ * @brief Number of incoming messages or message parts dropped for lack of receive blocks or
+ * URC queue space
+ */
+uint32_t simcom_mqtt_rx_dropped(void);
+
+
+/* ================================================== */
+/* =============== [ TCP/IP sockets ] =============== */
+/* ================================================== */
+
+/**
+ * [--- List of available commands ---]
+ * 
+ * [x] AT+NETOPEN            = Start socket service
+ * [x] AT+NETCLOSE           = Stop socket service
+ * [x] AT+CIPOPEN            = Establish connection in multi-socket mode
+ * [x] AT+CIPSEND            = Send data through TCP or UDP connection
+ * [x] AT+CIPRXGET           = Set the mode to retrieve data
+ * [x] AT+CIPCLOSE           = Close TCP or UDP socket
+ * [x] AT+CIPMODE            = Select TCP/IP application mode (transparent mode)
+ * [x] ATO                   = Switch from command mode to data mode
+ * [ ] AT+CIPHEAD            = Add an IP head when receiving data
+ * [ ] AT+CIPSRIP            = Show remote IP address and port
+ * [ ] AT+SERVERSTART        = Startup TCP server
+ * 
+ */
+
+/**
+ * Socket protocol
+ */
+typedef enum {
+    SIMCOM_SOCKET_TCP = 0,
+    SIMCOM_SOCKET_UDP,
+} simcom_socket_type_t;
+
+/**
+ * Counters of a link, reset when it is opened
+ */
+typedef struct {
+    uint32_t tx_bytes;                  // bytes the modem confirmed sent
+    uint32_t rx_bytes;                  // bytes stored in the receive ring
+    uint32_t rx_dropped;                // bytes lost: ring full (push mode) or input lost
+    uint32_t sends;                     // AT+CIPSEND commands, sends of a transparent link
+    uint32_t reads;                     // AT+CIPRXGET=2 commands
+} simcom_socket_stats_t;
+
+/**
+ * @brief Parse the socket error codes to string
+ * 
+ * @param err socket error code
+ * 
+ * @return A string with the status code description
+ */
+const char* simcom_socket_err_to_str(sim_socket_err_codes_t err);
+
+/**
+ * @brief Start the socket service of the modem (AT+NETOPEN) on the active PDP context. Received
+ * data is kept by the modem until simcom_socket_recv() asks for it (AT+CIPRXGET=1), unless the
+ * library is built with SIM_SOCKET_RX_MANUAL 0.
+ * 
+ * @returns SIM_AT_OK if succeded or already started, Error Code if failed
+ */
+simcom_err_t simcom_net_open(void);
+
+/**
+ * @brief Start the socket service in transparent mode (AT+CIPMODE=1, then AT+NETOPEN). Link 0
+ * is then the only one, TCP, and carries raw data after its CONNECT: no AT+CIPSEND or
+ * AT+CIPRXGET per chunk, and the parser hands every received byte to the receive ring. While
+ * the link is in data mode the modem takes no commands on its channel, other tasks' commands
+ * wait until simcom_socket_escape().
+ *
+ * The mode is only taken while the network is closed: call simcom_net_close() first to switch.
+ *
+ * @returns SIM_AT_OK if succeded or already started, Error Code if failed
+ */
+simcom_err_t simcom_net_open_transparent(void);
+
+/**
+ * @brief Stop the socket service, every link is closed with it
+ * 
+ * @returns SIM_AT_OK if succeded, Error Code if failed
+ */
+simcom_err_t simcom_net_close(void);
+
+/**
+ * @brief Open a link and wait for the connection.
+ * 
+ * @param link Link id, from 0 to 9
+ * @param type SIMCOM_SOCKET_TCP to connect to host:port, SIMCOM_SOCKET_UDP to bind local_port
+ * and send to host:port
+ * @param host Server name or IP address, up to 63 bytes
+ * @param port Server port
+ * @param local_port Local UDP port, unused for TCP
+ * 
+ * @returns
+ *  - SIM_AT_OK if connected
+ *  - SIM_AT_ERR_INVALID_ARG
+ *  - SIM_AT_ERR_NOT_INIT if simcom_net_open() was not called
+ *  - SIM_AT_ERR_BUSY if the link is open
+ *  - SIM_AT_ERR_RESPONSE if the modem refused it (the error code is logged, CONNECT FAIL in
+ *    transparent mode)
+ */
+simcom_err_t simcom_socket_open(int link, simcom_socket_type_t type, const char *host, uint16_t port, uint16_t local_port);
+
+/**
+ * @brief Close a link. The data left in its receive ring is discarded. A transparent link leaves
+ * data mode first ("+++" with the default guard time).
+ * 
+ * @returns SIM_AT_OK if succeded or already closed by the peer, Error Code if failed
+ */
+simcom_err_t simcom_socket_close(int link);
+
+/**
+ * @brief Send data on a link and wait until the modem confirmed all of it (blocking - do not
+ * call from ISR).
+ * 
+ * The buffers are written to the modem straight from the caller memory, in AT+CIPSEND commands
+ * of up to 1500 bytes; a few of them are queued at once so the modem works on one while the
+ * next is written. One send per link at a time.
+ *
+ * A transparent link in data mode writes the buffers as they are and returns once they are in
+ * the transmit buffer: TCP confirms them, there is no per-send report.
+ * 
+ * @param link Link id
+ * @param iov Data buffers, binary-safe
+ * @param iov_count Number of buffers
+ * 
+ * @returns
+ *  - SIM_AT_OK once every byte was confirmed
+ *  - SIM_AT_ERR_INVALID_ARG if the link is not open
+ *  - SIM_AT_ERR_RESPONSE if the modem refused or did not send some of it (e.g. link closed)
+ *  - The error of the failed command otherwise (e.g. SIMCOM_ERR_TIMEOUT)
+ *  - SIM_AT_ERR_INVALID_ARG or SIM_AT_ERR_BUSY for a transparent link out of data mode or
+ *    leaving it, see simcom_data_mode_write()
+ */
+simcom_err_t simcom_socket_sendv(int link, const simcom_iov_t *iov, size_t iov_count);
+
+/**
+ * @brief simcom_socket_sendv() of a single buffer
+ */
+simcom_err_t simcom_socket_send(int link, const void *data, size_t len);
+
+/**
+ * @brief Receive data from a link (blocking - do not call from ISR).
+ * 
+ * Returns what the receive ring holds, up to size bytes. With the ring empty and data waiting
+ * in the modem it is read with AT+CIPRXGET=2, as much as the ring has room for; otherwise the
+ * call waits for data. One reader per link at a time.
+ * 
+ * @param link Link id
+ * @param buf Destination
+ * @param size Destination size
+ * @param len Bytes received, 0 once the peer closed the connection and every byte was read
+ * @param timeout_ms How long to wait for data
+ * 
+ * @returns
+ *  - SIM_AT_OK with data, or at the end of the stream (*len 0)
+ *  - SIM_AT_ERR_INVALID_ARG if the link is not open
+ *  - SIMCOM_ERR_TIMEOUT if nothing arrived in time
+ *  - The error of the AT+CIPRXGET command otherwise
+ */
+simcom_err_t simcom_socket_recv(int link, void *buf, size_t size, size_t *len, uint32_t timeout_ms);
+
+/**
+ * @brief Take a transparent link out of data mode ("+++" between two guard times) to send
+ * commands, the connection stays open. Received data is kept by the modem until
+ * simcom_socket_resume().
+ *
+ * @param link Link id
+ * @param guard_ms Guard time of the modem (AT+CIPCCFG), 0 for SIM_AT_ESCAPE_GUARD_MS
+ *
+ * @returns
+ *  - SIM_AT_OK in command mode
+ *  - SIM_AT_ERR_INVALID_ARG if the link is not an open transparent link
+ *  - The error of simcom_data_mode_escape() otherwise
+ */
+simcom_err_t simcom_socket_escape(int link, uint32_t guard_ms);
+
+/**
+ * @brief Return a transparent link to data mode (ATO)
+ *
+ * @returns
+ *  - SIM_AT_OK in data mode
+ *  - SIM_AT_ERR_INVALID_ARG if the link is not an open transparent link
+ *  - SIM_AT_ERR_RESPONSE if the connection is gone
+ */
+simcom_err_t simcom_socket_resume(int link);
+
+/**
+ * @brief Read the counters of a link
+ * 
+ * @returns SIM_AT_OK, SIM_AT_ERR_INVALID_ARG if the link id is out of range
+ */
+simcom_err_t simcom_socket_stats(int link, simcom_socket_stats_t *stats);
+
+
+/* ============================================== */
+/* =============== [ Bring-up ] ================= */
+/* ============================================== */
+
+/**
+ * Phases of simcom_bringup(), in order
+ */
+typedef enum {
+    SIMCOM_BRINGUP_MODEM = 0,           // modem answers AT
+    SIMCOM_BRINGUP_SIM,                 // SIM card ready
+    SIMCOM_BRINGUP_NETWORK,             // EPS registration, which is also the packet domain attach
+    SIMCOM_BRINGUP_PDP,                 // PDP context defined and active
+    SIMCOM_BRINGUP_MQTT_SERVICE,        // AT+CMQTTSTART
+    SIMCOM_BRINGUP_MQTT_CLIENT,         // AT+CMQTTACCQ
+    SIMCOM_BRINGUP_MQTT_CONNECT,        // AT+CMQTTCONNECT
+    SIMCOM_BRINGUP_PHASES,
+} simcom_bringup_phase_t;
+
+/**
+ * Link to bring up, see simcom_bringup()
+ */
+typedef struct {
+    const char *apn;                    // APN of the context, NULL to keep the one the network gave
+    sim_pdp_type_t pdp_type;            // PDP type, used with apn
+    int cid;                            // context (1-15), 1 is the default LTE bearer
+    int client_index;                   // MQTT client (0-1)
+    const char *client_id;              // MQTT client ID (up to 128 bytes)
+    const char *server_addr;            // e.g. "tcp://broker.example.com:1883"
+    int keepalive_time;                 // 1-64800 seconds
+    int clean_session;                  // 0-1
+    uint32_t ready_timeout_ms;          // modem answering AT, 0 for SIM_BRINGUP_READY_TIMEOUT_MS
+    uint32_t reg_timeout_ms;            // network registration, 0 for SIM_BRINGUP_REG_TIMEOUT_MS
+    const simcom_baud_config_t *baud;   // UART rates to negotiate once the modem answers, NULL
+                                        // to keep uart_conf.baud_rate
+} simcom_bringup_config_t;
+
+/**
+ * Outcome of simcom_bringup()
+ */
+typedef struct {
+    uint32_t phase_ms[SIMCOM_BRINGUP_PHASES];   // time spent in each phase
+    uint32_t total_ms;
+    uint32_t commands;                  // AT commands sent
+    uint32_t skipped;                   // phases the modem had already done, bit (1 << phase)
+    simcom_bringup_phase_t phase;       // last phase started, the failed one on error
+    uint32_t baud_rate;                 // UART rate at the end, the next last_rate
+} simcom_bringup_stats_t;
+
+/**
+ * @brief Bring the link up to a connected MQTT client, replacing the sequence of
+ * simcom_get_simcard_pin_info(), simcom_eps_net_reg(), simcom_set_pdp_context(),
+ * simcom_set_pdp_context_activate(), simcom_mqtt_service_start(), simcom_mqtt_client_acquire()
+ * and simcom_mqtt_server_connect().
+ *
+ * Each phase first checks what the modem already did (e.g. after the MCU woke up with the
+ * modem still on) and skips it, and the checks implied by a previous phase are not sent: a
+ * registered modem has its SIM ready, a service started now has no clients. Registration is
+ * awaited on the +CEREG URCs (AT+CEREG=1 stays enabled), and the modem booting is probed
+ * again as soon as *ATREADY arrives. With use_hw_flow_control in the simcom_init()
+ * configuration the modem phase enables RTS/CTS on the modem (simcom_set_flow_control()).
+ * With cfg->baud the modem is looked for at those rates too and the UART rate is negotiated
+ * (simcom_baud_negotiate()) in the modem phase. Blocks the caller until the client is
+ * connected.
+ *
+ * @param cfg Link configuration
+ * @param stats Time spent in each phase and commands sent (may be NULL)
+ *
+ * @returns
+ *  - SIM_AT_OK if the client is connected
+ *  - SIM_AT_ERR_INVALID_ARG
+ *  - SIM_AT_ERR_BUSY if a bring-up is in progress
+ *  - SIMCOM_ERR_TIMEOUT if the modem did not answer or did not register in time
+ *  - The error of the failed phase otherwise (stats->phase)
+ */
+simcom_err_t simcom_bringup(const simcom_bringup_config_t *cfg, simcom_bringup_stats_t *stats);
+
+/**
+ * @brief Name of a bring-up phase
+ */
+const char *simcom_bringup_phase_to_str(simcom_bringup_phase_t phase);
+
+
+/* ============================================== */
+/* ============== [ State cache ] =============== */
+/* ============================================== */
+
+/**
+ * Entries of the modem state cache
+ */
+typedef enum {
+    SIMCOM_STATE_CSQ = 0,               // signal quality, +CSQ URC (AT+AUTOCSQ)
+    SIMCOM_STATE_CREG,                  // network registration, +CREG URC
+    SIMCOM_STATE_CEREG,                 // EPS network registration, +CEREG URC
+    SIMCOM_STATE_CGATT,                 // packet domain attach, +CGEV and +CEREG URCs
+    SIMCOM_STATE_CFUN,                  // phone functionality, simcom_set_phone_func()
+    SIMCOM_STATE_ITEMS,
+} simcom_state_item_t;
+
+/**
+ * Snapshot of the modem state cache, see simcom_state_cache_get()
+ */
+typedef struct {
+    int rssi;
+    int ber;
+    sim_network_registration_stat_t creg;
+    sim_eps_network_registration_stat_t cereg;
+    int attached;
+    sim_status_control_fun_t fun;
+    // Age of each value: 0 while the URCs keep it current, the time since it was read
+    // otherwise, UINT32_MAX if it is unknown (never read, or lost in a modem reset)
+    uint32_t age_ms[SIMCOM_STATE_ITEMS];
+} simcom_state_t;
+
+/**
+ * @brief Keep the modem state cache current with unsolicited reports.
+ *
+ * Enables the reports (AT+CREG=1, AT+CEREG=1, AT+CGEREP=2 and AT+AUTOCSQ=1,1), registers
+ * their URC handlers and reads every value once. From then on the values change with the URCs
+ * and the _cached() queries answer from memory without a command. The cache stops being
+ * current after a modem reset (*ATREADY) or a dropped URC (simcom_urc_dropped()); the
+ * values age from there until the next query or simcom_state_cache_start().
+ *
+ * The query functions (e.g. simcom_net_reg()) store what they read in the cache whether it
+ * was started or not.
+ *
+ * @returns
+ *  - SIM_AT_OK if succeded
+ *  - SIM_AT_ERR_NO_MEM if there are no free URC handler entries
+ *  - The error of the failed command otherwise
+ */
+simcom_err_t simcom_state_cache_start(void);
+
+/**
+ * @brief Stop following the URCs and disable the reports. The values are kept and age.
+ */
+simcom_err_t simcom_state_cache_stop(void);
+
+/**
+ * @brief Copy of the cached values and their age, without commands
+ */
+void simcom_state_cache_get(simcom_state_t *state);
+
+/**
+ * @brief simcom_query_signal_quality() answered from the cache if its value is not older
+ * than max_age_ms (0 only takes values kept current by the URCs)
+ */
+simcom_err_t simcom_query_signal_quality_cached(int* rssi, int* ber, uint32_t max_age_ms);
+
+/**
+ * @brief simcom_net_reg() answered from the cache if its value is not older than max_age_ms
+ */
+simcom_err_t simcom_net_reg_cached(sim_network_registration_stat_t *stat, uint32_t max_age_ms);
+
+/**
+ * @brief simcom_eps_net_reg() answered from the cache if its value is not older than
+ * max_age_ms
+ */
+simcom_err_t simcom_eps_net_reg_cached(sim_eps_network_registration_stat_t* stat, uint32_t max_age_ms);
+
+/**
+ * @brief simcom_get_packet_domain_attach() answered from the cache if its value is not older
+ * than max_age_ms
+ */
+simcom_err_t simcom_get_packet_domain_attach_cached(int* state, uint32_t max_age_ms);
+
+/**
+ * @brief simcom_get_phone_func() answered from the cache if its value is not older than
+ * max_age_ms
+ */
+simcom_err_t simcom_get_phone_func_cached(sim_status_control_fun_t* fun, uint32_t max_age_ms);
+
+
+/* ======================================= */
+/* ============== [ CMUX ] =============== */
+/* ======================================= */
+
+/**
+ * Counters of a command channel
+ */
+typedef struct {
+    uint32_t tx_bytes;                  // bytes written, frame overhead not included
+    uint32_t rx_bytes;
+    uint32_t commands;                  // commands completed
+    uint32_t lines;                     // lines received
+} simcom_chan_stats_t;
+
+/**
+ * @brief Start the 3GPP TS 27.010 multiplexer (AT+CMUX) and open a virtual channel per command
+ * channel, so a slow command (e.g. an MQTT publish waiting for its result) does not hold back
+ * the commands of the other channels. The channels are DLC 1 to channels; commands are sent
+ * to them by prefix (simcom_chan_route()), URCs arrive on any of them.
+ *
+ * Commands of other tasks wait while the multiplexer starts. The rate of the link must be
+ * settled before (simcom_baud_negotiate()): the multiplexer has no set_baud(). A modem restart
+ * ends the multiplexer on its side, call simcom_cmux_stop() and start it again.
+ *
+ * @param channels From 1 to SIM_AT_MAX_CHANNELS
+ *
+ * @returns
+ *  - SIM_AT_OK on success
+ *  - SIM_AT_ERR_INVALID_ARG
+ *  - SIM_AT_ERR_BUSY if already started
+ *  - SIM_AT_ERR_RESPONSE if the modem refused AT+CMUX
+ *  - SIMCOM_ERR_TIMEOUT if a channel was not opened; the link is back to plain AT
+ */
+simcom_err_t simcom_cmux_start(uint8_t channels);
+
+/**
+ * @brief Close the multiplexer (CLD) and go back to plain AT on the same link. Commands still
+ * queued are sent on the plain link.
+ *
+ * @returns
+ *  - SIM_AT_OK on success, or if not started
+ *  - SIMCOM_ERR_TIMEOUT if the modem did not answer the close; the link is back to plain AT
+ */
+simcom_err_t simcom_cmux_stop(void);
+
+/**
+ * @brief Send the commands with this prefix to a channel. With fewer channels open they go to
+ * the first one. "+CMQTT" goes to channel 1 by default.
+ *
+ * @param prefix Command prefix without "AT" (e.g. "+CMQTT", "+CSQ"), the longest match wins
+ * @param chan Channel from 1 to SIM_AT_MAX_CHANNELS - 1, 0 to remove the route
+ *
+ * @returns
+ *  - SIM_AT_OK on success
+ *  - SIM_AT_ERR_INVALID_ARG
+ *  - SIM_AT_ERR_NOT_INIT
+ *  - SIM_AT_ERR_NO_MEM if SIM_AT_MAX_ROUTES routes are set
+ */
+simcom_err_t simcom_chan_route(const char *prefix, uint8_t chan);
+
+/**
+ * @brief Read the counters of a channel, 0 on a plain link
+ *
+ * @returns
+ *  - SIM_AT_OK on success
+ *  - SIM_AT_ERR_INVALID_ARG
+ *  - SIM_AT_ERR_NOT_INIT
+ */
+simcom_err_t simcom_chan_stats(uint8_t chan, simcom_chan_stats_t *stats);
+
 
 #ifdef __cplusplus
 }
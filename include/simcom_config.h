@@ -8,6 +8,8 @@ extern "C" {
 #include "driver/uart.h"
 #include "driver/gpio.h"
 
+#include "simcom_transport.h"
+
 /**
  * -----------------------------
  * ----- [ Configuration ] -----
@@ -28,7 +30,7 @@ typedef struct {
  *
  * Note: user-provided uart config is an esp-idf uart_config_t; pins are provided too.
  */
-typedef struct {
+typedef struct simcom_config {
     gpio_num_t tx_pin;                  // TX gpio
     gpio_num_t rx_pin;                  // RX gpio
     uart_port_t uart_port;              // UART port (e.g., UART_NUM_1)
@@ -38,9 +40,11 @@ typedef struct {
     
     uint32_t default_cmd_timeout_ms;    // default blocking command timeout
     
-    bool use_hw_flow_control;           // enable hardware flow control (RTS/CTS)
+    bool use_hw_flow_control;           // RTS/CTS: sets uart_conf.flow_ctrl, AT+IFC=2,2 from simcom_bringup()
     gpio_num_t rts_pin;                 // RTS gpio (-1 if unused)
     gpio_num_t cts_pin;                 // CTS gpio (-1 if unused)
+
+    const simcom_transport_t *transport; // modem link, NULL for the ESP-IDF UART on uart_port
 } simcom_config_t;
 
 #ifdef __cplusplus
@@ -0,0 +1,152 @@
+#ifndef _SIMCOM_SPOOL_H_
+#define _SIMCOM_SPOOL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "simcom_types.h"
+
+/**
+ * --------------------------
+ * ----- [ MQTT spool ] -----
+ * --------------------------
+ */
+
+/**
+ * Persistent storage of the spool, with flash semantics: an erased byte reads 0xFF, a write
+ * only clears bits and erase() works on whole sectors.
+ *
+ * All the functions receive the ctx of the storage and are called with the spool lock taken,
+ * from the task that appends, the task that connects or the URC task.
+ */
+typedef struct {
+    /**
+     * @brief Reads len bytes at offset
+     *
+     * @return SIM_AT_OK or SIM_AT_ERR_INTERNAL
+     */
+    simcom_err_t (*read)(void *ctx, uint32_t offset, void *buf, size_t len);
+
+    /**
+     * @brief Writes len bytes at offset, previously erased
+     *
+     * @return SIM_AT_OK or SIM_AT_ERR_INTERNAL
+     */
+    simcom_err_t (*write)(void *ctx, uint32_t offset, const void *data, size_t len);
+
+    /**
+     * @brief Erases len bytes at offset, both multiple of sector_size
+     *
+     * @return SIM_AT_OK or SIM_AT_ERR_INTERNAL
+     */
+    simcom_err_t (*erase)(void *ctx, uint32_t offset, size_t len);
+
+    uint32_t size;              // bytes, multiple of sector_size
+    uint32_t sector_size;       // erase unit
+    void *ctx;
+} simcom_spool_storage_t;
+
+/**
+ * Spool state, see simcom_spool_get_stats()
+ */
+typedef struct {
+    uint32_t pending;           // messages not published yet
+    uint32_t used;              // bytes of the segments that hold them
+    uint32_t capacity;          // bytes of the storage
+    uint32_t rejected;          // messages not stored because the spool was full, since open
+    uint32_t corrupt;           // records cut by a reset found on open
+    uint32_t max_erases;        // erase count of the most worn segment
+} simcom_spool_stats_t;
+
+/**
+ * @brief Flash partition storage (ESP-IDF builds only)
+ *
+ * @param label Label of a data partition of the partition table
+ *
+ * @return Storage, NULL if the partition does not exist
+ */
+const simcom_spool_storage_t *simcom_spool_partition(const char *label);
+
+/**
+ * @brief File storage for host builds, created erased if it does not exist
+ *
+ * @param path File path
+ * @param size File size in bytes, multiple of sector_size
+ * @param sector_size Size of the emulated erase unit (e.g. 4096)
+ *
+ * @return Storage, NULL if the file cannot be opened
+ */
+const simcom_spool_storage_t *simcom_spool_file(const char *path, uint32_t size, uint32_t sector_size);
+
+/**
+ * @brief Open the spool: messages stored while the link is down and published after
+ * simcom_mqtt_server_connect() succeeds.
+ *
+ * The storage is split in segments of whole sectors (at most SIM_SPOOL_MAX_SEGMENTS) filled
+ * one after the other. Each message is a record with its CRC; the records of the previous
+ * sessions are found again on open, and the ones cut by a reset are skipped. A segment is only
+ * erased when it is needed again, and the free segment erased the fewest times is taken.
+ * RAM use is fixed whatever the backlog: a batch buffer of SIM_SPOOL_BATCH_SIZE bytes.
+ *
+ * @param storage Storage, must stay valid while open
+ * @param client_index MQTT client the messages are published on (0-1)
+ * @param qos QoS of the published messages (0-2)
+ *
+ * @returns
+ *  - SIM_AT_OK if succeded
+ *  - SIM_AT_ERR_INVALID_ARG (bad storage geometry too)
+ *  - SIM_AT_ERR_BUSY if the spool is already open
+ *  - SIM_AT_ERR_INTERNAL on a storage error
+ */
+simcom_err_t simcom_spool_open(const simcom_spool_storage_t *storage, int client_index, int qos);
+
+/**
+ * @brief Close the spool. Messages being published are finished first; the stored ones stay
+ * for the next open.
+ */
+void simcom_spool_close(void);
+
+/**
+ * @brief Store a message, e.g. after simcom_mqtt_publish_msg() failed. The data is copied.
+ *
+ * @param topic Topic (1-1024 bytes)
+ * @param payload Message body (may be binary)
+ * @param len Message length; header, topic and payload must fit in SIM_SPOOL_BATCH_SIZE
+ *
+ * @returns
+ *  - SIM_AT_OK if stored
+ *  - SIM_AT_ERR_INVALID_ARG
+ *  - SIM_AT_ERR_NOT_INIT if the spool is not open
+ *  - SIM_AT_ERR_NO_MEM if the spool is full
+ *  - SIM_AT_ERR_INTERNAL on a storage error
+ */
+simcom_err_t simcom_spool_append(const char *topic, const void *payload, size_t len);
+
+/**
+ * @brief Start publishing the stored messages. Called by simcom_mqtt_server_connect() and
+ * by the callback of simcom_mqtt_server_connect_async() on success.
+ *
+ * The messages go through simcom_mqtt_enqueue() in batches of up to SIM_SPOOL_BATCH_SIZE
+ * bytes, so the queue window keeps the link busy. A message is removed from the spool when its
+ * +CMQTTPUB result arrives; if any message of a batch fails the draining stops until the next
+ * call, which publishes the failed messages again (at least once delivery).
+ *
+ * @returns SIM_AT_OK if draining (or nothing to publish), SIM_AT_ERR_NOT_INIT if not open
+ */
+simcom_err_t simcom_spool_drain(void);
+
+/**
+ * @brief Spool counters
+ */
+simcom_err_t simcom_spool_get_stats(simcom_spool_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SIMCOM_SPOOL_H_
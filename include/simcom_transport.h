@@ -0,0 +1,138 @@
+#ifndef _SIMCOM_TRANSPORT_H_
+#define _SIMCOM_TRANSPORT_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "simcom_types.h"
+
+struct simcom_config;
+
+/**
+ * -------------------------
+ * ----- [ Transport ] -----
+ * -------------------------
+ */
+
+// read() timeout: wait until data arrives or wake() is called
+#define SIMCOM_TRANSPORT_WAIT_FOREVER   UINT32_MAX
+
+// read() errors
+#define SIMCOM_TRANSPORT_ERR_OVERFLOW   (-1)    // received data was lost, the input was flushed
+#define SIMCOM_TRANSPORT_ERR_IO         (-2)    // the link is down (e.g. TCP peer closed)
+
+/**
+ * Byte link between the AT engine and the modem.
+ *
+ * All the functions receive the ctx of the transport. read() and read_chan() are only called by
+ * the parser task; write(), write_chan(), flush(), wait_tx() and tx_pending() are called with
+ * the engine lock taken, wake() from any task.
+ */
+typedef struct {
+    /**
+     * @brief Opens the link, called by simcom_init()
+     *
+     * @return SIM_AT_OK or SIM_AT_ERR_UART
+     */
+    simcom_err_t (*open)(void *ctx, const struct simcom_config *cfg);
+
+    /**
+     * @brief Closes the link, called by simcom_deinit() after the parser task is stopped
+     */
+    void (*close)(void *ctx);
+
+    /**
+     * @brief Writes all the bytes. Returns once they are queued for transmission, it only
+     * blocks while the transmit buffer is full (e.g. the modem holds CTS).
+     *
+     * @return Number of bytes written, negative on error
+     */
+    int (*write)(void *ctx, const void *data, size_t len);
+
+    /**
+     * @brief Waits up to timeout_ms for received bytes and reads the available ones
+     *
+     * @return
+     *  - Number of bytes read
+     *  - 0 on timeout or when woken up by wake()
+     *  - SIMCOM_TRANSPORT_ERR_OVERFLOW
+     *  - SIMCOM_TRANSPORT_ERR_IO
+     */
+    int (*read)(void *ctx, void *buf, size_t size, uint32_t timeout_ms);
+
+    /**
+     * @brief Discards the received bytes not read yet
+     */
+    void (*flush)(void *ctx);
+
+    /**
+     * @brief Waits until the written bytes have been transmitted
+     *
+     * @return False on timeout
+     */
+    bool (*wait_tx)(void *ctx, uint32_t timeout_ms);
+
+    /**
+     * @brief Makes a blocked read() return 0 so the parser recomputes its wait
+     */
+    void (*wake)(void *ctx);
+
+    /**
+     * @brief Changes the line rate, called with nothing being transmitted. NULL if the link
+     * has no rate.
+     *
+     * @return SIM_AT_OK, SIM_AT_ERR_INVALID_ARG if the rate is not supported or SIM_AT_ERR_UART
+     */
+    simcom_err_t (*set_baud)(void *ctx, uint32_t baud_rate);
+
+    /**
+     * @brief Bytes written and not transmitted yet. NULL if the link cannot tell.
+     *
+     * @return Number of bytes, negative on error
+     */
+    int (*tx_pending)(void *ctx);
+
+    /**
+     * @brief read() of a multiplexed link: the bytes of a single channel per call. NULL if the
+     * link has a single channel.
+     *
+     * @param chan Set to the channel the bytes belong to, from 0
+     *
+     * @return As read()
+     */
+    int (*read_chan)(void *ctx, void *buf, size_t size, uint32_t timeout_ms, uint8_t *chan);
+
+    /**
+     * @brief write() to a channel of a multiplexed link. NULL if the link has a single channel.
+     *
+     * @return As write()
+     */
+    int (*write_chan)(void *ctx, uint8_t chan, const void *data, size_t len);
+
+    void *ctx;
+} simcom_transport_t;
+
+/**
+ * @brief ESP-IDF UART transport, on the uart_port and pins of the configuration.
+ * Used by simcom_init() when no transport is configured (ESP-IDF builds only).
+ */
+const simcom_transport_t *simcom_transport_uart(void);
+
+/**
+ * @brief POSIX transport for host builds
+ *
+ * @param path Serial device or pseudo-terminal (e.g. "/dev/ttyUSB0", "/dev/pts/3"), configured
+ *             raw at uart_conf.baud_rate, or a TCP endpoint "tcp:<host>:<port>" (e.g. ser2net)
+ */
+const simcom_transport_t *simcom_transport_posix(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SIMCOM_TRANSPORT_H_
@@ -5,6 +5,8 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+
 /**
  * ------------------------------------
  * ----- [ Error / status codes ] -----
@@ -35,6 +37,18 @@ typedef enum {
     SIM_AT_RESPONSE_ERR_COMMAND_INVALID = -4,
 } simcom_responses_err_t;
 
+/**
+ * -----------------------------
+ * ----- [ Data buffers ] -----
+ * -----------------------------
+ */
+
+/* One buffer of a scatter-gather list, written to the modem as is (binary-safe) */
+typedef struct {
+    const void *base;
+    size_t len;
+} simcom_iov_t;
+
 /**
  * ------------------------------------
  * ----- [ Status control codes ] -----
@@ -170,6 +184,28 @@ typedef enum {
     SIM_MQTT_ERR_DISCONNECT_FAIL                = 35  // Disconnect from server failed
 } sim_mqtt_err_codes_t;
 
+/**
+ * ----------------------------------
+ * ----- [ Socket error codes ] -----
+ * ----------------------------------
+ */
+
+typedef enum {
+    SIM_SOCKET_OK                       = 0,  // Operation succeeded
+    SIM_SOCKET_ERR_NETWORK              = 1,  // Network failure
+    SIM_SOCKET_ERR_NETWORK_NOT_OPENED   = 2,  // Network not opened
+    SIM_SOCKET_ERR_WRONG_PARAMETER      = 3,  // Wrong parameter
+    SIM_SOCKET_ERR_NOT_SUPPORTED        = 4,  // Operation not supported
+    SIM_SOCKET_ERR_CREATE               = 5,  // Failed to create socket
+    SIM_SOCKET_ERR_BIND                 = 6,  // Failed to bind socket
+    SIM_SOCKET_ERR_LISTENING            = 7,  // TCP server is already listening
+    SIM_SOCKET_ERR_BUSY                 = 8,  // Busy
+    SIM_SOCKET_ERR_OPENED               = 9,  // Sockets opened
+    SIM_SOCKET_ERR_TIMEOUT              = 10, // Timeout
+    SIM_SOCKET_ERR_DNS                  = 11, // DNS parse failed
+    SIM_SOCKET_ERR_UNKNOWN              = 12  // Unknown error
+} sim_socket_err_codes_t;
+
 #ifdef __cplusplus
 }
 #endif
@@ -7,13 +7,17 @@
  */
 
 #include "at/sim_at.h"
+#include "at/sim_at_urc.h"
+#include "at/sim_at_line.h"
 #include <string.h>
+#include <stdlib.h>
+#include <strings.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
-#include "freertos/queue.h"
 #include "driver/gpio.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 static const char *TAG = "sim_at";
 
@@ -27,26 +31,191 @@ static bool g_inited = false;
 #define SIM_AT_PARSER_TASK_PRIO 5
 static TaskHandle_t s_parser_task = NULL;
 
-/* UART parse response */
-#define SIM_AT_MAX_LINES 5
+/* Modem link, its read() drives the parser task */
+static const simcom_transport_t *s_transport = NULL;
 
-static char s_responses[SIM_AT_MAX_LINES][SIM_AT_MAX_RESP_LEN];
-static int s_resp_head = 0;  // write index
-static int s_resp_tail = 0;  // read index
-static int s_resp_count = 0; // number of stored responses
-// TODO: Antes de ver las respuesta el s_resp_count se debería reinicializar a 0
-
-static char s_line_buf[SIM_AT_MAX_RESP_LEN];
-static int s_line_pos = 0;
-
-/* Last sent command — used to detect and discard echoed lines */
-static char s_last_cmd[SIM_AT_MAX_CMD_LEN];
+/* UART parse response
+ *
+ * Lines are stored in a packed ring of length-prefixed records. Each record keeps its line
+ * contiguous and NUL-terminated, so readers get a pointer into the arena instead of a copy.
+ * When a record does not fit at the end of the arena a wrap marker is written and the record
+ * starts again at offset 0.
+ *
+ * Every record is tagged with its owner: the command slot that was in flight when the line
+ * arrived, or SIM_AT_OWNER_STREAM for lines received outside of a command. Records can be
+ * released out of order; the tail only moves over records that are already free.
+ * The parser is the only writer of s_resp_head, readers move s_resp_tail under s_read_lock
+ * and the counters shared with the parser are updated inside s_resp_mux.
+ */
+typedef struct {
+    uint16_t len;       // line length without the NUL, SIM_AT_ARENA_WRAP for wrap markers
+    uint8_t owner;      // command slot index or SIM_AT_OWNER_STREAM
+    uint8_t flags;      // SIM_AT_REC_* flags
+    uint8_t type;       // sim_at_line_type_t tag, computed by the parser
+    uint8_t prefix_len; // length of the prefix of INFO lines
+    uint16_t value_off; // offset of the first value of INFO lines, lines can be longer than 255
+    int16_t code;       // numeric +CME/+CMS error code, -1 if not present
+} sim_at_rec_hdr_t;
+
+#define SIM_AT_ARENA_WRAP       0xFFFFU
+#define SIM_AT_OWNER_STREAM     0xFFU
+#define SIM_AT_REC_FINAL        0x01U   // final result code of its command
+#define SIM_AT_REC_READ         0x02U   // lent to a reader
+#define SIM_AT_REC_FREE         0x04U   // released, space can be reclaimed
+#define SIM_AT_REC_HDR_LEN      sizeof(sim_at_rec_hdr_t)
+#define SIM_AT_REC_ALIGN        _Alignof(sim_at_rec_hdr_t)
+#define SIM_AT_REC_SIZE(len)    (((SIM_AT_REC_HDR_LEN + (len) + 1) + SIM_AT_REC_ALIGN - 1) & ~(SIM_AT_REC_ALIGN - 1))
+
+_Static_assert(SIM_AT_RESP_ARENA_SIZE >= SIM_AT_REC_SIZE(SIM_AT_MAX_RESP_LEN),
+               "SIM_AT_RESP_ARENA_SIZE must hold a max length line");
+_Static_assert(SIM_AT_MAX_PENDING_COMMANDS < SIM_AT_OWNER_STREAM,
+               "SIM_AT_MAX_PENDING_COMMANDS too large");
+
+static uint8_t s_resp_arena[SIM_AT_RESP_ARENA_SIZE] __attribute__((aligned(SIM_AT_REC_ALIGN)));
+static size_t s_resp_head = 0;              // write offset
+static size_t s_resp_tail = 0;              // oldest record offset
+static volatile int s_resp_count = 0;       // number of records between tail and head
+static volatile int s_stream_unread = 0;    // unread records received outside of a command
+static volatile uint32_t s_resp_dropped = 0; // lines dropped because the arena was full
+static portMUX_TYPE s_resp_mux = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t s_read_lock = NULL;
+
+/* Reader of the records of one owner */
+typedef struct {
+    uint8_t owner;      // records read by this reader
+    int32_t held;       // offset of the record lent to the reader, -1 if none
+    bool drained;       // the final result line was read
+} sim_at_reader_t;
+
+/* Lines received outside of a command (e.g. result URCs sent after the OK) */
+static sim_at_reader_t s_stream_reader = { .owner = SIM_AT_OWNER_STREAM, .held = -1 };
+static SemaphoreHandle_t s_stream_sem = NULL;
 
 /* Modem reset flag — set when *ATREADY: 1 is received */
 static volatile bool g_modem_reset = false;
 
-/* protects access to s_pending */
-static SemaphoreHandle_t s_sync_sem = NULL;
+/* Pending command table
+ *
+ * Commands are queued in a fixed table and written one at a time per channel: the next queued
+ * command is sent as soon as the final result code of the previous one arrives. Synchronous callers block
+ * on their slot and keep it after completion to read its lines; asynchronous commands are
+ * reported through their callback and released right after it returns.
+ *
+ * Asynchronous commands can carry the data of their '>' prompt, written by the parser as soon
+ * as the prompt arrives, and a result line prefix: after the OK the channel is freed for the
+ * next command and the slot completes when the matching result line arrives. Commands queued
+ * together as a chain run in order, and a failed one aborts the rest of its chain.
+ */
+typedef enum {
+    SIM_AT_SLOT_FREE = 0,
+    SIM_AT_SLOT_QUEUED,     // waiting for the channel
+    SIM_AT_SLOT_SENT,       // written, waiting for the final result code
+    SIM_AT_SLOT_RESULT,     // OK received, waiting for the result line; the channel is free
+    SIM_AT_SLOT_DONE,       // completed
+} sim_at_slot_state_t;
+
+#define SIM_AT_RESULT_PREFIX_LEN 24U
+
+typedef struct {
+    sim_at_slot_state_t state;
+    uint32_t seq;                   // submission order
+    char cmd[SIM_AT_MAX_CMD_LEN];
+    const simcom_iov_t *iov;        // data of the '>' prompt, sent instead of cmd if it is empty; caller owned
+    size_t iov_count;
+    sim_at_line_key_t key;          // prefix of the information responses (e.g. "+CSQ")
+    TickType_t timeout;             // command timeout, counted from the write
+    TickType_t deadline;            // set when the command is written
+    uint8_t chan;                   // channel it is written to, see simcom_chan_route()
+    char result_prefix[SIM_AT_RESULT_PREFIX_LEN]; // result line sent after the OK, empty if none
+    size_t result_prefix_len;
+    TickType_t result_timeout;      // wait for the result line, counted from the OK
+    uint32_t chain;                 // chain id, 0 for single commands
+    simcom_cmd_cb_t cb;             // completion callback, asynchronous commands only
+    void *ctx;
+    TaskHandle_t owner;             // synchronous caller, NULL for asynchronous commands
+    SemaphoreHandle_t done;         // given to the synchronous caller on completion
+    bool notify;                    // completion not yet notified
+    simcom_cmd_result_t result;
+    sim_at_reader_t reader;
+    simcom_data_mode_handler_t connect; // data mode handler on CONNECT, NULL for none
+    void *connect_ctx;
+    bool escape;                    // "+++" of the channel in data mode
+} sim_at_slot_t;
+
+static sim_at_slot_t s_slots[SIM_AT_MAX_PENDING_COMMANDS];
+static SemaphoreHandle_t s_slots_free = NULL;   // counts free slots
+static SemaphoreHandle_t s_eng_lock = NULL;     // protects the slot table and the channels
+static uint32_t s_seq = 0;
+static uint32_t s_chain_seq = 0;
+static volatile int s_results_pending = 0;     // slots waiting for a result line
+
+/* Command channels
+ *
+ * A plain link is a single channel. A multiplexed link (CMUX) has one per virtual channel,
+ * each with its own command in flight, '>' prompt, line assembly and echo detection, so a
+ * slow command on one channel does not hold back the others. Commands are sent to a channel
+ * by their prefix (simcom_chan_route()); the slot table and the response arena are shared.
+ *
+ * After a CONNECT answering simcom_cmd_connect() a channel is in data mode: its bytes go to
+ * the data handler without line assembly and only the "+++" escape is written as a command.
+ */
+#define SIM_AT_PROMPT_HOLD_MS 5000
+
+typedef struct {
+    sim_at_slot_t *volatile inflight;
+    bool reserved;                      // '>' prompt: kept for the prompted caller to send its data
+    TaskHandle_t owner;
+    TickType_t deadline;
+    char line_buf[SIM_AT_MAX_RESP_LEN];
+    int line_pos;
+    size_t data_left;                   // length-counted bytes of a data URC still to come
+    const sim_at_urc_data_handler_t *data_urc;  // handler of those bytes
+    volatile bool data_mode;            // CONNECT received, the bytes are connection data
+    volatile bool escaping;             // "+++" in progress, writes are refused
+    bool data_writing;                  // a data write is in the transport, out of s_eng_lock
+    simcom_data_mode_handler_t data_handler;
+    void *data_ctx;
+    TickType_t data_tx;                 // last data write, the escape guard counts from it
+    TickType_t data_guard;              // escape guard time
+    TickType_t data_until;              // end of the guard after "+++": the OK can follow
+    size_t ok_held;                     // first bytes of the escape OK received, not passed as data
+    char last_cmd[SIM_AT_MAX_CMD_LEN];  // last sent command without CR/LF, to discard its echo
+    size_t last_cmd_len;
+    simcom_chan_stats_t stats;
+} sim_at_chan_t;
+
+static sim_at_chan_t s_chans[SIM_AT_MAX_CHANNELS];
+static uint8_t s_chan_count = 1;                // channels in use, 0 holds every command
+static TaskHandle_t s_hold_owner = NULL;        // only its commands are sent, see simcom_engine_hold()
+
+/* Routes of commands to channels, the longest matching prefix wins; channel 0 otherwise */
+typedef struct {
+    char prefix[SIM_AT_URC_PREFIX_LEN + 1];
+    uint8_t chan;
+} sim_at_route_t;
+
+static sim_at_route_t s_routes[SIM_AT_MAX_ROUTES] = {
+    { "+CMQTT", 1 },        // MQTT on its own channel once there are two
+};
+
+/* Transport switch, adopted by the parser between reads */
+static const simcom_transport_t *volatile s_next_transport = NULL;
+static uint8_t s_next_chan_count;
+static SemaphoreHandle_t s_switch_sem = NULL;
+
+/* Slot whose lines are read by the completion callback being executed */
+static sim_at_slot_t *s_cb_slot = NULL;
+static TaskHandle_t s_cb_task = NULL;
+
+/* Run by the parser task after slots were freed */
+static simcom_slot_hook_t s_slot_hook = NULL;
+static void *s_slot_hook_ctx = NULL;
+static volatile bool s_slot_freed = false;
+static bool s_hook_timed = false;                // run the hook at s_hook_deadline too
+static TickType_t s_hook_deadline;
+
+/* Transmit counters, protected by s_eng_lock like the writes */
+static simcom_tx_stats_t s_tx_stats;
 
 void simcom_set_config(simcom_config_t* config)
 {
@@ -58,23 +227,85 @@ void simcom_set_init_flag(bool init_f)
     g_inited = init_f;
 }
 
+void simcom_set_transport(const simcom_transport_t *transport)
+{
+    s_transport = transport;
+    memset(&s_tx_stats, 0, sizeof(s_tx_stats));
+}
+
 simcom_err_t simcom_sem_create(void)
 {
     /* create locks */
-    s_sync_sem = xSemaphoreCreateBinary();
-    if (!s_sync_sem)
+    s_eng_lock = xSemaphoreCreateMutex();
+    s_read_lock = xSemaphoreCreateMutex();
+    s_stream_sem = xSemaphoreCreateBinary();
+    s_switch_sem = xSemaphoreCreateBinary();
+    s_slots_free = xSemaphoreCreateCounting(SIM_AT_MAX_PENDING_COMMANDS, SIM_AT_MAX_PENDING_COMMANDS);
+    if (!s_eng_lock || !s_read_lock || !s_stream_sem || !s_switch_sem || !s_slots_free)
+    {
+        simcom_sem_delete();
         return SIM_AT_ERR_NO_MEM;
+    }
+
+    for (size_t i = 0; i < SIM_AT_MAX_PENDING_COMMANDS; i++)
+    {
+        memset(&s_slots[i], 0, sizeof(s_slots[i]));
+        s_slots[i].reader.owner = (uint8_t)i;
+        s_slots[i].reader.held = -1;
+        s_slots[i].done = xSemaphoreCreateBinary();
+        if (!s_slots[i].done)
+        {
+            simcom_sem_delete();
+            return SIM_AT_ERR_NO_MEM;
+        }
+    }
+
+    /* start with an empty arena, records left by a previous session have no owner anymore */
+    s_resp_head = 0;
+    s_resp_tail = 0;
+    s_resp_count = 0;
+    s_stream_unread = 0;
+    s_stream_reader.held = -1;
+    s_stream_reader.drained = false;
+    memset(s_chans, 0, sizeof(s_chans));
+    s_chan_count = 1;
+    s_hold_owner = NULL;
+    s_next_transport = NULL;
     return SIM_AT_OK;
 }
 
 void simcom_sem_delete(void)
 {
     /* delete semaphores */
-    if (s_sync_sem)
+    SemaphoreHandle_t *sems[] = { &s_eng_lock, &s_read_lock, &s_stream_sem, &s_switch_sem, &s_slots_free };
+    for (size_t i = 0; i < sizeof(sems) / sizeof(sems[0]); i++)
+    {
+        if (*sems[i])
+        {
+            vSemaphoreDelete(*sems[i]);
+            *sems[i] = NULL;
+        }
+    }
+
+    for (size_t i = 0; i < SIM_AT_MAX_PENDING_COMMANDS; i++)
+    {
+        if (s_slots[i].done)
+        {
+            vSemaphoreDelete(s_slots[i].done);
+            s_slots[i].done = NULL;
+        }
+        s_slots[i].state = SIM_AT_SLOT_FREE;
+    }
+    for (size_t i = 0; i < SIM_AT_MAX_CHANNELS; i++)
     {
-        vSemaphoreDelete(s_sync_sem);
-        s_sync_sem = NULL;
+        s_chans[i].inflight = NULL;
+        s_chans[i].reserved = false;
+        s_chans[i].data_mode = false;
+        s_chans[i].escaping = false;
+        s_chans[i].data_writing = false;
+        s_chans[i].ok_held = 0;
     }
+    s_results_pending = 0;
 }
 
 const char *simcom_err_to_str(simcom_err_t err)
@@ -91,6 +322,7 @@ const char *simcom_err_to_str(simcom_err_t err)
     case SIM_AT_ERR_NOT_INIT:       return "SIM_AT_ERR_NOT_INIT";
     case SIM_AT_ERR_OVERFLOW:       return "SIM_AT_ERR_OVERFLOW";
     case SIM_AT_ERR_ABORTED:        return "SIM_AT_ERR_ABORTED";
+    case SIM_AT_ERR_RESPONSE:       return "SIM_AT_ERR_RESPONSE";
     case SIMCOM_ERR_MODEM_RESET:    return "SIMCOM_ERR_MODEM_RESET";
     default:                        return "INVALID ERR";
     }
@@ -144,69 +376,332 @@ static void _print_sent_command(const char* cmd, int len)
 }
 
 /**
- * @brief Add UART response to ring buffer
+ * @brief Returns the record header at an arena offset, following the wrap marker if needed.
  * 
- * @param data Response string
+ * @param offset Record offset, updated to the offset of the returned header
  */
-static void _add_resp_to_buff(const char* data)
+static sim_at_rec_hdr_t* _arena_rec_at(size_t *offset)
 {
-    if (s_resp_head < SIM_AT_MAX_LINES)
+    if (*offset + SIM_AT_REC_HDR_LEN > SIM_AT_RESP_ARENA_SIZE)
+        *offset = 0;
+
+    sim_at_rec_hdr_t *hdr = (sim_at_rec_hdr_t *)&s_resp_arena[*offset];
+    if (hdr->len == SIM_AT_ARENA_WRAP)
     {
-        // Write normally
-        strncpy(s_responses[s_resp_head], data, SIM_AT_MAX_RESP_LEN - 1);
-        s_responses[s_resp_head][SIM_AT_MAX_RESP_LEN - 1] = '\0';
-        s_resp_head = (s_resp_head + 1) % SIM_AT_MAX_LINES;
-        s_resp_count++;
+        *offset = 0;
+        hdr = (sim_at_rec_hdr_t *)&s_resp_arena[0];
     }
-    else
+    return hdr;
+}
+
+/**
+ * @brief Add UART response to the response arena. Never overwrites unread lines.
+ * 
+ * @param data Response string
+ * @param len Response length
+ * @param info Line tag
+ * @param owner Command slot index or SIM_AT_OWNER_STREAM
+ * @param flags SIM_AT_REC_* flags
+ * 
+ * @return False if the arena is full and the line was dropped
+ */
+static bool _add_resp_to_buff(const char* data, size_t len, const sim_at_line_info_t *info,
+                              uint8_t owner, uint8_t flags)
+{
+    size_t need = SIM_AT_REC_SIZE(len);
+
+    portENTER_CRITICAL(&s_resp_mux);
+    size_t tail = s_resp_tail;
+    bool empty = (s_resp_count == 0);
+    portEXIT_CRITICAL(&s_resp_mux);
+
+    // An empty arena restarts from the beginning, which keeps records from wrapping
+    size_t head = s_resp_head;
+    size_t offset;
+    if (head == tail && !empty)
+        goto overflow;
+    if (head >= tail || empty)
     {
-        // Buffer full: overwrite oldest
-        s_resp_head = 0;
-        strncpy(s_responses[s_resp_head], data, SIM_AT_MAX_RESP_LEN - 1);
-        s_responses[s_resp_head][SIM_AT_MAX_RESP_LEN - 1] = '\0';
+        if (need <= SIM_AT_RESP_ARENA_SIZE - head)
+            offset = head;
+        else if (need <= tail || empty)
+            offset = 0;
+        else
+            goto overflow;
     }
+    else if (need <= tail - head)
+        offset = head;
+    else
+        goto overflow;
+
+    // Record does not fit at the end: mark the jump for the readers
+    if (offset != head && head + SIM_AT_REC_HDR_LEN <= SIM_AT_RESP_ARENA_SIZE)
+        ((sim_at_rec_hdr_t *)&s_resp_arena[head])->len = SIM_AT_ARENA_WRAP;
+
+    sim_at_rec_hdr_t *hdr = (sim_at_rec_hdr_t *)&s_resp_arena[offset];
+    hdr->len = (uint16_t)len;
+    hdr->owner = owner;
+    hdr->flags = flags;
+    hdr->type = (uint8_t)info->type;
+    hdr->prefix_len = (info->type == SIM_AT_LINE_INFO) ? info->key.len : 0;
+    hdr->value_off = info->value_off;
+    hdr->code = info->code;
+    memcpy(hdr + 1, data, len);
+    ((char *)(hdr + 1))[len] = '\0';
+
+    portENTER_CRITICAL(&s_resp_mux);
+    if (s_resp_count == 0)
+        s_resp_tail = offset;
+    s_resp_head = offset + need;
+    s_resp_count++;
+    if (owner == SIM_AT_OWNER_STREAM)
+        s_stream_unread++;
+    portEXIT_CRITICAL(&s_resp_mux);
 
     if (g_debug)
         ESP_LOGI(TAG, "<-- %s", data); 
+    return true;
+
+overflow:
+    return false;
 }
 
 /**
- * @brief Resets response line buffer
+ * @brief Moves the tail over the records already released. Call with s_read_lock taken.
  */
-static void _reset_line_buff(void)
+static void _arena_advance_tail(void)
 {
-    s_line_pos = 0;
-    s_line_buf[0] = '\0';
+    portENTER_CRITICAL(&s_resp_mux);
+    size_t tail = s_resp_tail;
+    while (s_resp_count > 0)
+    {
+        sim_at_rec_hdr_t *hdr = _arena_rec_at(&tail);
+        if (!(hdr->flags & SIM_AT_REC_FREE))
+            break;
+        tail += SIM_AT_REC_SIZE(hdr->len);
+        s_resp_count--;
+    }
+    s_resp_tail = tail;
+    portEXIT_CRITICAL(&s_resp_mux);
 }
 
 /**
- * @brief Returns true if the assembled line matches the last sent command.
+ * @brief Finds the oldest unread record of an owner. Call with s_read_lock taken.
  *
- * The echo is the command string without the trailing CR/LF, so we compare
- * against s_last_cmd stripped of those characters.
+ * @param owner Command slot index or SIM_AT_OWNER_STREAM
+ * @param offset Offset of the record found
  *
- * @param line NUL-terminated line (already CR/LF stripped by the parser)
+ * @return NULL if there is no unread record for the owner
  */
-static bool _line_is_echo(const char *line)
+static sim_at_rec_hdr_t* _arena_find(uint8_t owner, size_t *offset)
 {
-    if (s_last_cmd[0] == '\0')
-        return false;
+    portENTER_CRITICAL(&s_resp_mux);
+    size_t pos = s_resp_tail;
+    int count = s_resp_count;
+    portEXIT_CRITICAL(&s_resp_mux);
+
+    // Records between tail and the snapshot count cannot be reclaimed while the lock is held
+    for (int i = 0; i < count; i++)
+    {
+        sim_at_rec_hdr_t *hdr = _arena_rec_at(&pos);
+        if (hdr->owner == owner && !(hdr->flags & (SIM_AT_REC_READ | SIM_AT_REC_FREE)))
+        {
+            *offset = pos;
+            return hdr;
+        }
+        pos += SIM_AT_REC_SIZE(hdr->len);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Releases an unread stream record. Call with s_read_lock taken.
+ */
+static void _arena_free_stream_rec(sim_at_rec_hdr_t *hdr)
+{
+    hdr->flags |= SIM_AT_REC_FREE;
+    portENTER_CRITICAL(&s_resp_mux);
+    s_stream_unread--;
+    portEXIT_CRITICAL(&s_resp_mux);
+}
+
+/**
+ * @brief Releases the record lent to a reader, if any. Call with s_read_lock taken.
+ */
+static void _reader_release_held(sim_at_reader_t *rd)
+{
+    if (rd->held < 0)
+        return;
+
+    size_t offset = rd->held;
+    _arena_rec_at(&offset)->flags |= SIM_AT_REC_FREE;
+    rd->held = -1;
+    _arena_advance_tail();
+}
+
+/**
+ * @brief Lends the next unread record of a reader, releasing the previous one.
+ *
+ * @param rd Reader
+ * @param line Line inside the arena and its tag
+ *
+ * @return False if there is no unread record for the reader
+ */
+static bool _reader_next(sim_at_reader_t *rd, simcom_resp_line_t *line)
+{
+    xSemaphoreTake(s_read_lock, portMAX_DELAY);
+    _reader_release_held(rd);
+
+    size_t offset;
+    sim_at_rec_hdr_t *hdr = _arena_find(rd->owner, &offset);
+    if (hdr)
+    {
+        hdr->flags |= SIM_AT_REC_READ;
+        rd->held = offset;
+        if (hdr->flags & SIM_AT_REC_FINAL)
+            rd->drained = true;
+        if (rd->owner == SIM_AT_OWNER_STREAM)
+        {
+            portENTER_CRITICAL(&s_resp_mux);
+            s_stream_unread--;
+            portEXIT_CRITICAL(&s_resp_mux);
+        }
+
+        line->text = (const char *)(hdr + 1);
+        line->len = hdr->len;
+        line->type = (sim_at_line_type_t)hdr->type;
+        line->prefix_len = hdr->prefix_len;
+        line->value_off = hdr->value_off;
+        line->code = hdr->code;
+    }
+    xSemaphoreGive(s_read_lock);
+
+    return (hdr != NULL);
+}
+
+/**
+ * @brief Releases every record of a reader, the lent one included.
+ */
+static void _reader_release_all(sim_at_reader_t *rd)
+{
+    xSemaphoreTake(s_read_lock, portMAX_DELAY);
+    _reader_release_held(rd);
+
+    size_t offset;
+    sim_at_rec_hdr_t *hdr;
+    while ((hdr = _arena_find(rd->owner, &offset)) != NULL)
+        hdr->flags |= SIM_AT_REC_FREE;
+    _arena_advance_tail();
+
+    rd->drained = false;
+    xSemaphoreGive(s_read_lock);
+}
+
+/**
+ * @brief Discards the unread stream lines, keeping at most max of them.
+ *
+ * @param max Number of unread lines to keep
+ * @param release_held Also release the stream line lent to a reader
+ */
+static void _stream_trim(int max, bool release_held)
+{
+    xSemaphoreTake(s_read_lock, portMAX_DELAY);
+    if (release_held)
+        _reader_release_held(&s_stream_reader);
+
+    size_t offset;
+    sim_at_rec_hdr_t *hdr;
+    while (s_stream_unread > max && (hdr = _arena_find(SIM_AT_OWNER_STREAM, &offset)) != NULL)
+        _arena_free_stream_rec(hdr);
+    _arena_advance_tail();
+    xSemaphoreGive(s_read_lock);
+}
+
+/**
+ * @brief Stores a line, discarding the stream lines if the arena is full.
+ *
+ * Stream lines that nobody reads would otherwise keep the tail, and every line stored after
+ * them, from being reclaimed.
+ */
+static bool _store_line(const char *line, size_t len, const sim_at_line_info_t *info,
+                        uint8_t owner, uint8_t flags)
+{
+    if (_add_resp_to_buff(line, len, info, owner, flags))
+        return true;
+    if (s_stream_reader.held >= 0 || s_stream_unread > 0)
+    {
+        _stream_trim(0, true);
+        if (_add_resp_to_buff(line, len, info, owner, flags))
+            return true;
+    }
+
+    // Warn once, the counter keeps the total
+    if (s_resp_dropped++ == 0)
+        ESP_LOGW(TAG, "Response buffer full, dropping lines: %s", line);
+    return false;
+}
+
+/**
+ * @brief Resets the line buffer of a channel
+ */
+static void _reset_line_buff(sim_at_chan_t *ch)
+{
+    ch->line_pos = 0;
+    ch->line_buf[0] = '\0';
+}
 
-    /* Build a CR/LF-stripped copy of the last sent command for comparison */
-    char stripped[SIM_AT_MAX_CMD_LEN];
-    strncpy(stripped, s_last_cmd, sizeof(stripped) - 1);
-    stripped[sizeof(stripped) - 1] = '\0';
+/**
+ * @brief Writes to the channel through the transport, with or without s_eng_lock taken
+ */
+static int _tx_transport_write(sim_at_chan_t *ch, const void *data, size_t len)
+{
+    return s_transport->write_chan ?
+           s_transport->write_chan(s_transport->ctx, (uint8_t)(ch - s_chans), data, len) :
+           s_transport->write(s_transport->ctx, data, len);
+}
 
-    int len = strlen(stripped);
-    while (len > 0 && (stripped[len - 1] == '\r' || stripped[len - 1] == '\n'))
-        stripped[--len] = '\0';
+/**
+ * @brief Counts a transport write of @p took microseconds. Call with s_eng_lock taken.
+ */
+static void _tx_count(sim_at_chan_t *ch, int written, uint32_t took)
+{
+    s_tx_stats.writes++;
+    if (written > 0)
+    {
+        s_tx_stats.bytes += (uint32_t)written;
+        ch->stats.tx_bytes += (uint32_t)written;
+    }
+    if (took >= SIM_AT_TX_STALL_US)
+    {
+        s_tx_stats.stalls++;
+        s_tx_stats.stall_us += took;
+    }
+    if (s_transport->tx_pending)
+    {
+        int pending = s_transport->tx_pending(s_transport->ctx);
+        if (pending > 0 && (uint32_t)pending > s_tx_stats.queued_peak)
+            s_tx_stats.queued_peak = (uint32_t)pending;
+    }
+}
 
-    return (strcmp(line, stripped) == 0);
+/**
+ * @brief Writes to the transport and counts the time it blocked. Call with s_eng_lock taken.
+ *
+ * The transport returns once the bytes are in its transmit buffer, so a write only takes long
+ * when the buffer is full: the line is slower than the writes or the modem holds CTS.
+ */
+static int _tx_write(sim_at_chan_t *ch, const void *data, size_t len)
+{
+    int64_t start = esp_timer_get_time();
+    int written = _tx_transport_write(ch, data, len);
+    _tx_count(ch, written, (uint32_t)(esp_timer_get_time() - start));
+    return written;
 }
 
 /**
- * @brief Write raw command to UART (blocking) 
+ * @brief Write raw command to UART
  * 
+ * @param ch Channel
  * @param cmd NUL-Terminated AT Command (e.g. "AT+CGSN\r\n"). Must be <= SIM_AT_MAX_CMD_LEN.
  * 
  * @returns
@@ -215,19 +710,20 @@ static bool _line_is_echo(const char *line)
  *  - SIM_AT_ERR_UART if there is a UART error
  *  
  */ 
-static simcom_err_t _prv_uart_write_cmd(const char *cmd)
+static simcom_err_t _prv_uart_write_cmd(sim_at_chan_t *ch, const char *cmd)
 {
     if (!g_inited)
         return SIM_AT_ERR_NOT_INIT;
 
     int len = strlen(cmd);
 
-    /* Store command for echo detection before sending */
-    strncpy(s_last_cmd, cmd, SIM_AT_MAX_CMD_LEN - 1);
-    s_last_cmd[SIM_AT_MAX_CMD_LEN - 1] = '\0';
+    /* Store command for echo detection before sending, the echo has no CR/LF */
+    size_t echo_len = strcspn(cmd, "\r\n");
+    memcpy(ch->last_cmd, cmd, echo_len);
+    ch->last_cmd[echo_len] = '\0';
+    ch->last_cmd_len = echo_len;
 
-    uart_wait_tx_done(g_cfg->uart_port, pdMS_TO_TICKS(100));
-    int written = uart_write_bytes(g_cfg->uart_port, cmd, len);
+    int written = _tx_write(ch, cmd, len);
     
     if (written != len)
         return SIM_AT_ERR_UART;
@@ -237,228 +733,1817 @@ static simcom_err_t _prv_uart_write_cmd(const char *cmd)
     return SIM_AT_OK;
 }
 
-static bool _response_is_urc(const char *line)
-{
-    return (
-        strstr(line, "+CGEV:") != NULL ||
-        strstr(line, "SMS") != NULL ||
-        strstr(line, "*ISIMAID") != NULL
-        // extend as needed
-    );
-}
-
 /**
- * @brief Returns true if the line is the *ATREADY: 1 modem reset URC.
- *        Sets g_modem_reset flag as a side effect.
- * 
- * @param line NUL-terminated line (already CR/LF stripped)
+ * @brief Write the data answering a '>' prompt straight from the caller buffers
+ *
+ * @param ch Channel
+ * @param iov Buffers, written in order
+ * @param count Number of buffers
+ *
+ * @returns
+ *  - SIM_AT_OK on success
+ *  - SIM_AT_ERR_NOT_INIT is module not initialized
+ *  - SIM_AT_ERR_UART if there is a UART error
  */
-static bool _response_is_modem_reset(const char *line)
+static simcom_err_t _prv_uart_write_data(sim_at_chan_t *ch, const simcom_iov_t *iov, size_t count)
 {
-    if (strstr(line, "*ATREADY: 1") != NULL)
-    {
-        g_modem_reset = true;
-        ESP_LOGW(TAG, "Modem reset detected (*ATREADY: 1)");
-        return true;
-    }
-    return false;
-}
+    if (!g_inited)
+        return SIM_AT_ERR_NOT_INIT;
 
-/* Parser task: reads bytes from UART, assembles lines, routes them */
-static void _s_parser_task_fn(void *arg)
-{
-    const TickType_t rx_wait = pdMS_TO_TICKS(UART_MAX_WAITTIME);
-    uint8_t *data = (uint8_t *)malloc(SIM_AT_MAX_RESP_LEN + 1);
+    /* Data input is not echoed as a command line */
+    ch->last_cmd_len = 0;
+    ch->last_cmd[0] = '\0';
 
-    while (1)
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++)
     {
-        int len = uart_read_bytes(g_cfg->uart_port, data, SIM_AT_MAX_RESP_LEN, rx_wait);
-        if (len <= 0)
-        {
-            vTaskDelay(pdMS_TO_TICKS(10));
+        if (iov[i].len == 0)
             continue;
-        }
+        int written = _tx_write(ch, iov[i].base, iov[i].len);
+        if (written < 0 || (size_t)written != iov[i].len)
+            return SIM_AT_ERR_UART;
+        total += iov[i].len;
+    }
 
-        // Print received bytes
-        if (g_debug) _print_bytes(data, len);
+    if (g_debug) ESP_LOGI(TAG, "--> <%u data bytes>", (unsigned)total);
 
-        // Form responses
-        for (int i = 0; i < len; i++)
-        {
-            char c = (char)data[i];
+    return SIM_AT_OK;
+}
 
-            // Append to line buffer
-            if (s_line_pos < SIM_AT_MAX_RESP_LEN - 1)
-            {
-                s_line_buf[s_line_pos++] = c;
-                s_line_buf[s_line_pos] = '\0';
-            }
+/**
+ * @brief Returns true if a tick deadline has been reached
+ */
+static bool _deadline_reached(TickType_t deadline)
+{
+    return (int32_t)(xTaskGetTickCount() - deadline) >= 0;
+}
 
-            // Detect end of line (CRLF or LF)
-            if (c == '\n')
-            {
-                // Trim CR/LF
-                while (s_line_pos > 0 &&
-                       (s_line_buf[s_line_pos - 1] == '\r' || s_line_buf[s_line_pos - 1] == '\n'))
-                {
-                    s_line_buf[--s_line_pos] = '\0';
-                }
-
-                // Check for empty responses
-                if (s_line_pos <= 0)
-                {
-                    _reset_line_buff();
-                    continue;
-                }
-
-                /* --- Discard echoed command lines --- */
-                if (_line_is_echo(s_line_buf))
-                {
-                    if (g_debug)
-                        ESP_LOGW(TAG, "Echo discarded: %s", s_line_buf);
-                    _reset_line_buff();
-                    continue;
-                }
-
-                /* --- Detect modem reset URC --- */
-                if (_response_is_modem_reset(s_line_buf))
-                {
-                    _reset_line_buff();
-                    continue;
-                }
-
-                // Write to circular buffer
-                // xSemaphoreTake(s_resp_mutex, portMAX_DELAY); // TODO: Por el momento no pero no es mala
-                if (_response_is_urc(s_line_buf) == false)
-                {
-                    _add_resp_to_buff(s_line_buf);
-    
-                    // xSemaphoreGive(s_resp_mutex); // TODO: Por el momento no pero no es mala
-                    xSemaphoreGive(s_sync_sem); // Notify new response available
-                }
+/**
+ * @brief Completes a command and, if it failed, aborts the rest of its chain. Call with
+ * s_eng_lock taken.
+ */
+static void _engine_done(sim_at_slot_t *slot)
+{
+    if (slot->state == SIM_AT_SLOT_RESULT)
+        s_results_pending--;
+    slot->state = SIM_AT_SLOT_DONE;
+    slot->notify = true;
 
-                _reset_line_buff();
-            }
-            // Sometimes it responds with '>' to complete with additional data
-            if (c == '>')
-            {
-                _add_resp_to_buff(s_line_buf);
-                
-                // xSemaphoreGive(s_resp_mutex); // TODO: Por el momento no pero no es mala
-                xSemaphoreGive(s_sync_sem); // Notify new response available
+    bool failed = (slot->result.final != SIM_AT_FINAL_OK) ||
+                  (slot->result.err != SIM_AT_OK && slot->result.err != SIM_AT_ERR_OVERFLOW);
+    if (slot->chain == 0 || !failed)
+        return;
 
-                _reset_line_buff();
-            }
-        }
+    for (size_t i = 0; i < SIM_AT_MAX_PENDING_COMMANDS; i++)
+    {
+        sim_at_slot_t *next = &s_slots[i];
+        if (next->state != SIM_AT_SLOT_QUEUED || next->chain != slot->chain)
+            continue;
+        next->result.err = SIM_AT_ERR_ABORTED;
+        next->state = SIM_AT_SLOT_DONE;
+        next->notify = true;
     }
-    free(data);
 }
 
-simcom_err_t simcom_cmd_sync(const char *cmd, uint32_t timeout_ms)
+/**
+ * @brief Records the outcome of a command and frees the channel. Call with s_eng_lock taken.
+ *
+ * @param slot Completed command
+ * @param final Final result code, SIM_AT_FINAL_NONE on timeout/reset/write error
+ * @param code Numeric +CME/+CMS error code
+ * @param err Error reported when no final result code was received
+ */
+static void _engine_finish(sim_at_slot_t *slot, simcom_final_t final, int code, simcom_err_t err)
 {
-    if (!g_inited)
-        return SIM_AT_ERR_NOT_INIT;
-    if (strlen(cmd) >= SIM_AT_MAX_CMD_LEN)
-        return SIM_AT_ERR_INVALID_ARG;
+    if (slot->state != SIM_AT_SLOT_SENT)
+        return;
 
-    // Clears previous response count
-    // TODO: Ver bien cómo hacer esto
-    s_resp_count = 0;
-    s_resp_tail = s_resp_head;
-    
-    simcom_err_t r = _prv_uart_write_cmd(cmd);
-    if (r != SIM_AT_OK)
+    slot->result.final = final;
+    slot->result.code = code;
+    if (final == SIM_AT_FINAL_NONE)
+        slot->result.err = err;
+    else
+        slot->result.err = slot->result.overflow ? SIM_AT_ERR_OVERFLOW : SIM_AT_OK;
+
+    sim_at_chan_t *ch = &s_chans[slot->chan];
+    if (ch->inflight == slot)
+        ch->inflight = NULL;
+    ch->stats.commands++;
+
+    // The prompted caller keeps the channel to send its data
+    ch->reserved = (final == SIM_AT_FINAL_PROMPT);
+    if (ch->reserved)
     {
-        ESP_LOGE(TAG, "Error sending UART data");
-        return r;
+        ch->owner = slot->owner;
+        ch->deadline = xTaskGetTickCount() + pdMS_TO_TICKS(SIM_AT_PROMPT_HOLD_MS);
     }
 
-    // Drain pending semaphore gives
-    while (xSemaphoreTake(s_sync_sem, 0) == pdTRUE);
+    // The connection takes the channel until it ends or the escape
+    if (final == SIM_AT_FINAL_CONNECT && slot->connect != NULL)
+    {
+        ch->data_handler = slot->connect;
+        ch->data_ctx = slot->connect_ctx;
+        ch->data_tx = xTaskGetTickCount();
+        ch->escaping = false;
+        ch->ok_held = 0;
+        ch->data_mode = true;
+        if (g_debug) ESP_LOGI(TAG, "Data mode on channel %u", (unsigned)slot->chan);
+    }
 
-    // Wait for completion
-    TickType_t wait_ticks = pdMS_TO_TICKS((timeout_ms == 0) ? g_cfg->default_cmd_timeout_ms : timeout_ms);
-    if (xSemaphoreTake(s_sync_sem, wait_ticks) == pdFALSE)
+    // The result line completes the command, other commands can run meanwhile
+    if (final == SIM_AT_FINAL_OK && slot->result_prefix_len > 0)
     {
-        return SIMCOM_ERR_TIMEOUT;
+        slot->result.err = SIMCOM_ERR_TIMEOUT;
+        slot->deadline = xTaskGetTickCount() + slot->result_timeout;
+        slot->state = SIM_AT_SLOT_RESULT;
+        s_results_pending++;
+        return;
     }
 
-    return SIM_AT_OK;
+    _engine_done(slot);
 }
 
-simcom_err_t simcom_wait_resp(uint32_t timeout_ms)
+/**
+ * @brief Leaves the data input mode of a '>' prompt nobody will answer. Call with s_eng_lock taken.
+ */
+static void _engine_cancel_prompt(sim_at_chan_t *ch)
 {
-    if (!g_inited)
-        return SIM_AT_ERR_NOT_INIT;
-
-    // Wait for completion
-    TickType_t wait_ticks = pdMS_TO_TICKS((timeout_ms == 0) ? g_cfg->default_cmd_timeout_ms : timeout_ms);
-    if (xSemaphoreTake(s_sync_sem, wait_ticks) == pdFALSE)
-    {
-        return SIMCOM_ERR_TIMEOUT;
-    }
-
-    return SIM_AT_OK;   
+    _tx_write(ch, "\x1B", 1);
+    ch->reserved = false;
 }
 
-// TODO: No sé si sirve
-simcom_err_t simcom_cmd_sync_ignore_resp(const char *cmd, uint32_t timeout_ms, uint8_t num_responses)
+/**
+ * @brief Returns true if an earlier command of the chain of a slot has not completed yet.
+ * Call with s_eng_lock taken.
+ */
+static bool _engine_chain_waits(const sim_at_slot_t *slot)
 {
-    if (!g_inited)
-        return SIM_AT_ERR_NOT_INIT;
-    if (strlen(cmd) >= SIM_AT_MAX_CMD_LEN)
-        return SIM_AT_ERR_INVALID_ARG;
+    if (slot->chain == 0)
+        return false;
 
-    simcom_err_t r = _prv_uart_write_cmd(cmd);
-    if (r != SIM_AT_OK)
+    for (size_t i = 0; i < SIM_AT_MAX_PENDING_COMMANDS; i++)
     {
-        ESP_LOGE(TAG, "Error sending UART data");
-        return r;
+        const sim_at_slot_t *prev = &s_slots[i];
+        if (prev->chain == slot->chain && (int32_t)(prev->seq - slot->seq) < 0 &&
+            prev->state >= SIM_AT_SLOT_QUEUED && prev->state <= SIM_AT_SLOT_RESULT)
+            return true;
     }
+    return false;
+}
 
-    /* wait for completion */
-    TickType_t wait_ticks = pdMS_TO_TICKS((timeout_ms == 0) ? g_cfg->default_cmd_timeout_ms : timeout_ms);
-    if (xSemaphoreTake(s_sync_sem, wait_ticks) == pdFALSE)
+/**
+ * @brief Writes the oldest queued command of a channel if it is free. Call with s_eng_lock taken.
+ */
+static void _engine_dispatch_chan(uint8_t c)
+{
+    sim_at_chan_t *ch = &s_chans[c];
+    while (ch->inflight == NULL)
     {
-        return SIMCOM_ERR_TIMEOUT;
-    }
+        sim_at_slot_t *next = NULL;
+        for (size_t i = 0; i < SIM_AT_MAX_PENDING_COMMANDS; i++)
+        {
+            sim_at_slot_t *slot = &s_slots[i];
+            if (slot->state != SIM_AT_SLOT_QUEUED)
+                continue;
+            // Routed to a channel that is not open: the first one
+            if ((slot->chan < s_chan_count ? slot->chan : 0) != c)
+                continue;
+            if (s_hold_owner != NULL && slot->owner != s_hold_owner)
+                continue;
+            if (ch->reserved && (ch->owner == NULL || slot->owner != ch->owner))
+                continue;
+            // A channel in data mode only takes its escape
+            if (slot->escape != ch->data_mode)
+                continue;
+            if (_engine_chain_waits(slot))
+                continue;
+            if (next == NULL || (int32_t)(slot->seq - next->seq) < 0)
+                next = slot;
+        }
+        if (next == NULL)
+            return;
 
-    for (int i=0; i<num_responses; i++)
-        simcom_ignore_resp();
+        // In flight before the write, so an immediate answer is routed to it
+        next->chan = c;
+        next->state = SIM_AT_SLOT_SENT;
+        next->deadline = xTaskGetTickCount() + next->timeout;
+        ch->inflight = next;
+        if (next->escape)
+            ch->data_until = xTaskGetTickCount() + ch->data_guard;
 
-    return SIM_AT_OK;
+        simcom_err_t err = (next->cmd[0] == '\0') ? _prv_uart_write_data(ch, next->iov, next->iov_count) : _prv_uart_write_cmd(ch, next->cmd);
+        if (err == SIM_AT_OK)
+            return;
+
+        ESP_LOGE(TAG, "Error sending UART data");
+        _engine_finish(next, SIM_AT_FINAL_NONE, -1, SIM_AT_ERR_UART);
+    }
 }
 
-// TODO: No sé si sirve
-simcom_err_t simcom_uart_flush_rx(void)
+/**
+ * @brief Writes the oldest queued command of each free channel. Call with s_eng_lock taken.
+ */
+static void _engine_dispatch(void)
 {
-    if (!g_inited)
-        return SIM_AT_ERR_NOT_INIT;
-    uart_flush_input(g_cfg->uart_port);
-    return SIM_AT_OK;
+    for (uint8_t c = 0; c < s_chan_count; c++)
+        _engine_dispatch_chan(c);
 }
 
-bool simcom_get_resp(char *buf)
+/**
+ * @brief Returns a slot to the free table, releasing its lines
+ */
+static void _slot_release(sim_at_slot_t *slot)
 {
-    if (s_resp_count == 0)
-        return false; // no new responses
-
-    strncpy(buf, s_responses[s_resp_tail], SIM_AT_MAX_RESP_LEN - 1);
-    buf[SIM_AT_MAX_RESP_LEN - 1] = '\0'; // ensure null-terminated
+    _reader_release_all(&slot->reader);
 
-    s_resp_tail = (s_resp_tail + 1) % SIM_AT_MAX_LINES;
-    s_resp_count--; // maintain count
-    
-    return true;
-}
+    xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+    slot->state = SIM_AT_SLOT_FREE;
+    slot->owner = NULL;
+    xSemaphoreGive(s_eng_lock);
 
-void simcom_ignore_resp(void)
-{
-    if (s_resp_count == 0)
-    return; // nothing to ignore
+    xSemaphoreGive(s_slots_free);
 
-    s_resp_tail = (s_resp_tail + 1) % SIM_AT_MAX_LINES;
-    s_resp_count--;
+    // The parser runs the slot hook, wake it up if it is waiting for input
+    if (s_slot_hook)
+    {
+        s_slot_freed = true;
+        if (s_transport && xTaskGetCurrentTaskHandle() != s_parser_task)
+            s_transport->wake(s_transport->ctx);
+    }
+}
+
+/**
+ * @brief Notifies the completed commands: gives synchronous callers and runs the callbacks of
+ * asynchronous commands, which can read the lines of their command. Call without s_eng_lock.
+ */
+static void _engine_notify(void)
+{
+    while (1)
+    {
+        sim_at_slot_t *slot = NULL;
+
+        xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+        for (size_t i = 0; i < SIM_AT_MAX_PENDING_COMMANDS && slot == NULL; i++)
+        {
+            if (s_slots[i].notify)
+            {
+                slot = &s_slots[i];
+                slot->notify = false;
+            }
+        }
+        xSemaphoreGive(s_eng_lock);
+
+        if (slot == NULL)
+            return;
+
+        if (slot->owner != NULL)
+        {
+            xSemaphoreGive(slot->done);
+            continue;
+        }
+
+        if (slot->cb)
+        {
+            s_cb_slot = slot;
+            s_cb_task = xTaskGetCurrentTaskHandle();
+            slot->cb(&slot->result, slot->ctx);
+            s_cb_slot = NULL;
+            s_cb_task = NULL;
+        }
+
+        // An asynchronous command has no way to send the prompted data
+        if (slot->result.final == SIM_AT_FINAL_PROMPT)
+        {
+            xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+            sim_at_chan_t *ch = &s_chans[slot->chan];
+            if (ch->reserved && ch->owner == NULL)
+            {
+                _engine_cancel_prompt(ch);
+                _engine_dispatch();
+            }
+            xSemaphoreGive(s_eng_lock);
+        }
+        _slot_release(slot);
+    }
+}
+
+/**
+ * @brief Runs the slot hook if slots were freed since its last run or its deadline passed,
+ * like a completion callback
+ */
+static void _engine_slot_hook(void)
+{
+    if (s_slot_hook == NULL)
+        return;
+
+    xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+    bool due = s_hook_timed && (int32_t)(xTaskGetTickCount() - s_hook_deadline) >= 0;
+    if (due)
+        s_hook_timed = false;
+    xSemaphoreGive(s_eng_lock);
+
+    if (!s_slot_freed && !due)
+        return;
+    s_slot_freed = false;
+
+    s_cb_task = xTaskGetCurrentTaskHandle();
+    s_slot_hook(s_slot_hook_ctx);
+    s_cb_task = NULL;
+    _engine_notify();
+}
+
+/**
+ * @brief Completes the command in flight on a channel and sends the next one
+ */
+static void _engine_complete_inflight(sim_at_chan_t *ch, simcom_final_t final, int code, simcom_err_t err)
+{
+    xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+    if (ch->inflight)
+        _engine_finish(ch->inflight, final, code, err);
+    _engine_dispatch();
+    xSemaphoreGive(s_eng_lock);
+
+    _engine_notify();
+}
+
+/**
+ * @brief Fails the commands in flight and the ones waiting for a result line after a modem reset
+ */
+static void _engine_modem_reset(void)
+{
+    xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+    for (size_t c = 0; c < SIM_AT_MAX_CHANNELS; c++)
+    {
+        if (s_chans[c].inflight)
+            _engine_finish(s_chans[c].inflight, SIM_AT_FINAL_NONE, -1, SIMCOM_ERR_MODEM_RESET);
+    }
+    for (size_t i = 0; i < SIM_AT_MAX_PENDING_COMMANDS && s_results_pending > 0; i++)
+    {
+        if (s_slots[i].state != SIM_AT_SLOT_RESULT)
+            continue;
+        s_slots[i].result.err = SIMCOM_ERR_MODEM_RESET;
+        _engine_done(&s_slots[i]);
+    }
+    _engine_dispatch();
+    xSemaphoreGive(s_eng_lock);
+
+    _engine_notify();
+}
+
+/**
+ * @brief Completes the oldest command waiting for a result line with this prefix
+ *
+ * @param ch Channel the line arrived on
+ * @param line NUL-terminated line
+ * @param len Line length
+ * @param info Line tag
+ *
+ * @return False if no command waits for the line
+ */
+static bool _engine_match_result(sim_at_chan_t *ch, const char *line, size_t len, const sim_at_line_info_t *info)
+{
+    if (s_results_pending == 0)
+        return false;
+
+    xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+
+    // A read command in flight (e.g. AT+CNTP? while AT+CNTP waits for "+CNTP: 0") gets the
+    // lines of its own key as information responses
+    sim_at_slot_t *inflight = ch->inflight;
+    if (inflight && inflight->key.len == info->key.len && inflight->key.hash == info->key.hash &&
+        inflight->cmd[strcspn(inflight->cmd, "?\r\n")] == '?')
+    {
+        xSemaphoreGive(s_eng_lock);
+        return false;
+    }
+
+    sim_at_slot_t *slot = NULL;
+    for (size_t i = 0; i < SIM_AT_MAX_PENDING_COMMANDS; i++)
+    {
+        sim_at_slot_t *s = &s_slots[i];
+        if (s->state != SIM_AT_SLOT_RESULT || len < s->result_prefix_len ||
+            memcmp(line, s->result_prefix, s->result_prefix_len) != 0)
+            continue;
+        if (slot == NULL || (int32_t)(s->seq - slot->seq) < 0)
+            slot = s;
+    }
+
+    if (slot)
+    {
+        if (_store_line(line, len, info, slot->reader.owner, SIM_AT_REC_FINAL))
+            slot->result.lines++;
+        else
+            slot->result.overflow = true;
+        slot->result.err = slot->result.overflow ? SIM_AT_ERR_OVERFLOW : SIM_AT_OK;
+        _engine_done(slot);
+        _engine_dispatch();
+    }
+    xSemaphoreGive(s_eng_lock);
+
+    if (slot == NULL)
+        return false;
+    _engine_notify();
+    return true;
+}
+
+/**
+ * @brief Expires the commands in flight, the result lines not received in time and the
+ * forgotten prompt reservations
+ */
+static void _engine_check_timeouts(void)
+{
+    xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+    for (size_t c = 0; c < SIM_AT_MAX_CHANNELS; c++)
+    {
+        sim_at_chan_t *ch = &s_chans[c];
+        sim_at_slot_t *slot = ch->inflight;
+        if (slot && _deadline_reached(slot->deadline))
+        {
+            ESP_LOGW(TAG, "Command timed out: %.*s", (int)strcspn(slot->cmd, "\r\n"), slot->cmd);
+            _engine_finish(slot, SIM_AT_FINAL_NONE, -1, SIMCOM_ERR_TIMEOUT);
+        }
+
+        if (ch->inflight == NULL && ch->reserved && _deadline_reached(ch->deadline))
+        {
+            // Nobody sent the data: leave the input mode (ESC) so other commands can run
+            ESP_LOGW(TAG, "Prompt data not sent, cancelling input");
+            _engine_cancel_prompt(ch);
+        }
+    }
+
+    for (size_t i = 0; i < SIM_AT_MAX_PENDING_COMMANDS && s_results_pending > 0; i++)
+    {
+        sim_at_slot_t *slot = &s_slots[i];
+        if (slot->state == SIM_AT_SLOT_RESULT && _deadline_reached(slot->deadline))
+        {
+            ESP_LOGW(TAG, "Result not received: %.*s", (int)strcspn(slot->cmd, "\r\n"), slot->cmd);
+            _engine_done(slot);
+        }
+    }
+
+    _engine_dispatch();
+    xSemaphoreGive(s_eng_lock);
+
+    _engine_notify();
+}
+
+/**
+ * @brief Ticks until the next engine deadline, portMAX_DELAY if there is none
+ */
+static TickType_t _engine_next_wait(void)
+{
+    TickType_t deadline = 0;
+    bool any = false;
+
+    xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+    for (size_t c = 0; c < SIM_AT_MAX_CHANNELS; c++)
+    {
+        const sim_at_chan_t *ch = &s_chans[c];
+        if (!ch->inflight && !ch->reserved)
+            continue;
+        TickType_t due = ch->inflight ? ch->inflight->deadline : ch->deadline;
+        if (!any || (int32_t)(due - deadline) < 0)
+            deadline = due;
+        any = true;
+    }
+    for (size_t i = 0; i < SIM_AT_MAX_PENDING_COMMANDS && s_results_pending > 0; i++)
+    {
+        const sim_at_slot_t *slot = &s_slots[i];
+        if (slot->state != SIM_AT_SLOT_RESULT)
+            continue;
+        if (!any || (int32_t)(slot->deadline - deadline) < 0)
+            deadline = slot->deadline;
+        any = true;
+    }
+    if (s_slot_hook && s_hook_timed && (!any || (int32_t)(s_hook_deadline - deadline) < 0))
+    {
+        deadline = s_hook_deadline;
+        any = true;
+    }
+    xSemaphoreGive(s_eng_lock);
+
+    if (!any)
+        return portMAX_DELAY;
+
+    int32_t remaining = (int32_t)(deadline - xTaskGetTickCount());
+    return (remaining > 0) ? (TickType_t)remaining : 0;
+}
+
+/**
+ * @brief Returns the reader of the calling context: the command completing in a callback, the
+ * command of a synchronous caller or the stream of lines received outside of a command.
+ */
+static sim_at_reader_t* _current_reader(void)
+{
+    TaskHandle_t me = xTaskGetCurrentTaskHandle();
+    if (s_cb_slot && s_cb_task == me)
+        return &s_cb_slot->reader;
+
+    while (1)
+    {
+        sim_at_slot_t *slot = NULL;
+
+        xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+        for (size_t i = 0; i < SIM_AT_MAX_PENDING_COMMANDS && slot == NULL; i++)
+        {
+            if (s_slots[i].state == SIM_AT_SLOT_DONE && s_slots[i].owner == me)
+                slot = &s_slots[i];
+        }
+        xSemaphoreGive(s_eng_lock);
+
+        if (slot == NULL)
+            return &s_stream_reader;
+        if (!slot->reader.drained)
+            return &slot->reader;
+
+        // Every line of the command was read, following reads go to the stream
+        _slot_release(slot);
+    }
+}
+
+/**
+ * @brief Releases the completed commands kept by the calling task
+ */
+static void _release_task_slots(void)
+{
+    TaskHandle_t me = xTaskGetCurrentTaskHandle();
+    for (size_t i = 0; i < SIM_AT_MAX_PENDING_COMMANDS; i++)
+    {
+        xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+        bool own = (s_slots[i].state == SIM_AT_SLOT_DONE && s_slots[i].owner == me);
+        xSemaphoreGive(s_eng_lock);
+
+        if (own)
+            _slot_release(&s_slots[i]);
+    }
+}
+
+/**
+ * @brief Channel a command is routed to by its prefix. Call with s_eng_lock taken.
+ */
+static uint8_t _engine_route(const char *cmd, TaskHandle_t owner)
+{
+    // Prompt data goes where the prompt was received
+    if (cmd[0] == '\0')
+    {
+        for (uint8_t c = 0; c < SIM_AT_MAX_CHANNELS; c++)
+        {
+            if (s_chans[c].reserved && s_chans[c].owner == owner)
+                return c;
+        }
+        return 0;
+    }
+
+    if (strncasecmp(cmd, "AT", 2) == 0)
+        cmd += 2;
+    uint8_t chan = 0;
+    size_t best = 0;
+    for (size_t i = 0; i < SIM_AT_MAX_ROUTES; i++)
+    {
+        size_t len = strlen(s_routes[i].prefix);
+        if (len > best && strncasecmp(cmd, s_routes[i].prefix, len) == 0)
+        {
+            best = len;
+            chan = s_routes[i].chan;
+        }
+    }
+    return chan;
+}
+
+/**
+ * @brief Fills a free slot with a command and queues it. Call with s_eng_lock taken and a free
+ * slot taken from s_slots_free.
+ *
+ * @param cmd NUL-terminated AT command, empty for prompt data
+ * @param iov Data of the '>' prompt: sent instead of the command if it is empty, or as soon as
+ *            the prompt of the command arrives. NULL for none.
+ * @param iov_count Number of data buffers
+ * @param timeout Command timeout in ticks
+ * @param result Prefix of the result line sent after the OK, which completes the command. NULL
+ *               to complete on the OK.
+ * @param result_timeout Result line timeout in ticks, counted from the OK
+ * @param owner Synchronous caller, NULL for asynchronous commands
+ * @param cb Completion callback
+ * @param ctx Callback context
+ *
+ * @return Queued slot, NULL if the free slot count and the table disagree (should not happen)
+ */
+static sim_at_slot_t* _engine_queue(const char *cmd, const simcom_iov_t *iov, size_t iov_count,
+                                    TickType_t timeout, const char *result, TickType_t result_timeout,
+                                    TaskHandle_t owner, simcom_cmd_cb_t cb, void *ctx)
+{
+    sim_at_slot_t *slot = NULL;
+    for (size_t i = 0; i < SIM_AT_MAX_PENDING_COMMANDS && slot == NULL; i++)
+    {
+        if (s_slots[i].state == SIM_AT_SLOT_FREE)
+            slot = &s_slots[i];
+    }
+    if (slot == NULL)
+        return NULL;
+
+    strcpy(slot->cmd, cmd);
+    slot->iov = iov;
+    slot->iov_count = iov_count;
+    slot->key = sim_at_urc_cmd_key(cmd);
+    slot->seq = s_seq++;
+    slot->timeout = timeout;
+    slot->result_prefix_len = (result != NULL) ? strlen(result) : 0;
+    memcpy(slot->result_prefix, result ? result : "", slot->result_prefix_len + 1);
+    slot->result_timeout = result_timeout;
+    slot->chan = _engine_route(cmd, owner);
+    slot->chain = 0;
+    slot->owner = owner;
+    slot->cb = cb;
+    slot->ctx = ctx;
+    slot->notify = false;
+    slot->result.final = SIM_AT_FINAL_NONE;
+    slot->result.code = -1;
+    slot->result.lines = 0;
+    slot->result.step = 0;
+    slot->result.overflow = false;
+    slot->result.err = SIMCOM_ERR_TIMEOUT;
+    slot->reader.held = -1;
+    slot->reader.drained = false;
+    slot->connect = NULL;
+    slot->connect_ctx = NULL;
+    slot->escape = false;
+    xSemaphoreTake(slot->done, 0);
+    slot->state = SIM_AT_SLOT_QUEUED;
+    return slot;
+}
+
+/**
+ * @brief Runs what the commands just queued completed and wakes up the parser
+ */
+static void _engine_kick(void)
+{
+    // A callback queuing commands leaves the notifications to the loop that runs it
+    TaskHandle_t me = xTaskGetCurrentTaskHandle();
+    if (s_cb_task != me)
+        _engine_notify();
+
+    // The parser computes its wait from the command in flight: wake it up
+    if (s_transport && me != s_parser_task)
+        s_transport->wake(s_transport->ctx);
+}
+
+/**
+ * @brief Queues a command in a free slot and starts it if the channel is free
+ *
+ * @param cmd NUL-terminated AT command, empty for prompt data
+ * @param iov Data of the '>' prompt, see _engine_queue(). NULL for none.
+ * @param iov_count Number of data buffers
+ * @param wait_ticks Time to wait for a free slot
+ * @param timeout Command timeout in ticks
+ * @param result Prefix of the result line that completes the command, NULL for none
+ * @param result_timeout Result line timeout in ticks
+ * @param owner Synchronous caller, NULL for asynchronous commands
+ * @param cb Completion callback
+ * @param ctx Callback context
+ *
+ * @return Queued slot, NULL if there is no free slot
+ */
+static sim_at_slot_t* _engine_submit(const char *cmd, const simcom_iov_t *iov, size_t iov_count,
+                                     TickType_t wait_ticks, TickType_t timeout,
+                                     const char *result, TickType_t result_timeout,
+                                     TaskHandle_t owner, simcom_cmd_cb_t cb, void *ctx)
+{
+    if (xSemaphoreTake(s_slots_free, wait_ticks) == pdFALSE)
+        return NULL;
+
+    xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+    sim_at_slot_t *slot = _engine_queue(cmd, iov, iov_count, timeout, result, result_timeout, owner, cb, ctx);
+    if (slot == NULL)
+    {
+        xSemaphoreGive(s_eng_lock);
+        xSemaphoreGive(s_slots_free);
+        return NULL;
+    }
+    _engine_dispatch();
+    xSemaphoreGive(s_eng_lock);
+
+    _engine_kick();
+    return slot;
+}
+
+/**
+ * @brief Queues a synchronous command that enters or leaves data mode and starts it if the
+ * channel is free
+ *
+ * @param cmd NUL-terminated AT command, "+++" for the escape
+ * @param wait_ticks Time to wait for a free slot
+ * @param timeout Command timeout in ticks
+ * @param connect Data mode handler installed on CONNECT, NULL for the escape
+ * @param ctx Handler context
+ * @param escape Channel in data mode the escape is written to, NULL for a command
+ *
+ * @return Queued slot, NULL if there is no free slot
+ */
+static sim_at_slot_t* _engine_submit_data_mode(const char *cmd, TickType_t wait_ticks, TickType_t timeout,
+                                               simcom_data_mode_handler_t connect, void *ctx,
+                                               sim_at_chan_t *escape)
+{
+    if (xSemaphoreTake(s_slots_free, wait_ticks) == pdFALSE)
+        return NULL;
+
+    xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+    sim_at_slot_t *slot = _engine_queue(cmd, NULL, 0, timeout, NULL, 0, xTaskGetCurrentTaskHandle(), NULL, NULL);
+    if (slot == NULL)
+    {
+        xSemaphoreGive(s_eng_lock);
+        xSemaphoreGive(s_slots_free);
+        return NULL;
+    }
+    slot->connect = connect;
+    slot->connect_ctx = ctx;
+    if (escape != NULL)
+    {
+        slot->escape = true;
+        slot->chan = (uint8_t)(escape - s_chans);
+    }
+    _engine_dispatch();
+    xSemaphoreGive(s_eng_lock);
+
+    _engine_kick();
+    return slot;
+}
+
+/**
+ * @brief Returns the channel in data mode, NULL if there is none. Call with s_eng_lock taken.
+ */
+static sim_at_chan_t* _data_mode_chan(void)
+{
+    for (size_t c = 0; c < SIM_AT_MAX_CHANNELS; c++)
+    {
+        if (s_chans[c].data_mode)
+            return &s_chans[c];
+    }
+    return NULL;
+}
+
+/**
+ * @brief Returns the final result code of a line tag, SIM_AT_FINAL_NONE if it is not final
+ */
+static simcom_final_t _line_final_type(sim_at_line_type_t type)
+{
+    switch (type)
+    {
+    case SIM_AT_LINE_OK:            return SIM_AT_FINAL_OK;
+    case SIM_AT_LINE_ERROR:         return SIM_AT_FINAL_ERROR;
+    case SIM_AT_LINE_CME_ERROR:     return SIM_AT_FINAL_CME_ERROR;
+    case SIM_AT_LINE_CMS_ERROR:     return SIM_AT_FINAL_CMS_ERROR;
+    case SIM_AT_LINE_PROMPT:        return SIM_AT_FINAL_PROMPT;
+    case SIM_AT_LINE_CONNECT:       return SIM_AT_FINAL_CONNECT;
+    default:                        return SIM_AT_FINAL_NONE;
+    }
+}
+
+/**
+ * @brief Stores a line in the stream, read by the tasks without a command
+ *
+ * @param line NUL-terminated line
+ * @param len Line length
+ * @param info Line tag
+ */
+static void _route_stream(const char *line, size_t len, const sim_at_line_info_t *info)
+{
+    if (s_stream_unread >= (int)SIM_AT_MAX_STREAM_LINES)
+        _stream_trim((int)SIM_AT_MAX_STREAM_LINES - 1, false);
+    if (_store_line(line, len, info, SIM_AT_OWNER_STREAM, 0))
+        xSemaphoreGive(s_stream_sem); // Notify new response available
+}
+
+/**
+ * @brief Stores a line for its owner and completes the command in flight on its final result.
+ * 
+ * Lines received while a command is in flight belong to it, and its caller is only woken up
+ * by the final result code, so all the intermediate lines are already stored when it wakes
+ * up. Lines received outside of a command go to the stream (e.g. result URCs that arrive
+ * after the OK), which keeps at most SIM_AT_MAX_STREAM_LINES unread lines.
+ * 
+ * @param ch Channel the line arrived on
+ * @param line NUL-terminated line
+ * @param len Line length
+ * @param info Line tag
+ */
+static void _route_line(sim_at_chan_t *ch, const char *line, size_t len, const sim_at_line_info_t *info)
+{
+    sim_at_slot_t *slot = ch->inflight;
+
+    if (slot == NULL)
+    {
+        _route_stream(line, len, info);
+        return;
+    }
+
+    // The prompt of a command with data and the OK of a command with a result line are
+    // followed by more lines of the same command. They are not stored: the arena is reused in
+    // order, a record held until a late result line would block it meanwhile.
+    simcom_final_t final = _line_final_type(info->type);
+    bool data = (final == SIM_AT_FINAL_PROMPT && slot->iov != NULL && slot->cmd[0] != '\0');
+    bool wait_result = (final == SIM_AT_FINAL_OK && slot->result_prefix_len > 0);
+    if (!data && !wait_result)
+    {
+        bool last = (final != SIM_AT_FINAL_NONE);
+        if (_store_line(line, len, info, slot->reader.owner, last ? SIM_AT_REC_FINAL : 0))
+            slot->result.lines++;
+        else
+            slot->result.overflow = true;
+    }
+
+    if (data)
+    {
+        // Answer the prompt right away, the timeout restarts with the data
+        xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+        if (ch->inflight == slot)
+        {
+            slot->deadline = xTaskGetTickCount() + slot->timeout;
+            if (_prv_uart_write_data(ch, slot->iov, slot->iov_count) != SIM_AT_OK)
+            {
+                ESP_LOGE(TAG, "Error sending UART data");
+                _engine_finish(slot, SIM_AT_FINAL_NONE, -1, SIM_AT_ERR_UART);
+                _engine_dispatch();
+            }
+        }
+        xSemaphoreGive(s_eng_lock);
+
+        _engine_notify();
+        return;
+    }
+
+    if (final != SIM_AT_FINAL_NONE)
+        _engine_complete_inflight(ch, final, info->code, SIM_AT_OK);
+}
+
+/**
+ * @brief True if the line has the prefix of the command in flight on the channel
+ */
+static bool _response_of_inflight(const sim_at_chan_t *ch, const char *line, sim_at_line_key_t key)
+{
+    sim_at_slot_t *slot = ch->inflight;
+    if (slot == NULL || slot->key.len != key.len || slot->key.hash != key.hash)
+        return false;
+
+    const char *cmd = slot->cmd + ((strncasecmp(slot->cmd, "AT", 2) == 0) ? 2 : 0);
+    return memcmp(cmd, line, key.len) == 0;
+}
+
+/**
+ * @brief Returns the URC class of a line. Lines with the prefix of the command in flight are
+ * its information responses, even if the same prefix is also sent as a URC (e.g. +CREG).
+ *
+ * @param ch Channel the line arrived on
+ * @param line NUL-terminated line (already CR/LF stripped)
+ * @param key Line prefix key
+ */
+static sim_at_urc_class_t _response_urc_class(const sim_at_chan_t *ch, const char *line, sim_at_line_key_t key)
+{
+    if (key.len == 0)
+        return SIM_AT_URC_NONE;
+
+    // Length-counted data is always read by its handler, the line is routed as well
+    sim_at_urc_class_t type = sim_at_urc_classify(line, key);
+    if (type != SIM_AT_URC_DATA && _response_of_inflight(ch, line, key))
+        return SIM_AT_URC_NONE;
+    return type;
+}
+
+/**
+ * @brief Returns true if the line is the *ATREADY: 1 modem reset URC.
+ *        Sets g_modem_reset flag as a side effect.
+ *
+ * @param line NUL-terminated line (already CR/LF stripped)
+ * @param info Line tag
+ */
+static bool _response_is_modem_reset(const char *line, const sim_at_line_info_t *info)
+{
+    if (info->type == SIM_AT_LINE_INFO && info->key.len == 8 &&
+        memcmp(line, "*ATREADY", 8) == 0 && line[info->value_off] == '1')
+    {
+        g_modem_reset = true;
+        ESP_LOGW(TAG, "Modem reset detected (*ATREADY: 1)");
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Returns the channel to command mode and sends the commands it held back. An escape
+ * in flight completes: the data ended on its OK, or the modem ended the connection and the
+ * escape has nothing left to do.
+ *
+ * @param ch Channel in data mode
+ */
+static void _engine_leave_data_mode(sim_at_chan_t *ch)
+{
+    xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+    ch->data_mode = false;
+    ch->escaping = false;
+    ch->data_handler = NULL;
+    ch->ok_held = 0;
+    _reset_line_buff(ch);
+
+    if (ch->inflight && ch->inflight->escape)
+        _engine_finish(ch->inflight, SIM_AT_FINAL_OK, -1, SIM_AT_OK);
+    for (size_t i = 0; i < SIM_AT_MAX_PENDING_COMMANDS; i++)
+    {
+        sim_at_slot_t *slot = &s_slots[i];
+        if (slot->state != SIM_AT_SLOT_QUEUED || !slot->escape || &s_chans[slot->chan] != ch)
+            continue;
+        slot->result.final = SIM_AT_FINAL_OK;
+        slot->result.err = SIM_AT_OK;
+        _engine_done(slot);
+    }
+    _engine_dispatch();
+    xSemaphoreGive(s_eng_lock);
+
+    if (g_debug) ESP_LOGI(TAG, "Command mode on channel %u", (unsigned)(ch - s_chans));
+    _engine_notify();
+}
+
+/**
+ * @brief Passes received bytes to the data mode handler of a channel
+ *
+ * Once the guard time after "+++" is over, the OK of the escape ends the data and completes
+ * the escape. It can arrive split across reads: the bytes that may be its start are held
+ * back from the handler until the next ones tell. The handler ends the data when the modem
+ * ends the connection.
+ *
+ * @return Bytes of data consumed (data and OK), the rest are lines
+ */
+static size_t _data_mode_input(sim_at_chan_t *ch, const uint8_t *data, size_t len)
+{
+    static const char ok[] = "\r\nOK\r\n";
+    const size_t ok_len = sizeof(ok) - 1;
+    size_t held = ch->ok_held;
+    size_t match = 0;
+    size_t end = len;
+    bool escaped = false;
+
+    if (ch->escaping && _deadline_reached(ch->data_until))
+    {
+        match = held;
+        for (size_t i = 0; i < len && !escaped; i++)
+        {
+            match = sim_at_line_match(ok, ok_len, match, data[i]);
+            if (match == ok_len)
+            {
+                end = i + 1;
+                escaped = true;
+            }
+        }
+    }
+
+    // Data: the held bytes and the new ones, up to what may be (or is) the OK
+    size_t n = held + end - match;
+    size_t from_held = (n < held) ? n : held;
+    bool closed = false;
+    if (from_held > 0)
+        ch->data_handler((const uint8_t *)ok, from_held, &closed, ch->data_ctx);
+    if (!closed && n > held)
+    {
+        size_t took = ch->data_handler(data, n - held, &closed, ch->data_ctx);
+        if (closed)
+        {
+            // The modem ended the connection, what follows are lines
+            _engine_leave_data_mode(ch);
+            return (took < n - held) ? took : n - held;
+        }
+    }
+    if (closed)
+    {
+        _engine_leave_data_mode(ch);
+        return 0;
+    }
+    if (escaped)
+    {
+        _engine_leave_data_mode(ch);
+        return end;
+    }
+    ch->ok_held = match;
+    return len;
+}
+
+/**
+ * @brief Assembles received bytes into lines and routes them
+ * 
+ * @param ch Channel the bytes arrived on
+ * @param data Received bytes
+ * @param len Number of bytes
+ */
+static void _parse_bytes(sim_at_chan_t *ch, const uint8_t *data, int len)
+{
+    ch->stats.rx_bytes += (uint32_t)len;
+
+    // Form responses
+    for (int i = 0; i < len; i++)
+    {
+        // Data mode: the bytes are not lines until the channel leaves it
+        if (ch->data_mode)
+        {
+            i += (int)_data_mode_input(ch, &data[i], (size_t)(len - i)) - 1;
+            continue;
+        }
+
+        // Data announced by the last data URC line, passed on as it is
+        if (ch->data_left > 0)
+        {
+            size_t n = (size_t)(len - i);
+            if (n > ch->data_left)
+                n = ch->data_left;
+            sim_at_urc_data(ch->data_urc, &data[i], n);
+            ch->data_left -= n;
+            i += (int)n - 1;
+            continue;
+        }
+
+        char c = (char)data[i];
+
+        // Append to line buffer
+        if (ch->line_pos < SIM_AT_MAX_RESP_LEN - 1)
+        {
+            ch->line_buf[ch->line_pos++] = c;
+            ch->line_buf[ch->line_pos] = '\0';
+        }
+
+        // Detect end of line (CRLF or LF)
+        if (c == '\n')
+        {
+            // Trim CR/LF
+            while (ch->line_pos > 0 &&
+                   (ch->line_buf[ch->line_pos - 1] == '\r' || ch->line_buf[ch->line_pos - 1] == '\n'))
+            {
+                ch->line_buf[--ch->line_pos] = '\0';
+            }
+
+            // Check for empty responses
+            if (ch->line_pos <= 0)
+            {
+                _reset_line_buff(ch);
+                continue;
+            }
+
+            // Classify the line once, every later decision uses the tag
+            ch->stats.lines++;
+            sim_at_line_info_t info;
+            sim_at_line_classify(ch->line_buf, ch->line_pos, ch->last_cmd, ch->last_cmd_len, &info);
+
+            /* --- Discard echoed command lines --- */
+            if (info.type == SIM_AT_LINE_ECHO)
+            {
+                if (g_debug)
+                    ESP_LOGW(TAG, "Echo discarded: %s", ch->line_buf);
+                _reset_line_buff(ch);
+                continue;
+            }
+
+            /* --- Detect modem reset URC --- */
+            if (_response_is_modem_reset(ch->line_buf, &info))
+            {
+                // The command in flight and the pending results will never complete
+                _engine_modem_reset();
+                if (_response_urc_class(ch, ch->line_buf, info.key) == SIM_AT_URC_HANDLED)
+                    sim_at_urc_post(ch->line_buf, ch->line_pos);
+                else
+                    _route_stream(ch->line_buf, ch->line_pos, &info);   // for simcom_wait_atready()
+                _reset_line_buff(ch);
+                continue;
+            }
+
+            /* --- Result lines of commands completed by them --- */
+            if (_engine_match_result(ch, ch->line_buf, ch->line_pos, &info))
+            {
+                _reset_line_buff(ch);
+                continue;
+            }
+
+            /* --- Dispatch URCs, write responses to circular buffer --- */
+            switch (_response_urc_class(ch, ch->line_buf, info.key))
+            {
+            case SIM_AT_URC_HANDLED:
+                sim_at_urc_post(ch->line_buf, ch->line_pos);
+                break;
+
+            case SIM_AT_URC_DISCARD:
+                if (g_debug)
+                    ESP_LOGW(TAG, "URC discarded: %s", ch->line_buf);
+                break;
+
+            case SIM_AT_URC_DATA:
+                ch->data_left = sim_at_urc_data_line(ch->line_buf, ch->line_pos, info.key, &ch->data_urc);
+                // Data read by a command (e.g. AT+CIPRXGET=2): its line is also a response
+                if (_response_of_inflight(ch, ch->line_buf, info.key))
+                    _route_line(ch, ch->line_buf, ch->line_pos, &info);
+                break;
+
+            default:
+                _route_line(ch, ch->line_buf, ch->line_pos, &info);
+                break;
+            }
+
+            _reset_line_buff(ch);
+        }
+        // Sometimes it responds with '>' at the start of a line to complete with additional data
+        else if (c == '>' && ch->line_pos == 1)
+        {
+            sim_at_line_info_t info;
+            sim_at_line_classify(ch->line_buf, ch->line_pos, NULL, 0, &info);
+            _route_line(ch, ch->line_buf, ch->line_pos, &info);
+            _reset_line_buff(ch);
+        }
+    }
+}
+
+/**
+ * @brief Drops the partial lines and the data URC bytes still expected on every channel
+ */
+static void _engine_reset_input(void)
+{
+    for (size_t c = 0; c < SIM_AT_MAX_CHANNELS; c++)
+    {
+        _reset_line_buff(&s_chans[c]);
+        if (s_chans[c].data_left > 0)
+        {
+            s_chans[c].data_left = 0;
+            sim_at_urc_data(s_chans[c].data_urc, NULL, 0);
+        }
+    }
+}
+
+/**
+ * @brief Takes the transport and the channel count set by simcom_switch_transport(). Runs in
+ * the parser task, between two reads, so no read is left on the old transport.
+ */
+static void _engine_adopt_transport(void)
+{
+    xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+    if (s_next_transport != s_transport)
+    {
+        // The bytes of a half received line belong to the old framing
+        s_transport = s_next_transport;
+        _engine_reset_input();
+        for (size_t c = 0; c < SIM_AT_MAX_CHANNELS; c++)
+            s_chans[c].last_cmd_len = 0;
+    }
+    s_chan_count = s_next_chan_count;
+    s_next_transport = NULL;
+    _engine_dispatch();
+    xSemaphoreGive(s_eng_lock);
+
+    xSemaphoreGive(s_switch_sem);
+}
+
+/* Parser task: blocks on the transport, assembles lines, routes them */
+static void _s_parser_task_fn(void *arg)
+{
+    static uint8_t data[SIM_AT_MAX_RESP_LEN];
+    bool link_down = false;
+
+    while (1)
+    {
+        // Sleeps until the transport has data (the UART driver reports a line feed, a full
+        // RX FIFO or an RX idle timeout, e.g. the '>' prompt without line feed).
+        // Wakes up earlier if the command in flight reaches its timeout or one is submitted.
+        if (s_next_transport != NULL)
+            _engine_adopt_transport();
+
+        TickType_t wait = _engine_next_wait();
+        uint32_t wait_ms = (wait == portMAX_DELAY) ? SIMCOM_TRANSPORT_WAIT_FOREVER : wait * portTICK_PERIOD_MS;
+        uint8_t chan = 0;
+        int len = s_transport->read_chan ?
+                  s_transport->read_chan(s_transport->ctx, data, sizeof(data), wait_ms, &chan) :
+                  s_transport->read(s_transport->ctx, data, sizeof(data), wait_ms);
+
+        if (len > 0)
+        {
+            link_down = false;
+
+            // Print received bytes
+            if (g_debug) _print_bytes(data, len);
+
+            _parse_bytes(&s_chans[chan < SIM_AT_MAX_CHANNELS ? chan : 0], data, len);
+        }
+        else if (len == SIMCOM_TRANSPORT_ERR_OVERFLOW)
+        {
+            // Received data is lost, restart from a clean line
+            ESP_LOGW(TAG, "RX overflow, input flushed");
+            _engine_reset_input();
+        }
+        else if (len == SIMCOM_TRANSPORT_ERR_IO)
+        {
+            // Pending commands time out; retry without spinning
+            if (!link_down)
+                ESP_LOGE(TAG, "Modem link read error");
+            link_down = true;
+            vTaskDelay(pdMS_TO_TICKS(100));
+        }
+
+        _engine_check_timeouts();
+        _engine_slot_hook();
+    }
+}
+
+/**
+ * @brief Waits for the final result code of a synchronous command. While queued behind other
+ * commands the wait goes on, once written the command expires at its deadline, and so does
+ * the wait for its result line.
+ */
+static simcom_err_t _cmd_wait(sim_at_slot_t *slot, TickType_t wait_ticks, simcom_cmd_result_t *result)
+{
+    while (xSemaphoreTake(slot->done, wait_ticks) == pdFALSE)
+    {
+        xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+        if (slot->state == SIM_AT_SLOT_SENT && _deadline_reached(slot->deadline))
+        {
+            _engine_finish(slot, SIM_AT_FINAL_NONE, -1, SIMCOM_ERR_TIMEOUT);
+            _engine_dispatch();
+        }
+        else if (slot->state == SIM_AT_SLOT_RESULT && _deadline_reached(slot->deadline))
+        {
+            _engine_done(slot);
+        }
+        xSemaphoreGive(s_eng_lock);
+    
+        _engine_notify();
+    }
+
+    if (result)
+        *result = slot->result;
+
+    return slot->result.err;
+}
+
+simcom_err_t simcom_cmd_transact(const char *cmd, uint32_t timeout_ms, simcom_cmd_result_t *result)
+{
+    if (!g_inited)
+        return SIM_AT_ERR_NOT_INIT;
+    if (strlen(cmd) >= SIM_AT_MAX_CMD_LEN)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (xTaskGetCurrentTaskHandle() == s_parser_task)
+    {
+        ESP_LOGE(TAG, "Synchronous command from a completion callback: %s", cmd);
+        return SIM_AT_ERR_BUSY;
+    }
+
+    // Discards responses of previous commands
+    _release_task_slots();
+    _stream_trim(0, true);
+
+    TickType_t wait_ticks = pdMS_TO_TICKS((timeout_ms == 0) ? g_cfg->default_cmd_timeout_ms : timeout_ms);
+    sim_at_slot_t *slot = _engine_submit(cmd, NULL, 0, wait_ticks, wait_ticks, NULL, 0, xTaskGetCurrentTaskHandle(), NULL, NULL);
+    if (slot == NULL)
+        return SIM_AT_ERR_BUSY;
+
+    return _cmd_wait(slot, wait_ticks, result);
+}
+
+simcom_err_t simcom_cmd_data(const simcom_iov_t *iov, size_t iov_count, uint32_t timeout_ms, simcom_cmd_result_t *result)
+{
+    if (!g_inited)
+        return SIM_AT_ERR_NOT_INIT;
+    if (iov == NULL || iov_count == 0)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (xTaskGetCurrentTaskHandle() == s_parser_task)
+    {
+        ESP_LOGE(TAG, "Prompt data from a completion callback");
+        return SIM_AT_ERR_BUSY;
+    }
+
+    // Only the task the '>' prompt answered can send data
+    TaskHandle_t me = xTaskGetCurrentTaskHandle();
+    xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+    bool prompted = false;
+    for (size_t c = 0; c < SIM_AT_MAX_CHANNELS; c++)
+        prompted |= s_chans[c].reserved && s_chans[c].owner == me;
+    xSemaphoreGive(s_eng_lock);
+    if (!prompted)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    _release_task_slots();
+    _stream_trim(0, true);
+
+    TickType_t wait_ticks = pdMS_TO_TICKS((timeout_ms == 0) ? g_cfg->default_cmd_timeout_ms : timeout_ms);
+    sim_at_slot_t *slot = _engine_submit("", iov, iov_count, wait_ticks, wait_ticks, NULL, 0, me, NULL, NULL);
+    if (slot == NULL)
+        return SIM_AT_ERR_BUSY;
+
+    return _cmd_wait(slot, wait_ticks, result);
+}
+
+simcom_err_t simcom_cmd_sync(const char *cmd, uint32_t timeout_ms)
+{
+    return simcom_cmd_transact(cmd, timeout_ms, NULL);
+}
+
+simcom_err_t simcom_cmd_async(const char *cmd, uint32_t timeout_ms, simcom_cmd_cb_t cb, void *ctx)
+{
+    if (!g_inited)
+        return SIM_AT_ERR_NOT_INIT;
+    if (cmd == NULL || strlen(cmd) >= SIM_AT_MAX_CMD_LEN)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    TickType_t timeout = pdMS_TO_TICKS((timeout_ms == 0) ? g_cfg->default_cmd_timeout_ms : timeout_ms);
+    if (_engine_submit(cmd, NULL, 0, 0, timeout, NULL, 0, NULL, cb, ctx) == NULL)
+        return SIM_AT_ERR_BUSY;
+
+    return SIM_AT_OK;
+}
+
+/**
+ * @brief Returns true if a command step is valid
+ */
+static bool _step_valid(const simcom_cmd_step_t *step)
+{
+    if (step->cmd == NULL || step->cmd[0] == '\0' || strlen(step->cmd) >= SIM_AT_MAX_CMD_LEN)
+        return false;
+    if (step->data != NULL && step->data_count == 0)
+        return false;
+    if (step->result != NULL && strlen(step->result) >= SIM_AT_RESULT_PREFIX_LEN)
+        return false;
+    return true;
+}
+
+simcom_err_t simcom_cmd_step_sync(const simcom_cmd_step_t *step, simcom_cmd_result_t *result)
+{
+    if (!g_inited)
+        return SIM_AT_ERR_NOT_INIT;
+    if (step == NULL || !_step_valid(step))
+        return SIM_AT_ERR_INVALID_ARG;
+    if (xTaskGetCurrentTaskHandle() == s_parser_task)
+    {
+        ESP_LOGE(TAG, "Synchronous command from a completion callback: %s", step->cmd);
+        return SIM_AT_ERR_BUSY;
+    }
+
+    // Discards responses of previous commands
+    _release_task_slots();
+    _stream_trim(0, true);
+
+    TickType_t wait_ticks = pdMS_TO_TICKS((step->timeout_ms == 0) ? g_cfg->default_cmd_timeout_ms : step->timeout_ms);
+    TickType_t result_ticks = pdMS_TO_TICKS((step->result_timeout_ms == 0) ? g_cfg->default_cmd_timeout_ms : step->result_timeout_ms);
+    sim_at_slot_t *slot = _engine_submit(step->cmd, step->data, step->data_count, wait_ticks, wait_ticks,
+                                         step->result, result_ticks, xTaskGetCurrentTaskHandle(), NULL, NULL);
+    if (slot == NULL)
+        return SIM_AT_ERR_BUSY;
+
+    return _cmd_wait(slot, wait_ticks, result);
+}
+
+simcom_err_t simcom_cmd_connect(const char *cmd, uint32_t timeout_ms, simcom_data_mode_handler_t handler,
+                                void *ctx, simcom_cmd_result_t *result)
+{
+    if (!g_inited)
+        return SIM_AT_ERR_NOT_INIT;
+    if (cmd == NULL || handler == NULL || strlen(cmd) >= SIM_AT_MAX_CMD_LEN)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (xTaskGetCurrentTaskHandle() == s_parser_task)
+    {
+        ESP_LOGE(TAG, "Synchronous command from a completion callback: %s", cmd);
+        return SIM_AT_ERR_BUSY;
+    }
+    if (simcom_data_mode_active())
+        return SIM_AT_ERR_BUSY;
+
+    _release_task_slots();
+    _stream_trim(0, true);
+
+    TickType_t wait_ticks = pdMS_TO_TICKS((timeout_ms == 0) ? g_cfg->default_cmd_timeout_ms : timeout_ms);
+    sim_at_slot_t *slot = _engine_submit_data_mode(cmd, wait_ticks, wait_ticks, handler, ctx, NULL);
+    if (slot == NULL)
+        return SIM_AT_ERR_BUSY;
+
+    return _cmd_wait(slot, wait_ticks, result);
+}
+
+simcom_err_t simcom_data_mode_write(const void *data, size_t len)
+{
+    if (!g_inited)
+        return SIM_AT_ERR_NOT_INIT;
+    if (data == NULL && len > 0)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    const uint8_t *p = data;
+    while (len > 0)
+    {
+        size_t n = (len < SIM_AT_UART_TX_BUF_LEN) ? len : SIM_AT_UART_TX_BUF_LEN;
+
+        xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+        sim_at_chan_t *ch = _data_mode_chan();
+        if (ch == NULL || ch->escaping || ch->data_writing)
+        {
+            xSemaphoreGive(s_eng_lock);
+            return (ch == NULL) ? SIM_AT_ERR_INVALID_ARG : SIM_AT_ERR_BUSY;
+        }
+        ch->data_writing = true;
+        xSemaphoreGive(s_eng_lock);
+
+        // A full transmit buffer blocks the write: the parser goes on reading meanwhile
+        int64_t start = esp_timer_get_time();
+        int written = _tx_transport_write(ch, p, n);
+        uint32_t took = (uint32_t)(esp_timer_get_time() - start);
+
+        xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+        _tx_count(ch, written, took);
+        ch->data_tx = xTaskGetTickCount();
+        ch->data_writing = false;
+        xSemaphoreGive(s_eng_lock);
+
+        if (written < 0 || (size_t)written != n)
+            return SIM_AT_ERR_UART;
+        p += n;
+        len -= n;
+    }
+    return SIM_AT_OK;
+}
+
+simcom_err_t simcom_data_mode_escape(uint32_t guard_ms)
+{
+    if (!g_inited)
+        return SIM_AT_ERR_NOT_INIT;
+    if (xTaskGetCurrentTaskHandle() == s_parser_task)
+    {
+        ESP_LOGE(TAG, "Data mode escape from a completion callback");
+        return SIM_AT_ERR_BUSY;
+    }
+
+    TickType_t guard = pdMS_TO_TICKS((guard_ms == 0) ? SIM_AT_ESCAPE_GUARD_MS : guard_ms);
+    sim_at_chan_t *ch;
+
+    // Nothing written for the guard time, then no more writes until the escape completes
+    while (1)
+    {
+        xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+        ch = _data_mode_chan();
+        if (ch == NULL || ch->escaping)
+        {
+            xSemaphoreGive(s_eng_lock);
+            return (ch == NULL) ? SIM_AT_OK : SIM_AT_ERR_BUSY;
+        }
+        // One tick more: the tick count of the last write is rounded down
+        int32_t idle = ch->data_writing ? 1 : (int32_t)(ch->data_tx + guard + 1 - xTaskGetTickCount());
+        if (idle <= 0 && s_transport->tx_pending && s_transport->tx_pending(s_transport->ctx) > 0)
+        {
+            // Still in the transmit buffer: the silence starts once it is out
+            ch->data_tx = xTaskGetTickCount();
+            idle = 1;
+        }
+        if (idle <= 0)
+        {
+            ch->escaping = true;
+            ch->data_guard = guard;
+            ch->data_until = xTaskGetTickCount() + guard;
+            xSemaphoreGive(s_eng_lock);
+            break;
+        }
+        xSemaphoreGive(s_eng_lock);
+        vTaskDelay((TickType_t)idle);
+    }
+
+    _release_task_slots();
+    _stream_trim(0, true);
+
+    // The modem answers after its own guard time
+    TickType_t wait_ticks = guard + pdMS_TO_TICKS(g_cfg->default_cmd_timeout_ms);
+    sim_at_slot_t *slot = _engine_submit_data_mode("+++", wait_ticks, wait_ticks, NULL, NULL, ch);
+    simcom_cmd_result_t result = { .err = SIM_AT_ERR_BUSY };
+    if (slot != NULL)
+        _cmd_wait(slot, wait_ticks, &result);
+
+    if (result.err == SIM_AT_OK && result.final == SIM_AT_FINAL_OK)
+        return SIM_AT_OK;
+
+    // Still in data mode: writes go on
+    xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+    ch->escaping = false;
+    xSemaphoreGive(s_eng_lock);
+    return (result.err != SIM_AT_OK) ? result.err : SIM_AT_ERR_RESPONSE;
+}
+
+bool simcom_data_mode_active(void)
+{
+    if (!g_inited || s_eng_lock == NULL)
+        return false;
+
+    xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+    bool active = (_data_mode_chan() != NULL);
+    xSemaphoreGive(s_eng_lock);
+    return active;
+}
+
+void simcom_cmd_set_slot_hook(simcom_slot_hook_t fn, void *ctx)
+{
+    s_slot_hook_ctx = ctx;
+    s_slot_hook = fn;
+}
+
+void simcom_cmd_hook_at(TickType_t deadline)
+{
+    if (s_eng_lock == NULL)
+        return;
+
+    xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+    bool earlier = !s_hook_timed || (int32_t)(deadline - s_hook_deadline) < 0;
+    if (earlier)
+    {
+        s_hook_deadline = deadline;
+        s_hook_timed = true;
+    }
+    xSemaphoreGive(s_eng_lock);
+
+    // The parser recomputes its wait
+    if (earlier && s_transport && xTaskGetCurrentTaskHandle() != s_parser_task)
+        s_transport->wake(s_transport->ctx);
+}
+
+simcom_err_t simcom_cmd_chain_async(const simcom_cmd_step_t *steps, size_t count, simcom_cmd_cb_t cb, void *ctx)
+{
+    if (!g_inited)
+        return SIM_AT_ERR_NOT_INIT;
+    if (steps == NULL || count == 0 || count > SIM_AT_MAX_PENDING_COMMANDS)
+        return SIM_AT_ERR_INVALID_ARG;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!_step_valid(&steps[i]))
+            return SIM_AT_ERR_INVALID_ARG;
+    }
+
+    // Like a synchronous command, frees the lines of the previous commands of the caller
+    if (s_cb_task != xTaskGetCurrentTaskHandle())
+        _release_task_slots();
+
+    // The chain is queued whole or not at all
+    size_t taken = 0;
+    while (taken < count && xSemaphoreTake(s_slots_free, 0) == pdTRUE)
+        taken++;
+    if (taken < count)
+    {
+        while (taken-- > 0)
+            xSemaphoreGive(s_slots_free);
+        return SIM_AT_ERR_BUSY;
+    }
+
+    xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+    if (++s_chain_seq == 0)
+        s_chain_seq = 1;
+    for (size_t i = 0; i < count; i++)
+    {
+        const simcom_cmd_step_t *step = &steps[i];
+        uint32_t timeout_ms = (step->timeout_ms == 0) ? g_cfg->default_cmd_timeout_ms : step->timeout_ms;
+        uint32_t result_ms = (step->result_timeout_ms == 0) ? g_cfg->default_cmd_timeout_ms : step->result_timeout_ms;
+        sim_at_slot_t *slot = _engine_queue(step->cmd, step->data, step->data_count, pdMS_TO_TICKS(timeout_ms),
+                                            step->result, pdMS_TO_TICKS(result_ms), NULL, cb, ctx);
+        if (slot == NULL)
+        {
+            // Should not happen, the slots were counted above
+            xSemaphoreGive(s_slots_free);
+            continue;
+        }
+        slot->chain = s_chain_seq;
+        slot->result.step = (uint8_t)i;
+    }
+    _engine_dispatch();
+    xSemaphoreGive(s_eng_lock);
+
+    _engine_kick();
+    return SIM_AT_OK;
+}
+
+simcom_err_t simcom_wait_resp(uint32_t timeout_ms)
+{
+    if (!g_inited)
+        return SIM_AT_ERR_NOT_INIT;
+
+    // Wait for an unread line outside of a command
+    TickType_t wait_ticks = pdMS_TO_TICKS((timeout_ms == 0) ? g_cfg->default_cmd_timeout_ms : timeout_ms);
+    TickType_t start = xTaskGetTickCount();
+    while (s_stream_unread == 0)
+    {
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if (elapsed >= wait_ticks)
+            return SIMCOM_ERR_TIMEOUT;
+        xSemaphoreTake(s_stream_sem, wait_ticks - elapsed);
+    }
+
+    return SIM_AT_OK;   
+}
+
+// TODO: No sé si sirve
+simcom_err_t simcom_cmd_sync_ignore_resp(const char *cmd, uint32_t timeout_ms, uint8_t num_responses)
+{
+    simcom_err_t r = simcom_cmd_sync(cmd, timeout_ms);
+    if (r != SIM_AT_OK)
+        return r;
+
+    for (int i=0; i<num_responses; i++)
+        simcom_ignore_resp();
+
+    return SIM_AT_OK;
+}
+
+// TODO: No sé si sirve
+simcom_err_t simcom_uart_flush_rx(void)
+{
+    if (!g_inited)
+        return SIM_AT_ERR_NOT_INIT;
+    s_transport->flush(s_transport->ctx);
+    return SIM_AT_OK;
+}
+
+simcom_err_t simcom_uart_set_baud(uint32_t baud_rate)
+{
+    if (!g_inited)
+        return SIM_AT_ERR_NOT_INIT;
+    if (s_transport->set_baud == NULL || baud_rate == 0)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    // Nothing is written while the rate changes; what arrived at the old rate is noise now
+    xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+    s_transport->wait_tx(s_transport->ctx, 100);
+    simcom_err_t err = s_transport->set_baud(s_transport->ctx, baud_rate);
+    if (err == SIM_AT_OK)
+    {
+        s_transport->flush(s_transport->ctx);
+        g_cfg->uart_conf.baud_rate = (int)baud_rate;
+    }
+    xSemaphoreGive(s_eng_lock);
+    return err;
+}
+
+uint32_t simcom_uart_get_baud(void)
+{
+    return g_cfg ? (uint32_t)g_cfg->uart_conf.baud_rate : 0;
+}
+
+bool simcom_uart_flow_control(void)
+{
+    return g_cfg ? g_cfg->use_hw_flow_control : false;
+}
+
+simcom_err_t simcom_tx_stats(simcom_tx_stats_t *stats)
+{
+    if (stats == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (!g_inited)
+        return SIM_AT_ERR_NOT_INIT;
+
+    xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+    *stats = s_tx_stats;
+    stats->queued = 0;
+    if (s_transport->tx_pending)
+    {
+        int pending = s_transport->tx_pending(s_transport->ctx);
+        if (pending > 0)
+            stats->queued = (uint32_t)pending;
+    }
+    xSemaphoreGive(s_eng_lock);
+    return SIM_AT_OK;
+}
+
+simcom_err_t simcom_switch_transport(const simcom_transport_t *transport, uint8_t channels)
+{
+    if (transport == NULL || channels > SIM_AT_MAX_CHANNELS)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (!g_inited)
+        return SIM_AT_ERR_NOT_INIT;
+    if (xTaskGetCurrentTaskHandle() == s_parser_task)
+        return SIM_AT_ERR_BUSY;
+
+    xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+    const simcom_transport_t *old = s_transport;
+    s_next_chan_count = channels;
+    s_next_transport = transport;
+    xSemaphoreGive(s_eng_lock);
+
+    // The parser leaves its read on the old transport and takes the new one
+    old->wake(old->ctx);
+    xSemaphoreTake(s_switch_sem, portMAX_DELAY);
+    return SIM_AT_OK;
+}
+
+const simcom_transport_t *simcom_get_transport(void)
+{
+    return s_transport;
+}
+
+simcom_err_t simcom_engine_hold(bool hold)
+{
+    if (!g_inited)
+        return SIM_AT_ERR_NOT_INIT;
+
+    xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+    s_hold_owner = hold ? xTaskGetCurrentTaskHandle() : NULL;
+    if (!hold)
+        _engine_dispatch();
+    xSemaphoreGive(s_eng_lock);
+    return SIM_AT_OK;
+}
+
+simcom_err_t simcom_chan_route(const char *prefix, uint8_t chan)
+{
+    if (prefix == NULL || prefix[0] == '\0' || strlen(prefix) > SIM_AT_URC_PREFIX_LEN || chan >= SIM_AT_MAX_CHANNELS)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (!g_inited)
+        return SIM_AT_ERR_NOT_INIT;
+
+    simcom_err_t err = SIM_AT_OK;
+    xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+    sim_at_route_t *route = NULL;
+    sim_at_route_t *empty = NULL;
+    for (size_t i = 0; i < SIM_AT_MAX_ROUTES; i++)
+    {
+        if (s_routes[i].prefix[0] == '\0')
+        {
+            if (empty == NULL)
+                empty = &s_routes[i];
+        }
+        else if (strcasecmp(s_routes[i].prefix, prefix) == 0)
+        {
+            route = &s_routes[i];
+        }
+    }
+
+    if (chan == 0)
+    {
+        if (route != NULL)
+            route->prefix[0] = '\0';
+    }
+    else if (route == NULL && empty == NULL)
+    {
+        err = SIM_AT_ERR_NO_MEM;
+    }
+    else
+    {
+        if (route == NULL)
+        {
+            route = empty;
+            strcpy(route->prefix, prefix);
+        }
+        route->chan = chan;
+    }
+    xSemaphoreGive(s_eng_lock);
+    return err;
+}
+
+simcom_err_t simcom_chan_stats(uint8_t chan, simcom_chan_stats_t *stats)
+{
+    if (stats == NULL || chan >= SIM_AT_MAX_CHANNELS)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (!g_inited)
+        return SIM_AT_ERR_NOT_INIT;
+
+    xSemaphoreTake(s_eng_lock, portMAX_DELAY);
+    *stats = s_chans[chan].stats;
+    xSemaphoreGive(s_eng_lock);
+    return SIM_AT_OK;
+}
+
+bool simcom_get_resp_line(simcom_resp_line_t *line)
+{
+    return _reader_next(_current_reader(), line);
+}
+
+bool simcom_get_resp_view(const char **line, size_t *len)
+{
+    simcom_resp_line_t resp;
+    if (!simcom_get_resp_line(&resp))
+        return false;
+
+    *line = resp.text;
+    if (len)
+        *len = resp.len;
+    return true;
+}
+
+bool simcom_get_resp(char *buf)
+{
+    const char *line;
+    size_t len;
+    if (!simcom_get_resp_view(&line, &len))
+        return false; // no new responses
+
+    if (len > SIM_AT_MAX_RESP_LEN - 1)
+        len = SIM_AT_MAX_RESP_LEN - 1;
+    memcpy(buf, line, len);
+    buf[len] = '\0';
+    
+    return true;
+}
+
+void simcom_ignore_resp(void)
+{
+    sim_at_reader_t *rd = _current_reader();
+    simcom_resp_line_t line;
+    if (_reader_next(rd, &line))
+    {
+        xSemaphoreTake(s_read_lock, portMAX_DELAY);
+        _reader_release_held(rd);
+        xSemaphoreGive(s_read_lock);
+    }
+}
+
+uint32_t simcom_resp_dropped(void)
+{
+    return s_resp_dropped;
 }
 
 simcom_err_t simcom_enable_debug(bool en)
@@ -468,40 +2553,52 @@ simcom_err_t simcom_enable_debug(bool en)
     return SIM_AT_OK;
 }
 
-simcom_responses_err_t simcom_read_resp_values(char* resp, const char* key_word, char** index)
+simcom_responses_err_t simcom_read_resp_values(const char* key_word, const char** index)
 {
     // TODO: Falta analizar el caso donde se reciben mensajes URC (SMS, CALLS, etc)
     // Habría que limitarlas al principio, y luego capaz ver que pasa si se recibne igual
 
-    // Get responses
-    simcom_get_resp(resp);
+    // Get responses, already tagged by the parser
+    simcom_resp_line_t resp;
+    if (!simcom_get_resp_line(&resp))
+        return SIM_AT_RESPONSE_ERR_COMMAND_INVALID;
 
-    if (strstr(resp, "ERROR") != NULL)
-        return SIM_AT_RESPONSE_ERR_COMMAND_ERROR;
-    
-    if (strstr(resp, "OK") != NULL)
+    switch (resp.type)
+    {
+    case SIM_AT_LINE_OK:
         return SIM_AT_RESPONSE_COMMAND_OK;
-    
-    if (strstr(resp, key_word) == NULL)
+
+    case SIM_AT_LINE_ERROR:
+    case SIM_AT_LINE_CME_ERROR:
+    case SIM_AT_LINE_CMS_ERROR:
+        return SIM_AT_RESPONSE_ERR_COMMAND_ERROR;
+
+    case SIM_AT_LINE_INFO:
+        break;
+
+    default:
         return SIM_AT_RESPONSE_ERR_COMMAND_INVALID;
-    
-    char *p = strchr(resp, ':');
-    if (!p) return SIM_AT_RESPONSE_ERR_INVALID_FORMAT; // invalid format
-    while (*p == ':' || *p == ' ' || *p == '\t')
-        p++;
-    *index = p;
+    }
+
+    // The prefix must be exactly the key word, the value follows ": "
+    if (resp.prefix_len != strlen(key_word) || memcmp(resp.text, key_word, resp.prefix_len) != 0)
+        return SIM_AT_RESPONSE_ERR_COMMAND_INVALID;
+
+    *index = resp.text + resp.value_off;
 
     return SIM_AT_RESPONSE_OK;
 }
 
-simcom_responses_err_t simcom_resp_read_ok(char* resp)
+simcom_responses_err_t simcom_resp_read_ok(void)
 {
-    // Get responses
-    simcom_get_resp(resp);
+    // Get responses, already tagged by the parser
+    simcom_resp_line_t resp;
+    if (!simcom_get_resp_line(&resp))
+        return SIM_AT_RESPONSE_ERR_COMMAND_INVALID;
 
-    if (strstr(resp, "OK") != NULL)
+    if (resp.type == SIM_AT_LINE_OK)
         return SIM_AT_RESPONSE_COMMAND_OK;
-    if (strstr(resp, "ERROR") != NULL)
+    if (resp.type == SIM_AT_LINE_ERROR || resp.type == SIM_AT_LINE_CME_ERROR || resp.type == SIM_AT_LINE_CMS_ERROR)
         return SIM_AT_RESPONSE_ERR_COMMAND_ERROR;
     
     return SIM_AT_RESPONSE_ERR_COMMAND_INVALID;
@@ -533,4 +2630,9 @@ void simcom_parser_task_delete(void)
     }
 }
 
-/* End of file */
\ No newline at end of file
+bool simcom_in_parser_task(void)
+{
+    return s_parser_task != NULL && xTaskGetCurrentTaskHandle() == s_parser_task;
+}
+
+/* End of file */
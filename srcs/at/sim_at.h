@@ -12,9 +12,12 @@ extern "C" {
 #include "esp_err.h"
 #include "driver/uart.h"
 #include "driver/gpio.h"
+#include "freertos/FreeRTOS.h"
 
 #include "simcom_types.h"
 #include "simcom_config.h"
+#include "simcom_transport.h"
+#include "at/sim_at_line.h"
 
 /**
  * -------------------------------------
@@ -32,29 +35,172 @@ extern "C" {
 #define SIM_AT_MAX_RESP_LEN       1024U   
 #endif
 
+// response arena size: received lines are stored packed as length-prefixed records
+#ifndef SIM_AT_RESP_ARENA_SIZE
+#define SIM_AT_RESP_ARENA_SIZE    2048U
+#endif
+
 // number of in-flight commands supported without dynamic alloc
 #ifndef SIM_AT_MAX_PENDING_COMMANDS
 #define SIM_AT_MAX_PENDING_COMMANDS 4U    
 #endif
 
-#define UART_MAX_WAITTIME 50 // [ms]
+// unread lines kept for lines received outside of a command, older ones are discarded
+#ifndef SIM_AT_MAX_STREAM_LINES
+#define SIM_AT_MAX_STREAM_LINES   8U
+#endif
+
+// UART driver event queue length (data, line feed pattern and error events)
+#ifndef SIM_AT_UART_EVENT_QUEUE_LEN
+#define SIM_AT_UART_EVENT_QUEUE_LEN 20U
+#endif
+
+// UART driver transmit buffer: writes return once copied, 0 blocks each write until it is in the FIFO
+#ifndef SIM_AT_UART_TX_BUF_LEN
+#define SIM_AT_UART_TX_BUF_LEN    2048U
+#endif
+
+// RX FIFO bytes at which RTS holds the modem back, with hardware flow control (FIFO of 128)
+#ifndef SIM_AT_UART_RTS_THRESH
+#define SIM_AT_UART_RTS_THRESH    100U
+#endif
+
+// a write that takes longer waited for room in the transmit buffer: counted as a stall
+#ifndef SIM_AT_TX_STALL_US
+#define SIM_AT_TX_STALL_US        1000U
+#endif
+
+// command channels of a multiplexed link (CMUX DLCs), 1 on a plain link
+#ifndef SIM_AT_MAX_CHANNELS
+#define SIM_AT_MAX_CHANNELS       3U
+#endif
+
+// idle time before and after "+++" for the modem to leave data mode, as AT+CIPCCFG sets it
+#ifndef SIM_AT_ESCAPE_GUARD_MS
+#define SIM_AT_ESCAPE_GUARD_MS    1000U
+#endif
+
+// command prefixes routed to a channel, see simcom_chan_route()
+#ifndef SIM_AT_MAX_ROUTES
+#define SIM_AT_MAX_ROUTES         4U
+#endif
 
 // TODO: Capaz conviene utilizar un extern para estos 2
 void simcom_set_config(simcom_config_t* config);
 void simcom_set_init_flag(bool init_f);
 
+/**
+ * @brief Sets the modem link the parser task reads and commands are written to
+ * 
+ * @param transport Transport, already opened
+ */
+void simcom_set_transport(const simcom_transport_t *transport);
+
+/**
+ * @brief Moves the engine to another transport, e.g. a multiplexer started over the current one.
+ * The parser adopts it between two reads, the partial lines received are dropped.
+ *
+ * @param transport Transport, already opened
+ * @param channels Channels commands are sent to, from 1 to SIM_AT_MAX_CHANNELS. 0 holds every
+ *                 command until the next switch.
+ *
+ * @return SIM_AT_OK once adopted, SIM_AT_ERR_INVALID_ARG or SIM_AT_ERR_BUSY from the parser task
+ */
+simcom_err_t simcom_switch_transport(const simcom_transport_t *transport, uint8_t channels);
+
+// Transport in use
+const simcom_transport_t *simcom_get_transport(void);
+
+/**
+ * @brief While held, only the commands of the calling task are sent (e.g. the AT+CMUX sequence)
+ *
+ * @return SIM_AT_OK or SIM_AT_ERR_NOT_INIT
+ */
+simcom_err_t simcom_engine_hold(bool hold);
+
 simcom_err_t simcom_sem_create(void);
 void simcom_sem_delete(void);
 
 BaseType_t simcom_parser_task_create(void);
 void simcom_parser_task_delete(void);
 
+// True in the parser task (completion callbacks, slot hook, data URC handlers)
+bool simcom_in_parser_task(void);
+
 /**
  * -----------------------------------------
  * ----- [ Response / callback types ] -----
  * ----------------------------------------- 
  */
 
+/**
+ * Final result code that closes an AT command transaction.
+ */
+typedef enum {
+    SIM_AT_FINAL_NONE = 0,      // no final result received (timeout / reset)
+    SIM_AT_FINAL_OK,            // OK
+    SIM_AT_FINAL_ERROR,         // ERROR
+    SIM_AT_FINAL_CME_ERROR,     // +CME ERROR: <err>
+    SIM_AT_FINAL_CMS_ERROR,     // +CMS ERROR: <err>
+    SIM_AT_FINAL_PROMPT,        // '>' data input prompt
+    SIM_AT_FINAL_CONNECT,       // CONNECT: the channel is in data mode
+} simcom_final_t;
+
+/**
+ * Outcome of a command transaction.
+ */
+typedef struct {
+    simcom_final_t final;       // final result code that completed the command
+    int code;                   // numeric +CME/+CMS error code, -1 if not present
+    uint8_t lines;              // lines stored for the command, final result line included
+    uint8_t step;               // position of the command in its chain, 0 for single commands
+    bool overflow;              // lines were dropped because the response arena was full
+    simcom_err_t err;           // same value simcom_cmd_sync() returns for the command
+} simcom_cmd_result_t;
+
+/**
+ * Completion callback of an asynchronous command. Runs in the parser task: it must not block
+ * nor issue synchronous commands. The lines of the command can be read with the response
+ * reading functions until it returns; they are released afterwards.
+ */
+typedef void (*simcom_cmd_cb_t)(const simcom_cmd_result_t *result, void *ctx);
+
+/**
+ * Command of a chain queued with simcom_cmd_chain_async().
+ */
+typedef struct {
+    const char *cmd;            // NUL-terminated AT command. Must be <= SIM_AT_MAX_CMD_LEN.
+    uint32_t timeout_ms;        // final response timeout, counted from the write. If zero, uses default configured timeout.
+    const simcom_iov_t *data;   // written as soon as the '>' prompt of the command arrives, NULL for none
+    size_t data_count;          // number of data buffers
+    const char *result;         // prefix of the result line sent after the OK (e.g. "+CMQTTPUB: 0,"),
+                                // which completes the command. NULL to complete on the OK.
+    uint32_t result_timeout_ms; // wait for the result line, counted from the OK. If zero, uses default configured timeout.
+} simcom_cmd_step_t;
+
+/**
+ * Receives the bytes of a channel in data mode, in the parser task. It must not block for long:
+ * the channel is not read meanwhile (with flow control, the modem is held back).
+ *
+ * @param end Set when the modem ended the connection (e.g. "\r\nCLOSED\r\n"): the channel
+ *            leaves data mode
+ * @return Bytes consumed, the connection's and those that ended it. Once ended, the rest is
+ *         parsed as lines.
+ */
+typedef size_t (*simcom_data_mode_handler_t)(const uint8_t *data, size_t len, bool *end, void *ctx);
+
+/**
+ * Response line with the tag computed by the parser when the line was received.
+ */
+typedef struct {
+    const char *text;           // NUL-terminated line inside the response arena
+    size_t len;                 // line length
+    sim_at_line_type_t type;    // OK, ERROR, +CME/+CMS ERROR, prompt, information response or data
+    uint8_t prefix_len;         // length of the "+XXX" prefix of information responses
+    uint16_t value_off;         // offset of the first value of information responses
+    int code;                   // numeric +CME/+CMS error code, -1 if not present
+} simcom_resp_line_t;
+
 /**
  * ------------------------------------------
  * ----- [ Core API: issuing commands ] -----
@@ -63,6 +209,10 @@ void simcom_parser_task_delete(void);
 
 /**
  * @brief Send an AT command synchronously (blocking - do not call from ISR).
+ * 
+ * The caller is woken up once, when the final result code (OK, ERROR, +CME ERROR, +CMS ERROR
+ * or the '>' prompt) arrives. Every line received for the command, final result included, is
+ * left in the response buffer in arrival order.
  *
  * @param cmd NUL-terminated AT command (e.g. "AT+CGSN\r\n"). Must be <= SIM_AT_MAX_CMD_LEN.
  * @param timeout_ms how long to wait for final response (OK/ERROR). If zero, uses default configured timeout.
@@ -70,17 +220,199 @@ void simcom_parser_task_delete(void);
  * @return 
  *  - SIM_AT_OK on success
  *  - SIM_AT_ERR_NOT_INIT
- *  - SIMCOM_ERR_TIMEOUT if the command timed out. Note: if simcom_was_reset() returns
- *    true after a timeout, the modem reset during the wait — treat as SIMCOM_ERR_MODEM_RESET.
+ *  - SIMCOM_ERR_TIMEOUT if the command timed out
+ *  - SIMCOM_ERR_MODEM_RESET if the modem reset (*ATREADY: 1) while waiting
+ *  - SIM_AT_ERR_OVERFLOW if response lines were dropped because the response arena was full
+ *  - SIM_AT_ERR_BUSY if no command slot got free in time, or if called from a completion callback
  *  - SIM_AT_ERR_UART
  *
  */
 simcom_err_t simcom_cmd_sync(const char *cmd, uint32_t timeout_ms);
 
 /**
- * @brief Waits for AT command response (blocking - do not call from ISR).
+ * @brief Send an AT command and wait for its final result code (blocking - do not call from ISR).
  * 
- * @param timeout_ms how long to wait for final response (OK/ERROR). If zero, uses default configured timeout.
+ * Same as simcom_cmd_sync() but also reports which final result code completed the command.
+ *
+ * @param cmd NUL-terminated AT command (e.g. "AT+CGSN\r\n"). Must be <= SIM_AT_MAX_CMD_LEN.
+ * @param timeout_ms how long to wait for final response. If zero, uses default configured timeout.
+ * @param result Transaction outcome (may be NULL)
+ *
+ * @return Same as simcom_cmd_sync()
+ */
+simcom_err_t simcom_cmd_transact(const char *cmd, uint32_t timeout_ms, simcom_cmd_result_t *result);
+
+/**
+ * @brief Send the data of a '>' prompt and wait for its final result code (blocking - do not
+ * call from ISR).
+ *
+ * Must be called by the task whose command got the prompt. The buffers are written in order
+ * straight from the caller memory, with no copy and no CR/LF added, so they can hold binary
+ * data of any length; they must stay valid until the call returns.
+ *
+ * @param iov Data buffers
+ * @param iov_count Number of buffers
+ * @param timeout_ms how long to wait for final response, counted from the write. If zero, uses default configured timeout.
+ * @param result Transaction outcome (may be NULL)
+ *
+ * @return
+ *  - Same as simcom_cmd_sync()
+ *  - SIM_AT_ERR_INVALID_ARG if the caller has no prompt to answer
+ */
+simcom_err_t simcom_cmd_data(const simcom_iov_t *iov, size_t iov_count, uint32_t timeout_ms, simcom_cmd_result_t *result);
+
+/**
+ * @brief Send one command of the simcom_cmd_chain_async() kind and wait until it completes
+ * (blocking - do not call from ISR).
+ *
+ * Its prompt data is written by the parser when the '>' arrives, and when it has a result
+ * prefix the call returns on the result line, the link being free for other commands in the
+ * meantime. Its lines are read like those of simcom_cmd_sync().
+ *
+ * @param step Command
+ * @param result Transaction outcome (may be NULL)
+ *
+ * @return
+ *  - Same as simcom_cmd_sync()
+ *  - SIM_AT_ERR_TIMEOUT also when the result line does not arrive in time
+ */
+simcom_err_t simcom_cmd_step_sync(const simcom_cmd_step_t *step, simcom_cmd_result_t *result);
+
+/**
+ * @brief Queue an AT command and return without waiting for it.
+ * 
+ * Commands are kept in a table of SIM_AT_MAX_PENDING_COMMANDS slots shared with the
+ * synchronous calls and written in submission order, each one as soon as the final result
+ * code of the previous one arrives. The timeout is counted from the write.
+ *
+ * @param cmd NUL-terminated AT command (e.g. "AT+CSQ\r\n"). Must be <= SIM_AT_MAX_CMD_LEN.
+ * @param timeout_ms how long to wait for final response. If zero, uses default configured timeout.
+ * @param cb Completion callback (may be NULL)
+ * @param ctx Callback context
+ *
+ * @return 
+ *  - SIM_AT_OK if the command was queued
+ *  - SIM_AT_ERR_NOT_INIT
+ *  - SIM_AT_ERR_INVALID_ARG
+ *  - SIM_AT_ERR_BUSY if every slot is in use
+ */
+simcom_err_t simcom_cmd_async(const char *cmd, uint32_t timeout_ms, simcom_cmd_cb_t cb, void *ctx);
+
+/**
+ * @brief Queue a chain of AT commands run back to back by the parser, and return without
+ * waiting for them.
+ * 
+ * The commands take one slot each and are queued whole or not at all. Each one is written when
+ * the previous one has completed, and a command that fails (no OK, no result line) completes
+ * the rest of the chain with SIM_AT_ERR_ABORTED without writing them. Prompt data is written
+ * straight from the caller buffers; they and their simcom_iov_t arrays must stay valid until
+ * the last callback. Once a command got its OK, other commands can use the link while it waits
+ * for its result line; result lines of the same prefix complete the waiting commands in
+ * submission order.
+ * 
+ * The callback is called once per command, in no particular order when commands are aborted;
+ * result->step tells which one. It can read the lines of its command: those before the OK and
+ * the result line, the OK itself is only reported in result->final (neither it nor the '>'
+ * prompt is stored). Like simcom_cmd_sync(), the call releases the lines of the previous
+ * commands of the calling task.
+ *
+ * @param steps Commands, copied by the call
+ * @param count Number of commands, at most SIM_AT_MAX_PENDING_COMMANDS
+ * @param cb Completion callback (may be NULL)
+ * @param ctx Callback context
+ *
+ * @return 
+ *  - SIM_AT_OK if the chain was queued
+ *  - SIM_AT_ERR_NOT_INIT
+ *  - SIM_AT_ERR_INVALID_ARG
+ *  - SIM_AT_ERR_BUSY if there are not enough free slots
+ */
+simcom_err_t simcom_cmd_chain_async(const simcom_cmd_step_t *steps, size_t count, simcom_cmd_cb_t cb, void *ctx);
+
+/**
+ * Run by the parser task after command slots were freed or at its deadline.
+ */
+typedef void (*simcom_slot_hook_t)(void *ctx);
+
+/**
+ * @brief Set the function the parser task runs after command slots were freed, to queue again
+ * what got SIM_AT_ERR_BUSY without polling. It runs like a completion callback: it must not
+ * block nor issue synchronous commands. There is a single hook.
+ *
+ * @param fn Hook, NULL for none
+ * @param ctx Hook context
+ */
+void simcom_cmd_set_slot_hook(simcom_slot_hook_t fn, void *ctx);
+
+/**
+ * @brief Run the slot hook at a tick count too, e.g. for a flush deadline. Only the earliest
+ * deadline is kept, the hook sets the next one when it runs. Ignored before simcom_init().
+ *
+ * @param deadline Tick count
+ */
+void simcom_cmd_hook_at(TickType_t deadline);
+
+/**
+ * @brief Send a command answered by CONNECT (e.g. AT+CIPOPEN in transparent mode, ATO) and wait
+ * for it (blocking - do not call from ISR).
+ *
+ * On CONNECT the channel of the command enters data mode: the parser hands every byte received
+ * on it to the handler, bytes in the same read as the CONNECT line included, without looking
+ * for lines. No command is written to the channel until simcom_data_mode_escape(); the other
+ * channels of a multiplexed link go on. A single channel can be in data mode.
+ *
+ * @param cmd NUL-terminated AT command. Must be <= SIM_AT_MAX_CMD_LEN.
+ * @param timeout_ms how long to wait for CONNECT. If zero, uses default configured timeout.
+ * @param handler Receives the data, called until the channel leaves data mode
+ * @param ctx Handler context
+ * @param result Transaction outcome (may be NULL), final is SIM_AT_FINAL_CONNECT if connected
+ *
+ * @return
+ *  - Same as simcom_cmd_sync()
+ *  - SIM_AT_ERR_BUSY also if a channel is in data mode already
+ */
+simcom_err_t simcom_cmd_connect(const char *cmd, uint32_t timeout_ms, simcom_data_mode_handler_t handler,
+                                void *ctx, simcom_cmd_result_t *result);
+
+/**
+ * @brief Write to the connection of the channel in data mode, from one task at a time. The
+ * bytes go out as they are, in pieces of at most SIM_AT_UART_TX_BUF_LEN written without the
+ * engine lock: the parser keeps reading while the transmit buffer is full.
+ *
+ * @return
+ *  - SIM_AT_OK
+ *  - SIM_AT_ERR_NOT_INIT
+ *  - SIM_AT_ERR_INVALID_ARG if no channel is in data mode
+ *  - SIM_AT_ERR_BUSY while the escape or another write is in progress
+ *  - SIM_AT_ERR_UART
+ */
+simcom_err_t simcom_data_mode_write(const void *data, size_t len);
+
+/**
+ * @brief Leave data mode (blocking - do not call from ISR): waits until nothing was written
+ * for the guard time, writes "+++" and waits for the OK the modem sends after another guard
+ * time. Bytes received until then are still data. The connection stays open, a command
+ * answered by CONNECT (ATO) goes back to it.
+ *
+ * @param guard_ms Guard time of the modem, 0 for SIM_AT_ESCAPE_GUARD_MS
+ *
+ * @return
+ *  - SIM_AT_OK in command mode, also if no channel was in data mode
+ *  - SIM_AT_ERR_NOT_INIT
+ *  - SIMCOM_ERR_TIMEOUT or SIM_AT_ERR_RESPONSE if the modem did not answer: the channel stays
+ *    in data mode
+ *  - SIM_AT_ERR_BUSY if called from a completion callback
+ */
+simcom_err_t simcom_data_mode_escape(uint32_t guard_ms);
+
+// True while a channel is in data mode
+bool simcom_data_mode_active(void);
+
+/**
+ * @brief Waits for a line received outside of a command transaction, e.g. the result URC
+ * that some commands send after their OK (blocking - do not call from ISR).
+ * 
+ * @param timeout_ms how long to wait for the line. If zero, uses default configured timeout.
  * 
  * @return
  *  - SIM_AT_OK on success
@@ -97,25 +429,56 @@ simcom_err_t simcom_wait_resp(uint32_t timeout_ms);
  */
 
 /**
- * @brief Get next response from ring buffer
+ * @brief Get next response from the response arena without copying it.
  * 
- * @param buf Response buffer
+ * The line is NUL-terminated and stays valid until the next call to any response reading
+ * function or to simcom_cmd_sync(), which release it.
+ *
+ * Each task reads the lines of its last synchronous command; once its final result line was
+ * read, and in tasks without a command, lines received outside of a command are returned.
+ * Completion callbacks read the lines of their own command.
+ * 
+ * @param line Pointer to the line inside the arena
+ * @param len Line length (may be NULL)
+ * 
+ * @return False is there is no new responses, True otherwise
+ */
+bool simcom_get_resp_view(const char **line, size_t *len);
+
+/**
+ * @brief Same as simcom_get_resp_view() but also returns the tag of the line, so it does not
+ * have to be searched for "OK", "ERROR" or its prefix again.
+ *
+ * @param line Line inside the arena and its tag
+ *
+ * @return False is there is no new responses, True otherwise
+ */
+bool simcom_get_resp_line(simcom_resp_line_t *line);
+
+/**
+ * @brief Get a copy of the next response from the response arena
+ * 
+ * @param buf Response buffer, at least SIM_AT_MAX_RESP_LEN long
  * 
  * @return False is there is no new responses, True otherwise
  */
 bool simcom_get_resp(char* buf);
 
 /**
- * @brief Ignore next response from ring buffer
+ * @brief Ignore next response from the response arena
  */
 void simcom_ignore_resp(void);
 
+/**
+ * @brief Number of lines dropped because the response arena was full, since initialization
+ */
+uint32_t simcom_resp_dropped(void);
+
 /**
  * @brief Verify the response and get the index of the values
  * 
- * @param resp Response buffer
  * @param key_word Word to verify if present in the response
- * @param start_response Start index to response values
+ * @param index Start of the response values, valid until the next response is read
  * 
  * @returns
  *  - SIM_AT_OK if succeded
@@ -124,19 +487,17 @@ void simcom_ignore_resp(void);
  *  - SIM_AT_ERR_COMMAND_INVALID invalid response
  *  - SIM_AT_ERR_INVALID_FORMAT invalid response format
  */
-simcom_responses_err_t simcom_read_resp_values(char* resp, const char* key_word, char** index);
+simcom_responses_err_t simcom_read_resp_values(const char* key_word, const char** index);
 
 /**
  * @brief Verify is the response is OK
  * 
- * @param resp Response buffer
- * 
  * @returns
  *  - SIM_AT_COMMAND_OK an OK was received
  *  - SIM_AT_ERR_COMMAND_ERROR an ERROR was received
  *  - SIM_AT_ERR_COMMAND_INVALID invalid response
  */
-simcom_responses_err_t simcom_resp_read_ok(char* resp);
+simcom_responses_err_t simcom_resp_read_ok(void);
 
 /**
  * -----------------------------------------
@@ -186,6 +547,28 @@ void simcom_clear_reset(void);
  */
 simcom_err_t simcom_uart_flush_rx(void);
 
+/**
+ * @brief Change the rate of the local end of the link (the modem is not told). Waits for the
+ * pending output and discards the input received so far.
+ *
+ * @return
+ *  - SIM_AT_OK on success
+ *  - SIM_AT_ERR_NOT_INIT
+ *  - SIM_AT_ERR_INVALID_ARG if the transport has no rate or does not support this one
+ *  - SIM_AT_ERR_UART
+ */
+simcom_err_t simcom_uart_set_baud(uint32_t baud_rate);
+
+/**
+ * @brief Rate of the local end of the link
+ */
+uint32_t simcom_uart_get_baud(void);
+
+/**
+ * @brief True if the configuration asks for RTS/CTS flow control
+ */
+bool simcom_uart_flow_control(void);
+
 /**
  * -----------------------------------
  * ----- [ Diagnostics / debug ] -----
@@ -0,0 +1,161 @@
+/**
+ * sim_at_fields.c
+ * Allocation-free field reader for SIMCom information responses
+ */
+
+#include "at/sim_at_fields.h"
+#include <string.h>
+#include <limits.h>
+
+/**
+ * @brief Returns the end of the field starting at p: the separating comma or the NUL
+ */
+static const char* _field_end(const char *p)
+{
+    if (*p == '"')
+    {
+        // Quoted fields can contain commas
+        const char *close = strchr(p + 1, '"');
+        if (close == NULL)
+            return p + strlen(p);
+        p = close + 1;
+    }
+    while (*p != '\0' && *p != ',')
+        p++;
+    return p;
+}
+
+/**
+ * @brief Moves the cursor past a field ending at end
+ */
+static void _field_advance(sim_at_fields_t *fields, const char *end)
+{
+    if (*end == ',')
+    {
+        fields->pos = end + 1;
+    }
+    else
+    {
+        fields->pos = end;
+        fields->end = true;
+    }
+}
+
+void sim_at_fields_init(sim_at_fields_t *fields, const char *values)
+{
+    fields->pos = values;
+    fields->end = false;
+}
+
+/**
+ * @brief Parses a decimal integer in [p, end), surrounding spaces allowed
+ */
+static bool _field_parse_int(const char *p, const char *end, int *value)
+{
+    while (p < end && *p == ' ')
+        p++;
+    while (end > p && end[-1] == ' ')
+        end--;
+
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+    {
+        negative = (*p == '-');
+        p++;
+    }
+    if (p == end)
+        return false;
+
+    long long acc = 0;
+    for (; p < end; p++)
+    {
+        if (*p < '0' || *p > '9')
+            return false;
+        acc = acc * 10 + (*p - '0');
+        if (acc > (long long)INT_MAX + 1)
+            return false;
+    }
+    if (negative)
+        acc = -acc;
+    if (acc > INT_MAX || acc < INT_MIN)
+        return false;
+
+    *value = (int)acc;
+    return true;
+}
+
+bool sim_at_fields_int(sim_at_fields_t *fields, int *value)
+{
+    if (fields->end)
+        return false;
+
+    const char *end = _field_end(fields->pos);
+    if (!_field_parse_int(fields->pos, end, value))
+        return false;
+
+    _field_advance(fields, end);
+    return true;
+}
+
+bool sim_at_fields_opt_int(sim_at_fields_t *fields, int *value, int def)
+{
+    *value = def;
+    if (fields->end)
+        return true;
+
+    const char *p = fields->pos;
+    const char *end = _field_end(p);
+    while (p < end && *p == ' ')
+        p++;
+    if (p != end && !_field_parse_int(p, end, value))
+        return false;
+
+    _field_advance(fields, end);
+    return true;
+}
+
+bool sim_at_fields_str(sim_at_fields_t *fields, char *buf, size_t size)
+{
+    if (fields->end || size == 0)
+        return false;
+
+    const char *p = fields->pos;
+    const char *end = _field_end(p);
+    while (p < end && *p == ' ')
+        p++;
+
+    const char *start = p;
+    const char *stop = end;
+    if (*p == '"')
+    {
+        start = p + 1;
+        stop = memchr(start, '"', end - start);
+        if (stop == NULL)
+            stop = end;
+    }
+    else
+    {
+        while (stop > start && stop[-1] == ' ')
+            stop--;
+    }
+
+    size_t len = stop - start;
+    if (len >= size)
+        return false;
+    memcpy(buf, start, len);
+    buf[len] = '\0';
+
+    _field_advance(fields, end);
+    return true;
+}
+
+bool sim_at_fields_skip(sim_at_fields_t *fields)
+{
+    if (fields->end)
+        return false;
+
+    _field_advance(fields, _field_end(fields->pos));
+    return true;
+}
+
+/* End of file */
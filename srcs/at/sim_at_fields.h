@@ -0,0 +1,83 @@
+#ifndef SIM_AT_FIELDS_H
+#define SIM_AT_FIELDS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * Field reader for the values of information responses (e.g. "1,\"10.0.0.1\"" of +CGPADDR).
+ *
+ * A cursor walks the comma separated fields in order. No allocation, no locale and no varargs:
+ * it replaces sscanf() in the services. Pure C, it is also built on the host for benchmarks.
+ *
+ * Example:
+ *   sim_at_fields_t fields;
+ *   sim_at_fields_init(&fields, data);
+ *   if (!sim_at_fields_int(&fields, &cid) || !sim_at_fields_str(&fields, addr, sizeof(addr)))
+ *       return SIM_AT_ERR_RESPONSE;
+ */
+typedef struct {
+    const char *pos;            // start of the next field
+    bool end;                   // every field was read
+} sim_at_fields_t;
+
+/**
+ * @brief Starts reading the fields of a value list
+ *
+ * @param fields Cursor
+ * @param values NUL-terminated values, e.g. the index returned by simcom_read_resp_values()
+ */
+void sim_at_fields_init(sim_at_fields_t *fields, const char *values);
+
+/**
+ * @brief Reads the next field as a decimal integer
+ *
+ * @param fields Cursor
+ * @param value Field value
+ *
+ * @return False if there are no more fields or the field is not a number. The cursor only
+ * moves on success.
+ */
+bool sim_at_fields_int(sim_at_fields_t *fields, int *value);
+
+/**
+ * @brief Reads the next field as a decimal integer, which may be empty or missing
+ *
+ * @param fields Cursor
+ * @param value Field value, def if the field is empty or missing
+ * @param def Default value
+ *
+ * @return False if the field is present and it is not a number
+ */
+bool sim_at_fields_opt_int(sim_at_fields_t *fields, int *value, int def);
+
+/**
+ * @brief Reads the next field as a string: quoted (quotes removed, commas kept) or bare (up
+ * to the next comma).
+ *
+ * @param fields Cursor
+ * @param buf Destination, always NUL-terminated
+ * @param size Destination size
+ *
+ * @return False if there are no more fields or the field does not fit in the destination.
+ * The cursor only moves on success.
+ */
+bool sim_at_fields_str(sim_at_fields_t *fields, char *buf, size_t size);
+
+/**
+ * @brief Skips the next field
+ *
+ * @return False if there are no more fields
+ */
+bool sim_at_fields_skip(sim_at_fields_t *fields);
+
+/**
+ * @brief Returns true if there are fields left to read
+ */
+static inline bool sim_at_fields_more(const sim_at_fields_t *fields)
+{
+    return !fields->end;
+}
+
+#endif // SIM_AT_FIELDS_H
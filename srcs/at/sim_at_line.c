@@ -0,0 +1,146 @@
+/**
+ * sim_at_line.c
+ * Single-pass line classifier for SIMCom modem responses
+ *
+ * Runs once per line in the parser task. Final result codes are recognized by their length
+ * and first characters; for the other lines only the prefix is read, hashing it on the way,
+ * so the cost does not depend on the line length.
+ */
+
+#include "at/sim_at_line.h"
+#include <string.h>
+
+/**
+ * @brief Reads an unsigned decimal number, -1 if there are no digits
+ */
+static int16_t _line_read_code(const char *p, const char *end)
+{
+    int32_t value = -1;
+    while (p < end && *p >= '0' && *p <= '9')
+    {
+        value = (value < 0 ? 0 : value * 10) + (*p - '0');
+        if (value > INT16_MAX)
+            return -1;
+        p++;
+    }
+    return (int16_t)value;
+}
+
+void sim_at_line_classify(const char *line, size_t len, const char *echo, size_t echo_len,
+                          sim_at_line_info_t *info)
+{
+    info->type = SIM_AT_LINE_DATA;
+    info->key.hash = 0;
+    info->key.len = 0;
+    info->value_off = 0;
+    info->code = -1;
+
+    if (len == 0)
+        return;
+
+    /* --- Echo of the last command --- */
+    if (echo && len == echo_len && memcmp(line, echo, len) == 0)
+    {
+        info->type = SIM_AT_LINE_ECHO;
+        return;
+    }
+
+    /* --- Final result codes without prefix --- */
+    switch (line[0])
+    {
+    case 'O':
+        if (len == 2 && line[1] == 'K')
+        {
+            info->type = SIM_AT_LINE_OK;
+            return;
+        }
+        break;
+    case 'E':
+        if (len == 5 && memcmp(line, "ERROR", 5) == 0)
+        {
+            info->type = SIM_AT_LINE_ERROR;
+            return;
+        }
+        break;
+    case '>':
+        if (len == 1)
+        {
+            info->type = SIM_AT_LINE_PROMPT;
+            return;
+        }
+        break;
+    case 'C':
+        // "CONNECT FAIL" is the error of a command that would have connected
+        if (len >= 7 && memcmp(line, "CONNECT", 7) == 0 && (len == 7 || line[7] == ' '))
+        {
+            bool fail = (len == 12 && memcmp(&line[8], "FAIL", 4) == 0);
+            info->type = fail ? SIM_AT_LINE_ERROR : SIM_AT_LINE_CONNECT;
+            return;
+        }
+        break;
+    default:
+        break;
+    }
+
+    /* --- Prefix: hashed up to ':', or ',' after a '+' (e.g. "+RECEIVE,0,16") --- */
+    uint32_t hash = SIM_AT_LINE_HASH_INIT;
+    char sep = (line[0] == '+') ? ',' : ':';
+    size_t i = 0;
+    while (i < len && line[i] != ':' && line[i] != sep)
+    {
+        if (i == SIM_AT_URC_PREFIX_LEN)
+            return; // too long to be a prefix
+        hash = SIM_AT_LINE_HASH_STEP(hash, line[i]);
+        i++;
+    }
+
+    info->key.hash = hash;
+    info->key.len = (uint8_t)i;
+    if (i == len)
+        return; // short line without parameters (e.g. "PB DONE")
+
+    if (line[0] != '+' && line[0] != '*')
+    {
+        // Not an information response, e.g. a timestamp: no prefix id
+        info->key.hash = 0;
+        info->key.len = 0;
+        return;
+    }
+
+    size_t value = i + 1;
+    while (value < len && (line[value] == ' ' || line[value] == '\t'))
+        value++;
+
+    info->type = SIM_AT_LINE_INFO;
+    info->value_off = (uint16_t)value;
+
+    if (i == 10 && line[0] == '+' && line[1] == 'C' && line[2] == 'M' &&
+        memcmp(&line[4], " ERROR", 6) == 0)
+    {
+        if (line[3] == 'E')
+            info->type = SIM_AT_LINE_CME_ERROR;
+        else if (line[3] == 'S')
+            info->type = SIM_AT_LINE_CMS_ERROR;
+        else
+            return;
+
+        // Numeric error code (verbose error mode reports text instead)
+        info->code = _line_read_code(&line[value], &line[len]);
+    }
+}
+
+size_t sim_at_line_match(const char *marker, size_t len, size_t held, uint8_t c)
+{
+    if (held < len && (uint8_t)marker[held] == c)
+        return held + 1;
+
+    // Mismatch: the longest shorter part of the marker that still ends the stream
+    for (size_t k = (held < len) ? held : len - 1; k > 0; k--)
+    {
+        if ((uint8_t)marker[k - 1] == c && memcmp(&marker[held - k + 1], marker, k - 1) == 0)
+            return k;
+    }
+    return 0;
+}
+
+/* End of file */
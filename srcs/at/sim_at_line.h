@@ -0,0 +1,88 @@
+#ifndef SIM_AT_LINE_H
+#define SIM_AT_LINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * Line classifier. Pure C, no RTOS dependencies: it is also built on the host for benchmarks.
+ */
+
+// max URC prefix length, text before ':' (e.g. "+CMQTTCONNLOST")
+#ifndef SIM_AT_URC_PREFIX_LEN
+#define SIM_AT_URC_PREFIX_LEN     24U
+#endif
+
+/* FNV-1a, the hash of the prefix is its id */
+#define SIM_AT_LINE_HASH_INIT           2166136261U
+#define SIM_AT_LINE_HASH_STEP(h, c)     (((h) ^ (uint8_t)(c)) * 16777619U)
+
+/**
+ * Line tag, computed once by the parser when a line is completed.
+ */
+typedef enum {
+    SIM_AT_LINE_DATA = 0,       // text without prefix (e.g. IMEI, payload)
+    SIM_AT_LINE_INFO,           // information response "+XXX: <values>"
+    SIM_AT_LINE_OK,             // OK
+    SIM_AT_LINE_ERROR,          // ERROR
+    SIM_AT_LINE_CME_ERROR,      // +CME ERROR: <err>
+    SIM_AT_LINE_CMS_ERROR,      // +CMS ERROR: <err>
+    SIM_AT_LINE_PROMPT,         // '>' data input prompt
+    SIM_AT_LINE_CONNECT,        // CONNECT [<rate>]: data mode follows
+    SIM_AT_LINE_ECHO,           // echo of the last sent command
+    SIM_AT_LINE_URC,            // registered URC
+} sim_at_line_type_t;
+
+/**
+ * Prefix key: hash of the text before ':', or before ',' in lines starting with '+' (e.g.
+ * "+RECEIVE,0,16"), the whole line if there is none.
+ */
+typedef struct {
+    uint32_t hash;
+    uint8_t len;                // 0 if the text is longer than SIM_AT_URC_PREFIX_LEN
+} sim_at_line_key_t;
+
+/**
+ * Classification of a line.
+ */
+typedef struct {
+    sim_at_line_type_t type;
+    sim_at_line_key_t key;      // prefix id, registry key
+    uint16_t value_off;         // offset of the first value of INFO lines, after ": "
+    int16_t code;               // numeric +CME/+CMS error code, -1 if not present
+} sim_at_line_info_t;
+
+/**
+ * @brief Classifies a line in a single pass over its prefix
+ *
+ * @param line Line (already CR/LF stripped)
+ * @param len Line length
+ * @param echo Last sent command without CR/LF (may be NULL)
+ * @param echo_len Echo length
+ * @param info Classification
+ */
+void sim_at_line_classify(const char *line, size_t len, const char *echo, size_t echo_len,
+                          sim_at_line_info_t *info);
+
+/**
+ * @brief Follows a marker (e.g. "\r\nOK\r\n") through a byte stream that may arrive split
+ * across reads: returns how many of its first bytes the stream ends with after c
+ *
+ * @param marker Marker bytes
+ * @param len Marker length
+ * @param held Bytes of the marker the stream ended with before c, 0 at the start
+ * @param c Next byte of the stream
+ * @return len once the whole marker was received
+ */
+size_t sim_at_line_match(const char *marker, size_t len, size_t held, uint8_t c);
+
+/**
+ * @brief Returns true for the final result code types (OK, ERROR, +CME/+CMS ERROR, prompt, CONNECT)
+ */
+static inline bool sim_at_line_is_final(sim_at_line_type_t type)
+{
+    return (type >= SIM_AT_LINE_OK && type <= SIM_AT_LINE_CONNECT);
+}
+
+#endif // SIM_AT_LINE_H
@@ -0,0 +1,435 @@
+/**
+ * sim_at_urc.c
+ * URC registry and dispatcher for SIMCom modem (ESP-IDF v5.3)
+ *
+ * The parser classifies each line once against an open addressing hash table keyed by the
+ * text before ':'. Lines with registered handlers are copied to a queue and the handlers run
+ * in their own task, so a slow handler never stalls the parser.
+ */
+
+#include "at/sim_at_urc.h"
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+
+static const char *TAG = "sim_at_urc";
+
+/* URC task */
+#define SIM_AT_URC_TASK_STACK 4096
+#define SIM_AT_URC_TASK_PRIO 4
+static TaskHandle_t s_urc_task = NULL;
+static QueueHandle_t s_urc_queue = NULL;
+static volatile uint32_t s_urc_dropped = 0;
+
+/* Registry
+ *
+ * Open addressing with linear probing, twice as many buckets as handlers so probe chains stay
+ * short. Removed entries become tombstones to keep the chains of the remaining ones intact.
+ */
+#define SIM_AT_URC_TABLE_SIZE   (SIM_AT_URC_MAX_HANDLERS * 2U)
+#define SIM_AT_URC_TABLE_MASK   (SIM_AT_URC_TABLE_SIZE - 1U)
+
+_Static_assert((SIM_AT_URC_TABLE_SIZE & SIM_AT_URC_TABLE_MASK) == 0,
+               "SIM_AT_URC_MAX_HANDLERS must be a power of two");
+
+typedef enum {
+    SIM_AT_URC_ENTRY_EMPTY = 0,
+    SIM_AT_URC_ENTRY_USED,
+    SIM_AT_URC_ENTRY_TOMBSTONE,
+} sim_at_urc_entry_state_t;
+
+typedef struct {
+    sim_at_urc_entry_state_t state;
+    sim_at_line_key_t key;
+    char prefix[SIM_AT_URC_PREFIX_LEN + 1];
+    simcom_urc_cb_t cb;             // NULL for built-in discarded URCs and data URCs
+    void *ctx;
+    const sim_at_urc_data_handler_t *data; // URC followed by length-counted data, NULL otherwise
+} sim_at_urc_entry_t;
+
+static sim_at_urc_entry_t s_urc_table[SIM_AT_URC_TABLE_SIZE];
+static size_t s_urc_used = 0;
+static bool s_urc_builtins = false;
+static portMUX_TYPE s_urc_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/* Known URCs without handler that are discarded instead of stored as responses */
+static const char *const s_urc_discard[] = {
+    "+CGEV",
+    "*ISIMAID",
+    "SMS DONE",
+    "PB DONE",
+    "+CPING",       // one per echo reply, simcom_ping() waits for the summary line
+};
+
+/* Line or deferred call queued for the URC task */
+typedef struct {
+    sim_at_urc_defer_fn_t fn;       // NULL for lines
+    void *arg;
+    uint16_t len;
+    char line[SIM_AT_URC_MAX_LINE_LEN];
+} sim_at_urc_event_t;
+
+/**
+ * @brief Hash of the text up to a stop character, same as the prefix id of sim_at_line_classify()
+ *
+ * @param s Text
+ * @param max Max number of characters to read
+ * @param stops Stop characters
+ */
+static sim_at_line_key_t _urc_key(const char *s, size_t max, const char *stops)
+{
+    sim_at_line_key_t key = { .hash = SIM_AT_LINE_HASH_INIT, .len = 0 };
+
+    size_t i = 0;
+    while (i < max && s[i] != '\0' && strchr(stops, s[i]) == NULL)
+    {
+        if (i == SIM_AT_URC_PREFIX_LEN)
+            return (sim_at_line_key_t){ 0 };
+        key.hash = SIM_AT_LINE_HASH_STEP(key.hash, s[i]);
+        i++;
+    }
+    key.len = (uint8_t)i;
+    return key;
+}
+
+sim_at_line_key_t sim_at_urc_cmd_key(const char *cmd)
+{
+    // Information responses of "AT+CMD=..." start with "+CMD"
+    if (strncmp(cmd, "AT", 2) == 0 || strncmp(cmd, "at", 2) == 0)
+        cmd += 2;
+    return _urc_key(cmd, SIM_AT_MAX_CMD_LEN, "=?;\r\n");
+}
+
+/**
+ * @brief Index of the first entry of a prefix at or after a probe position. Call inside s_urc_mux.
+ *
+ * @param prefix Prefix text
+ * @param key Prefix key
+ * @param probe Probe position, updated past the returned entry
+ *
+ * @return -1 if there are no more entries for the prefix
+ */
+static int _urc_find(const char *prefix, sim_at_line_key_t key, size_t *probe)
+{
+    for (; *probe < SIM_AT_URC_TABLE_SIZE; (*probe)++)
+    {
+        size_t idx = (key.hash + *probe) & SIM_AT_URC_TABLE_MASK;
+        sim_at_urc_entry_t *e = &s_urc_table[idx];
+
+        if (e->state == SIM_AT_URC_ENTRY_EMPTY)
+            return -1;
+        if (e->state == SIM_AT_URC_ENTRY_USED && e->key.hash == key.hash &&
+            e->key.len == key.len && memcmp(e->prefix, prefix, key.len) == 0)
+        {
+            (*probe)++;
+            return (int)idx;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Adds an entry to the registry
+ */
+static simcom_err_t _urc_add(const char *prefix, simcom_urc_cb_t cb, void *ctx,
+                             const sim_at_urc_data_handler_t *data)
+{
+    size_t len = strlen(prefix);
+    if (len > 0 && prefix[len - 1] == ':')
+        len--;
+    sim_at_line_key_t key = _urc_key(prefix, len, "");
+    if (key.len == 0)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    simcom_err_t err = SIM_AT_ERR_NO_MEM;
+    portENTER_CRITICAL(&s_urc_mux);
+    if (s_urc_used < SIM_AT_URC_MAX_HANDLERS)
+    {
+        for (size_t probe = 0; probe < SIM_AT_URC_TABLE_SIZE; probe++)
+        {
+            sim_at_urc_entry_t *e = &s_urc_table[(key.hash + probe) & SIM_AT_URC_TABLE_MASK];
+            if (e->state == SIM_AT_URC_ENTRY_USED)
+                continue;
+
+            e->key = key;
+            memcpy(e->prefix, prefix, key.len);
+            e->prefix[key.len] = '\0';
+            e->cb = cb;
+            e->ctx = ctx;
+            e->data = data;
+            e->state = SIM_AT_URC_ENTRY_USED;
+            s_urc_used++;
+            err = SIM_AT_OK;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_urc_mux);
+
+    return err;
+}
+
+/**
+ * @brief Registers the built-in discarded URCs once
+ */
+static void _urc_add_builtins(void)
+{
+    if (s_urc_builtins)
+        return;
+    s_urc_builtins = true;
+
+    for (size_t i = 0; i < sizeof(s_urc_discard) / sizeof(s_urc_discard[0]); i++)
+        _urc_add(s_urc_discard[i], NULL, NULL, NULL);
+}
+
+sim_at_urc_class_t sim_at_urc_classify(const char *line, sim_at_line_key_t key)
+{
+    if (key.len == 0)
+        return SIM_AT_URC_NONE;
+
+    sim_at_urc_class_t type = SIM_AT_URC_NONE;
+    size_t probe = 0;
+    int idx;
+
+    portENTER_CRITICAL(&s_urc_mux);
+    while ((idx = _urc_find(line, key, &probe)) >= 0)
+    {
+        if (s_urc_table[idx].data != NULL)
+        {
+            type = SIM_AT_URC_DATA;
+            break;
+        }
+        if (s_urc_table[idx].cb != NULL)
+            type = SIM_AT_URC_HANDLED;
+        else if (type == SIM_AT_URC_NONE)
+            type = SIM_AT_URC_DISCARD;
+    }
+    portEXIT_CRITICAL(&s_urc_mux);
+
+    return type;
+}
+
+size_t sim_at_urc_data_line(const char *line, size_t len, sim_at_line_key_t key,
+                            const sim_at_urc_data_handler_t **data)
+{
+    const sim_at_urc_data_handler_t *handler = NULL;
+    size_t probe = 0;
+    int idx;
+
+    portENTER_CRITICAL(&s_urc_mux);
+    while (handler == NULL && (idx = _urc_find(line, key, &probe)) >= 0)
+        handler = s_urc_table[idx].data;
+    portEXIT_CRITICAL(&s_urc_mux);
+
+    *data = handler;
+    if (handler == NULL)
+        return 0;
+    return handler->line(line, len, handler->ctx);
+}
+
+void sim_at_urc_data(const sim_at_urc_data_handler_t *handler, const uint8_t *data, size_t len)
+{
+    if (handler)
+        handler->data(data, len, handler->ctx);
+}
+
+bool sim_at_urc_defer(sim_at_urc_defer_fn_t fn, void *arg)
+{
+    static sim_at_urc_event_t event;    // only used by the parser task
+
+    if (s_urc_queue == NULL)
+        return false;
+
+    event.fn = fn;
+    event.arg = arg;
+    event.len = 0;
+    event.line[0] = '\0';
+    if (xQueueSend(s_urc_queue, &event, 0) != pdTRUE)
+    {
+        if (s_urc_dropped++ == 0)
+            ESP_LOGW(TAG, "URC queue full, dropping deferred call");
+        return false;
+    }
+    return true;
+}
+
+bool sim_at_urc_post(const char *line, size_t len)
+{
+    static sim_at_urc_event_t event;    // only used by the parser task
+
+    if (s_urc_queue == NULL)
+        return false;
+
+    if (len > SIM_AT_URC_MAX_LINE_LEN - 1)
+        len = SIM_AT_URC_MAX_LINE_LEN - 1;
+    memcpy(event.line, line, len);
+    event.line[len] = '\0';
+    event.len = (uint16_t)len;
+    event.fn = NULL;
+
+    if (xQueueSend(s_urc_queue, &event, 0) != pdTRUE)
+    {
+        // Warn once, the counter keeps the total
+        if (s_urc_dropped++ == 0)
+            ESP_LOGW(TAG, "URC queue full, dropping: %s", event.line);
+        return false;
+    }
+    return true;
+}
+
+/* URC task: runs the handlers of the queued lines */
+static void _s_urc_task_fn(void *arg)
+{
+    static sim_at_urc_event_t event;
+    struct {
+        simcom_urc_cb_t cb;
+        void *ctx;
+    } handlers[SIM_AT_URC_MAX_HANDLERS];
+
+    while (1)
+    {
+        if (xQueueReceive(s_urc_queue, &event, portMAX_DELAY) != pdTRUE)
+            continue;
+
+        if (event.fn)
+        {
+            event.fn(event.arg, true);
+            continue;
+        }
+
+        // Copy the handlers, they can be unregistered while running
+        sim_at_line_info_t info;
+        sim_at_line_classify(event.line, event.len, NULL, 0, &info);
+        sim_at_line_key_t key = info.key;
+        size_t count = 0;
+        size_t probe = 0;
+        int idx;
+
+        portENTER_CRITICAL(&s_urc_mux);
+        while ((idx = _urc_find(event.line, key, &probe)) >= 0)
+        {
+            if (s_urc_table[idx].cb == NULL)
+                continue;
+            handlers[count].cb = s_urc_table[idx].cb;
+            handlers[count].ctx = s_urc_table[idx].ctx;
+            count++;
+        }
+        portEXIT_CRITICAL(&s_urc_mux);
+
+        for (size_t i = 0; i < count; i++)
+            handlers[i].cb(event.line, event.len, handlers[i].ctx);
+    }
+}
+
+simcom_err_t sim_at_urc_start(void)
+{
+    _urc_add_builtins();
+
+    s_urc_queue = xQueueCreate(SIM_AT_URC_QUEUE_LEN, sizeof(sim_at_urc_event_t));
+    if (!s_urc_queue)
+        return SIM_AT_ERR_NO_MEM;
+
+    if (xTaskCreate(_s_urc_task_fn, "sim_at_urc", SIM_AT_URC_TASK_STACK, NULL, SIM_AT_URC_TASK_PRIO, &s_urc_task) != pdPASS)
+    {
+        vQueueDelete(s_urc_queue);
+        s_urc_queue = NULL;
+        return SIM_AT_ERR_NO_MEM;
+    }
+    return SIM_AT_OK;
+}
+
+void sim_at_urc_stop(void)
+{
+    /* stop URC task */
+    if (s_urc_task)
+    {
+        vTaskDelete(s_urc_task);
+        s_urc_task = NULL;
+    }
+    if (s_urc_queue)
+    {
+        // Deferred calls left release what they hold
+        static sim_at_urc_event_t event;
+        while (xQueueReceive(s_urc_queue, &event, 0) == pdTRUE)
+        {
+            if (event.fn)
+                event.fn(event.arg, false);
+        }
+        vQueueDelete(s_urc_queue);
+        s_urc_queue = NULL;
+    }
+}
+
+simcom_err_t simcom_urc_register(const char *prefix, simcom_urc_cb_t cb, void *ctx)
+{
+    if (prefix == NULL || cb == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    _urc_add_builtins();
+    return _urc_add(prefix, cb, ctx, NULL);
+}
+
+simcom_err_t sim_at_urc_register_data(const char *prefix, const sim_at_urc_data_handler_t *handler)
+{
+    if (prefix == NULL || handler == NULL || handler->line == NULL || handler->data == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    _urc_add_builtins();
+    return _urc_add(prefix, NULL, NULL, handler);
+}
+
+/**
+ * @brief Removes the entry of a prefix with the given handler
+ */
+static simcom_err_t _urc_remove(const char *prefix, simcom_urc_cb_t cb, void *ctx,
+                                const sim_at_urc_data_handler_t *data)
+{
+    size_t len = strlen(prefix);
+    if (len > 0 && prefix[len - 1] == ':')
+        len--;
+    sim_at_line_key_t key = _urc_key(prefix, len, "");
+    if (key.len == 0)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    simcom_err_t err = SIM_AT_ERR_INVALID_ARG;
+    size_t probe = 0;
+    int idx;
+
+    portENTER_CRITICAL(&s_urc_mux);
+    while ((idx = _urc_find(prefix, key, &probe)) >= 0)
+    {
+        sim_at_urc_entry_t *e = &s_urc_table[idx];
+        if (e->cb == cb && e->ctx == ctx && e->data == data)
+        {
+            e->state = SIM_AT_URC_ENTRY_TOMBSTONE;
+            s_urc_used--;
+            err = SIM_AT_OK;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_urc_mux);
+
+    return err;
+}
+
+simcom_err_t simcom_urc_unregister(const char *prefix, simcom_urc_cb_t cb, void *ctx)
+{
+    if (prefix == NULL || cb == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+    return _urc_remove(prefix, cb, ctx, NULL);
+}
+
+simcom_err_t sim_at_urc_unregister_data(const char *prefix, const sim_at_urc_data_handler_t *handler)
+{
+    if (prefix == NULL || handler == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+    return _urc_remove(prefix, NULL, NULL, handler);
+}
+
+uint32_t simcom_urc_dropped(void)
+{
+    return s_urc_dropped;
+}
+
+/* End of file */
@@ -0,0 +1,144 @@
+#ifndef SIM_AT_URC_H
+#define SIM_AT_URC_H
+
+#include "simcom.h"
+#include "at/sim_at.h"
+#include "at/sim_at_line.h"
+
+/**
+ * -------------------------------------
+ * ----- [ Compile-time tunables ] -----
+ * -------------------------------------
+ */
+
+// max registered URC handlers, a power of two. The library takes up to 20 with every service
+// in use: 5 built-in discarded URCs, 5 state cache, 4 MQTT receive, 4 sockets, 2 bring-up
+#ifndef SIM_AT_URC_MAX_HANDLERS
+#define SIM_AT_URC_MAX_HANDLERS   32U
+#endif
+
+// URC lines waiting for their handlers
+#ifndef SIM_AT_URC_QUEUE_LEN
+#define SIM_AT_URC_QUEUE_LEN      8U
+#endif
+
+// max URC line length delivered to handlers, longer lines are truncated
+#ifndef SIM_AT_URC_MAX_LINE_LEN
+#define SIM_AT_URC_MAX_LINE_LEN   256U
+#endif
+
+/**
+ * Classification of a received line against the URC registry.
+ */
+typedef enum {
+    SIM_AT_URC_NONE = 0,        // not a registered URC, stored as a response
+    SIM_AT_URC_DISCARD,         // known URC nobody handles, dropped
+    SIM_AT_URC_HANDLED,         // dispatched to the registered handlers
+    SIM_AT_URC_DATA,            // followed by length-counted data, handled in the parser task
+} sim_at_urc_class_t;
+
+/**
+ * Handler of a URC followed by length-counted data, e.g. "+CMQTTRXPAYLOAD: 0,1500" and the
+ * 1500 payload bytes after its line. The parser reads those bytes as they are, without
+ * looking for lines in them. Both functions run in the parser task and must not block. The
+ * line can also be the response of a command (AT+CIPRXGET=2), it is then stored for it too.
+ */
+typedef struct {
+    // URC line; returns the number of data bytes that follow it, 0 for none
+    size_t (*line)(const char *line, size_t len, void *ctx);
+    // next chunk of those bytes, in order; NULL data if the rest of them was lost
+    void (*data)(const uint8_t *data, size_t len, void *ctx);
+    void *ctx;
+} sim_at_urc_data_handler_t;
+
+/**
+ * Call deferred to the URC task. run is false when the URC task stops before running it, so
+ * the call only releases what arg holds.
+ */
+typedef void (*sim_at_urc_defer_fn_t)(void *arg, bool run);
+
+/**
+ * @brief Key of the information responses of a command, e.g. "+CSQ" for "AT+CSQ\r\n"
+ *
+ * @param cmd NUL-terminated AT command
+ */
+sim_at_line_key_t sim_at_urc_cmd_key(const char *cmd);
+
+/**
+ * @brief Looks up a line in the URC registry (O(1), called once per line by the parser)
+ *
+ * @param line Line (already CR/LF stripped)
+ * @param key Line key, from sim_at_line_classify()
+ */
+sim_at_urc_class_t sim_at_urc_classify(const char *line, sim_at_line_key_t key);
+
+/**
+ * @brief Registers the handler of a URC followed by length-counted data. Takes precedence
+ * over the handlers of simcom_urc_register() for the same prefix.
+ *
+ * @param prefix URC prefix, up to SIM_AT_URC_PREFIX_LEN characters
+ * @param handler Handler, must stay valid while registered
+ */
+simcom_err_t sim_at_urc_register_data(const char *prefix, const sim_at_urc_data_handler_t *handler);
+
+/**
+ * @brief Removes a handler added with sim_at_urc_register_data()
+ *
+ * @return SIM_AT_ERR_INVALID_ARG if it was not registered
+ */
+simcom_err_t sim_at_urc_unregister_data(const char *prefix, const sim_at_urc_data_handler_t *handler);
+
+/**
+ * @brief Runs the data handler of a SIM_AT_URC_DATA line (parser task only)
+ *
+ * @param line Line (already CR/LF stripped)
+ * @param len Line length
+ * @param key Line key, from sim_at_line_classify()
+ * @param data Handler of the data that follows, kept by the channel the line arrived on
+ *
+ * @return Number of data bytes that follow the line
+ */
+size_t sim_at_urc_data_line(const char *line, size_t len, sim_at_line_key_t key,
+                            const sim_at_urc_data_handler_t **data);
+
+/**
+ * @brief Passes the data that follows a SIM_AT_URC_DATA line to its handler (parser task only)
+ *
+ * @param handler Handler returned with the line
+ * @param data Next received bytes, NULL if the rest of them was lost
+ * @param len Number of bytes
+ */
+void sim_at_urc_data(const sim_at_urc_data_handler_t *handler, const uint8_t *data, size_t len);
+
+/**
+ * @brief Queues a call for the URC task, after the URC lines already queued. Never blocks.
+ *
+ * @return False if the URC queue is full and the call was not queued
+ */
+bool sim_at_urc_defer(sim_at_urc_defer_fn_t fn, void *arg);
+
+/**
+ * @brief Queues a URC line for its handlers. Never blocks.
+ *
+ * @param line Line (already CR/LF stripped)
+ * @param len Line length
+ *
+ * @return False if the URC queue is full and the line was dropped
+ */
+bool sim_at_urc_post(const char *line, size_t len);
+
+/**
+ * @brief Creates the URC queue and the task that runs the handlers
+ *
+ * @return
+ *  - SIM_AT_OK on success
+ *  - SIM_AT_ERR_NO_MEM
+ */
+simcom_err_t sim_at_urc_start(void);
+
+/**
+ * @brief Stops the URC task and deletes its queue. Registered handlers are kept.
+ */
+void sim_at_urc_stop(void);
+
+#endif // SIM_AT_URC_H
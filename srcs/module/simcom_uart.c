@@ -1,10 +1,12 @@
 #include "simcom.h"
 #include "at/sim_at.h"
+#include "at/sim_at_urc.h"
 
 static const char* TAG = "simcom_uart";
 
 static simcom_config_t g_cfg;
 static bool g_inited = false;
+static const simcom_transport_t *s_transport = NULL;
 
 /* Public API implementations */
 
@@ -23,33 +25,42 @@ simcom_err_t simcom_init(const simcom_config_t *cfg)
 
     /* copy config */
     memcpy(&g_cfg, cfg, sizeof(g_cfg));
-    simcom_set_config(&g_cfg);
 
-    simcom_sem_create();
+    /* RTS/CTS: RTS holds the modem back before the RX FIFO overruns */
+    if (g_cfg.use_hw_flow_control)
+    {
+        g_cfg.uart_conf.flow_ctrl = UART_HW_FLOWCTRL_CTS_RTS;
+        if (g_cfg.uart_conf.rx_flow_ctrl_thresh == 0)
+            g_cfg.uart_conf.rx_flow_ctrl_thresh = SIM_AT_UART_RTS_THRESH;
+    }
+    simcom_set_config(&g_cfg);
 
-    /* uart config */
-    esp_err_t e;
-    e = uart_driver_install(g_cfg.uart_port, SIM_AT_MAX_RESP_LEN * 2, 0, 0, NULL, 0);
-    if (e != ESP_OK)
+    simcom_err_t err = simcom_sem_create();
+    if (err != SIM_AT_OK)
     {
-        ESP_LOGE(TAG, "uart_driver_install failed: %d", e);
-        return SIM_AT_ERR_UART;
+        ESP_LOGE(TAG, "failed to create sim_at locks");
+        return err;
     }
-    e = uart_param_config(g_cfg.uart_port, &g_cfg.uart_conf);
-    if (e != ESP_OK)
+
+    /* open modem link, the ESP-IDF UART unless another transport is configured */
+    s_transport = g_cfg.transport;
+#ifdef ESP_PLATFORM
+    if (s_transport == NULL)
+        s_transport = simcom_transport_uart();
+#endif
+    if (s_transport == NULL)
     {
-        ESP_LOGE(TAG, "uart_param_config failed: %d", e);
-        uart_driver_delete(g_cfg.uart_port);
-        return SIM_AT_ERR_UART;
+        ESP_LOGE(TAG, "no transport configured");
+        simcom_sem_delete();
+        return SIM_AT_ERR_INVALID_ARG;
     }
-    e = uart_set_pin(g_cfg.uart_port, g_cfg.tx_pin, g_cfg.rx_pin, g_cfg.rts_pin, g_cfg.cts_pin);
-    if (e != ESP_OK)
+    err = s_transport->open(s_transport->ctx, &g_cfg);
+    if (err != SIM_AT_OK)
     {
-        ESP_LOGE(TAG, "uart_set_pin failed: %d", e);
-        uart_driver_delete(g_cfg.uart_port);
-        return SIM_AT_ERR_UART;
+        simcom_sem_delete();
+        return err;
     }
-    ESP_LOGI(TAG, "UART port %d initialized on TX=%d, RX=%d", g_cfg.uart_port, g_cfg.tx_pin, g_cfg.rx_pin);
+    simcom_set_transport(s_transport);
 
     // TODO: Controlar bien esto y hacerlo funcionar
     /* configure control pins as outputs if set */
@@ -66,12 +77,23 @@ simcom_err_t simcom_init(const simcom_config_t *cfg)
     //     gpio_set_level(g_cfg.control_pins.rst_pin, 1); /* assume active-low reset */
     // }
 
+    /* create URC dispatcher task */
+    err = sim_at_urc_start();
+    if (err != SIM_AT_OK)
+    {
+        ESP_LOGE(TAG, "failed to create URC task");
+        s_transport->close(s_transport->ctx);
+        simcom_sem_delete();
+        return err;
+    }
+
     /* create parser task */
     BaseType_t ok = simcom_parser_task_create();
     if (ok != pdPASS)
     {
         ESP_LOGE(TAG, "failed to create parser task");
-        uart_driver_delete(g_cfg.uart_port);
+        sim_at_urc_stop();
+        s_transport->close(s_transport->ctx);
         simcom_sem_delete();
         return SIM_AT_ERR_INTERNAL;
     }
@@ -89,9 +111,10 @@ simcom_err_t simcom_deinit(void)
         return SIM_AT_ERR_NOT_INIT;
     
     simcom_parser_task_delete();
+    sim_at_urc_stop();
 
-    /* delete uart driver */
-    uart_driver_delete(g_cfg.uart_port);
+    /* close modem link */
+    s_transport->close(s_transport->ctx);
     
     simcom_sem_delete();
     
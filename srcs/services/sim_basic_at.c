@@ -1,5 +1,6 @@
 #include "simcom.h"
 #include "at/sim_at.h"
+#include "at/sim_at_fields.h"
 
 static const char *TAG = "basic_at";
 
@@ -14,9 +15,8 @@ simcom_err_t simcom_wait_atready(void)
     }
     
     // Reads response
-    char resp[SIM_AT_MAX_RESP_LEN];
-    char *data;
-    simcom_responses_err_t resp_err = simcom_read_resp_values(resp, "*ATREADY", &data);
+    const char *data;
+    simcom_responses_err_t resp_err = simcom_read_resp_values("*ATREADY", &data);
     if (resp_err != SIM_AT_RESPONSE_OK)
     {
         ESP_LOGE(TAG, "Error with *ATREADY response: %s", simcom_resp_err_to_str(resp_err));
@@ -24,13 +24,15 @@ simcom_err_t simcom_wait_atready(void)
     }
 
     int err_code;
-    if (sscanf(data, "%d", &err_code) != 1)
+    sim_at_fields_t fields;
+    sim_at_fields_init(&fields, data);
+    if (!sim_at_fields_int(&fields, &err_code))
     return SIM_AT_ERR_RESPONSE;
 
     if (err_code != 1)
     {
         ESP_LOGE(TAG, "SIMCom not initilized");
-        return err;
+        return SIM_AT_ERR_RESPONSE;
     }
 
     return SIM_AT_OK;
@@ -47,8 +49,7 @@ simcom_err_t simcom_comm_test(void)
     }
 
     // Read OK responss
-    char resp[SIM_AT_MAX_RESP_LEN];
-    simcom_responses_err_t resp_err = simcom_resp_read_ok(resp);
+    simcom_responses_err_t resp_err = simcom_resp_read_ok();
     if (resp_err != SIM_AT_RESPONSE_COMMAND_OK)
     {
         ESP_LOGE(TAG, "Ok response was not received: %s", simcom_resp_err_to_str(resp_err));
@@ -73,8 +74,7 @@ simcom_err_t simcom_enable_echo(bool enable)
     }
 
     // Read OK responss
-    char resp[SIM_AT_MAX_RESP_LEN];
-    simcom_responses_err_t resp_err = simcom_resp_read_ok(resp);
+    simcom_responses_err_t resp_err = simcom_resp_read_ok();
     if (resp_err != SIM_AT_RESPONSE_COMMAND_OK)
     {
         ESP_LOGE(TAG, "Ok response was not received: %s", simcom_resp_err_to_str(resp_err));
@@ -83,4 +83,15 @@ simcom_err_t simcom_enable_echo(bool enable)
     
     return SIM_AT_OK;
 
-}
\ No newline at end of file
+}
+simcom_err_t simcom_set_flow_control(bool enable)
+{
+    // <DCE by DTE>,<DTE by DCE>: 2 is RTS for the first and CTS for the second
+    simcom_cmd_result_t result;
+    simcom_err_t err = simcom_cmd_transact(enable ? "AT+IFC=2,2\r\n" : "AT+IFC=0,0\r\n", 9000, &result);
+    if (err == SIM_AT_OK && result.final != SIM_AT_FINAL_OK)
+        err = SIM_AT_ERR_RESPONSE;
+    if (err != SIM_AT_OK)
+        ESP_LOGE(TAG, "Error with AT+IFC command: %s", simcom_err_to_str(err));
+    return err;
+}
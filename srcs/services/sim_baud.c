@@ -0,0 +1,154 @@
+/**
+ * sim_baud.c
+ * UART rate negotiation: the modem and the local UART move together to the fastest rate of a
+ * list that carries an AT round trip
+ *
+ * AT+IPR answers OK at the old rate and then switches, and only until the modem restarts, so
+ * a rate that does not work never outlives a reset. The local side follows through the
+ * set_baud() of the transport. Every switch is checked with AT before it is kept.
+ */
+
+#include "simcom.h"
+#include "at/sim_at.h"
+#include "services/sim_baud.h"
+#include "freertos/task.h"
+
+static const char *TAG = "baud";
+
+/**
+ * -------------------------------------
+ * ----- [ Compile-time tunables ] -----
+ * -------------------------------------
+ */
+
+// timeout of each AT probe
+#ifndef SIM_BAUD_PROBE_MS
+#define SIM_BAUD_PROBE_MS       300U
+#endif
+
+// probes at a rate before giving it up, the first bytes after a switch may be lost
+#ifndef SIM_BAUD_PROBE_TRIES
+#define SIM_BAUD_PROBE_TRIES    2
+#endif
+
+// wait after the OK of AT+IPR for the modem to switch
+#ifndef SIM_BAUD_SETTLE_MS
+#define SIM_BAUD_SETTLE_MS      20U
+#endif
+
+/**
+ * @brief Sends a command that ends with OK
+ */
+static simcom_err_t _baud_cmd(const char *cmd, uint32_t timeout_ms, uint32_t *commands)
+{
+    simcom_cmd_result_t result;
+    (*commands)++;
+    simcom_err_t err = simcom_cmd_transact(cmd, timeout_ms, &result);
+    if (err == SIM_AT_OK && result.final != SIM_AT_FINAL_OK)
+        err = SIM_AT_ERR_RESPONSE;
+    return err;
+}
+
+/**
+ * @brief Switches the local UART and checks the modem answers at that rate
+ */
+static bool _baud_probe(uint32_t rate, uint32_t *commands)
+{
+    if (simcom_uart_set_baud(rate) != SIM_AT_OK)
+        return false;
+    for (int i = 0; i < SIM_BAUD_PROBE_TRIES; i++)
+    {
+        if (_baud_cmd("AT\r\n", SIM_BAUD_PROBE_MS, commands) == SIM_AT_OK)
+            return true;
+    }
+    return false;
+}
+
+simcom_err_t sim_baud_find(const simcom_baud_config_t *cfg, uint32_t *commands)
+{
+    uint32_t current = simcom_uart_get_baud();
+
+    // The rate chosen last time first: the MCU may have restarted with the modem still there
+    uint32_t tried[2] = { cfg->last_rate, current };
+    for (size_t i = 0; i < 2; i++)
+    {
+        if (tried[i] != 0 && (i == 0 || tried[i] != tried[0]) && _baud_probe(tried[i], commands))
+            return SIM_AT_OK;
+    }
+    for (size_t i = 0; i < cfg->rate_count; i++)
+    {
+        uint32_t rate = cfg->rates[i];
+        if (rate != tried[0] && rate != tried[1] && _baud_probe(rate, commands))
+            return SIM_AT_OK;
+    }
+
+    simcom_uart_set_baud(current);
+    return SIMCOM_ERR_TIMEOUT;
+}
+
+simcom_err_t sim_baud_escalate(const simcom_baud_config_t *cfg, uint32_t *commands)
+{
+    uint32_t from = simcom_uart_get_baud();
+
+    for (size_t i = 0; i < cfg->rate_count; i++)
+    {
+        uint32_t rate = cfg->rates[i];
+        if (rate <= from)
+            continue;
+
+        // The local UART must take the rate before the modem moves to it
+        if (simcom_uart_set_baud(rate) != SIM_AT_OK)
+        {
+            ESP_LOGW(TAG, "%u baud not supported by the local UART", (unsigned)rate);
+            continue;
+        }
+        simcom_uart_set_baud(from);
+
+        char cmd[SIM_AT_MAX_CMD_LEN];
+        snprintf(cmd, sizeof(cmd), "AT+IPR=%u\r\n", (unsigned)rate);
+        if (_baud_cmd(cmd, 1000, commands) != SIM_AT_OK)
+        {
+            ESP_LOGW(TAG, "%u baud refused by the modem", (unsigned)rate);
+            continue;
+        }
+        vTaskDelay(pdMS_TO_TICKS(SIM_BAUD_SETTLE_MS));
+
+        if (_baud_probe(rate, commands))
+        {
+            ESP_LOGI(TAG, "Link at %u baud", (unsigned)rate);
+            return SIM_AT_OK;
+        }
+
+        // Not heard at the new rate, maybe the modem never switched
+        ESP_LOGW(TAG, "No answer at %u baud", (unsigned)rate);
+        if (_baud_probe(from, commands))
+            continue;
+
+        simcom_err_t err = sim_baud_find(cfg, commands);
+        if (err != SIM_AT_OK)
+        {
+            ESP_LOGE(TAG, "Modem lost after AT+IPR=%u, reset it", (unsigned)rate);
+            return err;
+        }
+        from = simcom_uart_get_baud();
+    }
+
+    return SIM_AT_OK;
+}
+
+simcom_err_t simcom_baud_negotiate(const simcom_baud_config_t *cfg, uint32_t *baud_rate)
+{
+    if (cfg == NULL || (cfg->rates == NULL && cfg->rate_count > 0))
+        return SIM_AT_ERR_INVALID_ARG;
+
+    uint32_t commands = 0;
+    simcom_err_t err = sim_baud_find(cfg, &commands);
+    if (err == SIM_AT_OK)
+        err = sim_baud_escalate(cfg, &commands);
+    else
+        ESP_LOGE(TAG, "The modem does not answer at any rate");
+
+    if (baud_rate != NULL)
+        *baud_rate = simcom_uart_get_baud();
+    return err;
+}
@@ -0,0 +1,24 @@
+#ifndef SIM_BAUD_H
+#define SIM_BAUD_H
+
+#include "simcom.h"
+
+/**
+ * @brief Looks for the modem at last_rate, at the rate in use and at the rates of the list,
+ * and leaves the local UART at the rate it answered
+ *
+ * @param commands Incremented with each AT sent
+ *
+ * @return SIM_AT_OK if found, SIMCOM_ERR_TIMEOUT otherwise (back at the rate in use)
+ */
+simcom_err_t sim_baud_find(const simcom_baud_config_t *cfg, uint32_t *commands);
+
+/**
+ * @brief Moves the modem and the local UART to the fastest rate of the list that works,
+ * starting from a modem that answers
+ *
+ * @param commands Incremented with each command sent
+ */
+simcom_err_t sim_baud_escalate(const simcom_baud_config_t *cfg, uint32_t *commands);
+
+#endif // SIM_BAUD_H
@@ -0,0 +1,433 @@
+/**
+ * sim_bringup.c
+ * Bring-up of the data link: from power-on, or from whatever the modem kept, to a connected
+ * MQTT client with the fewest commands
+ *
+ * The phases depend on each other: modem answering -> SIM ready -> EPS registration (on LTE
+ * also the packet domain attach) -> PDP context active -> MQTT service -> client -> server.
+ * Each phase first looks at what the modem already did, and what a phase proves is not checked
+ * again: a registered modem has its SIM ready, a service started now has no clients and a
+ * client acquired now is not connected. Registration is awaited on the +CEREG URCs.
+ */
+
+#include "simcom.h"
+#include "at/sim_at.h"
+#include "at/sim_at_fields.h"
+#include "services/sim_mqtt_at.h"
+#include "services/sim_baud.h"
+#include "spool/sim_spool.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+static const char *TAG = "bringup";
+
+/**
+ * -------------------------------------
+ * ----- [ Compile-time tunables ] -----
+ * -------------------------------------
+ */
+
+// default time for the modem to answer AT after power-on
+#ifndef SIM_BRINGUP_READY_TIMEOUT_MS
+#define SIM_BRINGUP_READY_TIMEOUT_MS    30000U
+#endif
+
+// default time for the network registration
+#ifndef SIM_BRINGUP_REG_TIMEOUT_MS
+#define SIM_BRINGUP_REG_TIMEOUT_MS      120000U
+#endif
+
+// timeout of each AT probe while the modem boots
+#ifndef SIM_BRINGUP_PROBE_MS
+#define SIM_BRINGUP_PROBE_MS            500U
+#endif
+
+// wait for *ATREADY between two probes
+#ifndef SIM_BRINGUP_PROBE_INTERVAL_MS
+#define SIM_BRINGUP_PROBE_INTERVAL_MS   1000U
+#endif
+
+typedef struct {
+    const simcom_bringup_config_t *cfg;
+    simcom_bringup_stats_t *stats;
+    TickType_t mark;            // end of the previous phase
+} sim_bringup_t;
+
+static SemaphoreHandle_t s_bringup_event;   // *ATREADY or a +CEREG URC
+static volatile int s_reg_stat = -1;        // state of the last +CEREG URC
+static bool s_bringup_busy;
+static portMUX_TYPE s_bringup_mux = portMUX_INITIALIZER_UNLOCKED;
+
+const char *simcom_bringup_phase_to_str(simcom_bringup_phase_t phase)
+{
+    switch (phase)
+    {
+    case SIMCOM_BRINGUP_MODEM:        return "modem";
+    case SIMCOM_BRINGUP_SIM:          return "SIM card";
+    case SIMCOM_BRINGUP_NETWORK:      return "network registration";
+    case SIMCOM_BRINGUP_PDP:          return "PDP context";
+    case SIMCOM_BRINGUP_MQTT_SERVICE: return "MQTT service";
+    case SIMCOM_BRINGUP_MQTT_CLIENT:  return "MQTT client";
+    case SIMCOM_BRINGUP_MQTT_CONNECT: return "MQTT connection";
+    default:                          return "unknown";
+    }
+}
+
+/**
+ * @brief "*ATREADY: 1" and "+CEREG: <stat>[,<tac>,<ci>,...]" URCs
+ */
+static void _bringup_urc(const char *line, size_t len, void *ctx)
+{
+    const char *values = strchr(line, ':');
+    if (line[0] == '+' && values != NULL)
+    {
+        int stat;
+        sim_at_fields_t fields;
+        sim_at_fields_init(&fields, values + 1);
+        if (!sim_at_fields_int(&fields, &stat))
+            return;
+        s_reg_stat = stat;
+    }
+    xSemaphoreGive(s_bringup_event);
+}
+
+static bool _bringup_registered(int stat)
+{
+    return stat == EPS_REGISTERED || stat == EPS_ROAMING;
+}
+
+/**
+ * @brief Adds the time since the end of the previous phase to a phase
+ */
+static void _bringup_done(sim_bringup_t *b, simcom_bringup_phase_t phase)
+{
+    TickType_t now = xTaskGetTickCount();
+    b->stats->phase_ms[phase] += (uint32_t)((now - b->mark) * portTICK_PERIOD_MS);
+    b->mark = now;
+}
+
+/**
+ * @brief Sends a command that ends with OK, its lines are read afterwards
+ */
+static simcom_err_t _bringup_cmd(sim_bringup_t *b, const char *cmd, uint32_t timeout_ms)
+{
+    simcom_cmd_result_t result;
+    b->stats->commands++;
+    simcom_err_t err = simcom_cmd_transact(cmd, timeout_ms, &result);
+    if (err == SIM_AT_OK && result.final != SIM_AT_FINAL_OK)
+        err = SIM_AT_ERR_RESPONSE;
+    return err;
+}
+
+/**
+ * @brief Probes the modem, at the negotiated rates too if configured
+ */
+static simcom_err_t _bringup_probe(sim_bringup_t *b)
+{
+    if (b->cfg->baud != NULL)
+        return sim_baud_find(b->cfg->baud, &b->stats->commands);
+    return _bringup_cmd(b, "AT\r\n", SIM_BRINGUP_PROBE_MS);
+}
+
+/**
+ * @brief Waits for the modem to answer AT. It is probed again as soon as *ATREADY arrives,
+ * or after a while in case it was missed. Then the modem side of the RTS/CTS flow control is
+ * enabled and the UART rate is negotiated, if configured.
+ */
+static simcom_err_t _bringup_modem(sim_bringup_t *b)
+{
+    uint32_t timeout_ms = b->cfg->ready_timeout_ms ? b->cfg->ready_timeout_ms : SIM_BRINGUP_READY_TIMEOUT_MS;
+    TickType_t wait = pdMS_TO_TICKS(timeout_ms);
+    TickType_t start = xTaskGetTickCount();
+    while (_bringup_probe(b) != SIM_AT_OK)
+    {
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if (elapsed >= wait)
+        {
+            ESP_LOGE(TAG, "The modem does not answer");
+            return SIMCOM_ERR_TIMEOUT;
+        }
+        TickType_t nap = pdMS_TO_TICKS(SIM_BRINGUP_PROBE_INTERVAL_MS);
+        xSemaphoreTake(s_bringup_event, (wait - elapsed < nap) ? wait - elapsed : nap);
+    }
+
+    // The bring-up itself recovers from the reset
+    simcom_clear_reset();
+
+    // Before any faster rate: the modem must stop when RTS says the RX FIFO is full
+    if (simcom_uart_flow_control())
+    {
+        b->stats->commands++;
+        simcom_err_t err = simcom_set_flow_control(true);
+        if (err != SIM_AT_OK)
+            return err;
+    }
+    if (b->cfg->baud != NULL)
+        return sim_baud_escalate(b->cfg->baud, &b->stats->commands);
+    return SIM_AT_OK;
+}
+
+/**
+ * @brief Queries the EPS registration. A +CEREG URC that arrives during the query is taken as
+ * its response and does not parse, the query is sent again then.
+ */
+static simcom_err_t _bringup_eps_stat(sim_bringup_t *b, int *stat)
+{
+    sim_eps_network_registration_stat_t eps;
+    simcom_err_t err = SIM_AT_ERR_RESPONSE;
+    for (int i = 0; i < 2 && err == SIM_AT_ERR_RESPONSE; i++)
+    {
+        b->stats->commands++;
+        err = simcom_eps_net_reg(&eps);
+    }
+    if (err == SIM_AT_OK)
+        *stat = eps;
+    return err;
+}
+
+/**
+ * @brief SIM card and network registration
+ */
+static simcom_err_t _bringup_network(sim_bringup_t *b)
+{
+    int stat;
+    b->stats->phase = SIMCOM_BRINGUP_NETWORK;
+    simcom_err_t err = _bringup_eps_stat(b, &stat);
+    if (err != SIM_AT_OK)
+        return err;
+    _bringup_done(b, SIMCOM_BRINGUP_NETWORK);
+
+    // A registered modem has its SIM ready
+    if (_bringup_registered(stat))
+    {
+        b->stats->skipped |= (1U << SIMCOM_BRINGUP_SIM) | (1U << SIMCOM_BRINGUP_NETWORK);
+        return SIM_AT_OK;
+    }
+
+    // A SIM that waits for its PIN never registers
+    sim_simcard_pin_code_t code = (sim_simcard_pin_code_t)-1;
+    b->stats->phase = SIMCOM_BRINGUP_SIM;
+    b->stats->commands++;
+    err = simcom_get_simcard_pin_info(&code);
+    if (err != SIM_AT_OK)
+        return err;
+    if (code != SIMCARD_READY)
+    {
+        ESP_LOGE(TAG, "SIM card not ready (%d)", (int)code);
+        return SIM_AT_ERR_RESPONSE;
+    }
+    _bringup_done(b, SIMCOM_BRINGUP_SIM);
+
+    // Registration changes reported by URCs, queried again in case it finished before
+    b->stats->phase = SIMCOM_BRINGUP_NETWORK;
+    s_reg_stat = -1;
+    err = _bringup_cmd(b, "AT+CEREG=1\r\n", 9000);
+    if (err == SIM_AT_OK)
+        err = _bringup_eps_stat(b, &stat);
+    if (err != SIM_AT_OK)
+        return err;
+
+    uint32_t timeout_ms = b->cfg->reg_timeout_ms ? b->cfg->reg_timeout_ms : SIM_BRINGUP_REG_TIMEOUT_MS;
+    TickType_t wait = pdMS_TO_TICKS(timeout_ms);
+    TickType_t start = xTaskGetTickCount();
+    while (!_bringup_registered(stat))
+    {
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if (elapsed >= wait)
+        {
+            ESP_LOGE(TAG, "Not registered: %s", simcom_sim_eps_net_stat_to_str(stat));
+            return SIMCOM_ERR_TIMEOUT;
+        }
+        if (xSemaphoreTake(s_bringup_event, wait - elapsed) == pdTRUE && s_reg_stat >= 0)
+            stat = s_reg_stat;
+    }
+    _bringup_done(b, SIMCOM_BRINGUP_NETWORK);
+    return SIM_AT_OK;
+}
+
+/**
+ * @brief PDP context: defined only if its APN differs, activated only if inactive
+ */
+static simcom_err_t _bringup_pdp(sim_bringup_t *b)
+{
+    const simcom_bringup_config_t *cfg = b->cfg;
+    simcom_resp_line_t line;
+    sim_at_fields_t fields;
+    bool define = false, activate = true;
+    simcom_err_t err;
+
+    b->stats->phase = SIMCOM_BRINGUP_PDP;
+    if (cfg->apn != NULL)
+    {
+        // "+CGDCONT: <cid>,<type>,<apn>,..." for each defined context
+        err = _bringup_cmd(b, "AT+CGDCONT?\r\n", 9000);
+        if (err != SIM_AT_OK)
+            return err;
+        define = true;
+        while (simcom_get_resp_line(&line))
+        {
+            int cid;
+            char type[8], apn[100];
+            sim_at_fields_init(&fields, line.text + line.value_off);
+            if (line.type == SIM_AT_LINE_INFO && sim_at_fields_int(&fields, &cid) && cid == cfg->cid &&
+                sim_at_fields_str(&fields, type, sizeof(type)) && sim_at_fields_str(&fields, apn, sizeof(apn)))
+                define = (strcmp(type, simcom_pdp_type_to_str(cfg->pdp_type)) != 0 || strcmp(apn, cfg->apn) != 0);
+        }
+    }
+
+    // A context defined now is not active
+    if (!define)
+    {
+        // "+CGACT: <cid>,<state>" for each defined context
+        err = _bringup_cmd(b, "AT+CGACT?\r\n", 9000);
+        if (err != SIM_AT_OK)
+            return err;
+        while (simcom_get_resp_line(&line))
+        {
+            int cid, state;
+            sim_at_fields_init(&fields, line.text + line.value_off);
+            if (line.type == SIM_AT_LINE_INFO && sim_at_fields_int(&fields, &cid) && cid == cfg->cid &&
+                sim_at_fields_int(&fields, &state) && state == 1)
+                activate = false;
+        }
+    }
+
+    if (define)
+    {
+        b->stats->commands++;
+        err = simcom_set_pdp_context(cfg->cid, cfg->pdp_type, cfg->apn);
+        if (err != SIM_AT_OK)
+            return err;
+    }
+    if (activate)
+    {
+        b->stats->commands++;
+        err = simcom_set_pdp_context_activate(cfg->cid, 1);
+        if (err != SIM_AT_OK)
+            return err;
+    }
+    else
+    {
+        b->stats->skipped |= (1U << SIMCOM_BRINGUP_PDP);
+    }
+    _bringup_done(b, SIMCOM_BRINGUP_PDP);
+    return SIM_AT_OK;
+}
+
+/**
+ * @brief MQTT service, client and connection
+ */
+static simcom_err_t _bringup_mqtt(sim_bringup_t *b)
+{
+    const simcom_bringup_config_t *cfg = b->cfg;
+    bool started = false, acquired = false, connected = false;
+
+    b->stats->phase = SIMCOM_BRINGUP_MQTT_SERVICE;
+    b->stats->commands++;
+    simcom_err_t err = sim_mqtt_service_start(&started);
+    if (err != SIM_AT_OK)
+        return err;
+    if (started)
+        b->stats->skipped |= (1U << SIMCOM_BRINGUP_MQTT_SERVICE);
+    _bringup_done(b, SIMCOM_BRINGUP_MQTT_SERVICE);
+
+    // A service started now has no clients
+    b->stats->phase = SIMCOM_BRINGUP_MQTT_CLIENT;
+    b->stats->commands++;
+    err = sim_mqtt_client_acquire(cfg->client_index, cfg->client_id, started ? &acquired : NULL);
+    if (err != SIM_AT_OK)
+        return err;
+    if (acquired)
+        b->stats->skipped |= (1U << SIMCOM_BRINGUP_MQTT_CLIENT);
+    _bringup_done(b, SIMCOM_BRINGUP_MQTT_CLIENT);
+
+    // A client acquired now is not connected
+    b->stats->phase = SIMCOM_BRINGUP_MQTT_CONNECT;
+    if (acquired)
+    {
+        b->stats->commands++;
+        err = sim_mqtt_server_connected(cfg->client_index, &connected);
+        if (err != SIM_AT_OK)
+            return err;
+    }
+    if (connected)
+    {
+        b->stats->skipped |= (1U << SIMCOM_BRINGUP_MQTT_CONNECT);
+        sim_spool_connected(cfg->client_index);
+    }
+    else
+    {
+        b->stats->commands++;
+        err = simcom_mqtt_server_connect(cfg->client_index, cfg->server_addr, cfg->keepalive_time, cfg->clean_session);
+        if (err != SIM_AT_OK)
+            return err;
+    }
+    _bringup_done(b, SIMCOM_BRINGUP_MQTT_CONNECT);
+    return SIM_AT_OK;
+}
+
+simcom_err_t simcom_bringup(const simcom_bringup_config_t *cfg, simcom_bringup_stats_t *stats)
+{
+    if (cfg == NULL || cfg->cid < 1 || cfg->cid > 15)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (cfg->client_index != 0 && cfg->client_index != 1)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (cfg->client_id == NULL || strlen(cfg->client_id) > 128 || cfg->server_addr == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (cfg->baud != NULL && cfg->baud->rates == NULL && cfg->baud->rate_count > 0)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    portENTER_CRITICAL(&s_bringup_mux);
+    bool busy = s_bringup_busy;
+    s_bringup_busy = true;
+    portEXIT_CRITICAL(&s_bringup_mux);
+    if (busy)
+        return SIM_AT_ERR_BUSY;
+
+    // Only the owner of the bring-up gets here, the semaphore is created once
+    if (s_bringup_event == NULL)
+        s_bringup_event = xSemaphoreCreateBinary();
+    if (s_bringup_event == NULL)
+    {
+        s_bringup_busy = false;
+        return SIM_AT_ERR_NO_MEM;
+    }
+    xSemaphoreTake(s_bringup_event, 0);
+
+    simcom_bringup_stats_t local;
+    sim_bringup_t b = { .cfg = cfg, .stats = stats ? stats : &local, .mark = xTaskGetTickCount() };
+    *b.stats = (simcom_bringup_stats_t){ 0 };
+    TickType_t start = b.mark;
+
+    simcom_err_t err = simcom_urc_register("*ATREADY", _bringup_urc, NULL);
+    if (err == SIM_AT_OK)
+    {
+        err = simcom_urc_register("+CEREG", _bringup_urc, NULL);
+        if (err == SIM_AT_OK)
+        {
+            b.stats->phase = SIMCOM_BRINGUP_MODEM;
+            err = _bringup_modem(&b);
+            if (err == SIM_AT_OK)
+            {
+                _bringup_done(&b, SIMCOM_BRINGUP_MODEM);
+                err = _bringup_network(&b);
+            }
+            if (err == SIM_AT_OK)
+                err = _bringup_pdp(&b);
+            if (err == SIM_AT_OK)
+                err = _bringup_mqtt(&b);
+            simcom_urc_unregister("+CEREG", _bringup_urc, NULL);
+        }
+        simcom_urc_unregister("*ATREADY", _bringup_urc, NULL);
+    }
+
+    b.stats->total_ms = (uint32_t)((xTaskGetTickCount() - start) * portTICK_PERIOD_MS);
+    b.stats->baud_rate = simcom_uart_get_baud();
+    if (err != SIM_AT_OK)
+        ESP_LOGE(TAG, "Bring-up failed in the %s phase: %s", simcom_bringup_phase_to_str(b.stats->phase), simcom_err_to_str(err));
+
+    portENTER_CRITICAL(&s_bringup_mux);
+    s_bringup_busy = false;
+    portEXIT_CRITICAL(&s_bringup_mux);
+    return err;
+}
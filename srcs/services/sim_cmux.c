@@ -0,0 +1,120 @@
+/**
+ * sim_cmux.c
+ * Start and stop of the 3GPP TS 27.010 multiplexer
+ *
+ * AT+CMUX is answered on the plain link, then the modem waits for the DLCs to be opened with
+ * SABM frames. The engine holds the commands of other tasks meanwhile and moves to the
+ * multiplexer transport with no channel open, so the frames that open the DLCs are only read
+ * by the parser; the channels are opened to the engine once all the DLCs answered.
+ */
+
+#include "simcom.h"
+#include "at/sim_at.h"
+#include "transport/sim_transport_cmux.h"
+
+static const char *TAG = "cmux";
+
+static const simcom_transport_t *s_cmux_base;  // link under the multiplexer
+
+/**
+ * @brief Writes the AT+CMUX command for the rate in use
+ *
+ * @return N1 agreed with it
+ */
+static size_t _cmux_cmd(char *cmd, size_t size)
+{
+    // 27.007 port speed codes, the other rates keep the defaults of the modem
+    static const uint32_t speeds[] = { 9600, 19200, 38400, 57600, 115200, 230400 };
+    uint32_t rate = simcom_uart_get_baud();
+
+    for (size_t i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++)
+    {
+        if (speeds[i] == rate)
+        {
+            snprintf(cmd, size, "AT+CMUX=0,0,%u,%u\r\n", (unsigned)(i + 1), (unsigned)SIM_CMUX_N1);
+            return SIM_CMUX_N1;
+        }
+    }
+    snprintf(cmd, size, "AT+CMUX=0\r\n");
+    return 31;
+}
+
+simcom_err_t simcom_cmux_start(uint8_t channels)
+{
+    if (channels == 0 || channels > SIM_AT_MAX_CHANNELS)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    simcom_err_t err = simcom_engine_hold(true);
+    if (err != SIM_AT_OK)
+        return err;
+
+    const simcom_transport_t *base = simcom_get_transport();
+    const simcom_transport_t *mux = sim_cmux_transport();
+    if (base == mux)
+    {
+        simcom_engine_hold(false);
+        return SIM_AT_ERR_BUSY;
+    }
+
+    char cmd[SIM_AT_MAX_CMD_LEN];
+    size_t n1 = _cmux_cmd(cmd, sizeof(cmd));
+    simcom_cmd_result_t result;
+    err = simcom_cmd_transact(cmd, 1000, &result);
+    if (err == SIM_AT_OK && result.final != SIM_AT_FINAL_OK)
+        err = SIM_AT_ERR_RESPONSE;
+    if (err != SIM_AT_OK)
+    {
+        ESP_LOGE(TAG, "Error with %.*s command: %s", (int)strcspn(cmd, "\r"), cmd, simcom_err_to_str(err));
+        simcom_engine_hold(false);
+        return err;
+    }
+
+    sim_cmux_reset(base, n1);
+    simcom_switch_transport(mux, 0);
+
+    // DLC 0 first, the control channel
+    uint8_t dlci;
+    for (dlci = 0; dlci <= channels && err == SIM_AT_OK; dlci++)
+    {
+        err = sim_cmux_open_dlc(dlci);
+        if (err == SIM_AT_OK && dlci > 0)
+            sim_cmux_msc(dlci);
+    }
+
+    if (err == SIM_AT_OK)
+    {
+        s_cmux_base = base;
+        simcom_switch_transport(mux, channels);
+        ESP_LOGI(TAG, "Multiplexer started, %u channels", channels);
+    }
+    else
+    {
+        // Back to plain AT: the modem left the multiplexer or never entered it
+        if (dlci > 1)
+            sim_cmux_close_down();
+        simcom_switch_transport(base, 1);
+    }
+
+    simcom_engine_hold(false);
+    return err;
+}
+
+simcom_err_t simcom_cmux_stop(void)
+{
+    const simcom_transport_t *mux = sim_cmux_transport();
+    if (simcom_engine_hold(true) != SIM_AT_OK)
+        return SIM_AT_OK;
+    if (simcom_get_transport() != mux)
+    {
+        simcom_engine_hold(false);
+        return SIM_AT_OK;
+    }
+
+    simcom_switch_transport(mux, 0);
+    simcom_err_t err = sim_cmux_close_down();
+    simcom_switch_transport(s_cmux_base, 1);
+    simcom_engine_hold(false);
+
+    ESP_LOGI(TAG, "Multiplexer stopped");
+    return err;
+}
@@ -1,5 +1,6 @@
 #include "simcom.h"
 #include "at/sim_at.h"
+#include "at/sim_at_fields.h"
 
 static const char *TAG = "internet_services_at";
 
@@ -14,9 +15,8 @@ simcom_err_t simcom_ntp_config_get(void)
     }
 
     // Reads response
-    char resp[SIM_AT_MAX_RESP_LEN];
-    char *data;
-    simcom_responses_err_t resp_err = simcom_read_resp_values(resp, "+CNTP", &data);
+    const char *data;
+    simcom_responses_err_t resp_err = simcom_read_resp_values("+CNTP", &data);
     if (resp_err != SIM_AT_RESPONSE_OK)
     {
         ESP_LOGE(TAG, "Error with AT+CNTP? response: %s", simcom_resp_err_to_str(resp_err));
@@ -26,7 +26,7 @@ simcom_err_t simcom_ntp_config_get(void)
     // Just logs the current NTP config
 
     // Read OK responss
-    resp_err = simcom_resp_read_ok(resp);
+    resp_err = simcom_resp_read_ok();
     if (resp_err != SIM_AT_RESPONSE_COMMAND_OK)
     {
         ESP_LOGE(TAG, "Ok response was not received: %s", simcom_resp_err_to_str(resp_err));
@@ -54,8 +54,7 @@ simcom_err_t simcom_ntp_config_set(const char* host, int timezone)
     }
     
     // Read OK responss
-    char resp[SIM_AT_MAX_RESP_LEN];
-    simcom_responses_err_t resp_err = simcom_resp_read_ok(resp);
+    simcom_responses_err_t resp_err = simcom_resp_read_ok();
     if (resp_err != SIM_AT_RESPONSE_COMMAND_OK)
     {
         ESP_LOGE(TAG, "Ok response was not received: %s", simcom_resp_err_to_str(resp_err));
@@ -65,50 +64,110 @@ simcom_err_t simcom_ntp_config_set(const char* host, int timezone)
     return SIM_AT_OK;
 }
 
-simcom_err_t simcom_ntp_sys_time_update(sim_at_ntp_err_code_t* ntp_err)
+// time the modem takes to report the +CNTP result of a time update, after the OK
+#ifndef SIM_NTP_RESULT_TIMEOUT_MS
+#define SIM_NTP_RESULT_TIMEOUT_MS   60000U
+#endif
+
+/* Asynchronous time update in progress */
+static struct {
+    bool busy;
+    simcom_ntp_cb_t cb;
+    void *ctx;
+} s_ntp;
+static portMUX_TYPE s_ntp_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * @brief Outcome of AT+CNTP from its lines: the OK and the "+CNTP: <err>" result after it
+ *
+ * @param result Command outcome
+ * @param err Error of the command
+ * @param ntp_err Error code reported by the modem
+ */
+static simcom_err_t _ntp_result(const simcom_cmd_result_t *result, simcom_err_t err, sim_at_ntp_err_code_t *ntp_err)
 {
-    // Send command
-    simcom_err_t err = simcom_cmd_sync("AT+CNTP\r\n", 9000);
-    if (err != SIM_AT_OK)
-    {   
-        ESP_LOGE(TAG, "Error with AT+CNTP commands: %s", simcom_err_to_str(err));
+    if (err != SIM_AT_OK && err != SIM_AT_ERR_OVERFLOW)
         return err;
-    }
+    if (result->final != SIM_AT_FINAL_OK)
+        return SIM_AT_ERR_RESPONSE;
 
-    // Read OK responss
-    char resp[SIM_AT_MAX_RESP_LEN];
-    simcom_responses_err_t resp_err = simcom_resp_read_ok(resp);
-    if (resp_err != SIM_AT_RESPONSE_COMMAND_OK)
+    simcom_resp_line_t line;
+    while (simcom_get_resp_line(&line))
     {
-        ESP_LOGE(TAG, "Ok response was not received: %s", simcom_resp_err_to_str(resp_err));
-        return SIM_AT_ERR_RESPONSE;
-    } 
+        if (line.type != SIM_AT_LINE_INFO)
+            continue;
+
+        int err_code;
+        sim_at_fields_t fields;
+        sim_at_fields_init(&fields, line.text + line.value_off);
+        if (!sim_at_fields_int(&fields, &err_code))
+            break;
+        *ntp_err = err_code;
+        return SIM_AT_OK;
+    }
+    return SIM_AT_ERR_RESPONSE;
+}
+
+static const simcom_cmd_step_t s_ntp_step = {
+    .cmd = "AT+CNTP\r\n",
+    .timeout_ms = 9000,
+    .result = "+CNTP: ",
+    .result_timeout_ms = SIM_NTP_RESULT_TIMEOUT_MS,
+};
+
+simcom_err_t simcom_ntp_sys_time_update(sim_at_ntp_err_code_t* ntp_err)
+{
+    if (ntp_err == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
 
-    // Wait for err code
-    // TODO: Revisar si existe una forma mejor de hacerlo
-    // El problema es que si no va a mandar la respuesta en cualquier momento, y no sé si se puede seguir 
-    // interactuando mientras
-    // Sino ver de encontrar cuál es el timeout configurado para el NTP
-    err = simcom_wait_resp(portMAX_DELAY); 
+    // The result is sent after the OK, the link is free in between
+    simcom_cmd_result_t result;
+    simcom_err_t err = _ntp_result(&result, simcom_cmd_step_sync(&s_ntp_step, &result), ntp_err);
     if (err != SIM_AT_OK)
     {
-        ESP_LOGE(TAG, "Error waiting for +CNTP response: %s", simcom_err_to_str(err));
+        ESP_LOGE(TAG, "Error with AT+CNTP: %s", simcom_err_to_str(err));
         return err;
     }
-    
-    // Parse response
-    char *data;
-    resp_err = simcom_read_resp_values(resp, "+CNTP", &data);
-    if (resp_err != SIM_AT_RESPONSE_OK)
-    {
-        ESP_LOGE(TAG, "Error with AT+CNTP response: %s", simcom_resp_err_to_str(resp_err));
-        return SIM_AT_ERR_RESPONSE;
-    } 
-    
-    int err_code;
-    if (sscanf(data, "%d", &err_code) != 1)
-        return SIM_AT_ERR_RESPONSE;
-    *ntp_err = err_code;
 
     return SIM_AT_OK;
-}
\ No newline at end of file
+}
+
+static void _ntp_cb(const simcom_cmd_result_t *result, void *ctx)
+{
+    sim_at_ntp_err_code_t ntp_err = NTP_UNKOWNW_ERROR;
+    simcom_err_t err = _ntp_result(result, result->err, &ntp_err);
+    if (err != SIM_AT_OK)
+        ESP_LOGE(TAG, "Error with AT+CNTP: %s", simcom_err_to_str(err));
+
+    simcom_ntp_cb_t cb = s_ntp.cb;
+    void *cb_ctx = s_ntp.ctx;
+
+    // The callback can start the next update
+    portENTER_CRITICAL(&s_ntp_mux);
+    s_ntp.busy = false;
+    portEXIT_CRITICAL(&s_ntp_mux);
+    if (cb)
+        cb(err, ntp_err, cb_ctx);
+}
+
+simcom_err_t simcom_ntp_sys_time_update_async(simcom_ntp_cb_t cb, void* ctx)
+{
+    portENTER_CRITICAL(&s_ntp_mux);
+    bool busy = s_ntp.busy;
+    s_ntp.busy = true;
+    portEXIT_CRITICAL(&s_ntp_mux);
+    if (busy)
+        return SIM_AT_ERR_BUSY;
+
+    s_ntp.cb = cb;
+    s_ntp.ctx = ctx;
+    simcom_err_t err = simcom_cmd_chain_async(&s_ntp_step, 1, _ntp_cb, NULL);
+    if (err != SIM_AT_OK)
+    {
+        ESP_LOGE(TAG, "Error queuing AT+CNTP: %s", simcom_err_to_str(err));
+        portENTER_CRITICAL(&s_ntp_mux);
+        s_ntp.busy = false;
+        portEXIT_CRITICAL(&s_ntp_mux);
+    }
+    return err;
+}
@@ -1,5 +1,10 @@
 #include "simcom.h"
 #include "at/sim_at.h"
+#include "at/sim_at_fields.h"
+#include "at/sim_at_urc.h"
+#include "spool/sim_spool.h"
+#include "services/sim_mqtt_at.h"
+#include "freertos/semphr.h"
 
 static const char *TAG = "mqtt_at";
 
@@ -47,40 +52,52 @@ const char* simcom_mqtt_err_to_str(sim_mqtt_err_codes_t err)
     }
 }
 
-simcom_err_t simcom_mqtt_service_start(void)
+static const simcom_cmd_step_t s_start_step = {
+    .cmd = "AT+CMQTTSTART\r\n",
+    .timeout_ms = 12000,
+    .result = "+CMQTTSTART: ",
+    .result_timeout_ms = 12000,
+};
+
+simcom_err_t sim_mqtt_service_start(bool *already)
 {
-    // Send command
-    simcom_err_t err = simcom_cmd_sync("AT+CMQTTSTART\r\n", 12000);
-    if (err != SIM_AT_OK)
-    {   
-        ESP_LOGE(TAG, "Error with AT+CMQTTSTART commands: %s", simcom_err_to_str(err));
+    *already = false;
+
+    // The result is sent after the OK, the link is free in between
+    simcom_cmd_result_t result;
+    simcom_err_t err = simcom_cmd_step_sync(&s_start_step, &result);
+    if (err != SIM_AT_OK && err != SIM_AT_ERR_OVERFLOW)
+    {
+        ESP_LOGE(TAG, "Error with AT+CMQTTSTART: %s", simcom_err_to_str(err));
         return err;
     }
 
-    // TODO: Si devuelve ERROR es que ya se encuentra inicializado
-
-    // Read OK responss
-    char resp[SIM_AT_MAX_RESP_LEN];
-    simcom_responses_err_t resp_err = simcom_resp_read_ok(resp);
-    if (resp_err != SIM_AT_RESPONSE_COMMAND_OK)
-    {
-        ESP_LOGE(TAG, "Ok response was not received: %s", simcom_resp_err_to_str(resp_err));
-        return SIM_AT_ERR_RESPONSE;
-    } 
-    
-    // Parse response
-    char *data;
-    resp_err = simcom_read_resp_values(resp, "+CMQTTSTART", &data);
-    if (resp_err != SIM_AT_RESPONSE_OK)
+    // "+CMQTTSTART: <err>" after the OK, or "+CMQTTSTART: 23" and ERROR if the service is already started
+    int err_code = -1;
+    simcom_resp_line_t line;
+    while (simcom_get_resp_line(&line))
     {
-        ESP_LOGE(TAG, "Error with AT+CNTP response: %s", simcom_resp_err_to_str(resp_err));
-        return SIM_AT_ERR_RESPONSE;
-    }  
-    
-    int err_code;
-    if (sscanf(data, "%d", &err_code) != 1)
-        return SIM_AT_ERR_RESPONSE;
+        if (line.type != SIM_AT_LINE_INFO)
+            continue;
 
+        sim_at_fields_t fields;
+        sim_at_fields_init(&fields, line.text + line.value_off);
+        if (!sim_at_fields_int(&fields, &err_code))
+            return SIM_AT_ERR_RESPONSE;
+        break;
+    }
+
+    if (result.final != SIM_AT_FINAL_OK)
+    {
+        if (err_code != SIM_MQTT_ERR_NETWORK_OPENED)
+        {
+            ESP_LOGE(TAG, "Error starting MQTT service: %s", simcom_mqtt_err_to_str(err_code));
+            return SIM_AT_ERR_RESPONSE;
+        }
+        ESP_LOGD(TAG, "MQTT service already started");
+        *already = true;
+        return SIM_AT_OK;
+    }
 
     if (err_code != SIM_MQTT_OK)
     {
@@ -91,6 +108,12 @@ simcom_err_t simcom_mqtt_service_start(void)
     return SIM_AT_OK;
 }
 
+simcom_err_t simcom_mqtt_service_start(void)
+{
+    bool already;
+    return sim_mqtt_service_start(&already);
+}
+
 simcom_err_t simcom_mqtt_service_stop(void)
 {
     // Send command
@@ -102,9 +125,8 @@ simcom_err_t simcom_mqtt_service_stop(void)
     }
     
     // Parse response
-    char resp[SIM_AT_MAX_RESP_LEN];
-    char *data;
-    simcom_responses_err_t resp_err = simcom_read_resp_values(resp, "+CMQTTSTOP", &data);
+    const char *data;
+    simcom_responses_err_t resp_err = simcom_read_resp_values("+CMQTTSTOP", &data);
     
     if (resp_err == SIM_AT_RESPONSE_COMMAND_OK)
         return SIM_AT_OK;
@@ -118,7 +140,9 @@ simcom_err_t simcom_mqtt_service_stop(void)
     if (resp_err == SIM_AT_RESPONSE_OK)
     {
         int err_code;
-        if (sscanf(data, "%d", &err_code) != 1)
+        sim_at_fields_t fields;
+        sim_at_fields_init(&fields, data);
+        if (!sim_at_fields_int(&fields, &err_code))
             return SIM_AT_ERR_RESPONSE;
         ESP_LOGE(TAG, "Error with stopping MQTT service: %s", simcom_mqtt_err_to_str(err_code));
         return SIM_AT_ERR_RESPONSE;
@@ -127,7 +151,192 @@ simcom_err_t simcom_mqtt_service_stop(void)
     return SIM_AT_ERR_RESPONSE;
 }
 
-simcom_err_t simcom_mqtt_client_acquire(int client_index, const char* client_id)
+/* Requests completed by a result line sent after the OK (+CMQTTCONNECT, +CMQTTPUB...): the
+ * link is free for other commands while the modem works on them. One asynchronous request
+ * per client at a time, the modem keeps a single topic and payload per client. */
+typedef struct {
+    bool busy;
+    const char *what;           // request name for the logs
+    simcom_iov_t topic;
+    simcom_iov_t payload;
+    uint8_t pending;            // commands of the chain not reported yet
+    simcom_err_t err;           // error of the step that failed
+    int mqtt_err;
+    simcom_mqtt_cb_t cb;
+    void *ctx;
+    bool sync;                  // a blocking caller waits on done
+    SemaphoreHandle_t done;     // created on the first blocking publish of the client
+} sim_mqtt_req_t;
+
+static sim_mqtt_req_t s_req[2];
+static portMUX_TYPE s_req_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * @brief Returns the MQTT error code of the "+CMQTTxxx: <client>,<err>" line of the command
+ * being reported, SIM_MQTT_OK if there is none
+ */
+static int _mqtt_line_err(void)
+{
+    simcom_resp_line_t line;
+    while (simcom_get_resp_line(&line))
+    {
+        if (line.type != SIM_AT_LINE_INFO)
+            continue;
+
+        int aux, err_code;
+        sim_at_fields_t fields;
+        sim_at_fields_init(&fields, line.text + line.value_off);
+        if (sim_at_fields_int(&fields, &aux) && sim_at_fields_int(&fields, &err_code))
+            return err_code;
+    }
+    return SIM_MQTT_OK;
+}
+
+/**
+ * @brief Outcome of a command completed by its result line. The error line comes before
+ * ERROR, the result after the OK.
+ *
+ * @param result Command outcome
+ * @param err Error of the command
+ * @param mqtt_err MQTT error code of its line, SIM_MQTT_OK if none
+ */
+static simcom_err_t _mqtt_result_err(const simcom_cmd_result_t *result, simcom_err_t err, int *mqtt_err)
+{
+    *mqtt_err = SIM_MQTT_OK;
+    if (err != SIM_AT_OK && err != SIM_AT_ERR_OVERFLOW)
+        return err;
+
+    *mqtt_err = _mqtt_line_err();
+    return (result->final != SIM_AT_FINAL_OK || *mqtt_err != SIM_MQTT_OK) ? SIM_AT_ERR_RESPONSE : SIM_AT_OK;
+}
+
+/**
+ * @brief Sends a command completed by its "+<name>: <client>,<err>" result line and waits for
+ * it, without holding the link in between
+ *
+ * @param name Command name (e.g. "CMQTTCONNECT")
+ * @param client_index Client index
+ * @param cmd Command
+ * @param data Data written on the '>' prompt, NULL for none
+ * @param timeout_ms Timeout of the OK
+ * @param result_ms Timeout of the result line, counted from the OK
+ */
+static simcom_err_t _mqtt_cmd_sync(const char *name, int client_index, const char *cmd, const simcom_iov_t *data,
+                                   uint32_t timeout_ms, uint32_t result_ms)
+{
+    char result[24];
+    snprintf(result, sizeof(result), "+%s: %d,", name, client_index);
+
+    simcom_cmd_step_t step = { .cmd = cmd, .timeout_ms = timeout_ms, .data = data, .data_count = data ? 1 : 0,
+                               .result = result, .result_timeout_ms = result_ms };
+    simcom_cmd_result_t res;
+    int mqtt_err;
+    simcom_err_t err = _mqtt_result_err(&res, simcom_cmd_step_sync(&step, &res), &mqtt_err);
+    if (err != SIM_AT_OK)
+        ESP_LOGE(TAG, "Error with AT+%s: %s (%s)", name, simcom_err_to_str(err), simcom_mqtt_err_to_str(mqtt_err));
+    return err;
+}
+
+/**
+ * @brief Takes the asynchronous request of a client, false if one is in progress
+ */
+static bool _mqtt_req_acquire(sim_mqtt_req_t *req)
+{
+    portENTER_CRITICAL(&s_req_mux);
+    bool busy = req->busy;
+    req->busy = true;
+    portEXIT_CRITICAL(&s_req_mux);
+    return !busy;
+}
+
+static void _mqtt_req_release(sim_mqtt_req_t *req)
+{
+    portENTER_CRITICAL(&s_req_mux);
+    req->busy = false;
+    portEXIT_CRITICAL(&s_req_mux);
+}
+
+/**
+ * @brief Completion of each command of a request chain, reports the request after the last one
+ */
+static void _mqtt_req_step_cb(const simcom_cmd_result_t *result, void *ctx)
+{
+    sim_mqtt_req_t *req = (sim_mqtt_req_t *)ctx;
+
+    int mqtt_err;
+    simcom_err_t err = _mqtt_result_err(result, result->err, &mqtt_err);
+
+    // Report the step that failed, not the ones aborted after it
+    if (err != SIM_AT_OK && (req->err == SIM_AT_OK || req->err == SIM_AT_ERR_ABORTED))
+    {
+        req->err = err;
+        req->mqtt_err = mqtt_err;
+    }
+
+    if (--req->pending > 0)
+        return;
+
+    if (req->err != SIM_AT_OK)
+        ESP_LOGE(TAG, "Error with MQTT %s: %s (%s)", req->what, simcom_err_to_str(req->err), simcom_mqtt_err_to_str(req->mqtt_err));
+
+    // The blocking caller reads the outcome and releases the client
+    if (req->sync)
+    {
+        xSemaphoreGive(req->done);
+        return;
+    }
+
+    int client_index = (int)(req - s_req);
+    simcom_mqtt_cb_t cb = req->cb;
+    void *cb_ctx = req->ctx;
+    err = req->err;
+    mqtt_err = req->mqtt_err;
+
+    // The callback can start the next request
+    _mqtt_req_release(req);
+    if (err == SIM_AT_OK && strcmp(req->what, "connect") == 0)
+        sim_spool_connected(client_index);
+    if (cb)
+        cb(client_index, err, mqtt_err, cb_ctx);
+}
+
+/**
+ * @brief Queues the command chain of a request. The client is taken by the caller and
+ * released on error.
+ */
+static simcom_err_t _mqtt_req_start(sim_mqtt_req_t *req, const simcom_cmd_step_t *steps, size_t count)
+{
+    req->err = SIM_AT_OK;
+    req->mqtt_err = SIM_MQTT_OK;
+    req->pending = (uint8_t)count;
+
+    simcom_err_t err = simcom_cmd_chain_async(steps, count, _mqtt_req_step_cb, req);
+    if (err != SIM_AT_OK)
+    {
+        ESP_LOGE(TAG, "Error queuing MQTT %s: %s", req->what, simcom_err_to_str(err));
+        _mqtt_req_release(req);
+    }
+    return err;
+}
+
+/**
+ * @brief Runs a single command request for the callback of an asynchronous call
+ */
+static simcom_err_t _mqtt_req_async(int client_index, const char *what, const simcom_cmd_step_t *step,
+                                    simcom_mqtt_cb_t cb, void *ctx)
+{
+    sim_mqtt_req_t *req = &s_req[client_index];
+    if (!_mqtt_req_acquire(req))
+        return SIM_AT_ERR_BUSY;
+
+    req->what = what;
+    req->sync = false;
+    req->cb = cb;
+    req->ctx = ctx;
+    return _mqtt_req_start(req, step, 1);
+}
+
+simcom_err_t sim_mqtt_client_acquire(int client_index, const char* client_id, bool *already)
 {
     if (client_index != 0 && client_index != 1)
         return SIM_AT_ERR_INVALID_ARG;
@@ -147,9 +356,8 @@ simcom_err_t simcom_mqtt_client_acquire(int client_index, const char* client_id)
     }
         
     // Parse response
-    char resp[SIM_AT_MAX_RESP_LEN];
-    char *data;
-    simcom_responses_err_t resp_err = simcom_read_resp_values(resp, "+CMQTTACCQ", &data);
+    const char *data;
+    simcom_responses_err_t resp_err = simcom_read_resp_values("+CMQTTACCQ", &data);
 
     if (resp_err == SIM_AT_RESPONSE_COMMAND_OK)
         return SIM_AT_OK;
@@ -157,8 +365,15 @@ simcom_err_t simcom_mqtt_client_acquire(int client_index, const char* client_id)
     if (resp_err == SIM_AT_RESPONSE_OK)
     {
         int aux, err_code;
-        if (sscanf(data, "%d,%d", &aux, &err_code) != 2)
+        sim_at_fields_t fields;
+        sim_at_fields_init(&fields, data);
+        if (!sim_at_fields_int(&fields, &aux) || !sim_at_fields_int(&fields, &err_code))
             return SIM_AT_ERR_RESPONSE;
+        if (already != NULL && err_code == SIM_MQTT_ERR_CLIENT_IN_USE)
+        {
+            *already = true;
+            return SIM_AT_OK;
+        }
         ESP_LOGE(TAG, "Error with acquiring MQTT client: %s", simcom_mqtt_err_to_str(err_code));
         return SIM_AT_ERR_RESPONSE;
     }
@@ -166,6 +381,11 @@ simcom_err_t simcom_mqtt_client_acquire(int client_index, const char* client_id)
     return SIM_AT_ERR_RESPONSE;
 }
 
+simcom_err_t simcom_mqtt_client_acquire(int client_index, const char* client_id)
+{
+    return sim_mqtt_client_acquire(client_index, client_id, NULL);
+}
+
 simcom_err_t simcom_mqtt_client_release(int client_index)
 {
     if (client_index != 0 && client_index != 1)
@@ -184,9 +404,8 @@ simcom_err_t simcom_mqtt_client_release(int client_index)
     }
     
     // Parse response
-    char resp[SIM_AT_MAX_RESP_LEN];
-    char *data;
-    simcom_responses_err_t resp_err = simcom_read_resp_values(resp, "+CMQTTREL", &data);
+    const char *data;
+    simcom_responses_err_t resp_err = simcom_read_resp_values("+CMQTTREL", &data);
 
     if (resp_err == SIM_AT_RESPONSE_COMMAND_OK)
         return SIM_AT_OK;
@@ -194,7 +413,9 @@ simcom_err_t simcom_mqtt_client_release(int client_index)
     if (resp_err == SIM_AT_RESPONSE_OK)
     {
         int aux, err_code;
-        if (sscanf(data, "%d,%d", &aux, &err_code) != 2)
+        sim_at_fields_t fields;
+        sim_at_fields_init(&fields, data);
+        if (!sim_at_fields_int(&fields, &aux) || !sim_at_fields_int(&fields, &err_code))
             return SIM_AT_ERR_RESPONSE;
         ESP_LOGE(TAG, "Error with acquiring MQTT client: %s", simcom_mqtt_err_to_str(err_code));
         return SIM_AT_ERR_RESPONSE;
@@ -203,76 +424,77 @@ simcom_err_t simcom_mqtt_client_release(int client_index)
     return SIM_AT_OK;
 }
 
-simcom_err_t simcom_mqtt_server_connect(int client_index, const char* server_addr, int keepalive_time, int clean_session)
+/**
+ * @brief Checks the arguments of a connection and builds its command
+ */
+static bool _mqtt_connect_cmd(char *cmd, int client_index, const char* server_addr, int keepalive_time, int clean_session)
 {
     if (client_index != 0 && client_index != 1)
-        return SIM_AT_ERR_INVALID_ARG;
+        return false;
+    if (server_addr == NULL)
+        return false;
     int server_addr_len = strlen(server_addr);
     if (server_addr_len < 9 || server_addr_len > 256)  
-        return SIM_AT_ERR_INVALID_ARG;
+        return false;
     if (keepalive_time < 1 || keepalive_time > 64800)
-        return SIM_AT_ERR_INVALID_ARG;
+        return false;
     if (clean_session != 0 && clean_session != 1)
-        return SIM_AT_ERR_INVALID_ARG;
-    
-    // Command
-    char cmd[SIM_AT_MAX_CMD_LEN];
+        return false;
+
     snprintf(cmd, SIM_AT_MAX_CMD_LEN, "AT+CMQTTCONNECT=%d,\"%s\",%d,%d\r\n", client_index, server_addr, keepalive_time, clean_session);
-    
-    // Send command
-    simcom_err_t err = simcom_cmd_sync(cmd, 9000);
+    return true;
+}
+
+simcom_err_t sim_mqtt_server_connected(int client_index, bool *connected)
+{
+    *connected = false;
+
+    // "+CMQTTCONNECT: <client>,<server>,<keepalive>,<clean_session>" for each connected client
+    simcom_cmd_result_t result;
+    simcom_err_t err = simcom_cmd_transact("AT+CMQTTCONNECT?\r\n", 9000, &result);
     if (err != SIM_AT_OK)
-    {   
-        ESP_LOGE(TAG, "Error with AT+CMQTTCONNECT commands: %s", simcom_err_to_str(err));
-        return err;
-    }
-    
-    // Parse response
-    char resp[SIM_AT_MAX_RESP_LEN];
-    char *data;
-    simcom_responses_err_t resp_err = simcom_read_resp_values(resp, "+CMQTTCONNECT", &data);   
-    
-    if (resp_err == SIM_AT_RESPONSE_COMMAND_OK)
     {
-        resp_err = simcom_read_resp_values(resp, "+CMQTTCONNECT", &data);
-        if (resp_err == SIM_AT_RESPONSE_OK)
-        {
-            int aux, err_code;
-            if (sscanf(data, "%d,%d", &aux, &err_code) != 2)
-                return SIM_AT_ERR_RESPONSE;
-            
-            if (err_code != SIM_MQTT_OK)
-            {
-                ESP_LOGE(TAG, "Error connecting to MQTT server: %s", simcom_mqtt_err_to_str(err_code));
-                return SIM_AT_ERR_RESPONSE;
-            }
-            return SIM_AT_OK;   
-        }
+        ESP_LOGE(TAG, "Error with AT+CMQTTCONNECT? command: %s", simcom_err_to_str(err));
+        return err;
     }
-
-    if (resp_err == SIM_AT_RESPONSE_OK)
-    {
-        int aux, err_code;
-        if (sscanf(data, "%d,%d", &aux, &err_code) != 2)
-            return SIM_AT_ERR_RESPONSE;
-        ESP_LOGE(TAG, "Error connecting to MQTT server: %s", simcom_mqtt_err_to_str(err_code));
+    if (result.final != SIM_AT_FINAL_OK)
         return SIM_AT_ERR_RESPONSE;
-    }
 
-    if (resp_err == SIM_AT_RESPONSE_ERR_COMMAND_ERROR)
+    simcom_resp_line_t line;
+    while (simcom_get_resp_line(&line))
     {
-        resp_err = simcom_read_resp_values(resp, "+CMQTTCONNECT", &data);
-        if (resp_err == SIM_AT_RESPONSE_OK)
-        {
-            int aux, err_code;
-            if (sscanf(data, "%d,%d", &aux, &err_code) != 2)
-                return SIM_AT_ERR_RESPONSE;
-            ESP_LOGE(TAG, "Error connecting to MQTT server: %s", simcom_mqtt_err_to_str(err_code));
-            return SIM_AT_ERR_RESPONSE;
-        }
+        int client;
+        sim_at_fields_t fields;
+        sim_at_fields_init(&fields, line.text + line.value_off);
+        if (line.type == SIM_AT_LINE_INFO && sim_at_fields_int(&fields, &client) && client == client_index)
+            *connected = true;
     }
-    
-    return SIM_AT_ERR_RESPONSE;
+    return SIM_AT_OK;
+}
+
+simcom_err_t simcom_mqtt_server_connect(int client_index, const char* server_addr, int keepalive_time, int clean_session)
+{
+    char cmd[SIM_AT_MAX_CMD_LEN];
+    if (!_mqtt_connect_cmd(cmd, client_index, server_addr, keepalive_time, clean_session))
+        return SIM_AT_ERR_INVALID_ARG;
+
+    // The result is sent after the OK, the link is free in between
+    simcom_err_t err = _mqtt_cmd_sync("CMQTTCONNECT", client_index, cmd, NULL, 9000, 9000);
+    if (err == SIM_AT_OK)
+        sim_spool_connected(client_index);
+    return err;
+}
+
+simcom_err_t simcom_mqtt_server_connect_async(int client_index, const char* server_addr, int keepalive_time, int clean_session,
+                                              simcom_mqtt_cb_t cb, void* ctx)
+{
+    char cmd[SIM_AT_MAX_CMD_LEN], result[24];
+    if (!_mqtt_connect_cmd(cmd, client_index, server_addr, keepalive_time, clean_session))
+        return SIM_AT_ERR_INVALID_ARG;
+    snprintf(result, sizeof(result), "+CMQTTCONNECT: %d,", client_index);
+
+    simcom_cmd_step_t step = { .cmd = cmd, .timeout_ms = 9000, .result = result, .result_timeout_ms = 9000 };
+    return _mqtt_req_async(client_index, "connect", &step, cb, ctx);
 }
 
 simcom_err_t simcom_mqtt_server_disconnect(int client_index, int timeout)
@@ -285,155 +507,106 @@ simcom_err_t simcom_mqtt_server_disconnect(int client_index, int timeout)
     // Command
     char cmd[SIM_AT_MAX_CMD_LEN];
     snprintf(cmd, SIM_AT_MAX_CMD_LEN, "AT+CMQTTDISC=%d,%d\r\n", client_index, timeout);
-    
-    // Send command
-    simcom_err_t err = simcom_cmd_sync(cmd, 9000);
-    if (err != SIM_AT_OK)
-    {   
-        ESP_LOGE(TAG, "Error with AT+CMQTTDISC commands: %s", simcom_err_to_str(err));
-        return err;
-    }
-    
-    // Parse response
-    char resp[SIM_AT_MAX_RESP_LEN];
-    char *data;
-    simcom_responses_err_t resp_err = simcom_read_resp_values(resp, "+CMQTTDISC", &data);   
-    
-    if (resp_err == SIM_AT_RESPONSE_COMMAND_OK)
-    {
-        resp_err = simcom_read_resp_values(resp, "+CMQTTDISC", &data);
-        if (resp_err == SIM_AT_RESPONSE_OK)
-        {
-            int aux, err_code;
-            if (sscanf(data, "%d,%d", &aux, &err_code) != 2)
-                return SIM_AT_ERR_RESPONSE;
-            
-            if (err_code != SIM_MQTT_OK)
-            {
-                ESP_LOGE(TAG, "Error connecting to MQTT server: %s", simcom_mqtt_err_to_str(err_code));
-                return SIM_AT_ERR_RESPONSE;
-            }
-            return SIM_AT_OK;   
-        }
-    }
 
-    if (resp_err == SIM_AT_RESPONSE_OK)
-    {
-        int aux, err_code;
-        if (sscanf(data, "%d,%d", &aux, &err_code) != 2)
-            return SIM_AT_ERR_RESPONSE;
-        ESP_LOGE(TAG, "Error connecting to MQTT server: %s", simcom_mqtt_err_to_str(err_code));
-        return SIM_AT_ERR_RESPONSE;
-    }
-
-    if (resp_err == SIM_AT_RESPONSE_ERR_COMMAND_ERROR)
-    {
-        resp_err = simcom_read_resp_values(resp, "+CMQTTDISC", &data);
-        if (resp_err == SIM_AT_RESPONSE_OK)
-        {
-            int aux, err_code;
-            if (sscanf(data, "%d,%d", &aux, &err_code) != 2)
-                return SIM_AT_ERR_RESPONSE;
-            ESP_LOGE(TAG, "Error connecting to MQTT server: %s", simcom_mqtt_err_to_str(err_code));
-            return SIM_AT_ERR_RESPONSE;
-        }
-    }
-    
-    return SIM_AT_ERR_RESPONSE;
+    // The result is sent after the OK, the link is free in between
+    return _mqtt_cmd_sync("CMQTTDISC", client_index, cmd, NULL, 9000, 9000);
 }
 
-simcom_err_t simcom_mqtt_topic_set(int client_index, const char* topic)
+/**
+ * @brief Sends an input command ("AT+<name>=<client>,<len>") and, once the '>' prompt arrives,
+ * its data straight from the caller buffers
+ *
+ * @param name Command name (e.g. "CMQTTPAYLOAD")
+ * @param client_index Client index
+ * @param iov Data buffers
+ * @param iov_count Number of buffers
+ * @param len Total data length
+ */
+static simcom_err_t _mqtt_input(const char *name, int client_index, const simcom_iov_t *iov, size_t iov_count, size_t len)
 {
-    if (client_index != 0 && client_index != 1)
-        return SIM_AT_ERR_INVALID_ARG;
-    int topic_len = strlen(topic);
-    if (topic == NULL || topic_len > 1024)
-        return SIM_AT_ERR_INVALID_ARG;
-    
     // Command
     char cmd[SIM_AT_MAX_CMD_LEN];
-    snprintf(cmd, SIM_AT_MAX_CMD_LEN, "AT+CMQTTTOPIC=%d,%d\r\n", client_index, (int)strlen(topic));
-    
+    snprintf(cmd, SIM_AT_MAX_CMD_LEN, "AT+%s=%d,%u\r\n", name, client_index, (unsigned)len);
+
     // Send command
     simcom_err_t err = simcom_cmd_sync(cmd, 2000);
     if (err != SIM_AT_OK)
-    {   
-        ESP_LOGE(TAG, "Error with AT+CMQTTTOPIC commands: %s", simcom_err_to_str(err));
+    {
+        ESP_LOGE(TAG, "Error with AT+%s commands: %s", name, simcom_err_to_str(err));
         return err;
     }
-    
-    // No se analiza el error en caso que falle
 
     // Wait for input response
-    char resp[SIM_AT_MAX_RESP_LEN];    
-    simcom_get_resp(resp);
-    if (strstr(resp, ">") == NULL)
-       return SIM_AT_ERR_RESPONSE; 
-    
-    // Send topic
-    snprintf(cmd, SIM_AT_MAX_CMD_LEN, "%s\r\n", topic);
-    err = simcom_cmd_sync(cmd, 9000);
+    simcom_resp_line_t resp;
+    if (!simcom_get_resp_line(&resp) || resp.type != SIM_AT_LINE_PROMPT)
+        return SIM_AT_ERR_RESPONSE;
+
+    // Send data, 1 ms per byte on top of the response time covers links down to 9600 baud
+    err = simcom_cmd_data(iov, iov_count, 2000 + len, NULL);
     if (err != SIM_AT_OK)
-    {   
-        ESP_LOGE(TAG, "Error sending topic: %s", simcom_err_to_str(err));
+    {
+        ESP_LOGE(TAG, "Error sending AT+%s data: %s", name, simcom_err_to_str(err));
         return err;
     }
-    
+
     // Read OK response
-    simcom_responses_err_t resp_err = simcom_resp_read_ok(resp);
+    simcom_responses_err_t resp_err = simcom_resp_read_ok();
     if (resp_err != SIM_AT_RESPONSE_COMMAND_OK)
     {
         ESP_LOGE(TAG, "Ok response was not received: %s", simcom_resp_err_to_str(resp_err));
         return SIM_AT_ERR_RESPONSE;
-    } 
-    
+    }
+
     return SIM_AT_OK;
 }
 
+simcom_err_t simcom_mqtt_topic_set(int client_index, const char* topic)
+{
+    if (client_index != 0 && client_index != 1)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (topic == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+    size_t topic_len = strlen(topic);
+    if (topic_len < 1 || topic_len > 1024)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    simcom_iov_t iov = { .base = topic, .len = topic_len };
+    return _mqtt_input("CMQTTTOPIC", client_index, &iov, 1, topic_len);
+}
+
 simcom_err_t simcom_mqtt_payload_set(int client_index, const char* payload)
+{
+    if (payload == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+    return simcom_mqtt_payload_set_buf(client_index, payload, strlen(payload));
+}
+
+simcom_err_t simcom_mqtt_payload_set_buf(int client_index, const void* data, size_t len)
+{
+    if (data == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+    simcom_iov_t iov = { .base = data, .len = len };
+    return simcom_mqtt_payload_set_iov(client_index, &iov, 1);
+}
+
+simcom_err_t simcom_mqtt_payload_set_iov(int client_index, const simcom_iov_t* iov, size_t iov_count)
 {
     if (client_index != 0 && client_index != 1)
         return SIM_AT_ERR_INVALID_ARG;
-    int payload_len = strlen(payload);
-    if (payload == NULL || payload_len > 10240)
+    if (iov == NULL || iov_count == 0)
         return SIM_AT_ERR_INVALID_ARG;
 
-    // Command
-    char cmd[SIM_AT_MAX_CMD_LEN];
-    snprintf(cmd, SIM_AT_MAX_CMD_LEN, "AT+CMQTTPAYLOAD=%d,%d\r\n", client_index, (int)strlen(payload));
-    
-    // Send command
-    simcom_err_t err = simcom_cmd_sync(cmd, 2000);
-    if (err != SIM_AT_OK)
-    {   
-        ESP_LOGE(TAG, "Error with AT+CMQTTPAYLOAD commands: %s", simcom_err_to_str(err));
-        return err;
-    }
-    
-    // Wait for input respose
-    char resp[SIM_AT_MAX_RESP_LEN];    
-    simcom_get_resp(resp);
-    if (strstr(resp, ">") == NULL)
-       return SIM_AT_ERR_RESPONSE; // TODO: Poner otro, o analizar el error después
-    
-    // Send payload
-    snprintf(cmd, SIM_AT_MAX_CMD_LEN, "%s\r\n", payload);
-    err = simcom_cmd_sync(cmd, 2000);
-    if (err != SIM_AT_OK)
-    {   
-        ESP_LOGE(TAG, "Error sending payload: %s", simcom_err_to_str(err));
-        return err;
-    }
-    
-    // Read OK response
-    simcom_responses_err_t resp_err = simcom_resp_read_ok(resp);
-    if (resp_err != SIM_AT_RESPONSE_COMMAND_OK)
+    size_t payload_len = 0;
+    for (size_t i = 0; i < iov_count; i++)
     {
-        ESP_LOGE(TAG, "Ok response was not received: %s", simcom_resp_err_to_str(resp_err));
-        return SIM_AT_ERR_RESPONSE;
-    } 
-    
-    return SIM_AT_OK;  
+        if (iov[i].base == NULL && iov[i].len > 0)
+            return SIM_AT_ERR_INVALID_ARG;
+        payload_len += iov[i].len;
+    }
+    if (payload_len < 1 || payload_len > 10240)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    return _mqtt_input("CMQTTPAYLOAD", client_index, iov, iov_count, payload_len);
 }
 
 simcom_err_t simcom_mqtt_publish(int client_index, int qos, int pub_timeout)
@@ -449,58 +622,853 @@ simcom_err_t simcom_mqtt_publish(int client_index, int qos, int pub_timeout)
     char cmd[SIM_AT_MAX_CMD_LEN];
     snprintf(cmd, SIM_AT_MAX_CMD_LEN, "AT+CMQTTPUB=%d,%d,%d\r\n", client_index, qos, pub_timeout);
     
-    // Send command
-    simcom_err_t err = simcom_cmd_sync(cmd, pub_timeout*1000);
+    // The result is sent after the OK, the link is free in between
+    return _mqtt_cmd_sync("CMQTTPUB", client_index, cmd, NULL, pub_timeout*1000, pub_timeout*1000);
+}
+
+simcom_err_t simcom_mqtt_publish_async(int client_index, int qos, int pub_timeout, simcom_mqtt_cb_t cb, void* ctx)
+{
+    if (client_index != 0 && client_index != 1)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (qos < 0 || qos > 2)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (pub_timeout < 1 || pub_timeout > 180)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    char cmd[SIM_AT_MAX_CMD_LEN], result[24];
+    snprintf(cmd, SIM_AT_MAX_CMD_LEN, "AT+CMQTTPUB=%d,%d,%d\r\n", client_index, qos, pub_timeout);
+    snprintf(result, sizeof(result), "+CMQTTPUB: %d,", client_index);
+
+    simcom_cmd_step_t step = { .cmd = cmd, .timeout_ms = pub_timeout * 1000, .result = result,
+                               .result_timeout_ms = pub_timeout * 1000 };
+    return _mqtt_req_async(client_index, "publish", &step, cb, ctx);
+}
+
+/* One-shot publish: topic, payload and publish are queued as one command chain that the parser
+ * runs without returning to the caller. */
+
+/**
+ * @brief Checks the arguments of a one-shot publish
+ */
+static bool _mqtt_pub_args_valid(int client_index, const char* topic, const void* payload, size_t len,
+                                 int qos, int pub_timeout)
+{
+    if (client_index != 0 && client_index != 1)
+        return false;
+    if (topic == NULL || strlen(topic) < 1 || strlen(topic) > 1024)
+        return false;
+    if ((payload == NULL && len > 0) || len > 10240)
+        return false;
+    if (qos < 0 || qos > 2)
+        return false;
+    if (pub_timeout < 1 || pub_timeout > 180)
+        return false;
+    return true;
+}
+
+/* Commands of a one-shot publish, copied by the engine when queued */
+typedef struct {
+    char topic[32];
+    char payload[32];
+    char pub[32];
+    char result[16];
+} sim_mqtt_pub_cmds_t;
+
+/**
+ * @brief Builds the command chain of a one-shot publish
+ *
+ * @param topic Topic input data, must stay valid until the chain completes
+ * @param payload Payload input data, idem
+ * @param cmds Command buffers, used until the chain is queued
+ * @param steps Chain, 3 steps at most
+ *
+ * @return Number of steps
+ */
+static size_t _mqtt_pub_steps(int client_index, const simcom_iov_t *topic, const simcom_iov_t *payload,
+                              int qos, int pub_timeout, sim_mqtt_pub_cmds_t *cmds, simcom_cmd_step_t *steps)
+{
+    snprintf(cmds->topic, sizeof(cmds->topic), "AT+CMQTTTOPIC=%d,%u\r\n", client_index, (unsigned)topic->len);
+    snprintf(cmds->payload, sizeof(cmds->payload), "AT+CMQTTPAYLOAD=%d,%u\r\n", client_index, (unsigned)payload->len);
+    snprintf(cmds->pub, sizeof(cmds->pub), "AT+CMQTTPUB=%d,%d,%d\r\n", client_index, qos, pub_timeout);
+    snprintf(cmds->result, sizeof(cmds->result), "+CMQTTPUB: %d,", client_index);
+
+    // Data timeouts as in the blocking calls, an empty message has no payload input
+    size_t count = 0;
+    steps[count++] = (simcom_cmd_step_t){ .cmd = cmds->topic, .timeout_ms = 2000 + topic->len,
+                                          .data = topic, .data_count = 1 };
+    if (payload->len > 0)
+        steps[count++] = (simcom_cmd_step_t){ .cmd = cmds->payload, .timeout_ms = 2000 + payload->len,
+                                              .data = payload, .data_count = 1 };
+    steps[count++] = (simcom_cmd_step_t){ .cmd = cmds->pub, .timeout_ms = pub_timeout * 1000,
+                                          .result = cmds->result, .result_timeout_ms = pub_timeout * 1000 };
+    return count;
+}
+
+/**
+ * @brief Queues the command chain of a one-shot publish. The client is taken by the caller and
+ * released on error.
+ */
+static simcom_err_t _mqtt_pub_start(int client_index, const char* topic, const void* payload, size_t len,
+                                    int qos, int pub_timeout)
+{
+    sim_mqtt_req_t *req = &s_req[client_index];
+    req->what = "publish";
+    req->topic.base = topic;
+    req->topic.len = strlen(topic);
+    req->payload.base = payload;
+    req->payload.len = len;
+
+    sim_mqtt_pub_cmds_t cmds;
+    simcom_cmd_step_t steps[3];
+    size_t count = _mqtt_pub_steps(client_index, &req->topic, &req->payload, qos, pub_timeout, &cmds, steps);
+    return _mqtt_req_start(req, steps, count);
+}
+
+simcom_err_t simcom_mqtt_publish_msg_async(int client_index, const char* topic, const void* payload, size_t len,
+                                           int qos, int pub_timeout, simcom_mqtt_pub_cb_t cb, void* ctx)
+{
+    if (!_mqtt_pub_args_valid(client_index, topic, payload, len, qos, pub_timeout))
+        return SIM_AT_ERR_INVALID_ARG;
+
+    sim_mqtt_req_t *req = &s_req[client_index];
+    if (!_mqtt_req_acquire(req))
+        return SIM_AT_ERR_BUSY;
+
+    req->sync = false;
+    req->cb = cb;
+    req->ctx = ctx;
+    return _mqtt_pub_start(client_index, topic, payload, len, qos, pub_timeout);
+}
+
+simcom_err_t simcom_mqtt_publish_msg(int client_index, const char* topic, const void* payload, size_t len,
+                                     int qos, int pub_timeout)
+{
+    if (!_mqtt_pub_args_valid(client_index, topic, payload, len, qos, pub_timeout))
+        return SIM_AT_ERR_INVALID_ARG;
+
+    sim_mqtt_req_t *req = &s_req[client_index];
+    if (!_mqtt_req_acquire(req))
+        return SIM_AT_ERR_BUSY;
+
+    // Only the owner of the client gets here, the semaphore is created once
+    if (req->done == NULL)
+        req->done = xSemaphoreCreateBinary();
+    if (req->done == NULL)
+    {
+        _mqtt_req_release(req);
+        return SIM_AT_ERR_NO_MEM;
+    }
+
+    req->sync = true;
+    req->cb = NULL;
+    req->ctx = NULL;
+    simcom_err_t err = _mqtt_pub_start(client_index, topic, payload, len, qos, pub_timeout);
     if (err != SIM_AT_OK)
-    {   
-        ESP_LOGE(TAG, "Error with AT+CMQTTPUB commands: %s", simcom_err_to_str(err));
         return err;
+
+    // Every command of the chain has a timeout, the completion always comes
+    xSemaphoreTake(req->done, portMAX_DELAY);
+    err = req->err;
+    _mqtt_req_release(req);
+    return err;
+}
+
+/* Outbound queue: messages of a client published one after the other without waiting for the
+ * +CMQTTPUB result of the previous ones. Up to a window of them are in flight; the next one is
+ * written as soon as the modem has taken the previous one (OK of its AT+CMQTTPUB), so QoS 1/2
+ * acknowledgements overlap with the following messages. Messages refused for lack of command
+ * slots are sent again from the slot hook of the parser, when slots are freed. */
+#ifndef SIM_MQTT_QUEUE_LEN
+#define SIM_MQTT_QUEUE_LEN          16U     // messages per client, queued and in flight
+#endif
+
+#ifndef SIM_MQTT_QUEUE_WINDOW
+#define SIM_MQTT_QUEUE_WINDOW       2U      // default messages in flight per client
+#endif
+
+#ifndef SIM_MQTT_QUEUE_RETRIES
+#define SIM_MQTT_QUEUE_RETRIES      2U      // default retries of a failed message
+#endif
+
+typedef enum {
+    SIM_MQTT_QMSG_FREE = 0,
+    SIM_MQTT_QMSG_QUEUED,       // waiting for the window or for command slots
+    SIM_MQTT_QMSG_SENT,         // chain queued, not reported yet
+} sim_mqtt_qmsg_state_t;
+
+typedef struct {
+    uint8_t state;
+    uint8_t client_index;
+    uint8_t qos;
+    uint8_t tries;              // retries done
+    uint8_t pending;            // commands of the chain not reported yet
+    uint8_t pub_timeout;
+    uint32_t seq;               // queuing order
+    simcom_iov_t topic;
+    simcom_iov_t payload;
+    simcom_err_t err;
+    int mqtt_err;
+    simcom_mqtt_cb_t cb;
+    void *ctx;
+} sim_mqtt_qmsg_t;
+
+typedef struct {
+    sim_mqtt_qmsg_t msgs[SIM_MQTT_QUEUE_LEN];
+    uint8_t count;              // queued and in flight
+    uint8_t inflight;
+    uint8_t window;
+    uint8_t retries;
+    uint32_t seq;
+    bool pumping;               // a task is sending messages of the queue
+    bool repump;                // look again before leaving
+} sim_mqtt_queue_t;
+
+static sim_mqtt_queue_t s_queue[2] = {
+    { .window = SIM_MQTT_QUEUE_WINDOW, .retries = SIM_MQTT_QUEUE_RETRIES },
+    { .window = SIM_MQTT_QUEUE_WINDOW, .retries = SIM_MQTT_QUEUE_RETRIES },
+};
+static portMUX_TYPE s_queue_mux = portMUX_INITIALIZER_UNLOCKED;
+static bool s_queue_hooked;
+
+static void _mqtt_queue_pump(int client_index);
+
+/**
+ * @brief Oldest queued message of a client, NULL if none (called in the critical section)
+ */
+static sim_mqtt_qmsg_t *_mqtt_queue_next(sim_mqtt_queue_t *queue)
+{
+    sim_mqtt_qmsg_t *next = NULL;
+    for (size_t i = 0; i < SIM_MQTT_QUEUE_LEN; i++)
+    {
+        sim_mqtt_qmsg_t *msg = &queue->msgs[i];
+        if (msg->state == SIM_MQTT_QMSG_QUEUED && (next == NULL || (int32_t)(msg->seq - next->seq) < 0))
+            next = msg;
     }
-    
-    // Parse response
-    char resp[SIM_AT_MAX_RESP_LEN];
-    char *data;
-    simcom_responses_err_t resp_err = simcom_read_resp_values(resp, "+CMQTTPUB", &data);   
-    
-    if (resp_err == SIM_AT_RESPONSE_COMMAND_OK)
+    return next;
+}
+
+/**
+ * @brief Frees a message and reports it. The callback can queue the next messages.
+ */
+static void _mqtt_queue_done(sim_mqtt_qmsg_t *msg, simcom_err_t err, int mqtt_err)
+{
+    sim_mqtt_queue_t *queue = &s_queue[msg->client_index];
+    int client_index = msg->client_index;
+    simcom_mqtt_cb_t cb = msg->cb;
+    void *cb_ctx = msg->ctx;
+
+    portENTER_CRITICAL(&s_queue_mux);
+    msg->state = SIM_MQTT_QMSG_FREE;
+    queue->count--;
+    portEXIT_CRITICAL(&s_queue_mux);
+
+    if (cb)
+        cb(client_index, err, mqtt_err, cb_ctx);
+}
+
+/**
+ * @brief Completion of each command of a queued message, retries or reports the message after
+ * the last one
+ */
+static void _mqtt_queue_step_cb(const simcom_cmd_result_t *result, void *ctx)
+{
+    sim_mqtt_qmsg_t *msg = (sim_mqtt_qmsg_t *)ctx;
+    sim_mqtt_queue_t *queue = &s_queue[msg->client_index];
+
+    int mqtt_err;
+    simcom_err_t err = _mqtt_result_err(result, result->err, &mqtt_err);
+
+    // Report the step that failed, not the ones aborted after it
+    if (err != SIM_AT_OK && (msg->err == SIM_AT_OK || msg->err == SIM_AT_ERR_ABORTED))
+    {
+        msg->err = err;
+        msg->mqtt_err = mqtt_err;
+    }
+
+    if (--msg->pending > 0)
+        return;
+
+    int client_index = msg->client_index;
+    err = msg->err;
+    mqtt_err = msg->mqtt_err;
+
+    portENTER_CRITICAL(&s_queue_mux);
+    queue->inflight--;
+    bool retry = err != SIM_AT_OK && msg->tries < queue->retries;
+    if (retry)
+    {
+        // Keeps its place, first in the queue
+        msg->tries++;
+        msg->state = SIM_MQTT_QMSG_QUEUED;
+    }
+    portEXIT_CRITICAL(&s_queue_mux);
+
+    if (retry)
+    {
+        ESP_LOGW(TAG, "Retrying MQTT message of client %d: %s (%s)", client_index,
+                 simcom_err_to_str(err), simcom_mqtt_err_to_str(mqtt_err));
+    }
+    else
+    {
+        if (err != SIM_AT_OK)
+            ESP_LOGE(TAG, "Error with MQTT message of client %d: %s (%s)", client_index,
+                     simcom_err_to_str(err), simcom_mqtt_err_to_str(mqtt_err));
+        _mqtt_queue_done(msg, err, mqtt_err);
+    }
+
+    _mqtt_queue_pump(client_index);
+}
+
+/**
+ * @brief Queues the command chain of a message
+ */
+static simcom_err_t _mqtt_queue_send(sim_mqtt_qmsg_t *msg)
+{
+    msg->err = SIM_AT_OK;
+    msg->mqtt_err = SIM_MQTT_OK;
+
+    sim_mqtt_pub_cmds_t cmds;
+    simcom_cmd_step_t steps[3];
+    size_t count = _mqtt_pub_steps(msg->client_index, &msg->topic, &msg->payload, msg->qos, msg->pub_timeout,
+                                   &cmds, steps);
+    msg->pending = (uint8_t)count;
+    return simcom_cmd_chain_async(steps, count, _mqtt_queue_step_cb, msg);
+}
+
+/**
+ * @brief Sends queued messages of a client while its window and the command slots allow it.
+ * Only one task sends at a time; a call made meanwhile makes it look again.
+ */
+static void _mqtt_queue_pump(int client_index)
+{
+    sim_mqtt_queue_t *queue = &s_queue[client_index];
+
+    portENTER_CRITICAL(&s_queue_mux);
+    bool pumping = queue->pumping;
+    queue->pumping = true;
+    queue->repump = true;
+    portEXIT_CRITICAL(&s_queue_mux);
+    if (pumping)
+        return;
+
+    for (;;)
     {
-        resp_err = simcom_read_resp_values(resp, "+CMQTTPUB", &data);
-        if (resp_err == SIM_AT_RESPONSE_OK)
+        portENTER_CRITICAL(&s_queue_mux);
+        if (!queue->repump)
         {
-            int aux, err_code;
-            if (sscanf(data, "%d,%d", &aux, &err_code) != 2)
-                return SIM_AT_ERR_RESPONSE;
-            
-            if (err_code != SIM_MQTT_OK)
+            queue->pumping = false;
+            portEXIT_CRITICAL(&s_queue_mux);
+            return;
+        }
+        queue->repump = false;
+        portEXIT_CRITICAL(&s_queue_mux);
+
+        for (;;)
+        {
+            portENTER_CRITICAL(&s_queue_mux);
+            sim_mqtt_qmsg_t *msg = queue->inflight < queue->window ? _mqtt_queue_next(queue) : NULL;
+            if (msg)
             {
-                ESP_LOGE(TAG, "Error connecting to MQTT server: %s", simcom_mqtt_err_to_str(err_code));
-                return SIM_AT_ERR_RESPONSE;
+                msg->state = SIM_MQTT_QMSG_SENT;
+                queue->inflight++;
             }
-            return SIM_AT_OK;   
+            portEXIT_CRITICAL(&s_queue_mux);
+            if (msg == NULL)
+                break;
+
+            simcom_err_t err = _mqtt_queue_send(msg);
+            if (err == SIM_AT_OK)
+                continue;
+
+            portENTER_CRITICAL(&s_queue_mux);
+            queue->inflight--;
+            if (err == SIM_AT_ERR_BUSY)
+                msg->state = SIM_MQTT_QMSG_QUEUED;
+            portEXIT_CRITICAL(&s_queue_mux);
+
+            // Out of command slots: the slot hook calls again when they are freed
+            if (err == SIM_AT_ERR_BUSY)
+                break;
+
+            ESP_LOGE(TAG, "Error queuing MQTT message of client %d: %s", client_index, simcom_err_to_str(err));
+            _mqtt_queue_done(msg, err, SIM_MQTT_OK);
         }
     }
+}
 
-    if (resp_err == SIM_AT_RESPONSE_OK)
+/**
+ * @brief Slot hook: command slots were freed, send what was refused for lack of them. Also
+ * run at the flush deadlines of the coalesced topics.
+ */
+static void _mqtt_queue_hook(void *ctx)
+{
+    (void)ctx;
+    _mqtt_queue_pump(0);
+    _mqtt_queue_pump(1);
+    sim_mqtt_coalesce_tick();
+}
+
+void sim_mqtt_hook_install(void)
+{
+    if (!s_queue_hooked)
     {
-        int aux, err_code;
-        if (sscanf(data, "%d,%d", &aux, &err_code) != 2)
-            return SIM_AT_ERR_RESPONSE;
-        ESP_LOGE(TAG, "Error connecting to MQTT server: %s", simcom_mqtt_err_to_str(err_code));
-        return SIM_AT_ERR_RESPONSE;
+        simcom_cmd_set_slot_hook(_mqtt_queue_hook, NULL);
+        s_queue_hooked = true;
     }
+}
 
-    if (resp_err == SIM_AT_RESPONSE_ERR_COMMAND_ERROR)
+simcom_err_t simcom_mqtt_queue_config(int client_index, int window, int retries)
+{
+    if (client_index != 0 && client_index != 1)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (window < 1 || window > (int)SIM_MQTT_QUEUE_LEN || retries < 0 || retries > 255)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    portENTER_CRITICAL(&s_queue_mux);
+    s_queue[client_index].window = (uint8_t)window;
+    s_queue[client_index].retries = (uint8_t)retries;
+    portEXIT_CRITICAL(&s_queue_mux);
+
+    // A wider window can send more now
+    _mqtt_queue_pump(client_index);
+    return SIM_AT_OK;
+}
+
+simcom_err_t simcom_mqtt_enqueue(int client_index, const char* topic, const void* payload, size_t len,
+                                 int qos, int pub_timeout, simcom_mqtt_cb_t cb, void* ctx)
+{
+    if (!_mqtt_pub_args_valid(client_index, topic, payload, len, qos, pub_timeout))
+        return SIM_AT_ERR_INVALID_ARG;
+
+    sim_mqtt_hook_install();
+
+    sim_mqtt_queue_t *queue = &s_queue[client_index];
+    size_t topic_len = strlen(topic);
+
+    portENTER_CRITICAL(&s_queue_mux);
+    sim_mqtt_qmsg_t *msg = NULL;
+    for (size_t i = 0; i < SIM_MQTT_QUEUE_LEN && msg == NULL; i++)
+    {
+        if (queue->msgs[i].state == SIM_MQTT_QMSG_FREE)
+            msg = &queue->msgs[i];
+    }
+    if (msg == NULL)
+    {
+        portEXIT_CRITICAL(&s_queue_mux);
+        return SIM_AT_ERR_BUSY;
+    }
+
+    *msg = (sim_mqtt_qmsg_t){ .state = SIM_MQTT_QMSG_QUEUED, .client_index = (uint8_t)client_index,
+                              .qos = (uint8_t)qos, .pub_timeout = (uint8_t)pub_timeout, .seq = queue->seq++,
+                              .topic = { topic, topic_len }, .payload = { payload, len }, .cb = cb, .ctx = ctx };
+    queue->count++;
+    portEXIT_CRITICAL(&s_queue_mux);
+
+    _mqtt_queue_pump(client_index);
+    return SIM_AT_OK;
+}
+
+int simcom_mqtt_queue_pending(int client_index)
+{
+    if (client_index != 0 && client_index != 1)
+        return 0;
+    return s_queue[client_index].count;
+}
+
+/* Inbound messages: the parser reads the +CMQTTRX* blocks straight into the blocks of a static
+ * pool, which the URC task hands to the receive callback and frees. A message that fits in one
+ * block is delivered whole; a bigger one keeps its topic in a block and streams its payload in
+ * block sized parts, so the memory used does not depend on the message size. */
+#ifndef SIM_MQTT_RX_BLOCKS
+#define SIM_MQTT_RX_BLOCKS          4U      // at most 32
+#endif
+
+#ifndef SIM_MQTT_RX_BLOCK_SIZE
+#define SIM_MQTT_RX_BLOCK_SIZE      512U
+#endif
+
+// how long the parser waits for a block freed by the URC task before dropping payload data
+#ifndef SIM_MQTT_RX_WAIT_MS
+#define SIM_MQTT_RX_WAIT_MS         50U
+#endif
+
+typedef struct sim_mqtt_rx_block {
+    simcom_mqtt_msg_t msg;                  // part delivered with the block
+    struct sim_mqtt_rx_block *topic;        // block of the topic, freed with the last part
+    uint8_t data[SIM_MQTT_RX_BLOCK_SIZE];
+} sim_mqtt_rx_block_t;
+
+typedef enum {
+    SIM_MQTT_RX_START = 0,
+    SIM_MQTT_RX_TOPIC,
+    SIM_MQTT_RX_PAYLOAD,
+    SIM_MQTT_RX_END,
+} sim_mqtt_rx_urc_t;
+
+static sim_mqtt_rx_block_t s_rx_pool[SIM_MQTT_RX_BLOCKS];
+static uint32_t s_rx_used;                  // bitmap of the blocks in use
+static SemaphoreHandle_t s_rx_free;         // free block count
+static bool s_rx_ready = false;             // pool created and every URC handler registered
+static portMUX_TYPE s_rx_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static simcom_mqtt_rx_cb_t s_rx_cb;
+static void *s_rx_ctx;
+static volatile uint32_t s_rx_dropped;
+
+/* Message being received, parser task only */
+static struct {
+    sim_mqtt_rx_urc_t data;                 // what the data after the last line is
+    sim_mqtt_rx_block_t *msg;               // topic block, the whole message if it fits
+    sim_mqtt_rx_block_t *chunk;             // payload part being filled, large messages
+    size_t topic_pos;
+    size_t payload_pos;                     // payload bytes received
+    bool whole;                             // topic and payload in one block
+    bool drop;                              // no block for the message, its data is skipped
+    bool truncated;                         // payload bytes were lost
+} s_rx;
+
+static sim_mqtt_rx_block_t *_mqtt_rx_alloc(uint32_t wait_ms)
+{
+    if (xSemaphoreTake(s_rx_free, pdMS_TO_TICKS(wait_ms)) == pdFALSE)
+        return NULL;
+
+    sim_mqtt_rx_block_t *block = NULL;
+    portENTER_CRITICAL(&s_rx_mux);
+    for (size_t i = 0; i < SIM_MQTT_RX_BLOCKS; i++)
     {
-        resp_err = simcom_read_resp_values(resp, "+CMQTTPUB", &data);
-        if (resp_err == SIM_AT_RESPONSE_OK)
+        if ((s_rx_used & (1U << i)) == 0)
         {
-            int aux, err_code;
-            if (sscanf(data, "%d,%d", &aux, &err_code) != 2)
-                return SIM_AT_ERR_RESPONSE;
-            ESP_LOGE(TAG, "Error connecting to MQTT server: %s", simcom_mqtt_err_to_str(err_code));
-            return SIM_AT_ERR_RESPONSE;
+            s_rx_used |= (1U << i);
+            block = &s_rx_pool[i];
+            break;
         }
     }
-    
-    return SIM_AT_ERR_RESPONSE;
-}
\ No newline at end of file
+    portEXIT_CRITICAL(&s_rx_mux);
+    return block;
+}
+
+static void _mqtt_rx_free(sim_mqtt_rx_block_t *block)
+{
+    portENTER_CRITICAL(&s_rx_mux);
+    s_rx_used &= ~(1U << (block - s_rx_pool));
+    portEXIT_CRITICAL(&s_rx_mux);
+    xSemaphoreGive(s_rx_free);
+}
+
+/**
+ * @brief Runs the receive callback for a message part, in the URC task
+ */
+static void _mqtt_rx_deliver(void *arg, bool run)
+{
+    sim_mqtt_rx_block_t *block = (sim_mqtt_rx_block_t *)arg;
+    simcom_mqtt_rx_cb_t cb = s_rx_cb;
+    if (run && cb)
+        cb(&block->msg, s_rx_ctx);
+
+    if (block->msg.last && block->topic != block)
+        _mqtt_rx_free(block->topic);
+    _mqtt_rx_free(block);
+}
+
+/**
+ * @brief Hands a message part to the URC task, the block is freed if it cannot be queued
+ */
+static void _mqtt_rx_post(sim_mqtt_rx_block_t *block)
+{
+    if (sim_at_urc_defer(_mqtt_rx_deliver, block))
+        return;
+    _mqtt_rx_deliver(block, false);
+    s_rx_dropped++;
+}
+
+/**
+ * @brief Ends the message being received. Large messages end with their last payload part,
+ * or with the topic block alone when that part was lost.
+ *
+ * @param complete False if the message was cut short (new message, lost input)
+ */
+static void _mqtt_rx_finish(bool complete)
+{
+    sim_mqtt_rx_block_t *msg = s_rx.msg;
+    sim_mqtt_rx_block_t *chunk = s_rx.chunk;
+    s_rx.msg = NULL;
+    s_rx.chunk = NULL;
+    s_rx.data = SIM_MQTT_RX_END;
+    if (msg == NULL)
+        return;
+
+    if (!complete || s_rx.payload_pos != msg->msg.total_len)
+        s_rx.truncated = true;
+
+    sim_mqtt_rx_block_t *last = (chunk != NULL && chunk->msg.len > 0) ? chunk : msg;
+    if (chunk != NULL && chunk != last)
+        _mqtt_rx_free(chunk);
+
+    // A large message whose last part was lost ends with the topic block, without payload
+    if (last == msg && !s_rx.whole)
+        msg->msg.offset = s_rx.payload_pos;
+    last->msg.last = true;
+    last->msg.truncated = s_rx.truncated;
+    _mqtt_rx_post(last);
+}
+
+/**
+ * @brief Starts a message from its "+CMQTTRXSTART: <client>,<topic_len>,<payload_len>" line
+ */
+static void _mqtt_rx_start(int client_index, int topic_len, int payload_len)
+{
+    if (s_rx.msg != NULL)
+    {
+        ESP_LOGW(TAG, "MQTT message without +CMQTTRXEND");
+        _mqtt_rx_finish(false);
+    }
+
+    s_rx.topic_pos = 0;
+    s_rx.payload_pos = 0;
+    s_rx.truncated = false;
+    s_rx.drop = true;
+    if (topic_len < 1 || (size_t)topic_len + 1 > SIM_MQTT_RX_BLOCK_SIZE || payload_len < 0)
+    {
+        ESP_LOGE(TAG, "Incoming MQTT message dropped: topic too long (%d)", topic_len);
+        s_rx_dropped++;
+        return;
+    }
+
+    sim_mqtt_rx_block_t *msg = _mqtt_rx_alloc(SIM_MQTT_RX_WAIT_MS);
+    if (msg == NULL)
+    {
+        ESP_LOGE(TAG, "Incoming MQTT message dropped: no free receive block");
+        s_rx_dropped++;
+        return;
+    }
+
+    // Topic and payload share the block if both fit, NUL-terminated
+    bool whole = ((size_t)topic_len + 1 + (size_t)payload_len + 1 <= SIM_MQTT_RX_BLOCK_SIZE);
+    msg->topic = msg;
+    msg->msg = (simcom_mqtt_msg_t){
+        .client_index = client_index,
+        .topic = (const char *)msg->data,
+        .topic_len = (size_t)topic_len,
+        .payload = whole ? &msg->data[topic_len + 1] : NULL,
+        .total_len = (size_t)payload_len,
+        .len = whole ? (size_t)payload_len : 0,
+    };
+    msg->data[topic_len] = '\0';
+    if (whole)
+        msg->data[topic_len + 1 + payload_len] = '\0';
+    s_rx.msg = msg;
+    s_rx.whole = whole;
+    s_rx.drop = false;
+}
+
+/**
+ * @brief Line handler of the +CMQTTRX* URCs, returns the length of the data that follows
+ */
+static size_t _mqtt_rx_line(const char *line, size_t len, void *ctx)
+{
+    sim_mqtt_rx_urc_t urc = (sim_mqtt_rx_urc_t)(uintptr_t)ctx;
+    const char *values = strchr(line, ':');
+    if (values == NULL)
+        return 0;
+    values++;
+    while (*values == ' ')
+        values++;
+
+    int client_index, a = 0, b = 0;
+    sim_at_fields_t fields;
+    sim_at_fields_init(&fields, values);
+    if (!sim_at_fields_int(&fields, &client_index))
+        return 0;
+    if (urc != SIM_MQTT_RX_END && !sim_at_fields_int(&fields, &a))
+        return 0;
+    if (urc == SIM_MQTT_RX_START && !sim_at_fields_int(&fields, &b))
+        return 0;
+
+    switch (urc)
+    {
+    case SIM_MQTT_RX_START:
+        _mqtt_rx_start(client_index, a, b);
+        return 0;
+
+    case SIM_MQTT_RX_END:
+        if (!s_rx.drop)
+            _mqtt_rx_finish(true);
+        return 0;
+
+    default:
+        // Data is always consumed, even when it has nowhere to go
+        s_rx.data = urc;
+        return (a > 0) ? (size_t)a : 0;
+    }
+}
+
+/**
+ * @brief Copies payload bytes of a large message into parts, posting each full one
+ */
+static void _mqtt_rx_stream(const uint8_t *data, size_t len)
+{
+    sim_mqtt_rx_block_t *msg = s_rx.msg;
+    while (len > 0)
+    {
+        if (s_rx.chunk == NULL)
+        {
+            s_rx.chunk = _mqtt_rx_alloc(SIM_MQTT_RX_WAIT_MS);
+            if (s_rx.chunk == NULL)
+            {
+                // The callback is not keeping up, this part of the payload is lost
+                s_rx.truncated = true;
+                s_rx.payload_pos += len;
+                return;
+            }
+            s_rx.chunk->topic = msg;
+            s_rx.chunk->msg = msg->msg;
+            s_rx.chunk->msg.payload = s_rx.chunk->data;
+            s_rx.chunk->msg.offset = s_rx.payload_pos;
+            s_rx.chunk->msg.len = 0;
+            s_rx.chunk->msg.truncated = s_rx.truncated;
+        }
+
+        sim_mqtt_rx_block_t *chunk = s_rx.chunk;
+        size_t n = SIM_MQTT_RX_BLOCK_SIZE - chunk->msg.len;
+        if (n > len)
+            n = len;
+        memcpy(&chunk->data[chunk->msg.len], data, n);
+        chunk->msg.len += n;
+        s_rx.payload_pos += n;
+        data += n;
+        len -= n;
+
+        // Full parts go out as they fill, the last one waits for +CMQTTRXEND
+        if (chunk->msg.len == SIM_MQTT_RX_BLOCK_SIZE && s_rx.payload_pos < msg->msg.total_len)
+        {
+            s_rx.chunk = NULL;
+            _mqtt_rx_post(chunk);
+        }
+    }
+}
+
+/**
+ * @brief Data handler of the +CMQTTRX* URCs: topic and payload bytes, in order
+ */
+static void _mqtt_rx_data(const uint8_t *data, size_t len, void *ctx)
+{
+    (void)ctx;
+    if (data == NULL)
+    {
+        // Input lost, the message cannot be completed
+        if (!s_rx.drop)
+            _mqtt_rx_finish(false);
+        s_rx.drop = true;
+        return;
+    }
+    if (s_rx.drop || s_rx.msg == NULL)
+        return;
+
+    sim_mqtt_rx_block_t *msg = s_rx.msg;
+    if (s_rx.data == SIM_MQTT_RX_TOPIC)
+    {
+        size_t n = msg->msg.topic_len - s_rx.topic_pos;
+        if (n > len)
+            n = len;
+        memcpy(&msg->data[s_rx.topic_pos], data, n);
+        s_rx.topic_pos += n;
+    }
+    else if (s_rx.data == SIM_MQTT_RX_PAYLOAD)
+    {
+        size_t left = msg->msg.total_len - s_rx.payload_pos;
+        if (len > left)
+            len = left;
+        if (s_rx.whole)
+        {
+            memcpy(&msg->data[msg->msg.topic_len + 1 + s_rx.payload_pos], data, len);
+            s_rx.payload_pos += len;
+        }
+        else
+        {
+            _mqtt_rx_stream(data, len);
+        }
+    }
+}
+
+simcom_err_t simcom_mqtt_rx_register(simcom_mqtt_rx_cb_t cb, void *ctx)
+{
+    static const sim_at_urc_data_handler_t handlers[] = {
+        { _mqtt_rx_line, _mqtt_rx_data, (void *)(uintptr_t)SIM_MQTT_RX_START },
+        { _mqtt_rx_line, _mqtt_rx_data, (void *)(uintptr_t)SIM_MQTT_RX_TOPIC },
+        { _mqtt_rx_line, _mqtt_rx_data, (void *)(uintptr_t)SIM_MQTT_RX_PAYLOAD },
+        { _mqtt_rx_line, _mqtt_rx_data, (void *)(uintptr_t)SIM_MQTT_RX_END },
+    };
+    static const char *prefixes[] = { "+CMQTTRXSTART", "+CMQTTRXTOPIC", "+CMQTTRXPAYLOAD", "+CMQTTRXEND" };
+
+    // The pool and the URC handlers are set up once, the callback can be replaced
+    if (!s_rx_ready)
+    {
+        s_rx_free = xSemaphoreCreateCounting(SIM_MQTT_RX_BLOCKS, SIM_MQTT_RX_BLOCKS);
+        if (s_rx_free == NULL)
+            return SIM_AT_ERR_NO_MEM;
+
+        for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++)
+        {
+            simcom_err_t err = sim_at_urc_register_data(prefixes[i], &handlers[i]);
+            if (err != SIM_AT_OK)
+            {
+                ESP_LOGE(TAG, "Error registering %s handler: %s", prefixes[i], simcom_err_to_str(err));
+
+                // Nothing half set up, a later call starts over
+                while (i-- > 0)
+                    sim_at_urc_unregister_data(prefixes[i], &handlers[i]);
+                vSemaphoreDelete(s_rx_free);
+                s_rx_free = NULL;
+                return err;
+            }
+        }
+        s_rx_ready = true;
+    }
+
+    s_rx_ctx = ctx;
+    s_rx_cb = cb;
+    return SIM_AT_OK;
+}
+
+uint32_t simcom_mqtt_rx_dropped(void)
+{
+    return s_rx_dropped;
+}
+
+/**
+ * @brief Sends a subscribe or unsubscribe command with its topic and waits for its result
+ *
+ * @param name Command name, "CMQTTSUB" or "CMQTTUNSUB"
+ * @param client_index Client index
+ * @param topic Topic
+ * @param arg Last command parameter: qos for a subscription, 0 (dup flag) otherwise
+ */
+static simcom_err_t _mqtt_sub(const char *name, int client_index, const char *topic, int arg)
+{
+    if (client_index != 0 && client_index != 1)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (topic == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+    size_t topic_len = strlen(topic);
+    if (topic_len < 1 || topic_len > 1024)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    // Command, the topic is written on the '>' prompt
+    char cmd[SIM_AT_MAX_CMD_LEN];
+    snprintf(cmd, SIM_AT_MAX_CMD_LEN, "AT+%s=%d,%u,%d\r\n", name, client_index, (unsigned)topic_len, arg);
+
+    simcom_iov_t iov = { .base = topic, .len = topic_len };
+    return _mqtt_cmd_sync(name, client_index, cmd, &iov, 2000 + topic_len, 9000);
+}
+
+simcom_err_t simcom_mqtt_subscribe(int client_index, const char* topic, int qos)
+{
+    if (qos < 0 || qos > 2)
+        return SIM_AT_ERR_INVALID_ARG;
+    return _mqtt_sub("CMQTTSUB", client_index, topic, qos);
+}
+
+simcom_err_t simcom_mqtt_unsubscribe(int client_index, const char* topic)
+{
+    return _mqtt_sub("CMQTTUNSUB", client_index, topic, 0);
+}
@@ -0,0 +1,34 @@
+#ifndef SIM_MQTT_AT_H
+#define SIM_MQTT_AT_H
+
+#include "simcom.h"
+
+/**
+ * @brief simcom_mqtt_service_start() that also tells if the service was already started
+ */
+simcom_err_t sim_mqtt_service_start(bool *already);
+
+/**
+ * @brief simcom_mqtt_client_acquire() that takes a client already in use as acquired and
+ * tells so (already may be NULL to report it as an error)
+ */
+simcom_err_t sim_mqtt_client_acquire(int client_index, const char* client_id, bool *already);
+
+/**
+ * @brief Tells if a client is connected to a server (AT+CMQTTCONNECT?)
+ */
+simcom_err_t sim_mqtt_server_connected(int client_index, bool *connected);
+
+/**
+ * @brief Installs the slot hook of the MQTT outbound queue, which also runs the coalescing
+ * deadlines
+ */
+void sim_mqtt_hook_install(void);
+
+/**
+ * @brief Flushes the coalesced topics whose deadline passed and sets the next deadline
+ * (parser task, from the slot hook)
+ */
+void sim_mqtt_coalesce_tick(void);
+
+#endif // SIM_MQTT_AT_H
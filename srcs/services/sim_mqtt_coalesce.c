@@ -0,0 +1,364 @@
+/**
+ * sim_mqtt_coalesce.c
+ * Telemetry coalescing: small records of a topic collected in a buffer and published together
+ *
+ * Each topic has two static buffers: one collects records while the other one is published
+ * through the outbound queue (simcom_mqtt_enqueue(), zero-copy). A buffer is flushed when it
+ * reaches the flush size, when its first record gets older than the max age or on request;
+ * the age deadlines run in the parser task, from the slot hook of the queue.
+ */
+
+#include "simcom.h"
+#include "at/sim_at.h"
+#include "services/sim_mqtt_at.h"
+#include "freertos/task.h"
+
+static const char *TAG = "mqtt_coalesce";
+
+/**
+ * -------------------------------------
+ * ----- [ Compile-time tunables ] -----
+ * -------------------------------------
+ */
+
+// topics coalesced at the same time
+#ifndef SIM_MQTT_COALESCE_TOPICS
+#define SIM_MQTT_COALESCE_TOPICS        2U
+#endif
+
+// bytes of each of the two buffers of a topic, the largest publish
+#ifndef SIM_MQTT_COALESCE_SIZE
+#define SIM_MQTT_COALESCE_SIZE          1024U
+#endif
+
+// wait before trying again a flush refused by a full outbound queue
+#ifndef SIM_MQTT_COALESCE_RETRY_MS
+#define SIM_MQTT_COALESCE_RETRY_MS      50U
+#endif
+
+// publish timeout of the coalesced messages, in seconds
+#ifndef SIM_MQTT_COALESCE_PUB_TIMEOUT
+#define SIM_MQTT_COALESCE_PUB_TIMEOUT   60
+#endif
+
+typedef enum {
+    SIM_MQTT_BUF_FILL = 0,      // collecting records (empty if len is 0)
+    SIM_MQTT_BUF_READY,         // to publish, waiting for room in the outbound queue
+    SIM_MQTT_BUF_SENT,          // queued, until its publish is reported
+} sim_mqtt_buf_state_t;
+
+typedef struct sim_mqtt_coalesce sim_mqtt_coalesce_t;
+
+typedef struct {
+    sim_mqtt_coalesce_t *topic;
+    uint8_t state;
+    uint16_t len;
+    uint16_t records;
+    TickType_t first;           // when the first record was added
+    uint8_t data[SIM_MQTT_COALESCE_SIZE];
+} sim_mqtt_buf_t;
+
+struct sim_mqtt_coalesce {
+    bool used;
+    bool closing;               // freed once both buffers are published
+    uint8_t active;             // buffer collecting records
+    simcom_mqtt_coalesce_config_t cfg;
+    sim_mqtt_buf_t buf[2];
+    simcom_mqtt_coalesce_stats_t stats;
+    uint32_t sent_records;      // records of the successful publishes
+};
+
+static sim_mqtt_coalesce_t s_coalesce[SIM_MQTT_COALESCE_TOPICS];
+static portMUX_TYPE s_coalesce_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static sim_mqtt_coalesce_t *_coalesce_get(int handle)
+{
+    if (handle < 0 || handle >= (int)SIM_MQTT_COALESCE_TOPICS || !s_coalesce[handle].used)
+        return NULL;
+    return &s_coalesce[handle];
+}
+
+/**
+ * @brief Collects in the other buffer once the active one is full and the other one empty
+ * (called in the critical section)
+ */
+static void _coalesce_rotate(sim_mqtt_coalesce_t *topic)
+{
+    sim_mqtt_buf_t *other = &topic->buf[topic->active ^ 1];
+    if (topic->buf[topic->active].state != SIM_MQTT_BUF_FILL && other->state == SIM_MQTT_BUF_FILL)
+        topic->active ^= 1;
+}
+
+/**
+ * @brief Marks the active buffer to publish, if it holds records (called in the critical section)
+ */
+static void _coalesce_close_buf(sim_mqtt_coalesce_t *topic)
+{
+    sim_mqtt_buf_t *buf = &topic->buf[topic->active];
+    if (buf->state == SIM_MQTT_BUF_FILL && buf->len > 0)
+    {
+        buf->state = SIM_MQTT_BUF_READY;
+        _coalesce_rotate(topic);
+    }
+}
+
+static void _coalesce_free_if_done(sim_mqtt_coalesce_t *topic)
+{
+    if (topic->closing && topic->buf[0].state == SIM_MQTT_BUF_FILL && topic->buf[0].len == 0 &&
+        topic->buf[1].state == SIM_MQTT_BUF_FILL && topic->buf[1].len == 0)
+        topic->used = false;
+}
+
+static void _coalesce_cb(int client_index, simcom_err_t err, int mqtt_err, void *ctx)
+{
+    sim_mqtt_buf_t *buf = (sim_mqtt_buf_t *)ctx;
+    sim_mqtt_coalesce_t *topic = buf->topic;
+    simcom_mqtt_cb_t cb = topic->cfg.cb;
+    void *cb_ctx = topic->cfg.ctx;
+
+    portENTER_CRITICAL(&s_coalesce_mux);
+    if (err == SIM_AT_OK)
+    {
+        topic->stats.publishes++;
+        topic->stats.bytes += buf->len;
+        topic->sent_records += buf->records;
+    }
+    else
+    {
+        topic->stats.failed += buf->records;
+    }
+    buf->len = 0;
+    buf->records = 0;
+    buf->state = SIM_MQTT_BUF_FILL;
+    _coalesce_rotate(topic);
+    _coalesce_free_if_done(topic);
+    portEXIT_CRITICAL(&s_coalesce_mux);
+
+    if (err != SIM_AT_OK)
+        ESP_LOGW(TAG, "Coalesced records lost: %s", simcom_err_to_str(err));
+
+    // A buffer closed meanwhile can go now
+    sim_mqtt_coalesce_tick();
+    if (cb)
+        cb(client_index, err, mqtt_err, cb_ctx);
+}
+
+/**
+ * @brief Queues the buffers ready to publish, the older one first
+ *
+ * @return SIM_AT_OK, or the error of simcom_mqtt_enqueue() with the buffer left ready
+ */
+static simcom_err_t _coalesce_send(sim_mqtt_coalesce_t *topic)
+{
+    for (;;)
+    {
+        portENTER_CRITICAL(&s_coalesce_mux);
+        sim_mqtt_buf_t *buf = &topic->buf[topic->active ^ 1];
+        if (buf->state != SIM_MQTT_BUF_READY)
+            buf = &topic->buf[topic->active];
+        bool ready = (buf->state == SIM_MQTT_BUF_READY);
+        if (ready)
+            buf->state = SIM_MQTT_BUF_SENT;
+        portEXIT_CRITICAL(&s_coalesce_mux);
+        if (!ready)
+            return SIM_AT_OK;
+
+        simcom_err_t err = simcom_mqtt_enqueue(topic->cfg.client_index, topic->cfg.topic, buf->data, buf->len,
+                                               topic->cfg.qos, SIM_MQTT_COALESCE_PUB_TIMEOUT, _coalesce_cb, buf);
+        if (err != SIM_AT_OK)
+        {
+            portENTER_CRITICAL(&s_coalesce_mux);
+            buf->state = SIM_MQTT_BUF_READY;
+            portEXIT_CRITICAL(&s_coalesce_mux);
+
+            // A full queue frees up, try again from the slot hook
+            if (err == SIM_AT_ERR_BUSY)
+                simcom_cmd_hook_at(xTaskGetTickCount() + pdMS_TO_TICKS(SIM_MQTT_COALESCE_RETRY_MS));
+            return err;
+        }
+    }
+}
+
+void sim_mqtt_coalesce_tick(void)
+{
+    TickType_t now = xTaskGetTickCount();
+    TickType_t next = 0;
+    bool any = false;
+
+    for (size_t i = 0; i < SIM_MQTT_COALESCE_TOPICS; i++)
+    {
+        sim_mqtt_coalesce_t *topic = &s_coalesce[i];
+        TickType_t age = pdMS_TO_TICKS(topic->cfg.max_age_ms);
+
+        portENTER_CRITICAL(&s_coalesce_mux);
+        bool used = topic->used;
+        sim_mqtt_buf_t *buf = &topic->buf[topic->active];
+        if (used && topic->cfg.max_age_ms > 0 && buf->state == SIM_MQTT_BUF_FILL && buf->len > 0)
+        {
+            TickType_t deadline = buf->first + age;
+            if ((int32_t)(now - deadline) >= 0)
+            {
+                _coalesce_close_buf(topic);
+            }
+            else if (!any || (int32_t)(deadline - next) < 0)
+            {
+                next = deadline;
+                any = true;
+            }
+        }
+        portEXIT_CRITICAL(&s_coalesce_mux);
+
+        if (used)
+            _coalesce_send(topic);
+    }
+
+    if (any)
+        simcom_cmd_hook_at(next);
+}
+
+simcom_err_t simcom_mqtt_coalesce_open(const simcom_mqtt_coalesce_config_t *cfg, int *handle)
+{
+    if (cfg == NULL || handle == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (cfg->client_index != 0 && cfg->client_index != 1)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (cfg->topic == NULL || strlen(cfg->topic) < 1 || strlen(cfg->topic) > 1024)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (cfg->qos < 0 || cfg->qos > 2 || cfg->flush_size > SIM_MQTT_COALESCE_SIZE)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (cfg->framing != SIMCOM_MQTT_FRAME_NEWLINE && cfg->framing != SIMCOM_MQTT_FRAME_LEN16)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    sim_mqtt_hook_install();
+
+    sim_mqtt_coalesce_t *topic = NULL;
+    portENTER_CRITICAL(&s_coalesce_mux);
+    for (size_t i = 0; i < SIM_MQTT_COALESCE_TOPICS && topic == NULL; i++)
+    {
+        if (!s_coalesce[i].used)
+        {
+            topic = &s_coalesce[i];
+            topic->used = true;
+        }
+    }
+    portEXIT_CRITICAL(&s_coalesce_mux);
+    if (topic == NULL)
+        return SIM_AT_ERR_BUSY;
+
+    topic->closing = false;
+    topic->active = 0;
+    topic->cfg = *cfg;
+    if (topic->cfg.flush_size == 0)
+        topic->cfg.flush_size = SIM_MQTT_COALESCE_SIZE;
+    topic->stats = (simcom_mqtt_coalesce_stats_t){ 0 };
+    topic->sent_records = 0;
+    for (size_t i = 0; i < 2; i++)
+    {
+        topic->buf[i].topic = topic;
+        topic->buf[i].state = SIM_MQTT_BUF_FILL;
+        topic->buf[i].len = 0;
+        topic->buf[i].records = 0;
+    }
+    *handle = (int)(topic - s_coalesce);
+    return SIM_AT_OK;
+}
+
+simcom_err_t simcom_mqtt_coalesce_add(int handle, const void *data, size_t len)
+{
+    sim_mqtt_coalesce_t *topic = _coalesce_get(handle);
+    if (topic == NULL || topic->closing || (data == NULL && len > 0))
+        return SIM_AT_ERR_INVALID_ARG;
+
+    size_t framed = len + (topic->cfg.framing == SIMCOM_MQTT_FRAME_LEN16 ? 2 : 1);
+    if (framed > SIM_MQTT_COALESCE_SIZE || len > UINT16_MAX)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    portENTER_CRITICAL(&s_coalesce_mux);
+    sim_mqtt_buf_t *buf = &topic->buf[topic->active];
+    if (buf->state == SIM_MQTT_BUF_FILL && buf->len + framed > SIM_MQTT_COALESCE_SIZE)
+    {
+        _coalesce_close_buf(topic);
+        buf = &topic->buf[topic->active];
+    }
+
+    bool added = (buf->state == SIM_MQTT_BUF_FILL);
+    bool first = added && buf->len == 0;
+    if (added)
+    {
+        uint8_t *p = buf->data + buf->len;
+        if (topic->cfg.framing == SIMCOM_MQTT_FRAME_LEN16)
+        {
+            *p++ = (uint8_t)(len >> 8);
+            *p++ = (uint8_t)len;
+            memcpy(p, data, len);
+        }
+        else
+        {
+            memcpy(p, data, len);
+            p[len] = '\n';
+        }
+        if (first)
+            buf->first = xTaskGetTickCount();
+        buf->len += (uint16_t)framed;
+        buf->records++;
+        topic->stats.records++;
+        if (buf->len >= topic->cfg.flush_size)
+            _coalesce_close_buf(topic);
+    }
+    bool ready = topic->buf[0].state == SIM_MQTT_BUF_READY || topic->buf[1].state == SIM_MQTT_BUF_READY;
+    TickType_t deadline = buf->first + pdMS_TO_TICKS(topic->cfg.max_age_ms);
+    portEXIT_CRITICAL(&s_coalesce_mux);
+
+    // The age deadline of a new buffer
+    if (first && topic->cfg.max_age_ms > 0)
+        simcom_cmd_hook_at(deadline);
+    if (ready)
+        _coalesce_send(topic);
+
+    // Both buffers in use: the link is slower than the records
+    return added ? SIM_AT_OK : SIM_AT_ERR_BUSY;
+}
+
+simcom_err_t simcom_mqtt_coalesce_flush(int handle)
+{
+    sim_mqtt_coalesce_t *topic = _coalesce_get(handle);
+    if (topic == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    portENTER_CRITICAL(&s_coalesce_mux);
+    _coalesce_close_buf(topic);
+    portEXIT_CRITICAL(&s_coalesce_mux);
+    return _coalesce_send(topic);
+}
+
+simcom_err_t simcom_mqtt_coalesce_close(int handle)
+{
+    sim_mqtt_coalesce_t *topic = _coalesce_get(handle);
+    if (topic == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    simcom_err_t err = simcom_mqtt_coalesce_flush(handle);
+    if (err != SIM_AT_OK)
+        return err;
+
+    portENTER_CRITICAL(&s_coalesce_mux);
+    topic->closing = true;
+    _coalesce_free_if_done(topic);
+    portEXIT_CRITICAL(&s_coalesce_mux);
+    return SIM_AT_OK;
+}
+
+simcom_err_t simcom_mqtt_coalesce_get_stats(int handle, simcom_mqtt_coalesce_stats_t *stats)
+{
+    sim_mqtt_coalesce_t *topic = _coalesce_get(handle);
+    if (topic == NULL || stats == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    portENTER_CRITICAL(&s_coalesce_mux);
+    *stats = topic->stats;
+    uint32_t sent_records = topic->sent_records;
+    portEXIT_CRITICAL(&s_coalesce_mux);
+    stats->bytes_per_publish = stats->publishes ? stats->bytes / stats->publishes : 0;
+    stats->records_per_publish = stats->publishes ? sent_records / stats->publishes : 0;
+    return SIM_AT_OK;
+}
@@ -1,5 +1,7 @@
 #include "simcom.h"
 #include "at/sim_at.h"
+#include "at/sim_at_fields.h"
+#include "services/sim_state_cache.h"
 
 static const char *TAG = "network_at";
 
@@ -14,9 +16,8 @@ simcom_err_t simcom_net_reg(sim_network_registration_stat_t *stat)
     }
 
     // Reads response
-    char resp[SIM_AT_MAX_RESP_LEN];
-    char *data;
-    simcom_responses_err_t resp_err = simcom_read_resp_values(resp, "+CREG", &data);
+    const char *data;
+    simcom_responses_err_t resp_err = simcom_read_resp_values("+CREG", &data);
     if (resp_err != SIM_AT_RESPONSE_OK)
     {
         ESP_LOGE(TAG, "Error with AT+CREG? response: %s", simcom_resp_err_to_str(resp_err));
@@ -26,19 +27,22 @@ simcom_err_t simcom_net_reg(sim_network_registration_stat_t *stat)
     // Get network status
     // TODO: N no se utiliza
     int pN, pStat;
-    if (sscanf(data, "%d,%d", &pN, &pStat) != 2)
+    sim_at_fields_t fields;
+    sim_at_fields_init(&fields, data);
+    if (!sim_at_fields_int(&fields, &pN) || !sim_at_fields_int(&fields, &pStat))
         return SIM_AT_ERR_RESPONSE;
 
     *stat = pStat;
 
     // Read OK responss
-    resp_err = simcom_resp_read_ok(resp);
+    resp_err = simcom_resp_read_ok();
     if (resp_err != SIM_AT_RESPONSE_COMMAND_OK)
     {
         ESP_LOGE(TAG, "Ok response was not received: %s", simcom_resp_err_to_str(resp_err));
         return SIM_AT_ERR_RESPONSE;
     }
 
+    sim_state_update(SIMCOM_STATE_CREG, pStat, 0);
     return SIM_AT_OK;
 }
 
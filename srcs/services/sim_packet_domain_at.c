@@ -1,5 +1,7 @@
 #include "simcom.h"
 #include "at/sim_at.h"
+#include "at/sim_at_fields.h"
+#include "services/sim_state_cache.h"
 
 static const char *TAG = "packet_domain_at";
 
@@ -14,9 +16,8 @@ simcom_err_t simcom_eps_net_reg(sim_eps_network_registration_stat_t* stat)
     }
     
     // Reads response
-    char resp[SIM_AT_MAX_RESP_LEN];
-    char *data;
-    simcom_responses_err_t resp_err = simcom_read_resp_values(resp, "+CEREG", &data);
+    const char *data;
+    simcom_responses_err_t resp_err = simcom_read_resp_values("+CEREG", &data);
     if (resp_err != SIM_AT_RESPONSE_OK)
     {
         ESP_LOGE(TAG, "Error with AT+CEREG? response: %s", simcom_resp_err_to_str(resp_err));
@@ -26,19 +27,22 @@ simcom_err_t simcom_eps_net_reg(sim_eps_network_registration_stat_t* stat)
     // Parse two integers separated by a comma
     // TODO: Por el momento no se utiliza para nada, pero se guarda por las dudas
     int pN, pStat; 
-    if (sscanf(data, "%d,%d", &pN, &pStat) != 2)
+    sim_at_fields_t fields;
+    sim_at_fields_init(&fields, data);
+    if (!sim_at_fields_int(&fields, &pN) || !sim_at_fields_int(&fields, &pStat))
         return SIM_AT_ERR_RESPONSE;
     
     *stat = pStat;
 
     // Read OK responss
-    resp_err = simcom_resp_read_ok(resp);
+    resp_err = simcom_resp_read_ok();
     if (resp_err != SIM_AT_RESPONSE_COMMAND_OK)
     {
         ESP_LOGE(TAG, "Ok response was not received: %s", simcom_resp_err_to_str(resp_err));
         return SIM_AT_ERR_RESPONSE;
     }
 
+    sim_state_update(SIMCOM_STATE_CEREG, pStat, 0);
     return SIM_AT_OK; 
 }
 
@@ -70,9 +74,8 @@ simcom_err_t simcom_get_packet_domain_attach(int* state)
     }
     
     // Reads response
-    char resp[SIM_AT_MAX_RESP_LEN];
-    char *data;
-    simcom_responses_err_t resp_err = simcom_read_resp_values(resp, "+CGATT", &data);
+    const char *data;
+    simcom_responses_err_t resp_err = simcom_read_resp_values("+CGATT", &data);
     if (resp_err != SIM_AT_RESPONSE_OK)
     {
         ESP_LOGE(TAG, "Error with AT+CGATT? response: %s", simcom_resp_err_to_str(resp_err));
@@ -80,17 +83,20 @@ simcom_err_t simcom_get_packet_domain_attach(int* state)
     }
 
     // Parse integer
-    if (sscanf(data, "%d", state) != 1)
+    sim_at_fields_t fields;
+    sim_at_fields_init(&fields, data);
+    if (!sim_at_fields_int(&fields, state))
         return SIM_AT_ERR_RESPONSE;
     
     // Read OK responss
-    resp_err = simcom_resp_read_ok(resp);
+    resp_err = simcom_resp_read_ok();
     if (resp_err != SIM_AT_RESPONSE_COMMAND_OK)
     {
         ESP_LOGE(TAG, "Ok response was not received: %s", simcom_resp_err_to_str(resp_err));
         return SIM_AT_ERR_RESPONSE;
     }
 
+    sim_state_update(SIMCOM_STATE_CGATT, *state, 0);
     return SIM_AT_OK; 
 }
 
@@ -112,56 +118,170 @@ simcom_err_t simcom_set_packet_domain_attach(int state)
     }
 
     // Read OK responss
-    char resp[SIM_AT_MAX_RESP_LEN];
-    simcom_responses_err_t resp_err = simcom_resp_read_ok(resp);
+    simcom_responses_err_t resp_err = simcom_resp_read_ok();
     if (resp_err != SIM_AT_RESPONSE_COMMAND_OK)
     {
         ESP_LOGE(TAG, "Ok response was not received: %s", simcom_resp_err_to_str(resp_err));
         return SIM_AT_ERR_RESPONSE;
     }
     
+    sim_state_update(SIMCOM_STATE_CGATT, state, 0);
     return SIM_AT_OK; 
 }
 
-// TODO: El problema si tiene muchos cid es como los devuelve, porque acá nomás devuelve el primero.
-// Habría que utilizar una array, o elegir que cid queremos verificar
-simcom_err_t simcom_get_pdp_context_activate(int* cid, int* state)
+/**
+ * @brief Entry of a context in a list, added at the end if it is not there yet
+ *
+ * @return The entry, NULL if the list is full
+ */
+static simcom_pdp_context_t *_pdp_entry(simcom_pdp_context_t *contexts, size_t max, size_t *count, int cid)
 {
-    // Send command
-    simcom_err_t err = simcom_cmd_sync("AT+CGACT?\r\n", 2000);
+    for (size_t i = 0; i < *count; i++)
+    {
+        if (contexts[i].cid == cid)
+            return &contexts[i];
+    }
+    if (*count == max)
+        return NULL;
+
+    simcom_pdp_context_t *context = &contexts[(*count)++];
+    memset(context, 0, sizeof(*context));
+    context->cid = cid;
+    context->state = -1;
+    return context;
+}
+
+/**
+ * @brief Fields of a context after the cid in one of the lines of a query
+ */
+typedef bool (*sim_pdp_parse_t)(sim_at_fields_t *fields, simcom_pdp_context_t *context);
+
+/**
+ * @brief Sends a query with one "<prefix>: <cid>,..." line per context and merges the lines
+ * into the list, by cid. Every line is read, up to the final OK, even when the list is full.
+ */
+static simcom_err_t _pdp_query(const char *cmd, const char *prefix, sim_pdp_parse_t parse,
+                               simcom_pdp_context_t *contexts, size_t max, size_t *count)
+{
+    simcom_cmd_result_t result;
+    simcom_err_t err = simcom_cmd_transact(cmd, 9000, &result);
+    if (err == SIM_AT_OK && result.final != SIM_AT_FINAL_OK)
+        err = SIM_AT_ERR_RESPONSE;
     if (err != SIM_AT_OK)
-    {   
-        ESP_LOGE(TAG, "Error with AT+CGACT command: %s", simcom_err_to_str(err));
+    {
+        ESP_LOGE(TAG, "Error with %.*s command: %s", (int)strcspn(cmd, "\r"), cmd, simcom_err_to_str(err));
         return err;
     }
-    
-    // Reads response
-    char resp[SIM_AT_MAX_RESP_LEN];
-    char *data;
-    simcom_responses_err_t resp_err = simcom_read_resp_values(resp, "+CGACT", &data);
-    if (resp_err != SIM_AT_RESPONSE_OK)
+
+    bool full = false;
+    size_t prefix_len = strlen(prefix);
+    simcom_resp_line_t line;
+    while (simcom_get_resp_line(&line))
     {
-        ESP_LOGE(TAG, "Error with AT+CGACT? response: %s", simcom_resp_err_to_str(resp_err));
-        return SIM_AT_ERR_RESPONSE;
+        if (line.type != SIM_AT_LINE_INFO || line.prefix_len != prefix_len ||
+            strncmp(line.text, prefix, prefix_len) != 0)
+            continue;
+
+        int cid;
+        sim_at_fields_t fields;
+        sim_at_fields_init(&fields, line.text + line.value_off);
+        if (!sim_at_fields_int(&fields, &cid))
+        {
+            err = SIM_AT_ERR_RESPONSE;
+            continue;
+        }
+
+        simcom_pdp_context_t *context = _pdp_entry(contexts, max, count, cid);
+        if (context == NULL)
+            full = true;
+        else if (!parse(&fields, context))
+            err = SIM_AT_ERR_RESPONSE;
     }
-    
-    // Parse two integers separated by a comma
-    if (sscanf(data, "%d,%d", cid, state) != 2)
-        return SIM_AT_ERR_RESPONSE;
-    
-    // TODO: En caso que haya muchos contextos de PDP podría haber problemas al leer las respuestas
-    // Ver bien como hacer eso
-    // Capaz controlar hasta que se reciba un OK
-    
-    // Reads OK
-    resp_err = simcom_resp_read_ok(resp);
-    if (resp_err != SIM_AT_RESPONSE_COMMAND_OK)
+
+    if (err == SIM_AT_OK && full)
     {
-        ESP_LOGE(TAG, "Ok response was not received: %s", simcom_resp_err_to_str(resp_err));
-        return SIM_AT_ERR_RESPONSE;
+        ESP_LOGW(TAG, "%.*s listed more than %u contexts", (int)strcspn(cmd, "\r"), cmd, (unsigned)max);
+        err = SIM_AT_ERR_OVERFLOW;
     }
+    return err;
+}
 
-    return SIM_AT_OK; 
+/**
+ * @brief "+CGACT: <cid>,<state>"
+ */
+static bool _pdp_parse_state(sim_at_fields_t *fields, simcom_pdp_context_t *context)
+{
+    return sim_at_fields_int(fields, &context->state);
+}
+
+/**
+ * @brief "+CGDCONT: <cid>,<PDP_type>,<APN>,<PDP_addr>,..."
+ */
+static bool _pdp_parse_definition(sim_at_fields_t *fields, simcom_pdp_context_t *context)
+{
+    char type[8];
+    if (!sim_at_fields_str(fields, type, sizeof(type)) || !sim_at_fields_str(fields, context->apn, sizeof(context->apn)))
+        return false;
+
+    context->pdp_type = PDP_IP;
+    if (strcmp(type, "IPV6") == 0)
+        context->pdp_type = PDP_IPV6;
+    else if (strcmp(type, "IPV4V6") == 0)
+        context->pdp_type = PDP_IPV4V6;
+    return true;
+}
+
+/**
+ * @brief "+CGPADDR: <cid>,<addr_1>[,<addr_2>]", an IPv4V6 context lists both addresses. The
+ * IPv6 address is in dotted decimal format (16 numbers) or in colon format.
+ */
+static bool _pdp_parse_addr(sim_at_fields_t *fields, simcom_pdp_context_t *context)
+{
+    char addr[SIMCOM_PDP_ADDR_LEN];
+    context->ipv4[0] = context->ipv6[0] = '\0';
+    while (sim_at_fields_more(fields))
+    {
+        if (!sim_at_fields_str(fields, addr, sizeof(addr)))
+            return false;
+
+        int dots = 0;
+        for (const char *p = addr; *p != '\0'; p++)
+            dots += (*p == '.');
+        if (strchr(addr, ':') != NULL || dots > 3)
+            strcpy(context->ipv6, addr);
+        else if (addr[0] != '\0')
+            strcpy(context->ipv4, addr);
+    }
+    return true;
+}
+
+simcom_err_t simcom_get_pdp_context_activate(int* cid, int* state)
+{
+    if (cid == NULL || state == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    simcom_pdp_context_t context;
+    size_t count = 0;
+    simcom_err_t err = _pdp_query("AT+CGACT?\r\n", "+CGACT", _pdp_parse_state, &context, 1, &count);
+    if (err == SIM_AT_ERR_OVERFLOW)
+        err = SIM_AT_OK;
+    if (err == SIM_AT_OK && count == 0)
+        err = SIM_AT_ERR_RESPONSE;
+    if (err != SIM_AT_OK)
+        return err;
+
+    *cid = context.cid;
+    *state = context.state;
+    return SIM_AT_OK;
+}
+
+simcom_err_t simcom_get_pdp_context_activate_list(simcom_pdp_context_t *contexts, size_t max, size_t *count)
+{
+    if (contexts == NULL || count == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    *count = 0;
+    return _pdp_query("AT+CGACT?\r\n", "+CGACT", _pdp_parse_state, contexts, max, count);
 }
 
 simcom_err_t simcom_set_pdp_context_activate(int cid, int state)
@@ -184,8 +304,7 @@ simcom_err_t simcom_set_pdp_context_activate(int cid, int state)
     }
     
     // Read OK responss
-    char resp[SIM_AT_MAX_RESP_LEN];
-    simcom_responses_err_t resp_err = simcom_resp_read_ok(resp);
+    simcom_responses_err_t resp_err = simcom_resp_read_ok();
     if (resp_err != SIM_AT_RESPONSE_COMMAND_OK)
     {
         ESP_LOGE(TAG, "Ok response was not received: %s", simcom_resp_err_to_str(resp_err));
@@ -195,42 +314,13 @@ simcom_err_t simcom_set_pdp_context_activate(int cid, int state)
     return SIM_AT_OK; 
 }
 
-simcom_err_t simcom_get_pdp_context(void)
+simcom_err_t simcom_get_pdp_context(simcom_pdp_context_t *contexts, size_t max, size_t *count)
 {
-    // Sends command
-    simcom_err_t err = simcom_cmd_sync("AT+CGDCONT?\r\n", 9000);
-    if (err != SIM_AT_OK)
-    {   
-        ESP_LOGE(TAG, "Error with AT+CGDCONT? command: %s", simcom_err_to_str(err));
-        return err;
-    }
-    
-    // Reads response
-    char resp[SIM_AT_MAX_RESP_LEN];
-    char *data;
-    simcom_responses_err_t resp_err = simcom_read_resp_values(resp, "+CGDCONT", &data);
-    if (resp_err != SIM_AT_RESPONSE_OK)
-    {
-        ESP_LOGE(TAG, "Error with AT+CGDCONT? response: %s", simcom_resp_err_to_str(resp_err));
-        return SIM_AT_ERR_RESPONSE;
-    }
-
-    // Parse values
-    // TODO: Ver si es necesario o útil
-
-    // TODO: En caso que haya muchos contextos de PDP podría haber problemas al leer las respuestas
-    // Ver bien como hacer eso
-    // Capaz controlar hasta que se reciba un OK
-
-    // Reads OK
-    resp_err = simcom_resp_read_ok(resp);
-    if (resp_err != SIM_AT_RESPONSE_COMMAND_OK)
-    {
-        ESP_LOGE(TAG, "Ok response was not received: %s", simcom_resp_err_to_str(resp_err));
-        return SIM_AT_ERR_RESPONSE;
-    }
+    if (contexts == NULL || count == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
 
-    return SIM_AT_OK; 
+    *count = 0;
+    return _pdp_query("AT+CGDCONT?\r\n", "+CGDCONT", _pdp_parse_definition, contexts, max, count);
 }
 
 const char* simcom_pdp_type_to_str(sim_pdp_type_t pdp_type)
@@ -264,8 +354,7 @@ simcom_err_t simcom_set_pdp_context(int cid, sim_pdp_type_t pdp_type, const char
     }
 
     // Read OK responss
-    char resp[SIM_AT_MAX_RESP_LEN];
-    simcom_responses_err_t resp_err = simcom_resp_read_ok(resp);
+    simcom_responses_err_t resp_err = simcom_resp_read_ok();
     if (resp_err != SIM_AT_RESPONSE_COMMAND_OK)
     {
         ESP_LOGE(TAG, "Ok response was not received: %s", simcom_resp_err_to_str(resp_err));
@@ -277,69 +366,180 @@ simcom_err_t simcom_set_pdp_context(int cid, sim_pdp_type_t pdp_type, const char
 
 simcom_err_t simcom_show_pdp_addr(int* cid, char* addr)
 {
-    // Sends command
-    simcom_err_t err = simcom_cmd_sync("AT+CGPADDR\r\n", 9000);
+    if (cid == NULL || addr == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    simcom_pdp_context_t context;
+    size_t count = 0;
+    simcom_err_t err = _pdp_query("AT+CGPADDR\r\n", "+CGPADDR", _pdp_parse_addr, &context, 1, &count);
+    if (err == SIM_AT_ERR_OVERFLOW)
+        err = SIM_AT_OK;
+    if (err == SIM_AT_OK && count == 0)
+        err = SIM_AT_ERR_RESPONSE;
     if (err != SIM_AT_OK)
-    {   
-        ESP_LOGE(TAG, "Error with AT+CGPADDR command: %s", simcom_err_to_str(err));
         return err;
-    }
-    
-    // Reads response
-    char resp[SIM_AT_MAX_RESP_LEN];
-    char *data;
-    simcom_responses_err_t resp_err = simcom_read_resp_values(resp, "+CGPADDR", &data);
-    if (resp_err != SIM_AT_RESPONSE_OK)
+
+    *cid = context.cid;
+    strcpy(addr, context.ipv4[0] != '\0' ? context.ipv4 : context.ipv6);
+    return SIM_AT_OK;
+}
+
+simcom_err_t simcom_show_pdp_addr_list(simcom_pdp_context_t *contexts, size_t max, size_t *count)
+{
+    if (contexts == NULL || count == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    *count = 0;
+    return _pdp_query("AT+CGPADDR\r\n", "+CGPADDR", _pdp_parse_addr, contexts, max, count);
+}
+
+simcom_err_t simcom_get_pdp_contexts(simcom_pdp_context_t *contexts, size_t max, size_t *count)
+{
+    if (contexts == NULL || count == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    // The definitions list every context, the other two only fill them in
+    *count = 0;
+    simcom_err_t err = _pdp_query("AT+CGDCONT?\r\n", "+CGDCONT", _pdp_parse_definition, contexts, max, count);
+    if (err == SIM_AT_OK || err == SIM_AT_ERR_OVERFLOW)
     {
-        ESP_LOGE(TAG, "Error with AT+CGPADDR response: %s", simcom_resp_err_to_str(resp_err));
-        return SIM_AT_ERR_RESPONSE;
+        simcom_err_t overflow = err;
+        err = _pdp_query("AT+CGACT?\r\n", "+CGACT", _pdp_parse_state, contexts, max, count);
+        if (err == SIM_AT_OK || err == SIM_AT_ERR_OVERFLOW)
+            err = _pdp_query("AT+CGPADDR\r\n", "+CGPADDR", _pdp_parse_addr, contexts, max, count);
+        if (err == SIM_AT_OK)
+            err = overflow;
     }
-    
-    // Parse two integers separated by a comma
-    if (sscanf(data, "%d,%s", cid, addr) != 2)
+    return err;
+}
+
+// time the modem takes to send the summary of a ping, after the OK (default 4 echoes)
+#ifndef SIM_PING_RESULT_TIMEOUT_MS
+#define SIM_PING_RESULT_TIMEOUT_MS  60000U
+#endif
+
+/* Asynchronous ping in progress */
+static struct {
+    bool busy;
+    simcom_ping_cb_t cb;
+    void *ctx;
+} s_ping;
+static portMUX_TYPE s_ping_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * @brief Checks the destination of a ping and builds its command
+ */
+static bool _ping_cmd(char *cmd, const char* dest_addr)
+{
+    if (dest_addr == NULL || dest_addr[0] == '\0')
+        return false;
+
+    // Always works with IPv4, altough it could be configured
+    // Use default parameters
+    int n = snprintf(cmd, SIM_AT_MAX_CMD_LEN, "AT+CPING=\"%s\",1\r\n", dest_addr);
+    return (n > 0 && (size_t)n < SIM_AT_MAX_CMD_LEN);
+}
+
+/**
+ * @brief Outcome of AT+CPING from its lines: the OK and the summary after it,
+ * "+CPING: 3,<sent>,<received>,<lost>,<min_rtt>,<max_rtt>,<avg_rtt>"
+ */
+static simcom_err_t _ping_result(const simcom_cmd_result_t *result, simcom_err_t err, simcom_ping_result_t *ping)
+{
+    if (err != SIM_AT_OK && err != SIM_AT_ERR_OVERFLOW)
+        return err;
+    if (result->final != SIM_AT_FINAL_OK)
         return SIM_AT_ERR_RESPONSE;
-    
-    // TODO: En caso que haya muchos contextos de PDP podría haber problemas al leer las respuestas
-    // Ver bien como hacer eso
-    // Capaz controlar hasta que se reciba un OK
 
-    // Read OK responss
-    resp_err = simcom_resp_read_ok(resp);
-    if (resp_err != SIM_AT_RESPONSE_COMMAND_OK)
+    simcom_resp_line_t line;
+    while (simcom_get_resp_line(&line))
     {
-        ESP_LOGE(TAG, "Ok response was not received: %s", simcom_resp_err_to_str(resp_err));
-        return SIM_AT_ERR_RESPONSE;
+        if (line.type != SIM_AT_LINE_INFO)
+            continue;
+
+        int type;
+        sim_at_fields_t fields;
+        sim_at_fields_init(&fields, line.text + line.value_off);
+        if (!sim_at_fields_int(&fields, &type) || type != 3)
+            continue;
+        if (!sim_at_fields_int(&fields, &ping->sent) || !sim_at_fields_int(&fields, &ping->received) ||
+            !sim_at_fields_int(&fields, &ping->lost) || !sim_at_fields_int(&fields, &ping->min_rtt) ||
+            !sim_at_fields_int(&fields, &ping->max_rtt) || !sim_at_fields_int(&fields, &ping->avg_rtt))
+            return SIM_AT_ERR_RESPONSE;
+        return SIM_AT_OK;
     }
-
-    return SIM_AT_OK; 
+    return SIM_AT_ERR_RESPONSE;
 }
 
 simcom_err_t simcom_ping(const char* dest_addr)
 {
     // Command
-    // Always works with IPv4, altough it could be configured
-    // Use default parameters
     char cmd[SIM_AT_MAX_CMD_LEN];
-    snprintf(cmd, SIM_AT_MAX_CMD_LEN, "AT+CPING=\"%s\",1\r\n", dest_addr);
-    
-    // Send command
-    simcom_err_t err = simcom_cmd_sync(cmd, 9000);
+    if (!_ping_cmd(cmd, dest_addr))
+        return SIM_AT_ERR_INVALID_ARG;
+
+    // The echoes and their summary come after the OK, the link is free in between
+    simcom_cmd_step_t step = { .cmd = cmd, .timeout_ms = 9000, .result = "+CPING: 3,",
+                               .result_timeout_ms = SIM_PING_RESULT_TIMEOUT_MS };
+    simcom_cmd_result_t result;
+    simcom_ping_result_t ping;
+    simcom_err_t err = _ping_result(&result, simcom_cmd_step_sync(&step, &result), &ping);
     if (err != SIM_AT_OK)
-    {   
+    {
         ESP_LOGE(TAG, "Error with AT+CPING command: %s", simcom_err_to_str(err));
         return err;
     }
-    
-    // Read OK responss
-    char resp[SIM_AT_MAX_RESP_LEN];
-    simcom_responses_err_t resp_err = simcom_resp_read_ok(resp);
-    if (resp_err != SIM_AT_RESPONSE_COMMAND_OK)
+
+    if (ping.received == 0)
+        ESP_LOGW(TAG, "No ping reply from %s", dest_addr);
+    return SIM_AT_OK; 
+}
+
+static void _ping_cb(const simcom_cmd_result_t *result, void *ctx)
+{
+    simcom_ping_result_t ping = { 0 };
+    simcom_err_t err = _ping_result(result, result->err, &ping);
+    if (err != SIM_AT_OK)
     {
-        ESP_LOGE(TAG, "Ok response was not received: %s", simcom_resp_err_to_str(resp_err));
-        return SIM_AT_ERR_RESPONSE;
+        ESP_LOGE(TAG, "Error with AT+CPING command: %s", simcom_err_to_str(err));
+        ping = (simcom_ping_result_t){ 0 };
     }
 
-    // TODO: Ignora los resultados del ping, solamente verifica el Ok.
+    simcom_ping_cb_t cb = s_ping.cb;
+    void *cb_ctx = s_ping.ctx;
 
-    return SIM_AT_OK; 
+    // The callback can start the next ping
+    portENTER_CRITICAL(&s_ping_mux);
+    s_ping.busy = false;
+    portEXIT_CRITICAL(&s_ping_mux);
+    if (cb)
+        cb(err, &ping, cb_ctx);
+}
+
+simcom_err_t simcom_ping_async(const char* dest_addr, simcom_ping_cb_t cb, void* ctx)
+{
+    char cmd[SIM_AT_MAX_CMD_LEN];
+    if (!_ping_cmd(cmd, dest_addr))
+        return SIM_AT_ERR_INVALID_ARG;
+
+    portENTER_CRITICAL(&s_ping_mux);
+    bool busy = s_ping.busy;
+    s_ping.busy = true;
+    portEXIT_CRITICAL(&s_ping_mux);
+    if (busy)
+        return SIM_AT_ERR_BUSY;
+
+    s_ping.cb = cb;
+    s_ping.ctx = ctx;
+    simcom_cmd_step_t step = { .cmd = cmd, .timeout_ms = 9000, .result = "+CPING: 3,",
+                               .result_timeout_ms = SIM_PING_RESULT_TIMEOUT_MS };
+    simcom_err_t err = simcom_cmd_chain_async(&step, 1, _ping_cb, NULL);
+    if (err != SIM_AT_OK)
+    {
+        ESP_LOGE(TAG, "Error queuing AT+CPING: %s", simcom_err_to_str(err));
+        portENTER_CRITICAL(&s_ping_mux);
+        s_ping.busy = false;
+        portEXIT_CRITICAL(&s_ping_mux);
+    }
+    return err;
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include "simcom.h"
 #include "at/sim_at.h"
+#include "at/sim_at_fields.h"
 
 static const char *TAG = "simcard_at";
 
@@ -14,18 +15,19 @@ simcom_err_t simcom_get_simcard_pin_info(sim_simcard_pin_code_t* code)
     }
     
     // Reads response
-    char resp[SIM_AT_MAX_RESP_LEN];
-    char *data;
-    simcom_responses_err_t resp_err = simcom_read_resp_values(resp, "+CPIN", &data);
+    const char *data;
+    simcom_responses_err_t resp_err = simcom_read_resp_values("+CPIN", &data);
     if (resp_err != SIM_AT_RESPONSE_OK)
     {
         ESP_LOGE(TAG, "Error with AT+CPIN? response: %s", simcom_resp_err_to_str(resp_err));
         return SIM_AT_ERR_RESPONSE;
     }
 
-    // Parse integer
+    // Parse code string (e.g. "SIM PIN")
     char code_str[16];
-    if (sscanf(data, "%s", code_str) != 1)
+    sim_at_fields_t fields;
+    sim_at_fields_init(&fields, data);
+    if (!sim_at_fields_str(&fields, code_str, sizeof(code_str)))
         return SIM_AT_ERR_RESPONSE;
     
     // Parse SIM Card code
@@ -47,7 +49,7 @@ simcom_err_t simcom_get_simcard_pin_info(sim_simcard_pin_code_t* code)
         ESP_LOGE(TAG, "The SIM Card code was not recognized: %s", code_str);
 
     // Read OK responss
-    resp_err = simcom_resp_read_ok(resp);
+    resp_err = simcom_resp_read_ok();
     if (resp_err != SIM_AT_RESPONSE_COMMAND_OK)
     {
         ESP_LOGE(TAG, "Ok response was not received: %s", simcom_resp_err_to_str(resp_err));
@@ -19,8 +19,7 @@ simcom_err_t simcom_sms_new_indications_set(uint8_t mode, uint8_t mt, uint8_t bm
     }
 
     // Read OK responss
-    char resp[SIM_AT_MAX_RESP_LEN];
-    simcom_responses_err_t resp_err = simcom_resp_read_ok(resp);
+    simcom_responses_err_t resp_err = simcom_resp_read_ok();
     if (resp_err != SIM_AT_RESPONSE_COMMAND_OK)
     {
         ESP_LOGE(TAG, "Ok response was not received: %s", simcom_resp_err_to_str(resp_err));
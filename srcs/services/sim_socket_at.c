@@ -0,0 +1,996 @@
+/**
+ * sim_socket_at.c
+ * TCP/UDP sockets of the modem (AT+NETOPEN, AT+CIPOPEN, AT+CIPSEND, AT+CIPRXGET, AT+CIPCLOSE)
+ *
+ * Received data is never read as lines: "+CIPRXGET: 2,<link>,<len>,<rest>" and
+ * "+RECEIVE,<link>,<len>" are data URCs, and the parser copies the <len> bytes after them
+ * straight into the receive ring of the link. In manual mode (AT+CIPRXGET=1, the default) the
+ * modem keeps the data until it is asked for, so a ring is only filled with what it has room
+ * for and nothing is lost while the application is slow.
+ *
+ * Sends are written from the caller buffers on the '>' prompt, in AT+CIPSEND commands of up to
+ * SIM_SOCKET_TX_CHUNK bytes. Up to SIM_SOCKET_TX_DEPTH of them are queued at once: the link is
+ * free for the next one as soon as the modem took the data, while it waits for the
+ * "+CIPSEND: <link>,<len>,<sent>" result.
+ *
+ * In transparent mode (AT+CIPMODE=1) link 0 is a raw byte stream after its CONNECT: the engine
+ * hands the received bytes to the ring without looking for lines, and sends are written as they
+ * are, without AT+CIPSEND. "+++" goes back to command mode with the connection open and ATO
+ * resumes it.
+ */
+
+#include "simcom.h"
+#include "at/sim_at.h"
+#include "at/sim_at_fields.h"
+#include "at/sim_at_line.h"
+#include "at/sim_at_urc.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+static const char *TAG = "socket_at";
+
+/**
+ * -------------------------------------
+ * ----- [ Compile-time tunables ] -----
+ * -------------------------------------
+ */
+
+// link ids 0 to SIM_SOCKET_MAX_LINKS - 1, the modem has 10
+#ifndef SIM_SOCKET_MAX_LINKS
+#define SIM_SOCKET_MAX_LINKS    10U
+#endif
+
+// receive ring of each link
+#ifndef SIM_SOCKET_RX_BUF_LEN
+#define SIM_SOCKET_RX_BUF_LEN   2048U
+#endif
+
+// 1 reads the data on demand (AT+CIPRXGET=1), 0 takes it as the modem pushes it (+RECEIVE)
+// and drops what does not fit in the ring
+#ifndef SIM_SOCKET_RX_MANUAL
+#define SIM_SOCKET_RX_MANUAL    1
+#endif
+
+// largest AT+CIPRXGET=2 read and AT+CIPSEND of the modem
+#ifndef SIM_SOCKET_TX_CHUNK
+#define SIM_SOCKET_TX_CHUNK     1500U
+#endif
+#define SIM_SOCKET_RX_READ_MAX  1500U
+
+// AT+CIPSEND commands queued at once by a send
+#ifndef SIM_SOCKET_TX_DEPTH
+#define SIM_SOCKET_TX_DEPTH     2U
+#endif
+
+// caller buffers a single AT+CIPSEND can take, a chunk ends early on more
+#ifndef SIM_SOCKET_TX_IOV
+#define SIM_SOCKET_TX_IOV       4U
+#endif
+
+// wait for the +CIPOPEN result of a connection
+#ifndef SIM_SOCKET_OPEN_TIMEOUT_MS
+#define SIM_SOCKET_OPEN_TIMEOUT_MS 30000U
+#endif
+
+// wait for the +CIPSEND result, counted from the OK
+#ifndef SIM_SOCKET_SEND_TIMEOUT_MS
+#define SIM_SOCKET_SEND_TIMEOUT_MS 10000U
+#endif
+
+// wait of the parser for room in the ring of a transparent link before dropping data; the
+// modem is held back meanwhile if the UART has flow control
+#ifndef SIM_SOCKET_RX_HOLD_MS
+#define SIM_SOCKET_RX_HOLD_MS   500U
+#endif
+
+// UDP destination host
+#define SIM_SOCKET_HOST_LEN     64U
+
+_Static_assert(SIM_SOCKET_TX_DEPTH >= 1 && SIM_SOCKET_TX_DEPTH <= SIM_AT_MAX_PENDING_COMMANDS,
+               "SIM_SOCKET_TX_DEPTH must be between 1 and SIM_AT_MAX_PENDING_COMMANDS");
+
+/* Link state. The ring is written by the parser task and read by the task of
+ * simcom_socket_recv(); the indexes move under s_sock_mux, the bytes are copied outside. */
+typedef struct {
+    bool open;
+    volatile bool closed;               // closed by the peer or the network
+    volatile bool pending;              // the modem holds data for the link (manual mode)
+    bool udp;
+    bool transparent;                   // opened in transparent mode, data mode after CONNECT
+    size_t closed_held;                 // first bytes of "\r\nCLOSED\r\n" received, not stored yet
+    char host[SIM_SOCKET_HOST_LEN];     // UDP destination
+    uint16_t port;
+    uint8_t ring[SIM_SOCKET_RX_BUF_LEN];
+    size_t head;                        // next byte written
+    size_t count;                       // bytes stored
+    SemaphoreHandle_t rx_ready;         // data, pending data or close
+    SemaphoreHandle_t rx_room;          // bytes taken out of the ring (transparent mode)
+    SemaphoreHandle_t tx_done;          // one per AT+CIPSEND reported
+    simcom_err_t tx_err;                // first failed AT+CIPSEND of the send in progress
+    simcom_iov_t tx_iov[SIM_SOCKET_TX_DEPTH][SIM_SOCKET_TX_IOV];  // data of the queued commands
+    simcom_socket_stats_t stats;
+} sim_socket_t;
+
+static sim_socket_t s_sock[SIM_SOCKET_MAX_LINKS];
+static portMUX_TYPE s_sock_mux = portMUX_INITIALIZER_UNLOCKED;
+static bool s_net_ready = false;        // handlers registered and semaphores created
+static bool s_transparent = false;      // network opened with AT+CIPMODE=1
+
+/* Data URCs of the sockets */
+typedef enum {
+    SIM_SOCKET_URC_RXGET = 0,           // +CIPRXGET: <mode>,<link>[,<len>,<rest>]
+    SIM_SOCKET_URC_RECEIVE,             // +RECEIVE,<link>,<len>
+    SIM_SOCKET_URC_IPCLOSE,             // +IPCLOSE: <link>,<reason>
+    SIM_SOCKET_URC_EVENT,               // +CIPEVENT: NETWORK CLOSED UNEXPECTEDLY
+} sim_socket_urc_t;
+
+static sim_socket_t *s_rx_sock = NULL;  // link of the data being received, parser task only
+
+const char *simcom_socket_err_to_str(sim_socket_err_codes_t err)
+{
+    switch (err)
+    {
+        case SIM_SOCKET_OK:                     return "Operation succeeded";
+        case SIM_SOCKET_ERR_NETWORK:            return "Network failure";
+        case SIM_SOCKET_ERR_NETWORK_NOT_OPENED: return "Network not opened";
+        case SIM_SOCKET_ERR_WRONG_PARAMETER:    return "Wrong parameter";
+        case SIM_SOCKET_ERR_NOT_SUPPORTED:      return "Operation not supported";
+        case SIM_SOCKET_ERR_CREATE:             return "Failed to create socket";
+        case SIM_SOCKET_ERR_BIND:               return "Failed to bind socket";
+        case SIM_SOCKET_ERR_LISTENING:          return "TCP server is already listening";
+        case SIM_SOCKET_ERR_BUSY:               return "Busy";
+        case SIM_SOCKET_ERR_OPENED:             return "Sockets opened";
+        case SIM_SOCKET_ERR_TIMEOUT:            return "Timeout";
+        case SIM_SOCKET_ERR_DNS:                return "DNS parse failed";
+        case SIM_SOCKET_ERR_UNKNOWN:            return "Unknown error";
+        default:                                return "Unknown socket error";
+    }
+}
+
+/**
+ * @brief Link of a call, NULL if out of range or not open
+ */
+static sim_socket_t *_socket_get(int link)
+{
+    if (link < 0 || link >= (int)SIM_SOCKET_MAX_LINKS || !s_sock[link].open)
+        return NULL;
+    return &s_sock[link];
+}
+
+/**
+ * -----------------------------
+ * ----- [ Receive rings ] -----
+ * -----------------------------
+ */
+
+/**
+ * @brief Stores received bytes in the ring, counting what does not fit (parser task)
+ */
+static void _socket_rx_store(sim_socket_t *s, const uint8_t *data, size_t len)
+{
+    portENTER_CRITICAL(&s_sock_mux);
+    size_t head = s->head;
+    size_t room = SIM_SOCKET_RX_BUF_LEN - s->count;
+    portEXIT_CRITICAL(&s_sock_mux);
+
+    size_t n = (len < room) ? len : room;
+    size_t first = SIM_SOCKET_RX_BUF_LEN - head;
+    if (first > n)
+        first = n;
+    memcpy(&s->ring[head], data, first);
+    memcpy(s->ring, data + first, n - first);
+
+    portENTER_CRITICAL(&s_sock_mux);
+    s->head = (head + n) % SIM_SOCKET_RX_BUF_LEN;
+    s->count += n;
+    portEXIT_CRITICAL(&s_sock_mux);
+
+    s->stats.rx_bytes += n;
+    if (n < len)
+    {
+        if (s->stats.rx_dropped == 0)
+            ESP_LOGW(TAG, "Receive ring of link %d full, dropping data", (int)(s - s_sock));
+        s->stats.rx_dropped += len - n;
+    }
+    xSemaphoreGive(s->rx_ready);
+}
+
+/**
+ * @brief Takes bytes out of the ring
+ *
+ * @return Number of bytes copied
+ */
+static size_t _socket_rx_take(sim_socket_t *s, uint8_t *buf, size_t size)
+{
+    portENTER_CRITICAL(&s_sock_mux);
+    size_t count = s->count;
+    size_t tail = (s->head + SIM_SOCKET_RX_BUF_LEN - count) % SIM_SOCKET_RX_BUF_LEN;
+    portEXIT_CRITICAL(&s_sock_mux);
+
+    size_t n = (size < count) ? size : count;
+    size_t first = SIM_SOCKET_RX_BUF_LEN - tail;
+    if (first > n)
+        first = n;
+    memcpy(buf, &s->ring[tail], first);
+    memcpy(buf + first, s->ring, n - first);
+
+    portENTER_CRITICAL(&s_sock_mux);
+    s->count -= n;
+    portEXIT_CRITICAL(&s_sock_mux);
+    return n;
+}
+
+/**
+ * @brief Marks a link closed and wakes up its reader (parser task)
+ */
+static void _socket_rx_closed(sim_socket_t *s)
+{
+    s->closed = true;
+    s->pending = false;
+    xSemaphoreGive(s->rx_ready);
+}
+
+/**
+ * @brief Line handler of the socket data URCs, returns the length of the data that follows
+ */
+static size_t _socket_rx_line(const char *line, size_t len, void *ctx)
+{
+    sim_socket_urc_t urc = (sim_socket_urc_t)(uintptr_t)ctx;
+    s_rx_sock = NULL;
+
+    if (urc == SIM_SOCKET_URC_EVENT)
+    {
+        // Every link is gone with the network
+        if (strstr(line, "NETWORK CLOSED") != NULL)
+        {
+            ESP_LOGW(TAG, "Network closed unexpectedly");
+            for (size_t i = 0; i < SIM_SOCKET_MAX_LINKS; i++)
+                _socket_rx_closed(&s_sock[i]);
+        }
+        return 0;
+    }
+
+    // Values after "+RECEIVE," or "+XXX: "
+    const char *values = line + strcspn(line, ":,");
+    if (*values == '\0')
+        return 0;
+    values++;
+    while (*values == ' ')
+        values++;
+
+    int mode = 2, link, data_len = 0, rest = 0;
+    sim_at_fields_t fields;
+    sim_at_fields_init(&fields, values);
+    if (urc == SIM_SOCKET_URC_RXGET && !sim_at_fields_int(&fields, &mode))
+        return 0;
+    if (!sim_at_fields_int(&fields, &link) || link < 0 || link >= (int)SIM_SOCKET_MAX_LINKS)
+        return 0;
+
+    sim_socket_t *s = &s_sock[link];
+    switch (urc)
+    {
+    case SIM_SOCKET_URC_IPCLOSE:
+        _socket_rx_closed(s);
+        return 0;
+
+    case SIM_SOCKET_URC_RXGET:
+        if (mode == 1)
+        {
+            // Data arrived, it stays in the modem until read
+            s->pending = true;
+            xSemaphoreGive(s->rx_ready);
+            return 0;
+        }
+        if (mode != 2 || !sim_at_fields_int(&fields, &data_len) || !sim_at_fields_int(&fields, &rest))
+            return 0;
+        s->pending = (rest > 0);
+        break;
+
+    default:
+        if (!sim_at_fields_int(&fields, &data_len))
+            return 0;
+        break;
+    }
+
+    // Data is always consumed, even when it has nowhere to go
+    s_rx_sock = s->open ? s : NULL;
+    return (data_len > 0) ? (size_t)data_len : 0;
+}
+
+/**
+ * @brief Data handler of the socket data URCs: received bytes, in order
+ */
+static void _socket_rx_data(const uint8_t *data, size_t len, void *ctx)
+{
+    (void)ctx;
+    if (data == NULL)
+    {
+        // Input lost: the stream has a hole, the reader finds out from rx_dropped
+        if (s_rx_sock != NULL)
+            s_rx_sock->stats.rx_dropped++;
+        s_rx_sock = NULL;
+        return;
+    }
+    // Data of a link that is not open is dropped
+    if (s_rx_sock != NULL)
+        _socket_rx_store(s_rx_sock, data, len);
+}
+
+/**
+ * @brief Registers the data URC handlers and creates the semaphores of the links, once
+ */
+static simcom_err_t _socket_setup(void)
+{
+    static const sim_at_urc_data_handler_t handlers[] = {
+        { _socket_rx_line, _socket_rx_data, (void *)(uintptr_t)SIM_SOCKET_URC_RXGET },
+        { _socket_rx_line, _socket_rx_data, (void *)(uintptr_t)SIM_SOCKET_URC_RECEIVE },
+        { _socket_rx_line, _socket_rx_data, (void *)(uintptr_t)SIM_SOCKET_URC_IPCLOSE },
+        { _socket_rx_line, _socket_rx_data, (void *)(uintptr_t)SIM_SOCKET_URC_EVENT },
+    };
+    static const char *prefixes[] = { "+CIPRXGET", "+RECEIVE", "+IPCLOSE", "+CIPEVENT" };
+
+    if (s_net_ready)
+        return SIM_AT_OK;
+
+    for (size_t i = 0; i < SIM_SOCKET_MAX_LINKS; i++)
+    {
+        if (s_sock[i].rx_ready == NULL)
+            s_sock[i].rx_ready = xSemaphoreCreateBinary();
+        if (s_sock[i].tx_done == NULL)
+            s_sock[i].tx_done = xSemaphoreCreateCounting(SIM_SOCKET_TX_DEPTH, 0);
+        if (s_sock[i].rx_room == NULL)
+            s_sock[i].rx_room = xSemaphoreCreateBinary();
+        if (s_sock[i].rx_ready == NULL || s_sock[i].tx_done == NULL || s_sock[i].rx_room == NULL)
+            return SIM_AT_ERR_NO_MEM;
+    }
+
+    for (size_t i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++)
+    {
+        simcom_err_t err = sim_at_urc_register_data(prefixes[i], &handlers[i]);
+        if (err != SIM_AT_OK)
+        {
+            ESP_LOGE(TAG, "Error registering %s handler: %s", prefixes[i], simcom_err_to_str(err));
+            while (i-- > 0)
+                sim_at_urc_unregister_data(prefixes[i], &handlers[i]);
+            return err;
+        }
+    }
+
+    s_net_ready = true;
+    return SIM_AT_OK;
+}
+
+/**
+ * --------------------------------
+ * ----- [ Transparent mode ] -----
+ * --------------------------------
+ */
+
+static const char SOCKET_CLOSED[] = "\r\nCLOSED\r\n";
+#define SOCKET_CLOSED_LEN (sizeof(SOCKET_CLOSED) - 1)
+
+/**
+ * @brief Stores received bytes of a transparent link, waiting up to SIM_SOCKET_RX_HOLD_MS for
+ * room in the ring; what still does not fit is dropped
+ */
+static void _socket_transparent_store(sim_socket_t *s, const uint8_t *data, size_t n)
+{
+    size_t off = 0;
+    TickType_t start = xTaskGetTickCount();
+    TickType_t hold = pdMS_TO_TICKS(SIM_SOCKET_RX_HOLD_MS);
+    while (off < n)
+    {
+        portENTER_CRITICAL(&s_sock_mux);
+        size_t room = SIM_SOCKET_RX_BUF_LEN - s->count;
+        portEXIT_CRITICAL(&s_sock_mux);
+        if (room == 0)
+        {
+            TickType_t waited = xTaskGetTickCount() - start;
+            if (waited < hold && xSemaphoreTake(s->rx_room, hold - waited) == pdTRUE)
+                continue;
+            break;
+        }
+        size_t part = (n - off < room) ? n - off : room;
+        _socket_rx_store(s, &data[off], part);
+        off += part;
+    }
+    if (off < n)
+        _socket_rx_store(s, &data[off], n - off);   // counted as dropped
+}
+
+/**
+ * @brief Data mode handler of a transparent link (parser task)
+ *
+ * The modem ends the data with "\r\nCLOSED\r\n" when the peer closes, and is back in command
+ * mode. It can arrive split across reads: the bytes that may be its start are held back from
+ * the ring until the next ones tell. It is taken as the close when nothing follows it in the
+ * read or a line does (a URC); followed by anything else it was data.
+ */
+static size_t _socket_transparent_rx(const uint8_t *data, size_t len, bool *end, void *ctx)
+{
+    sim_socket_t *s = (sim_socket_t *)ctx;
+    size_t held = s->closed_held;
+    size_t match = held;
+    size_t stop = len;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        match = sim_at_line_match(SOCKET_CLOSED, SOCKET_CLOSED_LEN, match, data[i]);
+        if (match == SOCKET_CLOSED_LEN &&
+            (i + 1 == len || memchr("\r\n+*", data[i + 1], 4) != NULL))
+        {
+            stop = i + 1;
+            *end = true;
+            break;
+        }
+    }
+
+    // Data: the held bytes and the new ones, up to what may be (or is) the close
+    size_t n = held + stop - match;
+    size_t from_held = (n < held) ? n : held;
+    if (from_held > 0)
+        _socket_transparent_store(s, (const uint8_t *)SOCKET_CLOSED, from_held);
+    if (n > held)
+        _socket_transparent_store(s, data, n - held);
+
+    if (*end)
+    {
+        s->closed_held = 0;
+        _socket_rx_closed(s);
+    }
+    else
+        s->closed_held = match;
+    return stop;
+}
+
+/**
+ * @brief Sends a command answered by CONNECT (AT+CIPOPEN, ATO): link 0 is in data mode after it
+ */
+static simcom_err_t _socket_connect(sim_socket_t *s, const char *cmd)
+{
+    simcom_cmd_result_t res;
+    simcom_err_t err = simcom_cmd_connect(cmd, SIM_SOCKET_OPEN_TIMEOUT_MS, _socket_transparent_rx, s, &res);
+    if (err == SIM_AT_OK && res.final != SIM_AT_FINAL_CONNECT)
+        err = SIM_AT_ERR_RESPONSE;
+    return err;
+}
+
+/**
+ * @brief Writes the buffers of a send to a transparent link, as they are
+ */
+static simcom_err_t _socket_transparent_send(sim_socket_t *s, const simcom_iov_t *iov, size_t iov_count)
+{
+    for (size_t i = 0; i < iov_count; i++)
+    {
+        simcom_err_t err = simcom_data_mode_write(iov[i].base, iov[i].len);
+        if (err != SIM_AT_OK)
+        {
+            ESP_LOGE(TAG, "Error sending on link %d: %s", (int)(s - s_sock), simcom_err_to_str(err));
+            return err;
+        }
+        s->stats.tx_bytes += (uint32_t)iov[i].len;
+    }
+    s->stats.sends++;
+    return SIM_AT_OK;
+}
+
+simcom_err_t simcom_socket_escape(int link, uint32_t guard_ms)
+{
+    sim_socket_t *s = _socket_get(link);
+    if (s == NULL || !s->transparent)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    simcom_err_t err = simcom_data_mode_escape(guard_ms);
+    if (err != SIM_AT_OK)
+    {
+        ESP_LOGE(TAG, "Error leaving data mode of link %d: %s", link, simcom_err_to_str(err));
+        return err;
+    }
+
+    // Bytes held back as a possible close were data after all
+    if (s->closed_held > 0)
+    {
+        _socket_rx_store(s, (const uint8_t *)SOCKET_CLOSED, s->closed_held);
+        s->closed_held = 0;
+    }
+    return SIM_AT_OK;
+}
+
+simcom_err_t simcom_socket_resume(int link)
+{
+    sim_socket_t *s = _socket_get(link);
+    if (s == NULL || !s->transparent)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (s->closed)
+        return SIM_AT_ERR_RESPONSE;
+    if (simcom_data_mode_active())
+        return SIM_AT_OK;
+
+    simcom_err_t err = _socket_connect(s, "ATO\r\n");
+    if (err != SIM_AT_OK)
+        ESP_LOGE(TAG, "Error resuming link %d: %s", link, simcom_err_to_str(err));
+    return err;
+}
+
+/**
+ * -------------------------------
+ * ----- [ Network / links ] -----
+ * -------------------------------
+ */
+
+/**
+ * @brief Reads the "+<name>: [<link>,]<err>" line of the command being reported
+ *
+ * @param name Command name with '+' (e.g. "+CIPOPEN")
+ * @param with_link The line starts with the link id
+ *
+ * @return Error code of the line, -1 if there is none
+ */
+static int _socket_line_err(const char *name, bool with_link)
+{
+    size_t name_len = strlen(name);
+    simcom_resp_line_t line;
+    while (simcom_get_resp_line(&line))
+    {
+        if (line.type != SIM_AT_LINE_INFO || line.prefix_len != name_len || strncmp(line.text, name, name_len) != 0)
+            continue;
+
+        int link, err_code;
+        sim_at_fields_t fields;
+        sim_at_fields_init(&fields, line.text + line.value_off);
+        if ((!with_link || sim_at_fields_int(&fields, &link)) && sim_at_fields_int(&fields, &err_code))
+            return err_code;
+    }
+    return -1;
+}
+
+/**
+ * @brief Sends a command completed by its "+<name>: [<link>,]<err>" result line and waits for it
+ *
+ * @param name Command name with '+' (e.g. "+CIPOPEN")
+ * @param link Link id, -1 for the network commands
+ * @param cmd Command
+ * @param result_ms Timeout of the result line, counted from the OK
+ * @param sock_err Error code reported by the modem, -1 if none (may be NULL)
+ */
+static simcom_err_t _socket_cmd_sync(const char *name, int link, const char *cmd, uint32_t result_ms, int *sock_err)
+{
+    char result[24];
+    if (link >= 0)
+        snprintf(result, sizeof(result), "%s: %d,", name, link);
+    else
+        snprintf(result, sizeof(result), "%s: ", name);
+
+    simcom_cmd_step_t step = { .cmd = cmd, .timeout_ms = 5000, .result = result, .result_timeout_ms = result_ms };
+    simcom_cmd_result_t res;
+    simcom_err_t err = simcom_cmd_step_sync(&step, &res);
+
+    int code = -1;
+    if (err == SIM_AT_OK || err == SIM_AT_ERR_OVERFLOW)
+    {
+        code = _socket_line_err(name, link >= 0);
+        err = (res.final == SIM_AT_FINAL_OK && code == SIM_SOCKET_OK) ? SIM_AT_OK : SIM_AT_ERR_RESPONSE;
+    }
+    if (sock_err != NULL)
+        *sock_err = code;
+    return err;
+}
+
+/**
+ * @brief Selects the application mode and starts the socket service
+ *
+ * @param transparent AT+CIPMODE=1: link 0 carries raw data after its CONNECT
+ */
+static simcom_err_t _net_open(bool transparent)
+{
+    simcom_err_t err = _socket_setup();
+    if (err != SIM_AT_OK)
+        return err;
+
+    // The mode is only taken before AT+NETOPEN, with the network open it stays as it is
+    err = simcom_cmd_sync(transparent ? "AT+CIPMODE=1\r\n" : "AT+CIPMODE=0\r\n", 5000);
+    if (err == SIM_AT_OK && simcom_resp_read_ok() != SIM_AT_RESPONSE_COMMAND_OK)
+        err = SIM_AT_ERR_RESPONSE;
+    if (err != SIM_AT_OK)
+        ESP_LOGW(TAG, "Error with AT+CIPMODE: %s", simcom_err_to_str(err));
+    s_transparent = transparent;
+
+    // Data is read on demand: the modem buffers it instead of pushing it
+    if (!transparent)
+    {
+        err = simcom_cmd_sync(SIM_SOCKET_RX_MANUAL ? "AT+CIPRXGET=1\r\n" : "AT+CIPRXGET=0\r\n", 5000);
+        if (err == SIM_AT_OK && simcom_resp_read_ok() != SIM_AT_RESPONSE_COMMAND_OK)
+            err = SIM_AT_ERR_RESPONSE;
+        if (err != SIM_AT_OK)
+        {
+            ESP_LOGE(TAG, "Error with AT+CIPRXGET: %s", simcom_err_to_str(err));
+            return err;
+        }
+    }
+
+    int sock_err;
+    err = _socket_cmd_sync("+NETOPEN", -1, "AT+NETOPEN\r\n", SIM_SOCKET_OPEN_TIMEOUT_MS, &sock_err);
+    if (err == SIM_AT_ERR_RESPONSE && sock_err == -1)
+    {
+        // "+IP ERROR: Network is already opened" and ERROR
+        simcom_cmd_result_t res;
+        if (simcom_cmd_transact("AT+NETOPEN?\r\n", 5000, &res) == SIM_AT_OK && res.final == SIM_AT_FINAL_OK)
+        {
+            const char *data;
+            int state;
+            sim_at_fields_t fields;
+            if (simcom_read_resp_values("+NETOPEN", &data) == SIM_AT_RESPONSE_OK)
+            {
+                sim_at_fields_init(&fields, data);
+                if (sim_at_fields_int(&fields, &state) && state == 1)
+                {
+                    ESP_LOGD(TAG, "Network already opened");
+                    return SIM_AT_OK;
+                }
+            }
+        }
+    }
+    if (err != SIM_AT_OK)
+        ESP_LOGE(TAG, "Error with AT+NETOPEN: %s (%s)", simcom_err_to_str(err), simcom_socket_err_to_str(sock_err));
+    return err;
+}
+
+simcom_err_t simcom_net_open(void)
+{
+    return _net_open(false);
+}
+
+simcom_err_t simcom_net_open_transparent(void)
+{
+    return _net_open(true);
+}
+
+simcom_err_t simcom_net_close(void)
+{
+    int sock_err;
+    simcom_err_t err = _socket_cmd_sync("+NETCLOSE", -1, "AT+NETCLOSE\r\n", SIM_SOCKET_OPEN_TIMEOUT_MS, &sock_err);
+
+    // Every link goes with the network, also when it was already closed
+    for (size_t i = 0; i < SIM_SOCKET_MAX_LINKS; i++)
+    {
+        s_sock[i].open = false;
+        if (s_sock[i].rx_ready)
+            xSemaphoreGive(s_sock[i].rx_ready);
+    }
+
+    if (err != SIM_AT_OK)
+        ESP_LOGE(TAG, "Error with AT+NETCLOSE: %s (%s)", simcom_err_to_str(err), simcom_socket_err_to_str(sock_err));
+    return err;
+}
+
+simcom_err_t simcom_socket_open(int link, simcom_socket_type_t type, const char *host, uint16_t port, uint16_t local_port)
+{
+    if (link < 0 || link >= (int)SIM_SOCKET_MAX_LINKS || host == NULL || port == 0)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (type != SIMCOM_SOCKET_TCP && type != SIMCOM_SOCKET_UDP)
+        return SIM_AT_ERR_INVALID_ARG;
+    size_t host_len = strlen(host);
+    if (host_len == 0 || host_len >= SIM_SOCKET_HOST_LEN)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (!s_net_ready)
+        return SIM_AT_ERR_NOT_INIT;
+    // The modem has a single transparent link, TCP on link 0
+    if (s_transparent && (link != 0 || type != SIMCOM_SOCKET_TCP))
+        return SIM_AT_ERR_INVALID_ARG;
+
+    sim_socket_t *s = &s_sock[link];
+    if (s->open)
+        return SIM_AT_ERR_BUSY;
+
+    // Fresh state, what was left of a previous connection is gone
+    portENTER_CRITICAL(&s_sock_mux);
+    s->head = 0;
+    s->count = 0;
+    portEXIT_CRITICAL(&s_sock_mux);
+    s->closed = false;
+    s->pending = false;
+    s->udp = (type == SIMCOM_SOCKET_UDP);
+    s->transparent = s_transparent;
+    s->closed_held = 0;
+    memcpy(s->host, host, host_len + 1);
+    xSemaphoreTake(s->rx_room, 0);
+    s->port = port;
+    memset(&s->stats, 0, sizeof(s->stats));
+    xSemaphoreTake(s->rx_ready, 0);
+
+    // UDP takes the local port, the destination goes with each send
+    char cmd[SIM_AT_MAX_CMD_LEN];
+    if (s->udp)
+        snprintf(cmd, sizeof(cmd), "AT+CIPOPEN=%d,\"UDP\",,,%u\r\n", link, (unsigned)local_port);
+    else
+        snprintf(cmd, sizeof(cmd), "AT+CIPOPEN=%d,\"TCP\",\"%s\",%u\r\n", link, host, (unsigned)port);
+
+    // Open from here on, data can arrive before the result line
+    s->open = true;
+    int sock_err = -1;
+    simcom_err_t err = s->transparent ? _socket_connect(s, cmd) :
+                       _socket_cmd_sync("+CIPOPEN", link, cmd, SIM_SOCKET_OPEN_TIMEOUT_MS, &sock_err);
+    if (err != SIM_AT_OK)
+    {
+        s->open = false;
+        ESP_LOGE(TAG, "Error opening link %d: %s (%s)", link, simcom_err_to_str(err), simcom_socket_err_to_str(sock_err));
+    }
+    return err;
+}
+
+simcom_err_t simcom_socket_close(int link)
+{
+    sim_socket_t *s = _socket_get(link);
+    if (s == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    // AT+CIPCLOSE is a command: leave data mode first
+    if (s->transparent)
+    {
+        simcom_err_t err = simcom_data_mode_escape(0);
+        if (err != SIM_AT_OK)
+        {
+            ESP_LOGE(TAG, "Error leaving data mode of link %d: %s", link, simcom_err_to_str(err));
+            return err;
+        }
+    }
+
+    char cmd[SIM_AT_MAX_CMD_LEN];
+    snprintf(cmd, sizeof(cmd), "AT+CIPCLOSE=%d\r\n", link);
+    int sock_err;
+    simcom_err_t err = _socket_cmd_sync("+CIPCLOSE", link, cmd, SIM_SOCKET_SEND_TIMEOUT_MS, &sock_err);
+
+    // A link the peer closed is refused by the modem, it is closed all the same
+    if (err == SIM_AT_ERR_RESPONSE && s->closed)
+        err = SIM_AT_OK;
+    s->open = false;
+    xSemaphoreGive(s->rx_ready);
+
+    if (err != SIM_AT_OK)
+        ESP_LOGE(TAG, "Error closing link %d: %s (%s)", link, simcom_err_to_str(err), simcom_socket_err_to_str(sock_err));
+    return err;
+}
+
+/**
+ * -----------------------
+ * ----- [ Sending ] -----
+ * -----------------------
+ */
+
+/**
+ * @brief Outcome of an AT+CIPSEND from its "+CIPSEND: <link>,<len>,<sent>" result, <sent> is
+ * -1 once the link is gone
+ *
+ * @param s Link
+ * @param result Command outcome
+ * @param err Error of the command
+ */
+static simcom_err_t _socket_tx_result(sim_socket_t *s, const simcom_cmd_result_t *result, simcom_err_t err)
+{
+    if (err != SIM_AT_OK && err != SIM_AT_ERR_OVERFLOW)
+        return err;
+    if (result->final != SIM_AT_FINAL_OK)
+        return SIM_AT_ERR_RESPONSE;
+
+    simcom_resp_line_t line;
+    while (simcom_get_resp_line(&line))
+    {
+        if (line.type != SIM_AT_LINE_INFO || line.prefix_len != 8 || strncmp(line.text, "+CIPSEND", 8) != 0)
+            continue;
+
+        int link, req, sent;
+        sim_at_fields_t fields;
+        sim_at_fields_init(&fields, line.text + line.value_off);
+        if (!sim_at_fields_int(&fields, &link) || !sim_at_fields_int(&fields, &req) ||
+            !sim_at_fields_int(&fields, &sent) || sent != req)
+            return SIM_AT_ERR_RESPONSE;
+
+        s->stats.tx_bytes += (uint32_t)sent;
+        return SIM_AT_OK;
+    }
+    return SIM_AT_ERR_RESPONSE;
+}
+
+/**
+ * @brief Completion of a queued AT+CIPSEND. The commands of a send complete in order.
+ */
+static void _socket_tx_cb(const simcom_cmd_result_t *result, void *ctx)
+{
+    sim_socket_t *s = (sim_socket_t *)ctx;
+
+    simcom_err_t err = _socket_tx_result(s, result, result->err);
+    if (err != SIM_AT_OK && s->tx_err == SIM_AT_OK)
+        s->tx_err = err;
+    xSemaphoreGive(s->tx_done);
+}
+
+simcom_err_t simcom_socket_sendv(int link, const simcom_iov_t *iov, size_t iov_count)
+{
+    sim_socket_t *s = _socket_get(link);
+    if (s == NULL || (iov == NULL && iov_count > 0))
+        return SIM_AT_ERR_INVALID_ARG;
+    if (s->closed)
+        return SIM_AT_ERR_RESPONSE;
+    if (s->transparent)
+        return _socket_transparent_send(s, iov, iov_count);
+
+    char result[16];
+    snprintf(result, sizeof(result), "+CIPSEND: %d,", link);
+
+    s->tx_err = SIM_AT_OK;
+    size_t idx = 0, off = 0;
+    uint32_t queued = 0, done = 0;
+    simcom_err_t err = SIM_AT_OK;
+
+    while (err == SIM_AT_OK)
+    {
+        // The buffer list of a command is reused once the command SIM_SOCKET_TX_DEPTH before reported
+        if (queued - done == SIM_SOCKET_TX_DEPTH)
+        {
+            xSemaphoreTake(s->tx_done, portMAX_DELAY);
+            done++;
+            err = s->tx_err;
+            continue;
+        }
+
+        // Next chunk: up to SIM_SOCKET_TX_CHUNK bytes of at most SIM_SOCKET_TX_IOV buffers
+        simcom_iov_t *chunk = s->tx_iov[queued % SIM_SOCKET_TX_DEPTH];
+        size_t pieces = 0, len = 0, next_idx = idx, next_off = off;
+        while (next_idx < iov_count && pieces < SIM_SOCKET_TX_IOV && len < SIM_SOCKET_TX_CHUNK)
+        {
+            size_t n = iov[next_idx].len - next_off;
+            if (n > SIM_SOCKET_TX_CHUNK - len)
+                n = SIM_SOCKET_TX_CHUNK - len;
+            if (n > 0)
+            {
+                chunk[pieces].base = (const uint8_t *)iov[next_idx].base + next_off;
+                chunk[pieces].len = n;
+                pieces++;
+                len += n;
+                next_off += n;
+            }
+            if (next_off == iov[next_idx].len)
+            {
+                next_idx++;
+                next_off = 0;
+            }
+        }
+        if (len == 0)
+            break;
+
+        char cmd[SIM_AT_MAX_CMD_LEN];
+        if (s->udp)
+            snprintf(cmd, sizeof(cmd), "AT+CIPSEND=%d,%u,\"%s\",%u\r\n", link, (unsigned)len, s->host, (unsigned)s->port);
+        else
+            snprintf(cmd, sizeof(cmd), "AT+CIPSEND=%d,%u\r\n", link, (unsigned)len);
+        simcom_cmd_step_t step = { .cmd = cmd, .timeout_ms = 5000, .data = chunk, .data_count = pieces,
+                                   .result = result, .result_timeout_ms = SIM_SOCKET_SEND_TIMEOUT_MS };
+
+        simcom_err_t qerr = simcom_cmd_chain_async(&step, 1, _socket_tx_cb, s);
+        if (qerr == SIM_AT_ERR_BUSY && queued > done)
+        {
+            // No free slot: wait for the oldest command and build the chunk again
+            xSemaphoreTake(s->tx_done, portMAX_DELAY);
+            done++;
+            err = s->tx_err;
+            continue;
+        }
+        if (qerr == SIM_AT_ERR_BUSY)
+        {
+            // Nothing in flight: wait for a slot like any synchronous command
+            simcom_cmd_result_t res;
+            qerr = _socket_tx_result(s, &res, simcom_cmd_step_sync(&step, &res));
+        }
+        else if (qerr == SIM_AT_OK)
+        {
+            queued++;
+        }
+
+        err = qerr;
+        if (err == SIM_AT_OK)
+        {
+            s->stats.sends++;
+            idx = next_idx;
+            off = next_off;
+        }
+    }
+
+    // The buffers are in use until every queued command reported
+    while (done < queued)
+    {
+        xSemaphoreTake(s->tx_done, portMAX_DELAY);
+        done++;
+    }
+    if (err == SIM_AT_OK)
+        err = s->tx_err;
+
+    if (err != SIM_AT_OK)
+        ESP_LOGE(TAG, "Error sending on link %d: %s", link, simcom_err_to_str(err));
+    return err;
+}
+
+simcom_err_t simcom_socket_send(int link, const void *data, size_t len)
+{
+    simcom_iov_t iov = { .base = data, .len = len };
+    return simcom_socket_sendv(link, &iov, 1);
+}
+
+/**
+ * -------------------------
+ * ----- [ Receiving ] -----
+ * -------------------------
+ */
+
+/**
+ * @brief Asks the modem for the data it holds for a link, as much as the ring has room for
+ */
+static simcom_err_t _socket_rx_read(int link, sim_socket_t *s)
+{
+    portENTER_CRITICAL(&s_sock_mux);
+    size_t room = SIM_SOCKET_RX_BUF_LEN - s->count;
+    portEXIT_CRITICAL(&s_sock_mux);
+    if (room > SIM_SOCKET_RX_READ_MAX)
+        room = SIM_SOCKET_RX_READ_MAX;
+    if (room == 0)
+        return SIM_AT_OK;
+
+    // "+CIPRXGET: 2,<link>,<len>,<rest>" and the data go to the ring through the data handler
+    char cmd[SIM_AT_MAX_CMD_LEN];
+    snprintf(cmd, sizeof(cmd), "AT+CIPRXGET=2,%d,%u\r\n", link, (unsigned)room);
+    s->stats.reads++;
+    simcom_cmd_result_t res;
+    simcom_err_t err = simcom_cmd_transact(cmd, 5000, &res);
+    if (err == SIM_AT_OK && res.final != SIM_AT_FINAL_OK)
+    {
+        // Nothing left to read (e.g. the link was closed meanwhile)
+        s->pending = false;
+    }
+    return err;
+}
+
+simcom_err_t simcom_socket_recv(int link, void *buf, size_t size, size_t *len, uint32_t timeout_ms)
+{
+    sim_socket_t *s = _socket_get(link);
+    if (s == NULL || buf == NULL || size == 0 || len == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    *len = 0;
+    TickType_t start = xTaskGetTickCount();
+    TickType_t wait = pdMS_TO_TICKS(timeout_ms);
+
+    while (1)
+    {
+        *len = _socket_rx_take(s, (uint8_t *)buf, size);
+        if (*len > 0)
+        {
+            // The parser may be waiting for room
+            if (s->transparent)
+                xSemaphoreGive(s->rx_room);
+            return SIM_AT_OK;
+        }
+
+        if (s->pending)
+        {
+            simcom_err_t err = _socket_rx_read(link, s);
+            if (err != SIM_AT_OK)
+                return err;
+            continue;
+        }
+        if (s->closed || !s->open)
+            return SIM_AT_OK;   // end of the stream
+
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if (elapsed >= wait || xSemaphoreTake(s->rx_ready, wait - elapsed) != pdTRUE)
+            return SIMCOM_ERR_TIMEOUT;
+    }
+}
+
+simcom_err_t simcom_socket_stats(int link, simcom_socket_stats_t *stats)
+{
+    if (link < 0 || link >= (int)SIM_SOCKET_MAX_LINKS || stats == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+    *stats = s_sock[link].stats;
+    return SIM_AT_OK;
+}
+
+/* End of file */
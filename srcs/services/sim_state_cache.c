@@ -0,0 +1,318 @@
+/**
+ * sim_state_cache.c
+ * Modem state kept in memory: signal quality, registrations, attach and functionality
+ *
+ * The query functions store what they read here. Once started, the modem reports every
+ * change with a URC (+CSQ, +CREG, +CEREG, +CGEV), so the values stay current and a status
+ * poll costs no command. A reset of the modem or a dropped URC leaves the values behind the
+ * modem; from then on they have an age and the _cached() queries go to the modem when the
+ * caller asks for something fresher.
+ */
+
+#include "simcom.h"
+#include "at/sim_at.h"
+#include "at/sim_at_fields.h"
+#include "services/sim_state_cache.h"
+#include "freertos/task.h"
+
+static const char *TAG = "state_cache";
+
+typedef struct {
+    int value;
+    int value2;
+    TickType_t stamp;           // when it was read
+    bool known;
+} sim_state_entry_t;
+
+static sim_state_entry_t s_state[SIMCOM_STATE_ITEMS];
+static bool s_state_started;
+static bool s_state_tracked;    // the URCs keep the values current
+static uint32_t s_state_dropped;    // simcom_urc_dropped() when the tracking started
+static portMUX_TYPE s_state_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// URCs followed, all handled by _state_urc()
+static const char *const s_state_urcs[] = { "*ATREADY", "+CSQ", "+CREG", "+CEREG", "+CGEV" };
+#define SIM_STATE_URCS  (sizeof(s_state_urcs) / sizeof(s_state_urcs[0]))
+
+void sim_state_update(simcom_state_item_t item, int value, int value2)
+{
+    if (item >= SIMCOM_STATE_ITEMS)
+        return;
+
+    portENTER_CRITICAL(&s_state_mux);
+    s_state[item].value = value;
+    s_state[item].value2 = value2;
+    s_state[item].stamp = xTaskGetTickCount();
+    s_state[item].known = true;
+    portEXIT_CRITICAL(&s_state_mux);
+}
+
+/**
+ * @brief Age of an entry, with the lock taken
+ */
+static uint32_t _state_age(simcom_state_item_t item, TickType_t now)
+{
+    if (!s_state[item].known)
+        return UINT32_MAX;
+
+    // A dropped URC may have been any of them
+    if (s_state_tracked && simcom_urc_dropped() != s_state_dropped)
+    {
+        ESP_LOGW(TAG, "URCs dropped, the cached state is no longer current");
+        s_state_tracked = false;
+    }
+    if (s_state_tracked)
+        return 0;
+
+    uint64_t age = (uint64_t)(now - s_state[item].stamp) * portTICK_PERIOD_MS;
+    return age >= UINT32_MAX ? UINT32_MAX - 1 : (uint32_t)age;
+}
+
+/**
+ * @brief Copies an entry if it is not older than max_age_ms
+ */
+static bool _state_fresh(simcom_state_item_t item, uint32_t max_age_ms, int *value, int *value2)
+{
+    bool fresh;
+
+    portENTER_CRITICAL(&s_state_mux);
+    fresh = _state_age(item, xTaskGetTickCount()) <= max_age_ms;
+    if (fresh)
+    {
+        *value = s_state[item].value;
+        if (value2 != NULL)
+            *value2 = s_state[item].value2;
+    }
+    portEXIT_CRITICAL(&s_state_mux);
+
+    return fresh;
+}
+
+/**
+ * @brief "*ATREADY: 1", "+CSQ: <rssi>,<ber>", "+CREG: <stat>", "+CEREG: <stat>[,...]" and
+ * "+CGEV: <event>" URCs
+ */
+static void _state_urc(const char *line, size_t len, void *ctx)
+{
+    if (line[0] == '*')
+    {
+        // The modem starts over with its defaults and the reports disabled
+        portENTER_CRITICAL(&s_state_mux);
+        for (int i = 0; i < SIMCOM_STATE_ITEMS; i++)
+            s_state[i].known = false;
+        s_state_tracked = false;
+        portEXIT_CRITICAL(&s_state_mux);
+        ESP_LOGW(TAG, "Modem reset, call simcom_state_cache_start() again");
+        return;
+    }
+
+    const char *values = strchr(line, ':');
+    if (values == NULL)
+        return;
+    values++;
+
+    if (strncmp(line, "+CGEV", 5) == 0)
+    {
+        // "NW DETACH", "ME DETACH", "ME PDN ACT 1"... a PDN active implies the attach
+        if (strstr(values, "DETACH") != NULL)
+            sim_state_update(SIMCOM_STATE_CGATT, 0, 0);
+        else if (strstr(values, "PDN ACT") != NULL)
+            sim_state_update(SIMCOM_STATE_CGATT, 1, 0);
+        return;
+    }
+
+    int v1, v2 = 0;
+    sim_at_fields_t fields;
+    sim_at_fields_init(&fields, values);
+    if (!sim_at_fields_int(&fields, &v1))
+        return;
+
+    if (strncmp(line, "+CSQ", 4) == 0)
+    {
+        if (sim_at_fields_int(&fields, &v2))
+            sim_state_update(SIMCOM_STATE_CSQ, v1, v2);
+    }
+    else if (strncmp(line, "+CREG", 5) == 0)
+    {
+        sim_state_update(SIMCOM_STATE_CREG, v1, 0);
+    }
+    else if (strncmp(line, "+CEREG", 6) == 0)
+    {
+        sim_state_update(SIMCOM_STATE_CEREG, v1, 0);
+
+        // On LTE the EPS registration is the packet domain attach
+        if (v1 == EPS_REGISTERED || v1 == EPS_ROAMING)
+            sim_state_update(SIMCOM_STATE_CGATT, 1, 0);
+        else if (v1 == EPS_NOT_REGISTERED || v1 == EPS_REGISTRATION_DENIED)
+            sim_state_update(SIMCOM_STATE_CGATT, 0, 0);
+    }
+}
+
+static void _state_unregister(size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        simcom_urc_unregister(s_state_urcs[i], _state_urc, NULL);
+}
+
+/**
+ * @brief Sends a command that ends with OK
+ */
+static simcom_err_t _state_cmd(const char *cmd)
+{
+    simcom_cmd_result_t result;
+    simcom_err_t err = simcom_cmd_transact(cmd, 9000, &result);
+    if (err == SIM_AT_OK && result.final != SIM_AT_FINAL_OK)
+        err = SIM_AT_ERR_RESPONSE;
+    if (err != SIM_AT_OK)
+        ESP_LOGE(TAG, "Error with %.*s command: %s", (int)strcspn(cmd, "\r"), cmd, simcom_err_to_str(err));
+    return err;
+}
+
+simcom_err_t simcom_state_cache_start(void)
+{
+    simcom_err_t err = SIM_AT_OK;
+
+    if (!s_state_started)
+    {
+        size_t i;
+        for (i = 0; i < SIM_STATE_URCS && err == SIM_AT_OK; i++)
+            err = simcom_urc_register(s_state_urcs[i], _state_urc, NULL);
+        if (err != SIM_AT_OK)
+        {
+            _state_unregister(i - 1);
+            return err;
+        }
+    }
+
+    // Reports of every change. AT+AUTOCSQ=1,1 reports +CSQ when the RSSI changes.
+    static const char *const enable[] = {
+        "AT+CREG=1\r\n", "AT+CEREG=1\r\n", "AT+CGEREP=2\r\n", "AT+AUTOCSQ=1,1\r\n",
+    };
+    for (size_t i = 0; i < sizeof(enable) / sizeof(enable[0]) && err == SIM_AT_OK; i++)
+        err = _state_cmd(enable[i]);
+
+    if (err == SIM_AT_OK)
+    {
+        portENTER_CRITICAL(&s_state_mux);
+        s_state_dropped = simcom_urc_dropped();
+        s_state_tracked = true;
+        portEXIT_CRITICAL(&s_state_mux);
+
+        // Changes are reported from now on, read the values they start from
+        int rssi, ber, attached;
+        sim_network_registration_stat_t creg;
+        sim_eps_network_registration_stat_t cereg;
+        sim_status_control_fun_t fun;
+        err = simcom_query_signal_quality(&rssi, &ber);
+        if (err == SIM_AT_OK)
+            err = simcom_net_reg(&creg);
+        if (err == SIM_AT_OK)
+            err = simcom_eps_net_reg(&cereg);
+        if (err == SIM_AT_OK)
+            err = simcom_get_packet_domain_attach(&attached);
+        if (err == SIM_AT_OK)
+            err = simcom_get_phone_func(&fun);
+    }
+
+    if (err != SIM_AT_OK)
+    {
+        portENTER_CRITICAL(&s_state_mux);
+        s_state_tracked = false;
+        portEXIT_CRITICAL(&s_state_mux);
+        _state_unregister(SIM_STATE_URCS);
+        s_state_started = false;
+        return err;
+    }
+
+    s_state_started = true;
+    return SIM_AT_OK;
+}
+
+simcom_err_t simcom_state_cache_stop(void)
+{
+    if (!s_state_started)
+        return SIM_AT_OK;
+
+    portENTER_CRITICAL(&s_state_mux);
+    s_state_tracked = false;
+    portEXIT_CRITICAL(&s_state_mux);
+    _state_unregister(SIM_STATE_URCS);
+    s_state_started = false;
+
+    static const char *const disable[] = {
+        "AT+AUTOCSQ=0,0\r\n", "AT+CGEREP=0\r\n", "AT+CEREG=0\r\n", "AT+CREG=0\r\n",
+    };
+    simcom_err_t err = SIM_AT_OK;
+    for (size_t i = 0; i < sizeof(disable) / sizeof(disable[0]) && err == SIM_AT_OK; i++)
+        err = _state_cmd(disable[i]);
+    return err;
+}
+
+void simcom_state_cache_get(simcom_state_t *state)
+{
+    if (state == NULL)
+        return;
+
+    portENTER_CRITICAL(&s_state_mux);
+    TickType_t now = xTaskGetTickCount();
+    state->rssi = s_state[SIMCOM_STATE_CSQ].value;
+    state->ber = s_state[SIMCOM_STATE_CSQ].value2;
+    state->creg = s_state[SIMCOM_STATE_CREG].value;
+    state->cereg = s_state[SIMCOM_STATE_CEREG].value;
+    state->attached = s_state[SIMCOM_STATE_CGATT].value;
+    state->fun = s_state[SIMCOM_STATE_CFUN].value;
+    for (int i = 0; i < SIMCOM_STATE_ITEMS; i++)
+        state->age_ms[i] = _state_age(i, now);
+    portEXIT_CRITICAL(&s_state_mux);
+}
+
+simcom_err_t simcom_query_signal_quality_cached(int* rssi, int* ber, uint32_t max_age_ms)
+{
+    if (rssi == NULL || ber == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (_state_fresh(SIMCOM_STATE_CSQ, max_age_ms, rssi, ber))
+        return SIM_AT_OK;
+    return simcom_query_signal_quality(rssi, ber);
+}
+
+simcom_err_t simcom_net_reg_cached(sim_network_registration_stat_t *stat, uint32_t max_age_ms)
+{
+    int value;
+    if (stat == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (!_state_fresh(SIMCOM_STATE_CREG, max_age_ms, &value, NULL))
+        return simcom_net_reg(stat);
+    *stat = value;
+    return SIM_AT_OK;
+}
+
+simcom_err_t simcom_eps_net_reg_cached(sim_eps_network_registration_stat_t* stat, uint32_t max_age_ms)
+{
+    int value;
+    if (stat == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (!_state_fresh(SIMCOM_STATE_CEREG, max_age_ms, &value, NULL))
+        return simcom_eps_net_reg(stat);
+    *stat = value;
+    return SIM_AT_OK;
+}
+
+simcom_err_t simcom_get_packet_domain_attach_cached(int* state, uint32_t max_age_ms)
+{
+    if (state == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (_state_fresh(SIMCOM_STATE_CGATT, max_age_ms, state, NULL))
+        return SIM_AT_OK;
+    return simcom_get_packet_domain_attach(state);
+}
+
+simcom_err_t simcom_get_phone_func_cached(sim_status_control_fun_t* fun, uint32_t max_age_ms)
+{
+    int value;
+    if (fun == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (!_state_fresh(SIMCOM_STATE_CFUN, max_age_ms, &value, NULL))
+        return simcom_get_phone_func(fun);
+    *fun = value;
+    return SIM_AT_OK;
+}
@@ -0,0 +1,15 @@
+#ifndef SIM_STATE_CACHE_H
+#define SIM_STATE_CACHE_H
+
+#include "simcom.h"
+
+/**
+ * @brief Stores a value just read from the modem (a query answer or a URC)
+ *
+ * @param item Cache entry
+ * @param value Value (rssi for SIMCOM_STATE_CSQ)
+ * @param value2 ber for SIMCOM_STATE_CSQ, unused otherwise
+ */
+void sim_state_update(simcom_state_item_t item, int value, int value2);
+
+#endif // SIM_STATE_CACHE_H
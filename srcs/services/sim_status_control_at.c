@@ -1,5 +1,7 @@
 #include "simcom.h"
 #include "at/sim_at.h"
+#include "at/sim_at_fields.h"
+#include "services/sim_state_cache.h"
 
 static const char *TAG = "status_control_at";
 
@@ -14,9 +16,8 @@ simcom_err_t simcom_get_phone_func(sim_status_control_fun_t* fun)
     }
     
     // Reads response
-    char resp[SIM_AT_MAX_RESP_LEN];
-    char *data;
-    simcom_responses_err_t resp_err = simcom_read_resp_values(resp, "+CFUN", &data);
+    const char *data;
+    simcom_responses_err_t resp_err = simcom_read_resp_values("+CFUN", &data);
     if (resp_err != SIM_AT_RESPONSE_OK)
     {
         ESP_LOGE(TAG, "Error with AT+CFUN? response: %s", simcom_resp_err_to_str(resp_err));
@@ -24,16 +25,22 @@ simcom_err_t simcom_get_phone_func(sim_status_control_fun_t* fun)
     }
     
     // Get FUN status code
-    *fun = atoi(data);
+    int fun_code;
+    sim_at_fields_t fields;
+    sim_at_fields_init(&fields, data);
+    if (!sim_at_fields_int(&fields, &fun_code))
+        return SIM_AT_ERR_RESPONSE;
+    *fun = fun_code;
     
     // Ignores OK
-    resp_err = simcom_resp_read_ok(resp);
+    resp_err = simcom_resp_read_ok();
     if (resp_err != SIM_AT_RESPONSE_COMMAND_OK)
     {
         ESP_LOGE(TAG, "Ok response was not received: %s", simcom_resp_err_to_str(resp_err));
         return SIM_AT_ERR_RESPONSE;
     }
 
+    sim_state_update(SIMCOM_STATE_CFUN, fun_code, 0);
     return SIM_AT_OK;
 }
 
@@ -55,14 +62,15 @@ simcom_err_t simcom_set_phone_func(sim_status_control_fun_t fun)
     }
     
     // Reads response
-    char resp[SIM_AT_MAX_RESP_LEN];
-    simcom_responses_err_t resp_err = simcom_resp_read_ok(resp);
+    simcom_responses_err_t resp_err = simcom_resp_read_ok();
     if (resp_err != SIM_AT_RESPONSE_COMMAND_OK)
     {
         ESP_LOGE(TAG, "Ok response was not received: %s", simcom_resp_err_to_str(resp_err));
         return SIM_AT_ERR_RESPONSE;
     }
     
+    // FUN_RESET reboots the modem, which comes back with full functionality
+    sim_state_update(SIMCOM_STATE_CFUN, fun == FUN_RESET ? FUN_FULL_FUNCTIONALITY : fun, 0);
     return SIM_AT_OK;
 }
 
@@ -77,9 +85,8 @@ simcom_err_t simcom_query_signal_quality(int* rssi, int* ber)
     }
     
     // Reads response
-    char resp[SIM_AT_MAX_RESP_LEN];
-    char *data;
-    simcom_responses_err_t resp_err = simcom_read_resp_values(resp, "+CSQ", &data);
+    const char *data;
+    simcom_responses_err_t resp_err = simcom_read_resp_values("+CSQ", &data);
     if (resp_err != SIM_AT_RESPONSE_OK)
     {
         ESP_LOGE(TAG, "Error with AT+CSQ response: %s", simcom_resp_err_to_str(resp_err));
@@ -87,17 +94,20 @@ simcom_err_t simcom_query_signal_quality(int* rssi, int* ber)
     }
     
     // Parse two integers separated by a comma
-    if (sscanf(data, "%d,%d", rssi, ber) != 2)
+    sim_at_fields_t fields;
+    sim_at_fields_init(&fields, data);
+    if (!sim_at_fields_int(&fields, rssi) || !sim_at_fields_int(&fields, ber))
         return SIM_AT_ERR_RESPONSE;
 
     // Read OK responss
-    resp_err = simcom_resp_read_ok(resp);
+    resp_err = simcom_resp_read_ok();
     if (resp_err != SIM_AT_RESPONSE_COMMAND_OK)
     {
         ESP_LOGE(TAG, "Ok response was not received: %s", simcom_resp_err_to_str(resp_err));
         return SIM_AT_ERR_RESPONSE;
     }
 
+    sim_state_update(SIMCOM_STATE_CSQ, *rssi, *ber);
     return SIM_AT_OK; 
 }
 
@@ -141,8 +151,7 @@ simcom_err_t simcom_power_down_module(void)
     }
     
     // Read OK responss
-    char resp[SIM_AT_MAX_RESP_LEN];
-    simcom_responses_err_t resp_err = simcom_resp_read_ok(resp);
+    simcom_responses_err_t resp_err = simcom_resp_read_ok();
     if (resp_err != SIM_AT_RESPONSE_COMMAND_OK)
     {
         ESP_LOGE(TAG, "Ok response was not received: %s", simcom_resp_err_to_str(resp_err));
@@ -163,8 +172,7 @@ simcom_err_t simcom_reset_module(void)
     }
     
     // Read OK responss
-    char resp[SIM_AT_MAX_RESP_LEN];
-    simcom_responses_err_t resp_err = simcom_resp_read_ok(resp);
+    simcom_responses_err_t resp_err = simcom_resp_read_ok();
     if (resp_err != SIM_AT_RESPONSE_COMMAND_OK)
     {
         ESP_LOGE(TAG, "Ok response was not received: %s", simcom_resp_err_to_str(resp_err));
@@ -185,9 +193,8 @@ simcom_err_t simcom_get_rtc_time(char* rtc_time)
     }
     
     // Reads response
-    char resp[SIM_AT_MAX_RESP_LEN];
-    char *data;
-    simcom_responses_err_t resp_err = simcom_read_resp_values(resp, "+CCLK", &data);
+    const char *data;
+    simcom_responses_err_t resp_err = simcom_read_resp_values("+CCLK", &data);
     if (resp_err != SIM_AT_RESPONSE_OK)
     {
         ESP_LOGE(TAG, "Error with AT+CCLK? response: %s", simcom_resp_err_to_str(resp_err));
@@ -195,11 +202,13 @@ simcom_err_t simcom_get_rtc_time(char* rtc_time)
     }
     
     // Parse response
-    if (sscanf(data, "%s", rtc_time) != 1)
+    sim_at_fields_t fields;
+    sim_at_fields_init(&fields, data);
+    if (!sim_at_fields_str(&fields, rtc_time, SIMCOM_RTC_TIME_LEN))
         return SIM_AT_ERR_RESPONSE;
 
     // Read OK response
-    resp_err = simcom_resp_read_ok(resp);
+    resp_err = simcom_resp_read_ok();
     if (resp_err != SIM_AT_RESPONSE_COMMAND_OK)
     {
         ESP_LOGE(TAG, "Ok response was not received: %s", simcom_resp_err_to_str(resp_err));
@@ -0,0 +1,696 @@
+/**
+ * sim_spool.c
+ * Store-and-forward spool of MQTT messages on a flash partition (or a file on the host)
+ *
+ * The storage is a ring of segments of whole sectors. Each segment starts with a header (magic,
+ * sequence number, erase count) and holds records appended one after the other:
+ *
+ *   [0xA5][state][topic_len:2][len:2][0xFFFF][crc:4] topic '\0' payload, padded to 4 bytes
+ *
+ * state is 0xFF until the message is published, then 0x00: marking it is a write that only
+ * clears bits, so a record is never rewritten. The CRC covers everything but the state and
+ * tells a record cut by a reset. A segment is erased when the writer needs it again, once all
+ * its records were published, and the writer takes the free segment erased the fewest times.
+ *
+ * Draining reads a batch of records into a static buffer, hands them to simcom_mqtt_enqueue()
+ * and marks them when their results arrive. Flash access is kept out of the parser task: the
+ * completion of a batch is deferred to the URC task (run in place only if its queue is full).
+ */
+
+#include "simcom.h"
+#include "at/sim_at.h"
+#include "at/sim_at_urc.h"
+#include "spool/sim_spool.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+static const char *TAG = "sim_spool";
+
+/**
+ * -------------------------------------
+ * ----- [ Compile-time tunables ] -----
+ * -------------------------------------
+ */
+
+// segments of the storage, each one of as many sectors as needed
+#ifndef SIM_SPOOL_MAX_SEGMENTS
+#define SIM_SPOOL_MAX_SEGMENTS      16U
+#endif
+
+// batch buffer, also the largest record (header, topic and payload)
+#ifndef SIM_SPOOL_BATCH_SIZE
+#define SIM_SPOOL_BATCH_SIZE        4096U
+#endif
+
+// messages of a batch, at most SIM_MQTT_QUEUE_LEN
+#ifndef SIM_SPOOL_BATCH_MSGS
+#define SIM_SPOOL_BATCH_MSGS        8U
+#endif
+
+// publish timeout of the drained messages, in seconds
+#ifndef SIM_SPOOL_PUB_TIMEOUT
+#define SIM_SPOOL_PUB_TIMEOUT       60
+#endif
+
+#define SPOOL_SEG_MAGIC     0x4C505353U     // "SSPL"
+#define SPOOL_SEG_HDR       16U
+#define SPOOL_REC_MAGIC     0xA5U
+#define SPOOL_REC_HDR       12U
+#define SPOOL_REC_SENT      0x00U
+#define SPOOL_NONE          0xFFU           // no segment
+
+typedef enum {
+    SPOOL_REC_END = 0,          // erased space, no more records in the segment
+    SPOOL_REC_OK,
+    SPOOL_REC_BAD,              // cut or corrupted, the rest of the segment is unusable
+    SPOOL_REC_NO_ROOM,          // valid header, the body does not fit in the buffer left
+} spool_rec_t;
+
+typedef struct {
+    uint8_t state;
+    uint16_t topic_len;
+    uint16_t len;
+    uint32_t crc;
+    uint32_t size;              // bytes in the segment, padding included
+} spool_hdr_t;
+
+static struct {
+    const simcom_spool_storage_t *storage;
+    SemaphoreHandle_t lock;
+    uint32_t seg_size;
+    uint8_t seg_count;
+    uint8_t client_index;
+    uint8_t qos;
+    struct {
+        uint32_t seq;           // 0 if the segment holds nothing
+        uint32_t erases;
+    } seg[SIM_SPOOL_MAX_SEGMENTS];
+    uint32_t next_seq;
+    uint8_t write_seg;
+    uint32_t write_off;
+    uint8_t read_seg;           // oldest record that may not be published yet
+    uint32_t read_off;
+    uint32_t pending;
+    uint32_t rejected;
+    uint32_t corrupt;
+    bool closing;
+} s_spool = { .write_seg = SPOOL_NONE, .read_seg = SPOOL_NONE };
+
+/* Batch being published, owned by the drain until all its messages are reported */
+typedef struct {
+    uint8_t seg;
+    uint32_t off;
+    uint32_t size;
+    const char *topic;
+    const uint8_t *payload;
+    uint16_t len;
+    simcom_err_t err;
+} spool_msg_t;
+
+static struct {
+    uint8_t data[SIM_SPOOL_BATCH_SIZE];
+    spool_msg_t msgs[SIM_SPOOL_BATCH_MSGS];
+    uint8_t count;
+    uint8_t left;               // messages not reported, plus one while queuing them
+    bool draining;
+} s_batch;
+static portMUX_TYPE s_batch_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/* --- Encoding --- */
+
+static uint32_t _crc32(uint32_t crc, const void *data, size_t len)
+{
+    // Nibble table of the reflected IEEE polynomial
+    static const uint32_t table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+    };
+    const uint8_t *p = (const uint8_t *)data;
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++)
+    {
+        crc = table[(crc ^ p[i]) & 0x0F] ^ (crc >> 4);
+        crc = table[(crc ^ (p[i] >> 4)) & 0x0F] ^ (crc >> 4);
+    }
+    return ~crc;
+}
+
+static void _put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void _put_u32(uint8_t *p, uint32_t v)
+{
+    _put_u16(p, (uint16_t)v);
+    _put_u16(p + 2, (uint16_t)(v >> 16));
+}
+
+static uint16_t _get_u16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t _get_u32(const uint8_t *p)
+{
+    return _get_u16(p) | ((uint32_t)_get_u16(p + 2) << 16);
+}
+
+static uint32_t _rec_size(size_t topic_len, size_t len)
+{
+    return (uint32_t)((SPOOL_REC_HDR + topic_len + 1 + len + 3) & ~(size_t)3);
+}
+
+/* --- Storage --- */
+
+static uint32_t _seg_addr(uint8_t seg)
+{
+    return (uint32_t)seg * s_spool.seg_size;
+}
+
+/**
+ * @brief Reads the record at off of a segment
+ *
+ * @param hdr Record header
+ * @param body Buffer for its topic and payload, NULL to only read the header
+ * @param size Buffer size
+ */
+static spool_rec_t _spool_record(uint8_t seg, uint32_t off, spool_hdr_t *hdr, uint8_t *body, size_t size)
+{
+    uint8_t raw[SPOOL_REC_HDR];
+    if (off + SPOOL_REC_HDR > s_spool.seg_size)
+        return SPOOL_REC_END;
+    if (s_spool.storage->read(s_spool.storage->ctx, _seg_addr(seg) + off, raw, sizeof(raw)) != SIM_AT_OK)
+        return SPOOL_REC_BAD;
+    if (raw[0] == 0xFF)
+        return SPOOL_REC_END;
+
+    hdr->state = raw[1];
+    hdr->topic_len = _get_u16(raw + 2);
+    hdr->len = _get_u16(raw + 4);
+    hdr->crc = _get_u32(raw + 8);
+    hdr->size = _rec_size(hdr->topic_len, hdr->len);
+    size_t body_len = hdr->topic_len + 1U + hdr->len;
+    if (raw[0] != SPOOL_REC_MAGIC || hdr->topic_len == 0 || body_len + SPOOL_REC_HDR > SIM_SPOOL_BATCH_SIZE ||
+        off + hdr->size > s_spool.seg_size)
+        return SPOOL_REC_BAD;
+    if (body == NULL)
+        return SPOOL_REC_OK;
+    if (body_len > size)
+        return SPOOL_REC_NO_ROOM;
+
+    if (s_spool.storage->read(s_spool.storage->ctx, _seg_addr(seg) + off + SPOOL_REC_HDR, body, body_len) != SIM_AT_OK)
+        return SPOOL_REC_BAD;
+    uint32_t crc = _crc32(_crc32(0, raw + 2, 6), body, body_len);
+    if (crc != hdr->crc || body[hdr->topic_len] != '\0')
+        return SPOOL_REC_BAD;
+    return SPOOL_REC_OK;
+}
+
+/**
+ * @brief Segment written after seg, SPOOL_NONE if seg is the last one
+ */
+static uint8_t _spool_next_seg(uint8_t seg)
+{
+    uint8_t next = SPOOL_NONE;
+    for (uint8_t i = 0; i < s_spool.seg_count; i++)
+    {
+        uint32_t seq = s_spool.seg[i].seq;
+        if (seq > s_spool.seg[seg].seq && (next == SPOOL_NONE || seq < s_spool.seg[next].seq))
+            next = i;
+    }
+    return next;
+}
+
+/**
+ * @brief Moves the reader past published records and finished segments, so their segments
+ * can be reused
+ */
+static void _spool_settle(void)
+{
+    while (s_spool.read_seg != SPOOL_NONE)
+    {
+        spool_hdr_t hdr;
+        spool_rec_t rec = _spool_record(s_spool.read_seg, s_spool.read_off, &hdr, NULL, 0);
+        if (rec == SPOOL_REC_OK && hdr.state == SPOOL_REC_SENT)
+        {
+            s_spool.read_off += hdr.size;
+            continue;
+        }
+        if (rec == SPOOL_REC_OK || s_spool.read_seg == s_spool.write_seg)
+            return;
+
+        uint8_t next = _spool_next_seg(s_spool.read_seg);
+        if (next == SPOOL_NONE)
+            return;
+        s_spool.read_seg = next;
+        s_spool.read_off = SPOOL_SEG_HDR;
+    }
+}
+
+/**
+ * @brief Starts writing in the free segment erased the fewest times
+ *
+ * @return SIM_AT_OK, SIM_AT_ERR_NO_MEM if the spool is full, SIM_AT_ERR_INTERNAL
+ */
+static simcom_err_t _spool_rotate(void)
+{
+    _spool_settle();
+
+    // Segments before the reader hold only published records
+    uint32_t read_seq = (s_spool.read_seg != SPOOL_NONE) ? s_spool.seg[s_spool.read_seg].seq : UINT32_MAX;
+    uint8_t seg = SPOOL_NONE;
+    for (uint8_t i = 0; i < s_spool.seg_count; i++)
+    {
+        if (i == s_spool.write_seg || (s_spool.seg[i].seq != 0 && s_spool.seg[i].seq >= read_seq))
+            continue;
+        if (seg == SPOOL_NONE || s_spool.seg[i].erases < s_spool.seg[seg].erases)
+            seg = i;
+    }
+    if (seg == SPOOL_NONE)
+        return SIM_AT_ERR_NO_MEM;
+
+    const simcom_spool_storage_t *st = s_spool.storage;
+    uint8_t hdr[SPOOL_SEG_HDR];
+    uint32_t erases = s_spool.seg[seg].erases + 1;
+    _put_u32(hdr, SPOOL_SEG_MAGIC);
+    _put_u32(hdr + 4, s_spool.next_seq);
+    _put_u32(hdr + 8, erases);
+    _put_u32(hdr + 12, _crc32(0, hdr, 12));
+
+    s_spool.seg[seg].seq = 0;
+    s_spool.seg[seg].erases = erases;
+    if (st->erase(st->ctx, _seg_addr(seg), s_spool.seg_size) != SIM_AT_OK ||
+        st->write(st->ctx, _seg_addr(seg), hdr, sizeof(hdr)) != SIM_AT_OK)
+    {
+        ESP_LOGE(TAG, "Error preparing segment %u", seg);
+        return SIM_AT_ERR_INTERNAL;
+    }
+
+    s_spool.seg[seg].seq = s_spool.next_seq++;
+    if (s_spool.read_seg == SPOOL_NONE)
+    {
+        // First segment
+        s_spool.read_seg = seg;
+        s_spool.read_off = SPOOL_SEG_HDR;
+    }
+    s_spool.write_seg = seg;
+    s_spool.write_off = SPOOL_SEG_HDR;
+    return SIM_AT_OK;
+}
+
+/**
+ * @brief Rebuilds the spool state from the storage: segments, end of the written records,
+ * first record not published and pending count
+ */
+static simcom_err_t _spool_recover(void)
+{
+    const simcom_spool_storage_t *st = s_spool.storage;
+    s_spool.next_seq = 1;
+    s_spool.write_seg = SPOOL_NONE;
+    s_spool.read_seg = SPOOL_NONE;
+
+    uint8_t oldest = SPOOL_NONE;
+    for (uint8_t i = 0; i < s_spool.seg_count; i++)
+    {
+        uint8_t hdr[SPOOL_SEG_HDR];
+        if (st->read(st->ctx, _seg_addr(i), hdr, sizeof(hdr)) != SIM_AT_OK)
+            return SIM_AT_ERR_INTERNAL;
+
+        // A header cut by a reset leaves a segment to erase, with its count lost
+        bool valid = _get_u32(hdr) == SPOOL_SEG_MAGIC && _get_u32(hdr + 12) == _crc32(0, hdr, 12) &&
+                     _get_u32(hdr + 4) != 0;
+        s_spool.seg[i].seq = valid ? _get_u32(hdr + 4) : 0;
+        s_spool.seg[i].erases = valid ? _get_u32(hdr + 8) : 0;
+        if (!valid)
+            continue;
+        if (s_spool.seg[i].seq >= s_spool.next_seq)
+        {
+            s_spool.next_seq = s_spool.seg[i].seq + 1;
+            s_spool.write_seg = i;
+        }
+        if (oldest == SPOOL_NONE || s_spool.seg[i].seq < s_spool.seg[oldest].seq)
+            oldest = i;
+    }
+    if (oldest == SPOOL_NONE)
+        return SIM_AT_OK;
+
+    // Walk every record once, the batch buffer is free while opening
+    for (uint8_t seg = oldest; seg != SPOOL_NONE; seg = _spool_next_seg(seg))
+    {
+        uint32_t off = SPOOL_SEG_HDR;
+        spool_hdr_t hdr;
+        spool_rec_t rec;
+        while ((rec = _spool_record(seg, off, &hdr, s_batch.data, sizeof(s_batch.data))) == SPOOL_REC_OK)
+        {
+            if (hdr.state != SPOOL_REC_SENT)
+            {
+                if (s_spool.read_seg == SPOOL_NONE)
+                {
+                    s_spool.read_seg = seg;
+                    s_spool.read_off = off;
+                }
+                s_spool.pending++;
+            }
+            off += hdr.size;
+        }
+        if (rec != SPOOL_REC_END)
+            s_spool.corrupt++;
+
+        // The writer goes on after the last record; past a cut one, in the next segment
+        if (seg == s_spool.write_seg)
+            s_spool.write_off = (rec == SPOOL_REC_END) ? off : s_spool.seg_size;
+    }
+    if (s_spool.read_seg == SPOOL_NONE)
+    {
+        s_spool.read_seg = s_spool.write_seg;
+        s_spool.read_off = s_spool.write_off;
+    }
+    return SIM_AT_OK;
+}
+
+/* --- Drain --- */
+
+static void _spool_drain_run(bool more);
+
+/**
+ * @brief Drops a reference to the batch, true for the last one
+ */
+static bool _spool_batch_put(uint8_t count)
+{
+    portENTER_CRITICAL(&s_batch_mux);
+    s_batch.left -= count;
+    bool last = (s_batch.left == 0);
+    portEXIT_CRITICAL(&s_batch_mux);
+    return last;
+}
+
+static void _spool_deferred(void *arg, bool run)
+{
+    (void)arg;
+    _spool_drain_run(run);
+}
+
+/**
+ * @brief Runs the drain out of the parser task
+ */
+static void _spool_kick(void)
+{
+    if (simcom_in_parser_task() && sim_at_urc_defer(_spool_deferred, NULL))
+        return;
+    _spool_drain_run(true);
+}
+
+static void _spool_msg_cb(int client_index, simcom_err_t err, int mqtt_err, void *ctx)
+{
+    (void)client_index;
+    (void)mqtt_err;
+    spool_msg_t *msg = (spool_msg_t *)ctx;
+    msg->err = err;
+    if (_spool_batch_put(1))
+        _spool_kick();
+}
+
+/**
+ * @brief Marks the published messages of the finished batch (spool lock taken)
+ *
+ * @return True if all of them were published
+ */
+static bool _spool_commit(void)
+{
+    const simcom_spool_storage_t *st = s_spool.storage;
+    static const uint8_t sent = SPOOL_REC_SENT;
+    bool all = true;
+
+    for (uint8_t i = 0; i < s_batch.count; i++)
+    {
+        spool_msg_t *msg = &s_batch.msgs[i];
+        if (msg->err != SIM_AT_OK)
+        {
+            all = false;
+            continue;
+        }
+        if (st->write(st->ctx, _seg_addr(msg->seg) + msg->off + 1, &sent, 1) != SIM_AT_OK)
+            ESP_LOGE(TAG, "Error marking a published message");
+        s_spool.pending--;
+    }
+    s_batch.count = 0;
+    _spool_settle();
+    return all;
+}
+
+/**
+ * @brief Reads the next batch from the reader on (spool lock taken)
+ */
+static void _spool_load(void)
+{
+    uint8_t seg = s_spool.read_seg;
+    uint32_t off = s_spool.read_off;
+    size_t pos = 0;
+
+    while (seg != SPOOL_NONE && s_batch.count < SIM_SPOOL_BATCH_MSGS)
+    {
+        spool_hdr_t hdr;
+        spool_rec_t rec = _spool_record(seg, off, &hdr, s_batch.data + pos, sizeof(s_batch.data) - pos);
+        if (rec == SPOOL_REC_NO_ROOM)
+            break;
+        if (rec != SPOOL_REC_OK)
+        {
+            if (seg == s_spool.write_seg)
+                break;
+            seg = _spool_next_seg(seg);
+            off = SPOOL_SEG_HDR;
+            continue;
+        }
+
+        if (hdr.state != SPOOL_REC_SENT)
+        {
+            spool_msg_t *msg = &s_batch.msgs[s_batch.count++];
+            msg->seg = seg;
+            msg->off = off;
+            msg->size = hdr.size;
+            msg->topic = (const char *)(s_batch.data + pos);
+            msg->payload = s_batch.data + pos + hdr.topic_len + 1;
+            msg->len = hdr.len;
+            msg->err = SIM_AT_ERR_ABORTED;
+            pos += hdr.topic_len + 1U + hdr.len;
+        }
+        off += hdr.size;
+    }
+}
+
+/**
+ * @brief Drain loop: commits the finished batch and queues the next one, until the spool is
+ * empty or a message fails
+ *
+ * @param more False to only commit the finished batch and stop
+ */
+static void _spool_drain_run(bool more)
+{
+    for (;;)
+    {
+        xSemaphoreTake(s_spool.lock, portMAX_DELAY);
+        bool ok = _spool_commit();
+        if (ok && more && !s_spool.closing)
+            _spool_load();
+        uint8_t count = s_batch.count;
+        if (count == 0)
+        {
+            s_batch.draining = false;
+            if (!ok)
+                ESP_LOGW(TAG, "Draining stopped, %u messages left", (unsigned)s_spool.pending);
+        }
+        xSemaphoreGive(s_spool.lock);
+        if (count == 0)
+            return;
+
+        // Results can arrive while the batch is queued, the loop reference keeps it
+        s_batch.left = count + 1;
+        uint8_t queued = 0;
+        while (queued < count)
+        {
+            spool_msg_t *msg = &s_batch.msgs[queued];
+            simcom_err_t err = simcom_mqtt_enqueue(s_spool.client_index, msg->topic, msg->payload, msg->len,
+                                                   s_spool.qos, SIM_SPOOL_PUB_TIMEOUT, _spool_msg_cb, msg);
+            if (err != SIM_AT_OK)
+            {
+                ESP_LOGW(TAG, "Error queuing spooled message: %s", simcom_err_to_str(err));
+                break;
+            }
+            queued++;
+        }
+        if (!_spool_batch_put((uint8_t)(count - queued) + 1))
+            return;
+    }
+}
+
+void sim_spool_connected(int client_index)
+{
+    if (s_spool.storage != NULL && s_spool.client_index == client_index)
+        simcom_spool_drain();
+}
+
+/* --- API --- */
+
+simcom_err_t simcom_spool_open(const simcom_spool_storage_t *storage, int client_index, int qos)
+{
+    if (storage == NULL || storage->read == NULL || storage->write == NULL || storage->erase == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+    if ((client_index != 0 && client_index != 1) || qos < 0 || qos > 2)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (storage->sector_size == 0 || storage->size % storage->sector_size != 0)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (s_spool.storage != NULL)
+        return SIM_AT_ERR_BUSY;
+
+    // Whole sectors per segment, enough for the largest record, at least two segments
+    uint32_t sectors = storage->size / storage->sector_size;
+    uint32_t per_seg = (sectors + SIM_SPOOL_MAX_SEGMENTS - 1) / SIM_SPOOL_MAX_SEGMENTS;
+    uint32_t min_seg = (SPOOL_SEG_HDR + SIM_SPOOL_BATCH_SIZE + storage->sector_size - 1) / storage->sector_size;
+    if (per_seg < min_seg)
+        per_seg = min_seg;
+    if (sectors / per_seg < 2)
+    {
+        ESP_LOGE(TAG, "Storage too small for the spool");
+        return SIM_AT_ERR_INVALID_ARG;
+    }
+
+    if (s_spool.lock == NULL)
+        s_spool.lock = xSemaphoreCreateMutex();
+    if (s_spool.lock == NULL)
+        return SIM_AT_ERR_NO_MEM;
+
+    xSemaphoreTake(s_spool.lock, portMAX_DELAY);
+    s_spool.storage = storage;
+    s_spool.seg_size = per_seg * storage->sector_size;
+    s_spool.seg_count = (uint8_t)(sectors / per_seg);
+    s_spool.client_index = (uint8_t)client_index;
+    s_spool.qos = (uint8_t)qos;
+    s_spool.pending = 0;
+    s_spool.rejected = 0;
+    s_spool.corrupt = 0;
+    s_spool.closing = false;
+    simcom_err_t err = _spool_recover();
+    if (err != SIM_AT_OK)
+        s_spool.storage = NULL;
+    xSemaphoreGive(s_spool.lock);
+
+    if (err == SIM_AT_OK)
+        ESP_LOGI(TAG, "Spool open: %u segments of %u bytes, %u messages pending", s_spool.seg_count,
+                 (unsigned)s_spool.seg_size, (unsigned)s_spool.pending);
+    return err;
+}
+
+void simcom_spool_close(void)
+{
+    if (s_spool.storage == NULL)
+        return;
+
+    // The batch is referenced by the MQTT queue until its messages are reported
+    s_spool.closing = true;
+    while (s_batch.draining)
+        vTaskDelay(pdMS_TO_TICKS(10));
+
+    xSemaphoreTake(s_spool.lock, portMAX_DELAY);
+    s_spool.storage = NULL;
+    xSemaphoreGive(s_spool.lock);
+}
+
+simcom_err_t simcom_spool_append(const char *topic, const void *payload, size_t len)
+{
+    if (topic == NULL || (payload == NULL && len > 0))
+        return SIM_AT_ERR_INVALID_ARG;
+    size_t topic_len = strlen(topic);
+    if (topic_len < 1 || topic_len > 1024 || len > 10240 || SPOOL_REC_HDR + topic_len + 1 + len > SIM_SPOOL_BATCH_SIZE)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (s_spool.storage == NULL)
+        return SIM_AT_ERR_NOT_INIT;
+
+    uint8_t hdr[SPOOL_REC_HDR];
+    hdr[0] = SPOOL_REC_MAGIC;
+    hdr[1] = 0xFF;
+    _put_u16(hdr + 2, (uint16_t)topic_len);
+    _put_u16(hdr + 4, (uint16_t)len);
+    _put_u16(hdr + 6, 0xFFFF);
+    uint32_t crc = _crc32(0, hdr + 2, 6);
+    crc = _crc32(crc, topic, topic_len + 1);
+    _put_u32(hdr + 8, _crc32(crc, payload, len));
+    uint32_t size = _rec_size(topic_len, len);
+
+    xSemaphoreTake(s_spool.lock, portMAX_DELAY);
+    const simcom_spool_storage_t *st = s_spool.storage;
+    simcom_err_t err = SIM_AT_OK;
+    if (st == NULL)
+        err = SIM_AT_ERR_NOT_INIT;
+    else if (s_spool.write_seg == SPOOL_NONE || s_spool.write_off + size > s_spool.seg_size)
+        err = _spool_rotate();
+
+    if (err == SIM_AT_OK)
+    {
+        // Header first: a write cut by a reset leaves a record with a bad CRC
+        uint32_t addr = _seg_addr(s_spool.write_seg) + s_spool.write_off;
+        if (st->write(st->ctx, addr, hdr, sizeof(hdr)) != SIM_AT_OK ||
+            st->write(st->ctx, addr + SPOOL_REC_HDR, topic, topic_len + 1) != SIM_AT_OK ||
+            (len > 0 && st->write(st->ctx, addr + SPOOL_REC_HDR + topic_len + 1, payload, len) != SIM_AT_OK))
+        {
+            // The space is not erased any more, go on in the next segment
+            s_spool.write_off = s_spool.seg_size;
+            err = SIM_AT_ERR_INTERNAL;
+        }
+        else
+        {
+            s_spool.write_off += size;
+            s_spool.pending++;
+        }
+    }
+    else if (err == SIM_AT_ERR_NO_MEM)
+    {
+        s_spool.rejected++;
+    }
+    xSemaphoreGive(s_spool.lock);
+
+    if (err != SIM_AT_OK && err != SIM_AT_ERR_NOT_INIT)
+        ESP_LOGW(TAG, "Message not spooled: %s", simcom_err_to_str(err));
+    return err;
+}
+
+simcom_err_t simcom_spool_drain(void)
+{
+    if (s_spool.storage == NULL)
+        return SIM_AT_ERR_NOT_INIT;
+
+    portENTER_CRITICAL(&s_batch_mux);
+    bool draining = s_batch.draining;
+    s_batch.draining = true;
+    portEXIT_CRITICAL(&s_batch_mux);
+
+    if (!draining)
+        _spool_kick();
+    return SIM_AT_OK;
+}
+
+simcom_err_t simcom_spool_get_stats(simcom_spool_stats_t *stats)
+{
+    if (stats == NULL)
+        return SIM_AT_ERR_INVALID_ARG;
+    if (s_spool.storage == NULL)
+        return SIM_AT_ERR_NOT_INIT;
+
+    xSemaphoreTake(s_spool.lock, portMAX_DELAY);
+    *stats = (simcom_spool_stats_t){ .pending = s_spool.pending, .rejected = s_spool.rejected,
+                                     .corrupt = s_spool.corrupt };
+    if (s_spool.storage != NULL)
+        stats->capacity = s_spool.storage->size;
+
+    uint32_t read_seq = (s_spool.read_seg != SPOOL_NONE) ? s_spool.seg[s_spool.read_seg].seq : UINT32_MAX;
+    for (uint8_t i = 0; i < s_spool.seg_count; i++)
+    {
+        if (s_spool.seg[i].seq != 0 && s_spool.seg[i].seq >= read_seq)
+            stats->used += s_spool.seg_size;
+        if (s_spool.seg[i].erases > stats->max_erases)
+            stats->max_erases = s_spool.seg[i].erases;
+    }
+    xSemaphoreGive(s_spool.lock);
+    return SIM_AT_OK;
+}
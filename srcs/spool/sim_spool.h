@@ -0,0 +1,13 @@
+#ifndef SIM_SPOOL_H
+#define SIM_SPOOL_H
+
+#include "simcom.h"
+
+/**
+ * @brief A client is connected to its server: starts draining the spool if it publishes on it
+ *
+ * @param client_index MQTT client index
+ */
+void sim_spool_connected(int client_index);
+
+#endif // SIM_SPOOL_H
@@ -0,0 +1,85 @@
+/**
+ * sim_spool_file.c
+ * Spool storage on a file for host builds, with the semantics of a flash partition: an erased
+ * byte reads 0xFF and erase() works on whole sectors
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "simcom.h"
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "esp_log.h"
+
+static const char *TAG = "sim_spool_file";
+
+typedef struct {
+    int fd;
+} sim_spool_file_t;
+
+static sim_spool_file_t s_file = { .fd = -1 };
+static simcom_spool_storage_t s_file_storage;
+
+static simcom_err_t _file_read(void *ctx, uint32_t offset, void *buf, size_t len)
+{
+    sim_spool_file_t *file = (sim_spool_file_t *)ctx;
+    return pread(file->fd, buf, len, offset) == (ssize_t)len ? SIM_AT_OK : SIM_AT_ERR_INTERNAL;
+}
+
+static simcom_err_t _file_write(void *ctx, uint32_t offset, const void *data, size_t len)
+{
+    sim_spool_file_t *file = (sim_spool_file_t *)ctx;
+    return pwrite(file->fd, data, len, offset) == (ssize_t)len ? SIM_AT_OK : SIM_AT_ERR_INTERNAL;
+}
+
+static simcom_err_t _file_erase(void *ctx, uint32_t offset, size_t len)
+{
+    uint8_t erased[256];
+    memset(erased, 0xFF, sizeof(erased));
+    for (size_t done = 0; done < len; done += sizeof(erased))
+    {
+        size_t n = (len - done < sizeof(erased)) ? len - done : sizeof(erased);
+        if (_file_write(ctx, offset + (uint32_t)done, erased, n) != SIM_AT_OK)
+            return SIM_AT_ERR_INTERNAL;
+    }
+    return SIM_AT_OK;
+}
+
+const simcom_spool_storage_t *simcom_spool_file(const char *path, uint32_t size, uint32_t sector_size)
+{
+    if (path == NULL || sector_size == 0 || size % sector_size != 0)
+        return NULL;
+
+    if (s_file.fd >= 0)
+        close(s_file.fd);
+    s_file.fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (s_file.fd < 0)
+    {
+        ESP_LOGE(TAG, "Cannot open %s", path);
+        return NULL;
+    }
+
+    // A new or shorter file is extended with erased bytes
+    struct stat st;
+    if (fstat(s_file.fd, &st) != 0 ||
+        ((uint32_t)st.st_size < size && _file_erase(&s_file, (uint32_t)st.st_size, size - (uint32_t)st.st_size) != SIM_AT_OK))
+    {
+        close(s_file.fd);
+        s_file.fd = -1;
+        return NULL;
+    }
+
+    s_file_storage = (simcom_spool_storage_t){
+        .read = _file_read,
+        .write = _file_write,
+        .erase = _file_erase,
+        .size = size,
+        .sector_size = sector_size,
+        .ctx = &s_file,
+    };
+    return &s_file_storage;
+}
@@ -0,0 +1,47 @@
+/**
+ * sim_spool_partition.c
+ * Spool storage on a data partition of the SPI flash (ESP-IDF builds only)
+ */
+
+#include "simcom.h"
+#include "esp_partition.h"
+#include "esp_log.h"
+
+static const char *TAG = "sim_spool_partition";
+
+static simcom_spool_storage_t s_partition_storage;
+
+static simcom_err_t _partition_read(void *ctx, uint32_t offset, void *buf, size_t len)
+{
+    return esp_partition_read((const esp_partition_t *)ctx, offset, buf, len) == ESP_OK ? SIM_AT_OK : SIM_AT_ERR_INTERNAL;
+}
+
+static simcom_err_t _partition_write(void *ctx, uint32_t offset, const void *data, size_t len)
+{
+    return esp_partition_write((const esp_partition_t *)ctx, offset, data, len) == ESP_OK ? SIM_AT_OK : SIM_AT_ERR_INTERNAL;
+}
+
+static simcom_err_t _partition_erase(void *ctx, uint32_t offset, size_t len)
+{
+    return esp_partition_erase_range((const esp_partition_t *)ctx, offset, len) == ESP_OK ? SIM_AT_OK : SIM_AT_ERR_INTERNAL;
+}
+
+const simcom_spool_storage_t *simcom_spool_partition(const char *label)
+{
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+    if (part == NULL)
+    {
+        ESP_LOGE(TAG, "Partition %s not found", label ? label : "(null)");
+        return NULL;
+    }
+
+    s_partition_storage = (simcom_spool_storage_t){
+        .read = _partition_read,
+        .write = _partition_write,
+        .erase = _partition_erase,
+        .size = part->size - part->size % part->erase_size,
+        .sector_size = part->erase_size,
+        .ctx = (void *)part,
+    };
+    return &s_partition_storage;
+}
@@ -0,0 +1,536 @@
+/**
+ * sim_transport_cmux.c
+ * 3GPP TS 27.010 multiplexer, basic option, over another transport
+ *
+ * Each engine channel is a DLC (channel n is DLC n + 1), DLC 0 carries the control messages.
+ * Writes are cut into UIH frames of at most N1 bytes. read_chan() is called by the parser task
+ * only and decodes the frames there: it returns the information field of one data frame at a
+ * time and answers the control frames (UA, DM, MSC, CLD) itself, so no other task reads the
+ * base transport. Received bytes after that frame stay for the next call.
+ */
+
+#include "simcom.h"
+#include "simcom_transport.h"
+#include "transport/sim_transport_cmux.h"
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+
+static const char *TAG = "sim_transport_cmux";
+
+/**
+ * -------------------------------------
+ * ----- [ Compile-time tunables ] -----
+ * -------------------------------------
+ */
+
+// wait for the answer to a SABM or a CLD (T1)
+#ifndef SIM_CMUX_T1_MS
+#define SIM_CMUX_T1_MS          300U
+#endif
+
+// tries of a SABM or a CLD (N2)
+#ifndef SIM_CMUX_N2
+#define SIM_CMUX_N2             3
+#endif
+
+// bytes read from the base transport at once
+#ifndef SIM_CMUX_RAW_LEN
+#define SIM_CMUX_RAW_LEN        256U
+#endif
+
+#define CMUX_FLAG       0xF9
+#define CMUX_EA         0x01
+#define CMUX_CR         0x02
+#define CMUX_PF         0x10
+
+// control field, without the P/F bit
+#define CMUX_SABM       0x2F
+#define CMUX_UA         0x63
+#define CMUX_DM         0x0F
+#define CMUX_DISC       0x43
+#define CMUX_UIH        0xEF
+#define CMUX_UI         0x03
+
+// control messages on DLC 0, type octet of a response (C/R clear)
+#define CMUX_MSG_CLD    0xC1
+#define CMUX_MSG_MSC    0xE1
+#define CMUX_MSG_NSC    0x11
+
+typedef enum {
+    CMUX_RX_HUNT = 0,       // looking for a flag
+    CMUX_RX_ADDR,
+    CMUX_RX_CTRL,
+    CMUX_RX_LEN,
+    CMUX_RX_LEN2,
+    CMUX_RX_INFO,
+    CMUX_RX_FCS,
+    CMUX_RX_END,
+} sim_cmux_rx_state_t;
+
+typedef struct {
+    const simcom_transport_t *base;
+    size_t n1;
+    SemaphoreHandle_t tx_lock;      // frames of different tasks are not interleaved
+    SemaphoreHandle_t ctl_sem;      // given on each answer of the modem to a control frame
+    volatile uint8_t ctl_dlci;      // last answer: DLC and frame type (UA, DM) or message (CLD)
+    volatile uint8_t ctl_type;
+
+    /* decoder, parser task only */
+    uint8_t raw[SIM_CMUX_RAW_LEN];
+    size_t raw_len;
+    size_t raw_pos;
+    sim_cmux_rx_state_t state;
+    uint8_t hdr[4];                 // address, control and length octets, covered by the FCS
+    size_t hdr_len;
+    uint8_t info[SIM_CMUX_N1];
+    size_t info_len;
+    size_t info_pos;
+    bool info_drop;                 // longer than N1: skipped, not stored
+} sim_transport_cmux_t;
+
+static sim_transport_cmux_t s_cmux;
+
+/**
+ * @brief Frame check sequence: reflected CRC-8 (x^8 + x^2 + x + 1), initial value 0xFF
+ */
+static uint8_t _cmux_fcs(const uint8_t *data, size_t len)
+{
+    uint8_t crc = 0xFF;
+    for (size_t i = 0; i < len; i++)
+    {
+        crc ^= data[i];
+        for (int b = 0; b < 8; b++)
+            crc = (crc & 1) ? (uint8_t)((crc >> 1) ^ 0xE0) : (uint8_t)(crc >> 1);
+    }
+    return (uint8_t)(0xFF - crc);
+}
+
+/**
+ * @brief Writes a frame
+ *
+ * @param addr Address octet (DLC, C/R and EA bits)
+ * @param ctrl Control octet with the P/F bit
+ * @param info Information field, at most n1 bytes
+ *
+ * @return Bytes of info written, negative on error
+ */
+static int _cmux_send(sim_transport_cmux_t *mux, uint8_t addr, uint8_t ctrl, const void *info, size_t len)
+{
+    uint8_t frame[SIM_CMUX_N1 + 7];
+    size_t n = 0;
+
+    frame[n++] = CMUX_FLAG;
+    frame[n++] = addr;
+    frame[n++] = ctrl;
+    if (len < 128)
+    {
+        frame[n++] = (uint8_t)((len << 1) | CMUX_EA);
+    }
+    else
+    {
+        frame[n++] = (uint8_t)(len << 1);
+        frame[n++] = (uint8_t)(len >> 7);
+    }
+    // UIH frames check the header only, the other ones the information field too
+    size_t hdr_len = n - 1;
+    if (len > 0)
+        memcpy(&frame[n], info, len);
+    n += len;
+    uint8_t fcs = _cmux_fcs(&frame[1], ((ctrl & ~CMUX_PF) == CMUX_UIH) ? hdr_len : n - 1);
+    frame[n++] = fcs;
+    frame[n++] = CMUX_FLAG;
+
+    xSemaphoreTake(mux->tx_lock, portMAX_DELAY);
+    int written = mux->base->write(mux->base->ctx, frame, n);
+    xSemaphoreGive(mux->tx_lock);
+    return (written == (int)n) ? (int)len : -1;
+}
+
+/**
+ * @brief Writes a control message on DLC 0
+ */
+static void _cmux_send_msg(sim_transport_cmux_t *mux, const uint8_t *msg, size_t len)
+{
+    _cmux_send(mux, CMUX_EA | CMUX_CR, CMUX_UIH, msg, len);
+}
+
+/**
+ * @brief Reports an answer of the modem to the task waiting for it
+ */
+static void _cmux_ctl_answer(sim_transport_cmux_t *mux, uint8_t dlci, uint8_t type)
+{
+    mux->ctl_dlci = dlci;
+    mux->ctl_type = type;
+    xSemaphoreGive(mux->ctl_sem);
+}
+
+/**
+ * @brief Handles a control message received on DLC 0
+ */
+static void _cmux_rx_msg(sim_transport_cmux_t *mux, const uint8_t *msg, size_t len)
+{
+    if (len < 2)
+        return;
+    uint8_t type = msg[0];
+
+    if ((type & CMUX_CR) == 0)
+    {
+        // Answer to one of ours
+        if (type == CMUX_MSG_CLD)
+            _cmux_ctl_answer(mux, 0, CMUX_MSG_CLD);
+        return;
+    }
+
+    uint8_t reply[8];
+    if ((type & ~CMUX_CR) == CMUX_MSG_MSC || (type & ~CMUX_CR) == CMUX_MSG_CLD)
+    {
+        // Same content back as the response
+        size_t n = (len < sizeof(reply)) ? len : sizeof(reply);
+        memcpy(reply, msg, n);
+        reply[0] = (uint8_t)(type & ~CMUX_CR);
+        _cmux_send_msg(mux, reply, n);
+        if ((type & ~CMUX_CR) == CMUX_MSG_CLD)
+            ESP_LOGW(TAG, "Multiplexer closed by the modem");
+        return;
+    }
+
+    // Not supported command (NSC)
+    reply[0] = CMUX_MSG_NSC;
+    reply[1] = (1 << 1) | CMUX_EA;
+    reply[2] = type;
+    _cmux_send_msg(mux, reply, 3);
+}
+
+/**
+ * @brief Handles a complete frame
+ *
+ * @return True for a data frame of a DLC above 0, its bytes in mux->info
+ */
+static bool _cmux_rx_frame(sim_transport_cmux_t *mux, uint8_t dlci, uint8_t ctrl)
+{
+    switch (ctrl & ~CMUX_PF)
+    {
+    case CMUX_UA:
+    case CMUX_DM:
+        _cmux_ctl_answer(mux, dlci, ctrl & ~CMUX_PF);
+        return false;
+
+    case CMUX_DISC:
+        _cmux_send(mux, (uint8_t)((dlci << 2) | CMUX_EA), CMUX_UA | CMUX_PF, NULL, 0);
+        ESP_LOGW(TAG, "DLC %u closed by the modem", dlci);
+        return false;
+
+    case CMUX_UIH:
+    case CMUX_UI:
+        if (dlci == 0)
+        {
+            _cmux_rx_msg(mux, mux->info, mux->info_len);
+            return false;
+        }
+        return mux->info_len > 0;
+
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief Feeds a received byte to the decoder
+ *
+ * @return DLC of a data frame just completed, 0 otherwise
+ */
+static uint8_t _cmux_rx_byte(sim_transport_cmux_t *mux, uint8_t c)
+{
+    switch (mux->state)
+    {
+    case CMUX_RX_HUNT:
+        if (c == CMUX_FLAG)
+            mux->state = CMUX_RX_ADDR;
+        break;
+
+    case CMUX_RX_ADDR:
+        // Consecutive flags: the closing flag of a frame and the opening one of the next
+        if (c == CMUX_FLAG)
+            break;
+        mux->hdr[0] = c;
+        mux->hdr_len = 1;
+        mux->state = CMUX_RX_CTRL;
+        break;
+
+    case CMUX_RX_CTRL:
+        mux->hdr[mux->hdr_len++] = c;
+        mux->state = CMUX_RX_LEN;
+        break;
+
+    case CMUX_RX_LEN:
+    case CMUX_RX_LEN2:
+        mux->hdr[mux->hdr_len++] = c;
+        if (mux->state == CMUX_RX_LEN)
+            mux->info_len = c >> 1;
+        else
+            mux->info_len |= (size_t)c << 7;
+        if (mux->state == CMUX_RX_LEN && (c & CMUX_EA) == 0)
+        {
+            mux->state = CMUX_RX_LEN2;
+            break;
+        }
+        mux->info_pos = 0;
+        mux->info_drop = (mux->info_len > sizeof(mux->info));
+        mux->state = (mux->info_len > 0) ? CMUX_RX_INFO : CMUX_RX_FCS;
+        break;
+
+    case CMUX_RX_INFO:
+        if (!mux->info_drop)
+            mux->info[mux->info_pos] = c;
+        if (++mux->info_pos == mux->info_len)
+            mux->state = CMUX_RX_FCS;
+        break;
+
+    case CMUX_RX_FCS:
+    {
+        uint8_t ctrl = mux->hdr[1] & ~CMUX_PF;
+        uint8_t fcs;
+        if (ctrl == CMUX_UIH || mux->info_drop)
+        {
+            fcs = _cmux_fcs(mux->hdr, mux->hdr_len);
+        }
+        else
+        {
+            uint8_t buf[sizeof(mux->hdr) + SIM_CMUX_N1];
+            memcpy(buf, mux->hdr, mux->hdr_len);
+            memcpy(&buf[mux->hdr_len], mux->info, mux->info_len);
+            fcs = _cmux_fcs(buf, mux->hdr_len + mux->info_len);
+        }
+        if (fcs != c)
+        {
+            ESP_LOGW(TAG, "Frame with a bad FCS dropped");
+            mux->state = CMUX_RX_HUNT;
+            break;
+        }
+        mux->state = CMUX_RX_END;
+        break;
+    }
+
+    case CMUX_RX_END:
+        mux->state = CMUX_RX_HUNT;
+        if (c != CMUX_FLAG)
+            break;
+        // The closing flag may open the next frame
+        mux->state = CMUX_RX_ADDR;
+        if (mux->info_drop)
+        {
+            ESP_LOGW(TAG, "Frame of %u bytes dropped, longer than N1", (unsigned)mux->info_len);
+            break;
+        }
+        if (_cmux_rx_frame(mux, mux->hdr[0] >> 2, mux->hdr[1]))
+            return mux->hdr[0] >> 2;
+        break;
+    }
+    return 0;
+}
+
+static simcom_err_t _cmux_open(void *ctx, const struct simcom_config *cfg)
+{
+    return SIM_AT_OK;
+}
+
+static void _cmux_close(void *ctx)
+{
+    // The base transport is closed by its owner
+}
+
+static int _cmux_write_chan(void *ctx, uint8_t chan, const void *data, size_t len)
+{
+    sim_transport_cmux_t *mux = ctx;
+    const uint8_t *p = data;
+    size_t left = len;
+
+    while (left > 0)
+    {
+        size_t n = (left < mux->n1) ? left : mux->n1;
+        if (_cmux_send(mux, (uint8_t)(((chan + 1) << 2) | CMUX_CR | CMUX_EA), CMUX_UIH, p, n) < 0)
+            return -1;
+        p += n;
+        left -= n;
+    }
+    return (int)len;
+}
+
+static int _cmux_write(void *ctx, const void *data, size_t len)
+{
+    return _cmux_write_chan(ctx, 0, data, len);
+}
+
+static int _cmux_read_chan(void *ctx, void *buf, size_t size, uint32_t timeout_ms, uint8_t *chan)
+{
+    sim_transport_cmux_t *mux = ctx;
+    bool read = false;
+
+    while (1)
+    {
+        while (mux->raw_pos < mux->raw_len)
+        {
+            uint8_t dlci = _cmux_rx_byte(mux, mux->raw[mux->raw_pos++]);
+            if (dlci > 0)
+            {
+                size_t n = (mux->info_len < size) ? mux->info_len : size;
+                memcpy(buf, mux->info, n);
+                *chan = (uint8_t)(dlci - 1);
+                return (int)n;
+            }
+        }
+
+        // One read of the base per call, a partial frame waits for the next one
+        if (read)
+            return 0;
+        int len = mux->base->read(mux->base->ctx, mux->raw, sizeof(mux->raw), timeout_ms);
+        if (len <= 0)
+        {
+            if (len == SIMCOM_TRANSPORT_ERR_OVERFLOW)
+                mux->state = CMUX_RX_HUNT;
+            return len;
+        }
+        mux->raw_len = (size_t)len;
+        mux->raw_pos = 0;
+        read = true;
+    }
+}
+
+static int _cmux_read(void *ctx, void *buf, size_t size, uint32_t timeout_ms)
+{
+    uint8_t chan;
+    return _cmux_read_chan(ctx, buf, size, timeout_ms, &chan);
+}
+
+static void _cmux_flush(void *ctx)
+{
+    sim_transport_cmux_t *mux = ctx;
+    mux->base->flush(mux->base->ctx);
+}
+
+static bool _cmux_wait_tx(void *ctx, uint32_t timeout_ms)
+{
+    sim_transport_cmux_t *mux = ctx;
+    return mux->base->wait_tx(mux->base->ctx, timeout_ms);
+}
+
+static void _cmux_wake(void *ctx)
+{
+    sim_transport_cmux_t *mux = ctx;
+    mux->base->wake(mux->base->ctx);
+}
+
+static int _cmux_tx_pending(void *ctx)
+{
+    sim_transport_cmux_t *mux = ctx;
+    return mux->base->tx_pending ? mux->base->tx_pending(mux->base->ctx) : 0;
+}
+
+static const simcom_transport_t s_cmux_transport = {
+    .open = _cmux_open,
+    .close = _cmux_close,
+    .write = _cmux_write,
+    .read = _cmux_read,
+    .flush = _cmux_flush,
+    .wait_tx = _cmux_wait_tx,
+    .wake = _cmux_wake,
+    .set_baud = NULL,           // the rate is settled before AT+CMUX
+    .tx_pending = _cmux_tx_pending,
+    .read_chan = _cmux_read_chan,
+    .write_chan = _cmux_write_chan,
+    .ctx = &s_cmux,
+};
+
+const simcom_transport_t *sim_cmux_transport(void)
+{
+    return &s_cmux_transport;
+}
+
+void sim_cmux_reset(const simcom_transport_t *base, size_t n1)
+{
+    sim_transport_cmux_t *mux = &s_cmux;
+
+    if (mux->tx_lock == NULL)
+        mux->tx_lock = xSemaphoreCreateMutex();
+    if (mux->ctl_sem == NULL)
+        mux->ctl_sem = xSemaphoreCreateBinary();
+
+    mux->base = base;
+    mux->n1 = (n1 > 0 && n1 < SIM_CMUX_N1) ? n1 : SIM_CMUX_N1;
+    mux->raw_len = 0;
+    mux->raw_pos = 0;
+    mux->state = CMUX_RX_HUNT;
+    xSemaphoreTake(mux->ctl_sem, 0);
+}
+
+/**
+ * @brief Sends a control frame or message up to N2 times until the modem answers
+ *
+ * @param dlci DLC of the answer expected
+ * @param types Answers that end the wait, 0 for none
+ *
+ * @return Answer received, 0 on timeout
+ */
+static uint8_t _cmux_ctl_request(sim_transport_cmux_t *mux, uint8_t addr, uint8_t ctrl,
+                                 const uint8_t *info, size_t len, uint8_t dlci, const uint8_t types[2])
+{
+    for (int i = 0; i < SIM_CMUX_N2; i++)
+    {
+        xSemaphoreTake(mux->ctl_sem, 0);
+        if (_cmux_send(mux, addr, ctrl, info, len) < 0)
+            return 0;
+
+        TickType_t deadline = xTaskGetTickCount() + pdMS_TO_TICKS(SIM_CMUX_T1_MS);
+        TickType_t left;
+        while ((int32_t)(left = deadline - xTaskGetTickCount()) > 0 &&
+               xSemaphoreTake(mux->ctl_sem, left) == pdTRUE)
+        {
+            if (mux->ctl_dlci == dlci && (mux->ctl_type == types[0] || mux->ctl_type == types[1]))
+                return mux->ctl_type;
+        }
+    }
+    return 0;
+}
+
+simcom_err_t sim_cmux_open_dlc(uint8_t dlci)
+{
+    static const uint8_t answers[2] = { CMUX_UA, CMUX_DM };
+    uint8_t addr = (uint8_t)((dlci << 2) | CMUX_CR | CMUX_EA);
+
+    switch (_cmux_ctl_request(&s_cmux, addr, CMUX_SABM | CMUX_PF, NULL, 0, dlci, answers))
+    {
+    case CMUX_UA:
+        return SIM_AT_OK;
+    case CMUX_DM:
+        ESP_LOGE(TAG, "DLC %u refused by the modem", dlci);
+        return SIM_AT_ERR_RESPONSE;
+    default:
+        ESP_LOGE(TAG, "No answer opening DLC %u", dlci);
+        return SIMCOM_ERR_TIMEOUT;
+    }
+}
+
+void sim_cmux_msc(uint8_t dlci)
+{
+    // DLC, then the V.24 signals: ready to communicate and to receive, valid data
+    const uint8_t msg[4] = {
+        CMUX_MSG_MSC | CMUX_CR, (2 << 1) | CMUX_EA, (uint8_t)((dlci << 2) | CMUX_CR | CMUX_EA), 0x8D,
+    };
+    _cmux_send_msg(&s_cmux, msg, sizeof(msg));
+}
+
+simcom_err_t sim_cmux_close_down(void)
+{
+    static const uint8_t answers[2] = { CMUX_MSG_CLD, CMUX_MSG_CLD };
+    static const uint8_t msg[2] = { CMUX_MSG_CLD | CMUX_CR, CMUX_EA };
+
+    if (_cmux_ctl_request(&s_cmux, CMUX_EA | CMUX_CR, CMUX_UIH, msg, sizeof(msg), 0, answers) == 0)
+    {
+        ESP_LOGW(TAG, "No answer to the close down");
+        return SIMCOM_ERR_TIMEOUT;
+    }
+    return SIM_AT_OK;
+}
@@ -0,0 +1,45 @@
+#ifndef SIM_TRANSPORT_CMUX_H
+#define SIM_TRANSPORT_CMUX_H
+
+#include "simcom.h"
+#include "simcom_transport.h"
+
+// largest information field of a frame (N1), asked in AT+CMUX; 31 if the modem keeps its default
+#ifndef SIM_CMUX_N1
+#define SIM_CMUX_N1             127U
+#endif
+
+/**
+ * @brief The multiplexer transport: read_chan() and write_chan() of the engine channels, channel
+ * n on DLC n + 1
+ */
+const simcom_transport_t *sim_cmux_transport(void);
+
+/**
+ * @brief Starts over on a base transport: frames in progress are dropped
+ *
+ * @param base Opened transport the frames go through
+ * @param n1 Largest information field agreed with the modem, up to SIM_CMUX_N1
+ */
+void sim_cmux_reset(const simcom_transport_t *base, size_t n1);
+
+/**
+ * @brief Opens a DLC (SABM) and waits for the UA. Needs the parser reading the multiplexer.
+ *
+ * @return SIM_AT_OK, SIM_AT_ERR_RESPONSE if the modem refused it (DM) or SIMCOM_ERR_TIMEOUT
+ */
+simcom_err_t sim_cmux_open_dlc(uint8_t dlci);
+
+/**
+ * @brief Sends the modem status of a DLC (MSC) with the lines of the terminal up
+ */
+void sim_cmux_msc(uint8_t dlci);
+
+/**
+ * @brief Closes the multiplexer (CLD) and waits for the answer of the modem
+ *
+ * @return SIM_AT_OK or SIMCOM_ERR_TIMEOUT
+ */
+simcom_err_t sim_cmux_close_down(void);
+
+#endif // SIM_TRANSPORT_CMUX_H
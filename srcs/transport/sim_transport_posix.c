@@ -0,0 +1,333 @@
+/**
+ * sim_transport_posix.c
+ * POSIX transport for host builds: serial device, pseudo-terminal or TCP socket
+ *
+ * read() polls the link together with the read end of a pipe; wake() writes a byte to the
+ * pipe so a blocked read() returns and the parser recomputes its wait.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "simcom.h"
+#include "simcom_transport.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include "esp_log.h"
+
+static const char *TAG = "sim_transport_posix";
+
+#define SIM_TRANSPORT_POSIX_PATH_LEN 128
+
+typedef struct {
+    char path[SIM_TRANSPORT_POSIX_PATH_LEN];
+    int fd;
+    int wake_fd[2];         // [0] polled by read(), [1] written by wake()
+    bool tty;
+} sim_transport_posix_t;
+
+static sim_transport_posix_t s_posix = { .fd = -1, .wake_fd = { -1, -1 } };
+
+/**
+ * @brief Returns the termios speed of a baud rate, B0 if it is not supported
+ */
+static speed_t _posix_speed(int baud_rate)
+{
+    switch (baud_rate)
+    {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+#ifdef B460800
+    case 460800: return B460800;
+#endif
+#ifdef B921600
+    case 921600: return B921600;
+#endif
+#ifdef B3000000
+    case 3000000: return B3000000;
+#endif
+#ifdef B3686400
+    case 3686400: return B3686400;
+#endif
+    default: return B0;
+    }
+}
+
+/**
+ * @brief Connects to "tcp:<host>:<port>"
+ *
+ * @return Socket, -1 on error
+ */
+static int _posix_connect(const char *endpoint)
+{
+    char host[SIM_TRANSPORT_POSIX_PATH_LEN];
+    const char *sep = strrchr(endpoint, ':');
+    if (sep == NULL || (size_t)(sep - endpoint) >= sizeof(host))
+        return -1;
+    memcpy(host, endpoint, sep - endpoint);
+    host[sep - endpoint] = '\0';
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res;
+    if (getaddrinfo(host, sep + 1, &hints, &res) != 0)
+        return -1;
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd >= 0)
+    {
+        // Commands are short writes, do not wait to coalesce them
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+/**
+ * @brief Configures a serial device or pseudo-terminal raw, 8N1
+ */
+static simcom_err_t _posix_setup_tty(int fd, const simcom_config_t *cfg)
+{
+    struct termios tio;
+    if (tcgetattr(fd, &tio) != 0)
+        return SIM_AT_ERR_UART;
+
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~CRTSCTS;
+    if (cfg->use_hw_flow_control)
+        tio.c_cflag |= CRTSCTS;
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+
+    if (cfg->uart_conf.baud_rate > 0)
+    {
+        speed_t speed = _posix_speed(cfg->uart_conf.baud_rate);
+        if (speed == B0)
+        {
+            ESP_LOGE(TAG, "Unsupported baud rate %d", cfg->uart_conf.baud_rate);
+            return SIM_AT_ERR_INVALID_ARG;
+        }
+        cfsetispeed(&tio, speed);
+        cfsetospeed(&tio, speed);
+    }
+
+    if (tcsetattr(fd, TCSANOW, &tio) != 0)
+        return SIM_AT_ERR_UART;
+    tcflush(fd, TCIOFLUSH);
+    return SIM_AT_OK;
+}
+
+static void _posix_close(void *ctx)
+{
+    sim_transport_posix_t *posix = ctx;
+    int *fds[] = { &posix->fd, &posix->wake_fd[0], &posix->wake_fd[1] };
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++)
+    {
+        if (*fds[i] >= 0)
+        {
+            close(*fds[i]);
+            *fds[i] = -1;
+        }
+    }
+}
+
+static simcom_err_t _posix_open(void *ctx, const simcom_config_t *cfg)
+{
+    sim_transport_posix_t *posix = ctx;
+
+    if (pipe(posix->wake_fd) != 0)
+        return SIM_AT_ERR_NO_MEM;
+    for (size_t i = 0; i < 2; i++)
+        fcntl(posix->wake_fd[i], F_SETFL, fcntl(posix->wake_fd[i], F_GETFL) | O_NONBLOCK);
+
+    simcom_err_t err = SIM_AT_OK;
+    if (strncmp(posix->path, "tcp:", 4) == 0)
+    {
+        posix->tty = false;
+        posix->fd = _posix_connect(posix->path + 4);
+    }
+    else
+    {
+        posix->tty = true;
+        posix->fd = open(posix->path, O_RDWR | O_NOCTTY);
+        if (posix->fd >= 0)
+            err = _posix_setup_tty(posix->fd, cfg);
+    }
+
+    if (posix->fd < 0)
+    {
+        ESP_LOGE(TAG, "Cannot open %s: %s", posix->path, strerror(errno));
+        err = SIM_AT_ERR_UART;
+    }
+    if (err != SIM_AT_OK)
+    {
+        _posix_close(posix);
+        return err;
+    }
+
+    ESP_LOGI(TAG, "Modem link on %s", posix->path);
+    return SIM_AT_OK;
+}
+
+static int _posix_write(void *ctx, const void *data, size_t len)
+{
+    sim_transport_posix_t *posix = ctx;
+    const uint8_t *p = data;
+    size_t left = len;
+
+    while (left > 0)
+    {
+        ssize_t n = posix->tty ? write(posix->fd, p, left) : send(posix->fd, p, left, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        left -= n;
+    }
+    return (int)len;
+}
+
+static int _posix_read(void *ctx, void *buf, size_t size, uint32_t timeout_ms)
+{
+    sim_transport_posix_t *posix = ctx;
+    struct pollfd fds[2] = {
+        { .fd = posix->fd, .events = POLLIN },
+        { .fd = posix->wake_fd[0], .events = POLLIN },
+    };
+
+    int timeout = (timeout_ms == SIMCOM_TRANSPORT_WAIT_FOREVER || timeout_ms > INT32_MAX) ? -1 : (int)timeout_ms;
+    int ready = poll(fds, 2, timeout);
+    if (ready <= 0)
+        return (ready < 0 && errno != EINTR) ? SIMCOM_TRANSPORT_ERR_IO : 0;
+
+    if (fds[1].revents & POLLIN)
+    {
+        uint8_t drain[16];
+        while (read(posix->wake_fd[0], drain, sizeof(drain)) > 0) { }
+    }
+    if ((fds[0].revents & (POLLIN | POLLHUP | POLLERR)) == 0)
+        return 0;
+
+    ssize_t len = read(posix->fd, buf, size);
+    if (len > 0)
+        return (int)len;
+    if (len < 0 && (errno == EINTR || errno == EAGAIN))
+        return 0;
+    return SIMCOM_TRANSPORT_ERR_IO;     // EOF: peer closed or pty master gone
+}
+
+static void _posix_flush(void *ctx)
+{
+    sim_transport_posix_t *posix = ctx;
+    if (posix->tty)
+    {
+        tcflush(posix->fd, TCIFLUSH);
+        return;
+    }
+
+    uint8_t drain[256];
+    while (recv(posix->fd, drain, sizeof(drain), MSG_DONTWAIT) > 0) { }
+}
+
+static bool _posix_wait_tx(void *ctx, uint32_t timeout_ms)
+{
+    sim_transport_posix_t *posix = ctx;
+    // Sockets have nothing to drain; tcdrain() has no timeout
+    return !posix->tty || tcdrain(posix->fd) == 0;
+}
+
+static void _posix_wake(void *ctx)
+{
+    sim_transport_posix_t *posix = ctx;
+    if (posix->wake_fd[1] >= 0)
+    {
+        // A full pipe already has a wake-up pending
+        uint8_t kick = 0;
+        ssize_t n = write(posix->wake_fd[1], &kick, 1);
+        (void)n;
+    }
+}
+
+static simcom_err_t _posix_set_baud(void *ctx, uint32_t baud_rate)
+{
+    sim_transport_posix_t *posix = ctx;
+    if (!posix->tty)
+        return SIM_AT_ERR_INVALID_ARG;      // no line rate on a socket
+
+    speed_t speed = _posix_speed((int)baud_rate);
+    if (speed == B0)
+        return SIM_AT_ERR_INVALID_ARG;
+
+    struct termios tio;
+    if (tcgetattr(posix->fd, &tio) != 0)
+        return SIM_AT_ERR_UART;
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    if (tcsetattr(posix->fd, TCSADRAIN, &tio) != 0)
+        return SIM_AT_ERR_UART;
+    return SIM_AT_OK;
+}
+
+static int _posix_tx_pending(void *ctx)
+{
+    sim_transport_posix_t *posix = ctx;
+    // Output queue of a serial device, unsent bytes of a socket; always 0 on a pty
+    int pending = 0;
+    if (ioctl(posix->fd, TIOCOUTQ, &pending) != 0)
+        return SIMCOM_TRANSPORT_ERR_IO;
+    return pending;
+}
+
+static const simcom_transport_t s_posix_transport = {
+    .open = _posix_open,
+    .close = _posix_close,
+    .write = _posix_write,
+    .read = _posix_read,
+    .flush = _posix_flush,
+    .wait_tx = _posix_wait_tx,
+    .wake = _posix_wake,
+    .set_baud = _posix_set_baud,
+    .tx_pending = _posix_tx_pending,
+    .ctx = &s_posix,
+};
+
+const simcom_transport_t *simcom_transport_posix(const char *path)
+{
+    if (path == NULL || strlen(path) >= sizeof(s_posix.path))
+        return NULL;
+    strcpy(s_posix.path, path);
+    return &s_posix_transport;
+}
+
+/* End of file */
@@ -0,0 +1,193 @@
+/**
+ * sim_transport_uart.c
+ * ESP-IDF UART transport for SIMCom modem (ESP-IDF v5.3)
+ *
+ * read() blocks on the UART driver event queue: the driver reports every line feed through
+ * pattern detection, and full RX FIFO or RX idle timeout events cover the '>' prompt, which
+ * has no line feed. wake() posts a UART_EVENT_MAX event to the same queue.
+ *
+ * write() copies into the driver transmit buffer and returns; the driver feeds the FIFO from
+ * its interrupt as fast as the line, and CTS with flow control, allows.
+ */
+
+#include "simcom.h"
+#include "simcom_transport.h"
+#include "at/sim_at.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "driver/uart.h"
+#include "esp_log.h"
+
+static const char *TAG = "sim_transport_uart";
+
+typedef struct {
+    uart_port_t port;
+    QueueHandle_t queue;    // UART driver event queue
+} sim_transport_uart_t;
+
+static sim_transport_uart_t s_uart = { .port = -1, .queue = NULL };
+
+static simcom_err_t _uart_open(void *ctx, const simcom_config_t *cfg)
+{
+    sim_transport_uart_t *uart = ctx;
+    esp_err_t e;
+
+    // RTS and CTS must be routed, flow control on unconnected pins does nothing
+    if (cfg->uart_conf.flow_ctrl != UART_HW_FLOWCTRL_DISABLE && (cfg->rts_pin < 0 || cfg->cts_pin < 0))
+    {
+        ESP_LOGE(TAG, "Hardware flow control needs rts_pin and cts_pin");
+        return SIM_AT_ERR_INVALID_ARG;
+    }
+
+    uart->port = cfg->uart_port;
+    e = uart_driver_install(uart->port, SIM_AT_MAX_RESP_LEN * 2, SIM_AT_UART_TX_BUF_LEN, SIM_AT_UART_EVENT_QUEUE_LEN, &uart->queue, 0);
+    if (e != ESP_OK)
+    {
+        ESP_LOGE(TAG, "uart_driver_install failed: %d", e);
+        return SIM_AT_ERR_UART;
+    }
+    e = uart_param_config(uart->port, &cfg->uart_conf);
+    if (e != ESP_OK)
+    {
+        ESP_LOGE(TAG, "uart_param_config failed: %d", e);
+        uart_driver_delete(uart->port);
+        return SIM_AT_ERR_UART;
+    }
+    e = uart_set_pin(uart->port, cfg->tx_pin, cfg->rx_pin, cfg->rts_pin, cfg->cts_pin);
+    if (e != ESP_OK)
+    {
+        ESP_LOGE(TAG, "uart_set_pin failed: %d", e);
+        uart_driver_delete(uart->port);
+        return SIM_AT_ERR_UART;
+    }
+
+    /* wake the parser on every line feed instead of polling */
+    e = uart_enable_pattern_det_baud_intr(uart->port, '\n', 1, 1, 0, 0);
+    if (e == ESP_OK)
+        e = uart_pattern_queue_reset(uart->port, SIM_AT_UART_EVENT_QUEUE_LEN);
+    if (e != ESP_OK)
+    {
+        ESP_LOGE(TAG, "uart pattern detection failed: %d", e);
+        uart_driver_delete(uart->port);
+        return SIM_AT_ERR_UART;
+    }
+    ESP_LOGI(TAG, "UART port %d initialized on TX=%d, RX=%d%s", uart->port, cfg->tx_pin, cfg->rx_pin,
+             (cfg->uart_conf.flow_ctrl != UART_HW_FLOWCTRL_DISABLE) ? ", RTS/CTS" : "");
+    return SIM_AT_OK;
+}
+
+static void _uart_close(void *ctx)
+{
+    sim_transport_uart_t *uart = ctx;
+
+    /* delete uart driver, also deletes its event queue */
+    uart_driver_delete(uart->port);
+    uart->queue = NULL;
+}
+
+static int _uart_write(void *ctx, const void *data, size_t len)
+{
+    sim_transport_uart_t *uart = ctx;
+    return uart_write_bytes(uart->port, data, len);
+}
+
+static int _uart_read(void *ctx, void *buf, size_t size, uint32_t timeout_ms)
+{
+    sim_transport_uart_t *uart = ctx;
+    size_t buffered = 0;
+
+    // Bytes left by a previous read are returned without waiting for a new event
+    uart_get_buffered_data_len(uart->port, &buffered);
+    if (buffered == 0)
+    {
+        uart_event_t event;
+        TickType_t wait = (timeout_ms == SIMCOM_TRANSPORT_WAIT_FOREVER) ? portMAX_DELAY : pdMS_TO_TICKS(timeout_ms);
+        if (xQueueReceive(uart->queue, &event, wait) != pdTRUE)
+            return 0;
+
+        switch (event.type)
+        {
+        case UART_DATA:
+        case UART_PATTERN_DET:
+            break;
+
+        case UART_FIFO_OVF:
+        case UART_BUFFER_FULL:
+            // Received data is lost, restart from a clean input
+            uart_flush_input(uart->port);
+            xQueueReset(uart->queue);
+            return SIMCOM_TRANSPORT_ERR_OVERFLOW;
+
+        default:
+            // Wake-up or an event without data
+            return 0;
+        }
+
+        uart_get_buffered_data_len(uart->port, &buffered);
+    }
+
+    if (buffered > size)
+        buffered = size;
+    int len = uart_read_bytes(uart->port, buf, buffered, 0);
+    return (len < 0) ? SIMCOM_TRANSPORT_ERR_IO : len;
+}
+
+static void _uart_flush(void *ctx)
+{
+    sim_transport_uart_t *uart = ctx;
+    uart_flush_input(uart->port);
+}
+
+static bool _uart_wait_tx(void *ctx, uint32_t timeout_ms)
+{
+    sim_transport_uart_t *uart = ctx;
+    return uart_wait_tx_done(uart->port, pdMS_TO_TICKS(timeout_ms)) == ESP_OK;
+}
+
+static void _uart_wake(void *ctx)
+{
+    sim_transport_uart_t *uart = ctx;
+    if (uart->queue)
+    {
+        uart_event_t kick = { .type = UART_EVENT_MAX };
+        xQueueSend(uart->queue, &kick, 0);
+    }
+}
+
+static simcom_err_t _uart_set_baud(void *ctx, uint32_t baud_rate)
+{
+    sim_transport_uart_t *uart = ctx;
+    esp_err_t e = uart_set_baudrate(uart->port, baud_rate);
+    if (e == ESP_ERR_INVALID_ARG)
+        return SIM_AT_ERR_INVALID_ARG;
+    return (e == ESP_OK) ? SIM_AT_OK : SIM_AT_ERR_UART;
+}
+
+static int _uart_tx_pending(void *ctx)
+{
+    sim_transport_uart_t *uart = ctx;
+    size_t free_len = 0;
+    if (uart_get_tx_buffer_free_size(uart->port, &free_len) != ESP_OK)
+        return SIMCOM_TRANSPORT_ERR_IO;
+    return (free_len < SIM_AT_UART_TX_BUF_LEN) ? (int)(SIM_AT_UART_TX_BUF_LEN - free_len) : 0;
+}
+
+static const simcom_transport_t s_uart_transport = {
+    .open = _uart_open,
+    .close = _uart_close,
+    .write = _uart_write,
+    .read = _uart_read,
+    .flush = _uart_flush,
+    .wait_tx = _uart_wait_tx,
+    .wake = _uart_wake,
+    .set_baud = _uart_set_baud,
+    .tx_pending = _uart_tx_pending,
+    .ctx = &s_uart,
+};
+
+const simcom_transport_t *simcom_transport_uart(void)
+{
+    return &s_uart_transport;
+}
+
+/* End of file */